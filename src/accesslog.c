@@ -0,0 +1,231 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Access log of the requests carried out.
+ *
+ * One request in every ACCESS_LOG_SAMPLE gets a record, a line like
+ *
+ *   {"t":1700000000,"ip":"10.0.0.2","sid":4660,"cmd":"TNFS_OPEN",
+ *    "path":"/games/zork.atr","in":25,"out":6,"status":0,"us":41}
+ *
+ * with "fd" in place of "path" for requests on an open file or
+ * directory, the bytes of the request and of its replies, the status of
+ * the last reply and how long it took to carry out. Records gather in a
+ * buffer of ACCESS_LOG_BUFSZ bytes that's written out when it fills or
+ * has waited ACCESS_LOG_FLUSH seconds. A log that's a regular file is
+ * rotated once it reaches ACCESS_LOG_ROTATE kilobytes, keeping
+ * ACCESS_LOG_KEEP old ones as <path>.1 and on.
+ *
+ * */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "accesslog.h"
+#include "batch.h"
+#include "datagram.h"
+#include "settings.h"
+#include "log.h"
+#include "bsdcompat.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define ACCESS_LOG_RECORD 768	/* longest record */
+
+static batchwriter alog = { .fd = -1 };
+static bool rotatable;			/* a regular file rather than a pipe */
+static uint64_t requests;		/* seen, for sampling */
+
+/* The request being carried out, if it was sampled */
+static struct
+{
+	bool active;
+	in_addr_t ipaddr;
+	uint16_t sid;
+	uint8_t cmd;
+	int fd;				/* -1 if it's about a path */
+	char path[MAX_TNFSPATH];
+	int in, out;
+	int status;
+} cur;
+
+static int _open()
+{
+	struct stat st;
+
+	alog.fd = open(alog.path, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+	if (alog.fd < 0)
+		return -1;
+	rotatable = fstat(alog.fd, &st) == 0 && S_ISREG(st.st_mode);
+	alog.written = rotatable ? st.st_size : 0;
+	return 0;
+}
+
+int accesslog_open(const char *path)
+{
+	if (batch_init(&alog, "access log", path, ACCESS_LOG_BUFSZ, ACCESS_LOG_FLUSH) < 0)
+		return -1;
+	if (_open() < 0)
+	{
+		batch_close(&alog);
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves the log to <path>.1, and the older ones up one */
+static void _rotate()
+{
+	char from[MAX_FILEPATH + 8], to[MAX_FILEPATH + 8];
+
+	close(alog.fd);
+	for (int i = ACCESS_LOG_KEEP; i > 1; i--)
+	{
+		snprintf(from, sizeof(from), "%s.%d", alog.path, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", alog.path, i);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", alog.path);
+	if (ACCESS_LOG_KEEP > 0)
+		rename(alog.path, to);
+	else
+		unlink(alog.path);
+	if (_open() < 0)
+		LOG("Unable to reopen the access log %s: %s\n", alog.path, strerror(errno));
+}
+
+/* Called after anything that may have written out records */
+static void _check_rotate()
+{
+	if (alog.fd >= 0 && rotatable && settings.access_log_rotate > 0 &&
+		alog.written >= (int64_t)settings.access_log_rotate * 1024)
+		_rotate();
+}
+
+void accesslog_close()
+{
+	batch_close(&alog);
+}
+
+void accesslog_begin(Header *hdr, unsigned char *databuf, int datasz)
+{
+	const char *path = NULL;
+
+	cur.active = false;
+	if (alog.fd < 0 || requests++ % settings.access_log_sample != 0)
+		return;
+
+	cur.active = true;
+	cur.ipaddr = hdr->ipaddr;
+	cur.sid = hdr->sid;
+	cur.cmd = hdr->cmd;
+	cur.path[0] = '\0';
+	cur.in = TNFS_HEADERSZ + datasz;
+	cur.out = 0;
+	cur.status = -1;
+
+	cur.fd = tnfs_request_target(hdr->cmd, databuf, datasz, &path);
+	if (path != NULL)
+		strlcpy(cur.path, path, sizeof(cur.path));
+}
+
+void accesslog_reply(uint8_t status, int bytes)
+{
+	if (!cur.active)
+		return;
+	cur.status = status;
+	if (bytes > 0)
+		cur.out += bytes;
+}
+
+/* Appends s as the inside of a JSON string */
+static int _escape(char *out, int outsz, const char *s)
+{
+	int len = 0;
+
+	for (; *s && len < outsz - 7; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+		{
+			out[len++] = '\\';
+			out[len++] = c;
+		}
+		else if (c < 0x20 || c >= 0x7f)
+		{
+			len += snprintf(out + len, outsz - len, "\\u%04x", c);
+		}
+		else
+		{
+			out[len++] = c;
+		}
+	}
+	out[len] = '\0';
+	return len;
+}
+
+void accesslog_end(int64_t latency_us)
+{
+	unsigned char *ip = (unsigned char *)&cur.ipaddr;
+	char record[ACCESS_LOG_RECORD], target[MAX_TNFSPATH * 2 + 16];
+	int len;
+
+	if (!cur.active)
+		return;
+	cur.active = false;
+
+	if (cur.fd >= 0)
+	{
+		snprintf(target, sizeof(target), "\"fd\":%d", cur.fd);
+	}
+	else
+	{
+		strlcpy(target, "\"path\":\"", sizeof(target));
+		len = strlen(target);
+		len += _escape(target + len, sizeof(target) - len - 1, cur.path);
+		strlcpy(target + len, "\"", sizeof(target) - len);
+	}
+	len = snprintf(record, sizeof(record),
+				   "{\"t\":%ld,\"ip\":\"%d.%d.%d.%d\",\"sid\":%u,\"cmd\":\"%s\",%s,"
+				   "\"in\":%d,\"out\":%d,\"status\":%d,\"us\":%" PRId64 "}\n",
+				   (long)time(NULL), ip[0], ip[1], ip[2], ip[3], cur.sid,
+				   get_cmd_name(cur.cmd), target, cur.in, cur.out, cur.status, latency_us);
+	if (len >= (int)sizeof(record))
+		return;
+
+	batch_add(&alog, record, len);
+	_check_rotate();
+}
+
+void accesslog_tick(time_t now)
+{
+	batch_tick(&alog, now);
+	_check_rotate();
+}
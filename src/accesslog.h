@@ -0,0 +1,49 @@
+#ifndef _TNFS_ACCESSLOG_H
+#define _TNFS_ACCESSLOG_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Access log of the requests carried out, one JSON object per line
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tnfs.h"
+
+/* Log requests to the file or named pipe at path. Returns 0 on success. */
+int accesslog_open(const char *path);
+void accesslog_close();
+
+/* Around carrying out a request: begin picks whether it's sampled and
+ * notes what it's about from its data, reply notes each reply sent for
+ * it, and end adds the record */
+void accesslog_begin(Header *hdr, unsigned char *databuf, int datasz);
+void accesslog_reply(uint8_t status, int bytes);
+void accesslog_end(int64_t latency_us);
+
+/* Called from the main loop: writes out records that have waited
+ * ACCESS_LOG_FLUSH seconds */
+void accesslog_tick(time_t now);
+
+#endif
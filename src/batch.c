@@ -0,0 +1,102 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Records written to a file in batches
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "log.h"
+#include "bsdcompat.h"
+
+int batch_init(batchwriter *bw, const char *what, const char *path, int size, int delay)
+{
+	memset(bw, 0, sizeof(batchwriter));
+	bw->fd = -1;
+	if (strlcpy(bw->path, path, sizeof(bw->path)) >= sizeof(bw->path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((bw->buf = malloc(size)) == NULL)
+		return -1;
+	bw->what = what;
+	bw->size = size;
+	bw->delay = delay;
+	return 0;
+}
+
+void batch_add(batchwriter *bw, const void *data, int len)
+{
+	if (bw->len + len > bw->size)
+		batch_flush(bw);
+	if (bw->fd < 0 || len > bw->size)
+		return;
+	if (bw->len == 0)
+		bw->since = time(NULL);
+	memcpy(bw->buf + bw->len, data, len);
+	bw->len += len;
+}
+
+void batch_flush(batchwriter *bw)
+{
+	int done = 0, n;
+
+	while (bw->fd >= 0 && done < bw->len)
+	{
+		n = write(bw->fd, bw->buf + done, bw->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			LOG("Unable to write the %s %s: %s\n", bw->what, bw->path, strerror(errno));
+			close(bw->fd);
+			bw->fd = -1;
+			break;
+		}
+		done += n;
+	}
+	bw->written += done;
+	bw->len = 0;
+}
+
+void batch_tick(batchwriter *bw, time_t now)
+{
+	if (bw->len > 0 && now - bw->since >= bw->delay)
+		batch_flush(bw);
+}
+
+void batch_close(batchwriter *bw)
+{
+	if (bw->buf == NULL)
+		return;
+	batch_flush(bw);
+	if (bw->fd >= 0)
+		close(bw->fd);
+	bw->fd = -1;
+	free(bw->buf);
+	bw->buf = NULL;
+}
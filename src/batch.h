@@ -0,0 +1,64 @@
+#ifndef _TNFS_BATCH_H
+#define _TNFS_BATCH_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Records gathered in memory and written to a file in batches, for the
+ * access log and the capture. Everything is done from the main loop.
+ *
+ * */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+
+typedef struct _batchwriter
+{
+	int fd;				/* the file, opened by the owner; -1 if none */
+	const char *what;		/* what the file is, for messages */
+	char path[MAX_FILEPATH];
+	char *buf;
+	int size;			/* of buf */
+	int len;			/* bytes waiting */
+	int delay;			/* most seconds they wait */
+	time_t since;			/* when the first of them was added */
+	int64_t written;		/* bytes in the file; the owner may set it */
+} batchwriter;
+
+/* Set up a writer for the file at path with a buffer of size bytes
+ * that are written out when it fills or after delay seconds. The owner
+ * then opens the file into fd. Returns 0, or -1 with errno set. */
+int batch_init(batchwriter *bw, const char *what, const char *path, int size, int delay);
+
+/* Add len bytes, writing out what's waiting first if they don't fit */
+void batch_add(batchwriter *bw, const void *data, int len);
+
+/* Write out what's waiting. A failure is logged and closes the file. */
+void batch_flush(batchwriter *bw);
+
+/* Called from the main loop: flushes what has waited long enough */
+void batch_tick(batchwriter *bw, time_t now);
+
+/* Flush, close the file and free the buffer */
+void batch_close(batchwriter *bw);
+
+#endif
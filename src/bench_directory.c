@@ -0,0 +1,500 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Microbenchmarks for the path and directory functions behind every
+ * request: normalize_path(), tnfs_valid_filename(), validate_path(),
+ * pattern_match(), dirlist_sort() with each combination of sort options,
+ * _load_directory() of directories of 100 to 100,000 entries made up for
+ * the purpose, and paging through them with tnfs_readdirx().
+ *
+ * Each case is run once to warm up, then timed over RUNS runs of enough
+ * iterations to take at least RUN_MS each. The median time per operation
+ * is reported with the fastest run and the median absolute deviation of
+ * the runs, so a change can be told from noise. Directories are read
+ * with the page cache warm. -j writes a JSON object per case instead of
+ * the table.
+ *
+ * Build with make OS=... bench_directory, run ../bin/bench_directory
+ *
+ * */
+
+/* for nftw() in glibc */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "tnfs.h"
+#include "directory.h"
+#include "tnfs_file.h"
+#include "session.h"
+#include "settings.h"
+#include "casefold.h"
+#include "pattern.h"
+#include "log.h"
+#include "bsdcompat.h"
+
+#define RUNS 9
+#define RUN_MS 50
+
+typedef int64_t (*bench_fn)(void *ctx, long iters);
+
+static bool json;
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Times fn, which returns the nanoseconds its iterations took, and
+ * reports the case */
+static void measure(const char *name, const char *param, bench_fn fn, void *ctx)
+{
+	double per_op[RUNS], dev[RUNS], median, mad;
+	long iters = 1;
+	int64_t ns;
+
+	/* warm up, and find how many iterations fill a run */
+	while ((ns = fn(ctx, iters)) < RUN_MS * 1000000LL && iters < (1L << 30))
+		iters = ns > 0 && ns < RUN_MS * 1000000LL / 8 ? iters * 8 : iters * 2;
+
+	for (int r = 0; r < RUNS; r++)
+		per_op[r] = (double)fn(ctx, iters) / iters;
+	qsort(per_op, RUNS, sizeof(double), compare_double);
+	median = per_op[RUNS / 2];
+	for (int r = 0; r < RUNS; r++)
+		dev[r] = per_op[r] > median ? per_op[r] - median : median - per_op[r];
+	qsort(dev, RUNS, sizeof(double), compare_double);
+	mad = dev[RUNS / 2];
+
+	if (json)
+		printf("{\"case\":\"%s\",\"param\":\"%s\",\"ns_per_op\":%.1f,\"min_ns\":%.1f,"
+			   "\"mad_ns\":%.1f,\"runs\":%d,\"iterations\":%ld}\n",
+			   name, param, median, per_op[0], mad, RUNS, iters);
+	else
+		printf("%-20s %-36s %14.1f %14.1f %10.1f\n", name, param, median, per_op[0], mad);
+	fflush(stdout);
+}
+
+/* Path functions */
+
+struct path_case
+{
+	Session *s;
+	const char *path;
+};
+
+static int64_t bench_normalize(void *ctx, long iters)
+{
+	struct path_case *pc = ctx;
+	char buf[MAX_FILEPATH];
+	int64_t start = now_ns();
+
+	for (long i = 0; i < iters; i++)
+	{
+		strlcpy(buf, pc->path, sizeof(buf));
+		normalize_path(buf, buf, sizeof(buf));
+	}
+	return now_ns() - start;
+}
+
+static int64_t bench_valid_filename(void *ctx, long iters)
+{
+	struct path_case *pc = ctx;
+	char name[MAX_TNFSPATH], fullpath[MAX_FILEPATH];
+	int len = strlen(pc->path) + 1;
+	int64_t start = now_ns();
+
+	for (long i = 0; i < iters; i++)
+	{
+		/* it's given the request buffer, which it may not change */
+		memcpy(name, pc->path, len);
+		tnfs_valid_filename(pc->s, fullpath, name, len);
+	}
+	return now_ns() - start;
+}
+
+static int64_t bench_validate_path(void *ctx, long iters)
+{
+	struct path_case *pc = ctx;
+	int64_t start = now_ns();
+
+	for (long i = 0; i < iters; i++)
+		validate_path(pc->s, pc->path);
+	return now_ns() - start;
+}
+
+struct pattern_case
+{
+	tnfs_pattern *pattern;
+	const char *name;
+};
+
+static int64_t bench_pattern_match(void *ctx, long iters)
+{
+	struct pattern_case *pc = ctx;
+	volatile bool sink = false;
+	int64_t start = now_ns();
+
+	for (long i = 0; i < iters; i++)
+		sink ^= pattern_match(pc->pattern, pc->name);
+	(void)sink;
+	return now_ns() - start;
+}
+
+/* Directory functions */
+
+struct dir_case
+{
+	char path[MAX_FILEPATH];
+	uint8_t diropts, sortopts;
+	const char *pattern;
+	dir_listing unsorted;		/* for the sorts to start from */
+	Session *s;
+	int cli_fd, sink_fd;		/* where tnfs_readdirx() replies go */
+	uint32_t paged;				/* entries seen paging, to check */
+};
+
+static int64_t bench_sort(void *ctx, long iters)
+{
+	struct dir_case *dc = ctx;
+	dir_listing list = dc->unsorted;
+	size_t size = dc->unsorted.count * sizeof(dir_listing_entry);
+	int64_t ns = 0, start;
+
+	if ((list.entries = malloc(size)) == NULL)
+		return 0;
+	for (long i = 0; i < iters; i++)
+	{
+		memcpy(list.entries, dc->unsorted.entries, size);
+		start = now_ns();
+		dirlist_sort(&list, dc->diropts, dc->sortopts);
+		ns += now_ns() - start;
+	}
+	free(list.entries);
+	return ns;
+}
+
+static int64_t bench_load(void *ctx, long iters)
+{
+	struct dir_case *dc = ctx;
+	dir_handle dh;
+	int64_t start = now_ns();
+
+	memset(&dh, 0, sizeof(dh));
+	strlcpy(dh.path, dc->path, sizeof(dh.path));
+	for (long i = 0; i < iters; i++)
+		_load_directory(&dh, dc->diropts, dc->sortopts, 0, dc->pattern);
+	start = now_ns() - start;
+	dirlist_free(&dh.list);
+	return start;
+}
+
+static int64_t bench_readdirx(void *ctx, long iters)
+{
+	struct dir_case *dc = ctx;
+	dir_handle *dh = &dc->s->dhandles[0];
+	unsigned char req[2] = {0, 0};
+	unsigned char reply[MAXMSGSZ];
+	Header hdr;
+	int64_t ns = 0, start;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.cmd = TNFS_READDIRX;
+	hdr.cli_fd = dc->cli_fd;
+	for (long i = 0; i < iters; i++)
+	{
+		dh->pos = 0;
+		dc->paged = 0;
+		while (dh->pos < dh->list.count)
+		{
+			start = now_ns();
+			tnfs_readdirx(&hdr, dc->s, req, sizeof(req));
+			ns += now_ns() - start;
+			if (recv(dc->sink_fd, reply, sizeof(reply), 0) > TNFS_HEADERSZ + 1)
+				dc->paged += reply[TNFS_HEADERSZ + 1];
+		}
+	}
+	return ns;
+}
+
+/* Synthetic directories */
+
+static void make_name(char *buf, int bufsz, int i)
+{
+	static const char *publishers[] = {"Atari", "Broderbund", "Epyx", "Infocom", "Sierra On-Line"};
+	static const char *exts[] = {"atr", "ATR", "xex", "cas", "zip"};
+
+	snprintf(buf, bufsz, "%s %05d (19%02d)(%s).%s", i % 3 ? "Game" : "game", (i * 7919) % 100000,
+			 80 + i % 10, publishers[i % 5], exts[(i / 5) % 5]);
+}
+
+/* Fills path with count entries, one in twenty of them directories,
+ * with sizes and mtimes spread out. Returns -1 on failure. */
+static int make_directory(const char *path, int count)
+{
+	char name[MAX_FILENAME_LEN], full[MAX_FILEPATH];
+	struct timeval times[2];
+	unsigned int seed = count;
+
+	if (mkdir(path, 0755) < 0)
+		return -1;
+	for (int i = 0; i < count; i++)
+	{
+		make_name(name, sizeof(name), i);
+		snprintf(full, sizeof(full), "%s/%s", path, name);
+		if (i % 20 == 0)
+		{
+			if (mkdir(full, 0755) < 0)
+				return -1;
+		}
+		else
+		{
+			int fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return -1;
+			int err = ftruncate(fd, rand_r(&seed) % 200000);
+			close(fd);
+			if (err < 0)
+				return -1;
+		}
+		times[0].tv_sec = times[1].tv_sec = 400000000 + rand_r(&seed) % 1000000000;
+		times[0].tv_usec = times[1].tv_usec = 0;
+		utimes(full, times);
+	}
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	if ((type == FTW_DP ? rmdir(path) : unlink(path)) != 0)
+		fprintf(stderr, "Unable to remove %s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+/* Removes the tree at path, deepest first, without following symlinks */
+static void remove_tree(const char *path)
+{
+	if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT)
+		fprintf(stderr, "Unable to remove %s: %s\n", path, strerror(errno));
+}
+
+static void sort_name(char *buf, int bufsz, uint8_t diropts, uint8_t sortopts)
+{
+	static const char *flags[] = {"none", "case", "desc", "mtime", "size"};
+	int len = snprintf(buf, bufsz, "%s", diropts & TNFS_DIROPT_NO_FOLDERSFIRST ? "mixed" : "dirs");
+
+	for (int b = 0; b < 5; b++)
+	{
+		if (sortopts & (1 << b))
+			len += snprintf(buf + len, bufsz - len, "+%s", flags[b]);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [-j] [-n max entries] [-d scratch dir] [-k]\n"
+			" -j  a JSON object per line rather than a table\n"
+			" -n  largest directory to make up (100000)\n"
+			" -d  where to make them up (/tmp)\n"
+			" -k  keep them afterwards\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = {100, 1000, 10000, 100000};
+	const char *scratch_parent = "/tmp";
+	char scratch[MAX_TNFSPATH - 32], param[64], name[64];
+	int max_entries = 100000, sort_size = 0, sindex, opt, failures = 0;
+	bool keep = false;
+	struct dir_case dc;
+	int sv[2];
+
+	while ((opt = getopt(argc, argv, "jn:d:k")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j': json = true; break;
+		case 'n': max_entries = atoi(optarg); break;
+		case 'd': scratch_parent = optarg; break;
+		case 'k': keep = true; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (snprintf(scratch, sizeof(scratch), "%s/bench_directory.XXXXXX", scratch_parent) >= (int)sizeof(scratch))
+	{
+		fprintf(stderr, "%s is too long a path\n", scratch_parent);
+		return 1;
+	}
+	if (mkdtemp(scratch) == NULL)
+	{
+		fprintf(stderr, "Unable to make a directory in %s: %s\n", scratch_parent, strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < 4 && sizes[i] <= max_entries; i++)
+	{
+		snprintf(dc.path, sizeof(dc.path), "%s/d%d", scratch, sizes[i]);
+		if (make_directory(dc.path, sizes[i]) < 0)
+		{
+			fprintf(stderr, "Unable to make up %s: %s\n", dc.path, strerror(errno));
+			remove_tree(scratch);
+			return 1;
+		}
+	}
+
+	/* a session as MOUNT would leave it, with replies to a socket of our own */
+	settings.log_level = LOGLEVEL_SERVER;
+	tnfs_setroot(scratch);
+	memset(&dc, 0, sizeof(dc));
+	if ((dc.s = tnfs_allocsession(&sindex, 0)) == NULL ||
+		socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+	{
+		remove_tree(scratch);
+		return 1;
+	}
+	dc.cli_fd = sv[0];
+	dc.sink_fd = sv[1];
+
+	if (!json)
+		printf("%-20s %-36s %14s %14s %10s\n", "case", "param", "median ns/op", "min ns/op", "mad ns");
+
+	struct path_case pc = {dc.s, NULL};
+	static const char *normalize_paths[] = {"/games/atari/zork.atr", "//games///atari//zork.atr//",
+		"/a/very/long/path/to/some/deeply/nested/collection/of/disk/images/for/the/atari/800/zork.atr"};
+	for (int i = 0; i < 3; i++)
+	{
+		pc.path = normalize_paths[i];
+		snprintf(param, sizeof(param), "%zu bytes%s", strlen(pc.path), strstr(pc.path, "//") ? ", slashes" : "");
+		measure("normalize_path", param, bench_normalize, &pc);
+	}
+
+	make_name(name, sizeof(name), 1);
+	snprintf(dc.path, sizeof(dc.path), "/d100/%s", name);
+	pc.path = dc.path;
+	measure("tnfs_valid_filename", "existing", bench_valid_filename, &pc);
+	casefold_init(true);
+	measure("tnfs_valid_filename", "existing, casefold", bench_valid_filename, &pc);
+	for (char *p = dc.path; *p; p++)
+		*p = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+	measure("tnfs_valid_filename", "wrong case, casefold", bench_valid_filename, &pc);
+	casefold_init(false);
+
+	snprintf(dc.path, sizeof(dc.path), "%s/d100/%s", scratch, name);
+	pc.path = dc.path;
+	measure("validate_path", "existing file", bench_validate_path, &pc);
+	snprintf(dc.path, sizeof(dc.path), "%s/d100/../../etc/passwd", scratch);
+	measure("validate_path", "outside the root", bench_validate_path, &pc);
+
+	struct pattern_case patc = {NULL, name};
+	static const char *patterns[] = {"*.atr", "game*", "*zork*", "*(198?)*.?tr"};
+	for (int i = 0; i < 4; i++)
+	{
+		patc.pattern = pattern_compile(patterns[i], 0);
+		measure("pattern_match", patterns[i], bench_pattern_match, &patc);
+		pattern_free(patc.pattern);
+	}
+
+	for (int i = 0; i < 4 && sizes[i] <= max_entries; i++)
+	{
+		snprintf(dc.path, sizeof(dc.path), "%s/d%d", scratch, sizes[i]);
+		dc.diropts = 0;
+		dc.sortopts = 0;
+		dc.pattern = NULL;
+		snprintf(param, sizeof(param), "%d entries", sizes[i]);
+		measure("_load_directory", param, bench_load, &dc);
+		dc.pattern = "*5*.atr";
+		snprintf(param, sizeof(param), "%d entries, *5*.atr", sizes[i]);
+		measure("_load_directory", param, bench_load, &dc);
+		if (sizes[i] <= 10000)
+			sort_size = sizes[i];
+	}
+
+	/* every sort on the largest listing that sorts quickly enough */
+	if (sort_size > 0)
+	{
+		dir_handle dh;
+
+		memset(&dh, 0, sizeof(dh));
+		snprintf(dh.path, sizeof(dh.path), "%s/d%d", scratch, sort_size);
+		_load_directory(&dh, 0, TNFS_DIRSORT_NONE, 0, NULL);
+		dc.unsorted = dh.list;
+		for (int diropts = 0; diropts <= TNFS_DIROPT_NO_FOLDERSFIRST; diropts++)
+		{
+			for (int sortopts = 0; sortopts < 32; sortopts++)
+			{
+				int len;
+				dc.diropts = diropts;
+				dc.sortopts = sortopts;
+				len = snprintf(param, sizeof(param), "%d ", sort_size);
+				sort_name(param + len, sizeof(param) - len, diropts, sortopts);
+				measure("dirlist_sort", param, bench_sort, &dc);
+			}
+		}
+		dirlist_free(&dh.list);
+	}
+
+	for (int i = 0; i < 4 && sizes[i] <= max_entries; i++)
+	{
+		dir_handle *dh = &dc.s->dhandles[0];
+
+		snprintf(dh->path, sizeof(dh->path), "%s/d%d", scratch, sizes[i]);
+		if (_load_directory(dh, 0, 0, 0, NULL) != 0)
+			continue;
+		dh->in_use = true;
+		snprintf(param, sizeof(param), "%d entries, all pages", sizes[i]);
+		measure("tnfs_readdirx", param, bench_readdirx, &dc);
+		if (dc.paged != dh->list.count)
+		{
+			fprintf(stderr, "tnfs_readdirx paged through %u of %u entries\n", dc.paged, dh->list.count);
+			failures++;
+		}
+		dirhandle_close(dh);
+	}
+
+	tnfs_freesession(dc.s, sindex);
+	close(sv[0]);
+	close(sv[1]);
+	if (!keep)
+		remove_tree(scratch);
+	return failures ? 1 : 0;
+}
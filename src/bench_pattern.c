@@ -0,0 +1,180 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Microbenchmark for the directory pattern matcher. Times the compiled
+ * matcher against the two it replaced on ordinary and pathological
+ * patterns, and checks all three agree on random ones.
+ *
+ * Build with make OS=... bench_pattern, run ../bin/bench_pattern
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "pattern.h"
+
+/* The OPENDIRX matcher it replaces: a full table per name */
+static bool dp_match(const char *src, const char *pattern)
+{
+	int m = strlen(pattern);
+	int n = strlen(src);
+
+	if (m == 0)
+		return (n == 0);
+
+	bool lookup[n + 1][m + 1];
+	memset(lookup, false, sizeof(lookup));
+	lookup[0][0] = true;
+	for (int j = 1; j <= m; j++)
+		if (pattern[j - 1] == '*')
+			lookup[0][j] = lookup[0][j - 1];
+
+	for (int i = 1; i <= n; i++)
+	{
+		for (int j = 1; j <= m; j++)
+		{
+			if (pattern[j - 1] == '*')
+				lookup[i][j] = lookup[i][j - 1] || lookup[i - 1][j];
+			else if (pattern[j - 1] == '?' ||
+					 (src[i - 1] == pattern[j - 1]) ||
+					 (tolower(src[i - 1]) == tolower(pattern[j - 1])))
+				lookup[i][j] = lookup[i - 1][j - 1];
+			else
+				lookup[i][j] = false;
+		}
+	}
+	return lookup[n][m];
+}
+
+/* The TNFS_DIR_EXT matcher it replaces: backtracking recursion */
+static int rec_match(const char *pattern, const char *str)
+{
+	if (*pattern == '\0')
+		return !*str;
+	if (*pattern == '*')
+		return rec_match(pattern + 1, str) || (*str && rec_match(pattern, str + 1));
+	if (*pattern == '?')
+		return *str && (*str != '.') && rec_match(pattern + 1, str + 1);
+	return (tolower((unsigned char)*str) == tolower((unsigned char)*pattern)) &&
+		   rec_match(pattern + 1, str + 1);
+}
+
+struct bench_case
+{
+	const char *name;
+	const char *pattern;
+	const char *entry;
+	int slow_iters;		/* iterations for the old matchers */
+};
+
+static double elapsed_ns(clock_t start, long iters)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / iters;
+}
+
+static void run_case(const struct bench_case *bc)
+{
+	const long fast_iters = 1000000;
+	tnfs_pattern *pat = pattern_compile(bc->pattern, 0);
+	volatile bool sink = false;
+	clock_t start;
+	double t_new, t_dp, t_rec;
+	long i;
+
+	start = clock();
+	for (i = 0; i < fast_iters; i++)
+		sink ^= pattern_match(pat, bc->entry);
+	t_new = elapsed_ns(start, fast_iters);
+
+	start = clock();
+	for (i = 0; i < bc->slow_iters; i++)
+		sink ^= dp_match(bc->entry, bc->pattern);
+	t_dp = elapsed_ns(start, bc->slow_iters);
+
+	start = clock();
+	for (i = 0; i < bc->slow_iters; i++)
+		sink ^= rec_match(bc->pattern, bc->entry);
+	t_rec = elapsed_ns(start, bc->slow_iters);
+
+	printf("%-22s %12.1f %12.1f %14.1f  %s\n", bc->name, t_new, t_dp, t_rec,
+		   pattern_match(pat, bc->entry) ? "match" : "no match");
+	pattern_free(pat);
+	(void)sink;
+}
+
+static void random_string(char *buf, int len, const char *alphabet)
+{
+	int n = strlen(alphabet);
+	for (int i = 0; i < len; i++)
+		buf[i] = alphabet[rand() % n];
+	buf[len] = '\0';
+}
+
+/* Returns the number of disagreements over random patterns and names */
+static int cross_check(int rounds)
+{
+	char pattern[16], entry[24];
+	int failures = 0;
+
+	srand(1);
+	for (int r = 0; r < rounds; r++)
+	{
+		random_string(pattern, rand() % 10, "aAb.*?");
+		random_string(entry, rand() % 16, "aAbB.");
+
+		tnfs_pattern *pat = pattern_compile(pattern, 0);
+		tnfs_pattern *ext = pattern_compile(pattern, PATTERN_QMARK_NOT_DOT);
+		if (pattern_match(pat, entry) != dp_match(entry, pattern) ||
+			pattern_match(ext, entry) != (bool)rec_match(pattern, entry))
+		{
+			if (failures++ < 10)
+				printf("MISMATCH pattern=\"%s\" name=\"%s\"\n", pattern, entry);
+		}
+		pattern_free(pat);
+		pattern_free(ext);
+	}
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct bench_case cases[] = {
+		{"extension", "*.atr", "Mule (1983)(Electronic Arts).atr", 200000},
+		{"prefix", "mule*", "Mule (1983)(Electronic Arts).atr", 200000},
+		{"question marks", "????????????????*.?tr", "Mule (1983)(Electronic Arts).atr", 200000},
+		{"no match", "*zork*", "Mule (1983)(Electronic Arts).atr", 200000},
+		{"many stars", "*a*a*a*a*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 20},
+		{"stars and marks", "*?a*?a*?a*?a*?a*?b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 5},
+		{"long name", "*x*y*", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaxy", 20000},
+	};
+	int failures;
+
+	printf("%-22s %12s %12s %14s\n", "case (ns/match)", "compiled", "table", "recursive");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		run_case(&cases[i]);
+
+	failures = cross_check(200000);
+	printf("cross check: %d mismatches\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Capture of the requests clients send, for replaying them against a
+ * test server with tnfs_replay. The format is described in capture.h.
+ * Records gather in a buffer of CAPTURE_BUFSZ bytes that's written out
+ * when it fills or has waited CAPTURE_FLUSH seconds. Capturing stops
+ * once the file reaches CAPTURE_LIMIT megabytes.
+ *
+ * */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "capture.h"
+#include "batch.h"
+#include "endian.h"
+#include "settings.h"
+#include "log.h"
+#include "bsdcompat.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static batchwriter cap = { .fd = -1 };
+
+int capture_open(const char *path)
+{
+	if (batch_init(&cap, "capture", path, CAPTURE_BUFSZ, CAPTURE_FLUSH) < 0)
+		return -1;
+	cap.fd = open(cap.path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (cap.fd < 0)
+	{
+		batch_close(&cap);
+		return -1;
+	}
+	batch_add(&cap, CAPTURE_MAGIC, 8);
+	return 0;
+}
+
+void capture_close()
+{
+	batch_close(&cap);
+}
+
+void capture_request(const struct sockaddr_in *cliaddr, bool tcp,
+	const unsigned char *req, int len)
+{
+	unsigned char rec[CAPTURE_RECORD_HDRSZ + MAXMSGSZ];
+	struct timeval tv;
+	uint64_t us;
+
+	if (cap.fd < 0 || len <= 0 || len > MAXMSGSZ)
+		return;
+
+	if (settings.capture_limit > 0 &&
+		cap.written + cap.len + CAPTURE_RECORD_HDRSZ + len > (int64_t)settings.capture_limit * 1024 * 1024)
+	{
+		LOG("The capture %s reached %d megabytes, capturing stopped\n", cap.path, settings.capture_limit);
+		capture_close();
+		return;
+	}
+
+	gettimeofday(&tv, NULL);
+	us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	uint32tnfs(rec, (uint32_t)us);
+	uint32tnfs(rec + 4, (uint32_t)(us >> 32));
+	memcpy(rec + 8, &cliaddr->sin_addr.s_addr, 4);
+	uint16tnfs(rec + 12, ntohs(cliaddr->sin_port));
+	rec[14] = tcp ? CAPTURE_TCP : 0;
+	uint16tnfs(rec + 15, (uint16_t)len);
+	memcpy(rec + CAPTURE_RECORD_HDRSZ, req, len);
+	batch_add(&cap, rec, CAPTURE_RECORD_HDRSZ + len);
+}
+
+void capture_tick(time_t now)
+{
+	batch_tick(&cap, now);
+}
@@ -0,0 +1,64 @@
+#ifndef _TNFS_CAPTURE_H
+#define _TNFS_CAPTURE_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Capture of the requests clients send, for tnfs_replay
+ *
+ * A capture file starts with the 8 bytes of CAPTURE_MAGIC, then has a
+ * record per request as it arrived: a header of CAPTURE_RECORD_HDRSZ
+ * bytes holding
+ *
+ *   0  time it arrived, microseconds since 1970, 64 bits
+ *   8  client address, 4 bytes in network order
+ *  12  client port, 16 bits
+ *  14  flags, CAPTURE_TCP if it came over TCP
+ *  15  length of the request, 16 bits
+ *
+ * followed by the request itself, header and all. Numbers are little
+ * endian, as in TNFS. Requests over TCP are recorded one by one once
+ * they've been framed.
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tnfs.h"
+
+#define CAPTURE_MAGIC "TNFSCAP1"
+#define CAPTURE_RECORD_HDRSZ 17
+#define CAPTURE_TCP 0x01
+
+/* Capture requests to the file at path. Returns 0 on success. */
+int capture_open(const char *path);
+void capture_close();
+
+/* Record a request received from cliaddr */
+void capture_request(const struct sockaddr_in *cliaddr, bool tcp,
+	const unsigned char *buf, int len);
+
+/* Called from the main loop: writes out requests that have waited
+ * CAPTURE_FLUSH seconds */
+void capture_tick(time_t now);
+
+#endif
@@ -0,0 +1,278 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Case insensitive resolution of file names.
+ *
+ * Clients asking for GAMES/ZORK.ATR on a case sensitive filesystem get
+ * games/Zork.atr. A path that exists as given costs one lstat(); other
+ * components are looked up in a hash table of the case folded names of
+ * their directory. The tables of the CASEFOLD_CACHE_DIRS directories
+ * used most recently are kept, and read again when a directory's mtime
+ * changes.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "casefold.h"
+#include "pattern.h"
+#include "vfs.h"
+#include "bsdcompat.h"
+
+#ifdef WIN32
+#define lstat stat
+#endif
+
+typedef struct _folddir
+{
+	char path[MAX_FILEPATH];
+	time_t mtime;			/* of the directory when it was read */
+	time_t scanned;			/* when it was read */
+	uint64_t used;			/* for finding the least recently used */
+	char *names;
+	uint32_t namesz;
+	uint32_t *slots;		/* name offset + 1 by folded hash, 0 if free */
+	uint32_t nslots;
+} folddir;
+
+static bool enabled;
+static folddir cache[CASEFOLD_CACHE_DIRS];
+static uint64_t usecount;
+static uint64_t hits, misses;
+
+void casefold_init(bool enable)
+{
+	enabled = enable;
+}
+
+bool casefold_enabled()
+{
+	return enabled;
+}
+
+static uint32_t _hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	for (; *s; s++)
+		h = (h ^ (uint8_t)PATTERN_FOLD(*s)) * 16777619u;
+	return h;
+}
+
+static bool _fold_equal(const char *a, const char *b)
+{
+	for (; *a && PATTERN_FOLD(*a) == PATTERN_FOLD(*b); a++, b++)
+		;
+	return *a == *b;
+}
+
+static void _folddir_free(folddir *d)
+{
+	free(d->names);
+	free(d->slots);
+	memset(d, 0, sizeof(folddir));
+}
+
+/* Read the directory's names into d. Returns -1 on failure. */
+static int _folddir_scan(folddir *d, const char *path, time_t mtime)
+{
+	const char *name;
+	uint32_t count = 0, cap = 0, mask;
+	vfs_dir *dp;
+
+	_folddir_free(d);
+	if ((dp = vfs->opendir(path)) == NULL)
+		return -1;
+	while ((name = vfs->readdir(dp)) != NULL)
+	{
+		uint32_t len = strlen(name) + 1;
+		if (d->namesz + len > cap)
+		{
+			cap = cap ? cap * 2 : 4096;
+			while (d->namesz + len > cap)
+				cap *= 2;
+			char *names = realloc(d->names, cap);
+			if (names == NULL)
+			{
+				vfs->closedir(dp);
+				_folddir_free(d);
+				return -1;
+			}
+			d->names = names;
+		}
+		memcpy(d->names + d->namesz, name, len);
+		d->namesz += len;
+		count++;
+	}
+	vfs->closedir(dp);
+
+	for (d->nslots = 16; d->nslots < count * 2; d->nslots *= 2)
+		;
+	if ((d->slots = calloc(d->nslots, sizeof(uint32_t))) == NULL)
+	{
+		_folddir_free(d);
+		return -1;
+	}
+	mask = d->nslots - 1;
+	for (uint32_t off = 0; off < d->namesz; off += strlen(d->names + off) + 1)
+	{
+		const char *name = d->names + off;
+		uint32_t i;
+		for (i = _hash(name) & mask; d->slots[i] != 0; i = (i + 1) & mask)
+		{
+			/* of names differing only in case, the same one always wins */
+			const char *other = d->names + d->slots[i] - 1;
+			if (_fold_equal(other, name))
+				break;
+		}
+		if (d->slots[i] == 0 || strcmp(name, d->names + d->slots[i] - 1) < 0)
+			d->slots[i] = off + 1;
+	}
+
+	strlcpy(d->path, path, sizeof(d->path));
+	d->mtime = mtime;
+	d->scanned = time(NULL);
+	return 0;
+}
+
+/* The names of the directory at path, read again if it changed */
+static folddir *_folddir_get(const char *path)
+{
+	folddir *d, *lru = &cache[0];
+	struct stat st;
+
+	if (vfs->stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+	for (d = cache; d < cache + CASEFOLD_CACHE_DIRS; d++)
+	{
+		if (d->slots != NULL && strcmp(d->path, path) == 0)
+			break;
+		if (d->used < lru->used)
+			lru = d;
+	}
+	if (d == cache + CASEFOLD_CACHE_DIRS)
+		d = lru;
+	if (d->slots == NULL || d->mtime != st.st_mtime || strcmp(d->path, path) != 0)
+	{
+		misses++;
+		if (_folddir_scan(d, path, st.st_mtime) < 0)
+			return NULL;
+	}
+	else
+	{
+		hits++;
+	}
+	d->used = ++usecount;
+	return d;
+}
+
+static const char *_folddir_find(const folddir *d, const char *name)
+{
+	uint32_t mask = d->nslots - 1;
+
+	for (uint32_t i = _hash(name) & mask; d->slots[i] != 0; i = (i + 1) & mask)
+	{
+		const char *other = d->names + d->slots[i] - 1;
+		if (_fold_equal(other, name))
+			return other;
+	}
+	return NULL;
+}
+
+/* The entry of the directory at dirpath matching name but for case */
+static const char *_lookup(const char *dirpath, const char *name)
+{
+	folddir *d = _folddir_get(dirpath);
+	const char *found;
+
+	if (d == NULL)
+		return NULL;
+	found = _folddir_find(d, name);
+	/* mtimes are only to the second, so a directory read in the same
+	   second it last changed may have changed again since */
+	if (found == NULL && d->scanned <= d->mtime &&
+		_folddir_scan(d, dirpath, d->mtime) == 0)
+		found = _folddir_find(d, name);
+	return found;
+}
+
+void casefold_resolve(char *path, int skip)
+{
+	struct stat st;
+	char *p, *end;
+
+	if (!enabled || vfs->lstat(path, &st) == 0)
+		return;
+
+	for (p = path + skip; *p == '/'; p++)
+		;
+	for (; *p; p = end + 1)
+	{
+		char saved;
+
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		saved = *end;
+		*end = '\0';
+
+		if (vfs->lstat(path, &st) != 0)
+		{
+			const char *found;
+			/* the directory it's in, with the slash before it cut off */
+			if (p == path)
+			{
+				found = _lookup(".", p);
+			}
+			else if (p - 1 == path)
+			{
+				found = _lookup("/", p);
+			}
+			else
+			{
+				p[-1] = '\0';
+				found = _lookup(path, p);
+				p[-1] = '/';
+			}
+			if (found == NULL)
+			{
+				*end = saved;
+				return;
+			}
+			memcpy(p, found, end - p);
+		}
+
+		*end = saved;
+		if (saved == '\0')
+			break;
+	}
+}
+
+void casefold_cache_stats(uint64_t *h, uint64_t *m)
+{
+	*h = hits;
+	*m = misses;
+}
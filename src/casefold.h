@@ -0,0 +1,43 @@
+#ifndef _TNFS_CASEFOLD_H
+#define _TNFS_CASEFOLD_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Case insensitive resolution of file names
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Turn case insensitive resolution on or off */
+void casefold_init(bool enable);
+bool casefold_enabled();
+
+/* Replace each component of path after the first skip characters that
+ * doesn't exist as given with an entry of its directory differing only
+ * in case. Components that can't be matched are left alone. */
+void casefold_resolve(char *path, int skip);
+
+/* Directory lookups answered from the cache, and those that read it */
+void casefold_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,788 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Memory mapped catalog of the served tree.
+ *
+ * The catalog file holds every directory under the root with the name,
+ * flags, size and times of each of its entries, so listings and stats
+ * can be answered without touching the filesystem. Starting up maps the
+ * file instead of scanning the tree again.
+ *
+ * The file is native endian and laid out as a header, a table of
+ * directories sorted by their path relative to the root, their entries
+ * (each directory's run in strcmp() order so names can be looked up),
+ * the folders first case insensitive order of each run as indexes, and
+ * a pool of names and paths.
+ *
+ * A directory is trusted for CATALOG_RECHECK seconds at a time, after
+ * which the next lookup in it compares its mtime, and the size and times
+ * of each of its files, with those catalogued; a file rewritten in place
+ * leaves the directory's mtime alone. Directories that changed, or that
+ * the server itself changed, are left to the filesystem until the
+ * catalog is rebuilt, at most every CATALOG_REFRESH seconds. Rebuilding
+ * only rescans those; the rest is copied over from the map.
+ *
+ * */
+
+#ifdef ENABLE_CATALOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "catalog.h"
+#include "directory.h"
+#include "bsdcompat.h"
+#include "log.h"
+
+#define CATALOG_MAGIC "TNFSCAT"
+#define CATALOG_VERSION 1
+#define CATALOG_BYTEORDER 0x01020304
+
+/* entry flags beyond the FILEINFOFLAG_* ones */
+#define CATENTRY_SYMLINK 0x80		/* not descended into when building */
+#define CATENTRY_FILEINFO (FILEINFOFLAG_DIRECTORY | FILEINFOFLAG_HIDDEN | FILEINFOFLAG_SPECIAL)
+
+/* directory flags */
+#define CATDIR_UNSETTLED 0x01		/* had files modified just before it was scanned */
+
+typedef struct _catalog_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t ndirs;
+	uint32_t nentries;
+	uint32_t strsz;
+	uint32_t root;			/* real path of the tree, in the pool */
+	uint64_t dirs;			/* file offsets of the tables */
+	uint64_t entries;
+	uint64_t orders;
+	uint64_t strings;
+	int64_t built;
+} catalog_header;
+
+typedef struct _catalog_dir
+{
+	uint32_t path;			/* relative to the root, "" for the root */
+	uint32_t first;			/* first entry */
+	uint32_t count;
+	uint32_t flags;			/* CATDIR_* */
+	int64_t mtime;
+} catalog_dir;
+
+typedef struct _catalog_entry
+{
+	uint32_t name;
+	uint32_t size;
+	uint32_t atime;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint16_t mode;
+	uint16_t uid;
+	uint16_t gid;
+	uint8_t flags;			/* FILEINFOFLAG_* and CATENTRY_* */
+	uint8_t pad;
+} catalog_entry;
+
+/* What's known about a mapped directory beyond the file */
+struct _dirstate
+{
+	time_t checked;			/* when its mtime was last compared */
+	bool stale;
+};
+
+static char catfile[MAX_FILEPATH];
+static char catroot[MAX_FILEPATH];	/* root as paths are built, no trailing slash */
+
+static void *map;
+static size_t mapsz;
+static const catalog_header *chdr;
+static const catalog_dir *cdirs;
+static const catalog_entry *centries;
+static const uint32_t *corders;
+static const char *cstrings;
+static struct _dirstate *dstate;
+static uint32_t nstale;
+static time_t last_build;
+static uint64_t hits, misses;
+
+/* A catalog being built */
+struct _builder
+{
+	catalog_dir *dirs;
+	uint32_t ndirs, dircap;
+	catalog_entry *entries;
+	uint32_t *orders;
+	uint32_t nentries, entcap;
+	char *strings;
+	uint32_t strsz, strcap;
+	time_t started;
+	int err;
+};
+
+static void _unmap()
+{
+	if (map != NULL)
+		munmap(map, mapsz);
+	free(dstate);
+	map = NULL;
+	mapsz = 0;
+	chdr = NULL;
+	dstate = NULL;
+	nstale = 0;
+}
+
+/* Whether every directory's run, every order and every name in a mapped
+ * catalog lie within their tables */
+static bool _map_sound(const catalog_header *h, const void *m)
+{
+	const catalog_dir *dirs = (const catalog_dir *)((const char *)m + h->dirs);
+	const catalog_entry *entries = (const catalog_entry *)((const char *)m + h->entries);
+	const uint32_t *orders = (const uint32_t *)((const char *)m + h->orders);
+
+	for (uint32_t d = 0; d < h->ndirs; d++)
+	{
+		const catalog_dir *dir = &dirs[d];
+		if ((uint64_t)dir->first + dir->count > h->nentries || dir->path >= h->strsz)
+			return false;
+		for (uint32_t i = dir->first; i < dir->first + dir->count; i++)
+		{
+			if (entries[i].name >= h->strsz || orders[i] >= dir->count)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Map the catalog file if it's sound and describes realroot */
+static int _map(const char *catpath, const char *realroot)
+{
+	struct stat st;
+	const catalog_header *h;
+	void *m;
+	int fd;
+
+	if ((fd = open(catpath, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(catalog_header))
+	{
+		close(fd);
+		return -1;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	h = m;
+	if (memcmp(h->magic, CATALOG_MAGIC, sizeof(h->magic)) != 0 ||
+		h->version != CATALOG_VERSION || h->byteorder != CATALOG_BYTEORDER ||
+		h->dirs + (uint64_t)h->ndirs * sizeof(catalog_dir) > (uint64_t)st.st_size ||
+		h->entries + (uint64_t)h->nentries * sizeof(catalog_entry) > (uint64_t)st.st_size ||
+		h->orders + (uint64_t)h->nentries * sizeof(uint32_t) > (uint64_t)st.st_size ||
+		h->strings + (uint64_t)h->strsz > (uint64_t)st.st_size ||
+		h->strsz == 0 || ((const char *)m)[h->strings + h->strsz - 1] != '\0' ||
+		h->root >= h->strsz ||
+		strcmp((const char *)m + h->strings + h->root, realroot) != 0 ||
+		!_map_sound(h, m))
+	{
+		munmap(m, st.st_size);
+		return -1;
+	}
+
+	_unmap();
+	if ((dstate = calloc(h->ndirs ? h->ndirs : 1, sizeof(struct _dirstate))) == NULL)
+	{
+		munmap(m, st.st_size);
+		return -1;
+	}
+	map = m;
+	mapsz = st.st_size;
+	chdr = h;
+	cdirs = (const catalog_dir *)((const char *)m + h->dirs);
+	centries = (const catalog_entry *)((const char *)m + h->entries);
+	corders = (const uint32_t *)((const char *)m + h->orders);
+	cstrings = (const char *)m + h->strings;
+
+	/* whatever was still being written when it was scanned waits for
+	   the next rebuild */
+	for (uint32_t d = 0; d < h->ndirs; d++)
+	{
+		if (cdirs[d].flags & CATDIR_UNSETTLED)
+		{
+			dstate[d].stale = true;
+			nstale++;
+		}
+	}
+	return 0;
+}
+
+/* Index of the mapped directory at rel, or -1 */
+static int _find_dir(const char *rel)
+{
+	uint32_t lo = 0, hi;
+
+	if (map == NULL)
+		return -1;
+	hi = chdr->ndirs;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		int r = strcmp(cstrings + cdirs[mid].path, rel);
+		if (r == 0)
+			return mid;
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static void _mark_stale(int d)
+{
+	if (!dstate[d].stale)
+	{
+		dstate[d].stale = true;
+		nstale++;
+	}
+}
+
+/* Whether a mapped directory still matches what's on disk */
+static bool _dir_current(int d)
+{
+	char path[MAX_FILEPATH];
+	char entpath[MAX_FILEPATH];
+	struct stat st;
+	time_t now;
+
+	if (dstate[d].stale)
+		return false;
+	now = time(NULL);
+	if (now - dstate[d].checked < CATALOG_RECHECK)
+		return true;
+
+	join_path(catroot, cstrings + cdirs[d].path, path, sizeof(path));
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_mtime != cdirs[d].mtime)
+	{
+		_mark_stale(d);
+		return false;
+	}
+
+	/* files rewritten in place leave the directory's mtime alone */
+	for (uint32_t i = 0; i < cdirs[d].count; i++)
+	{
+		const catalog_entry *e = &centries[cdirs[d].first + i];
+		if (!S_ISREG(e->mode))
+			continue;
+		join_path(path, cstrings + e->name, entpath, sizeof(entpath));
+		if (stat(entpath, &st) != 0 || !S_ISREG(st.st_mode) || (uint32_t)st.st_size != e->size ||
+			(uint32_t)st.st_mtime != e->mtime || (uint32_t)st.st_ctime != e->ctime)
+		{
+			_mark_stale(d);
+			return false;
+		}
+	}
+	dstate[d].checked = now;
+	return true;
+}
+
+static int _list(const char *path, int order, catalog_callback cb, void *ctx)
+{
+	char rel[MAX_FILEPATH];
+	const catalog_dir *dir;
+	fileinfo_t finf;
+	int d;
+
+	if (relative_path(catroot, path, rel, sizeof(rel)) < 0 || (d = _find_dir(rel)) < 0 || !_dir_current(d))
+		return -1;
+
+	dir = &cdirs[d];
+	for (uint32_t i = 0; i < dir->count; i++)
+	{
+		const catalog_entry *e = &centries[dir->first +
+			(order == CATALOG_ORDER_DEFAULT ? corders[dir->first + i] : i)];
+		finf.flags = e->flags & CATENTRY_FILEINFO;
+		finf.size = e->size;
+		finf.m_time = e->mtime;
+		finf.c_time = e->ctime;
+		cb(cstrings + e->name, &finf, ctx);
+	}
+	return 0;
+}
+
+static int _stat(const char *path, struct stat *st)
+{
+	char rel[MAX_FILEPATH];
+	const catalog_dir *dir;
+	const catalog_entry *e;
+	char *name;
+	uint32_t lo, hi;
+	int d;
+
+	if (relative_path(catroot, path, rel, sizeof(rel)) < 0 || rel[0] == '\0')
+		return -1;
+	if ((name = strrchr(rel, '/')) != NULL)
+	{
+		*name++ = '\0';
+		d = _find_dir(rel);
+	}
+	else
+	{
+		/* entries of the root itself */
+		name = rel;
+		d = _find_dir("");
+	}
+	if (d < 0 || !_dir_current(d))
+		return -1;
+
+	dir = &cdirs[d];
+	lo = 0;
+	hi = dir->count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		e = &centries[dir->first + mid];
+		int r = strcmp(cstrings + e->name, name);
+		if (r == 0)
+		{
+			memset(st, 0, sizeof(struct stat));
+			st->st_mode = e->mode;
+			st->st_uid = e->uid;
+			st->st_gid = e->gid;
+			st->st_size = e->size;
+			st->st_atime = e->atime;
+			st->st_mtime = e->mtime;
+			st->st_ctime = e->ctime;
+			return 0;
+		}
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+/* Lookups are only counted while there's a catalog to answer them */
+static int _count(int result)
+{
+	if (map != NULL)
+	{
+		if (result == 0)
+			hits++;
+		else
+			misses++;
+	}
+	return result;
+}
+
+int catalog_list(const char *path, int order, catalog_callback cb, void *ctx)
+{
+	return _count(_list(path, order, cb, ctx));
+}
+
+int catalog_stat(const char *path, struct stat *st)
+{
+	return _count(_stat(path, st));
+}
+
+void catalog_cache_stats(uint64_t *h, uint64_t *m)
+{
+	*h = hits;
+	*m = misses;
+}
+
+void catalog_invalidate(const char *path)
+{
+	char rel[MAX_FILEPATH];
+	char *slash;
+	int d;
+
+	if (map == NULL || relative_path(catroot, path, rel, sizeof(rel)) < 0)
+		return;
+
+	/* the path itself if it's a directory, and the one holding it */
+	if ((d = _find_dir(rel)) >= 0)
+		_mark_stale(d);
+	if ((slash = strrchr(rel, '/')) != NULL)
+		*slash = '\0';
+	else
+		rel[0] = '\0';
+	if ((d = _find_dir(rel)) >= 0)
+		_mark_stale(d);
+}
+
+void catalog_tick(time_t now)
+{
+	if (map == NULL || nstale == 0 || now - last_build < CATALOG_REFRESH)
+		return;
+	if (catalog_build(catfile, catroot) == 0)
+		LOG("Catalog refreshed: %u directories, %u entries\n", chdr->ndirs, chdr->nentries);
+}
+
+/* Adds a string to the pool being built. Returns its offset. */
+static uint32_t _build_string(struct _builder *b, const char *s)
+{
+	uint32_t len = strlen(s) + 1;
+	uint32_t at = b->strsz;
+
+	if (b->strsz + len > b->strcap)
+	{
+		uint32_t cap = b->strcap ? b->strcap : 65536;
+		while (b->strsz + len > cap)
+			cap *= 2;
+		char *strings = realloc(b->strings, cap);
+		if (strings == NULL)
+		{
+			b->err = ENOMEM;
+			return 0;
+		}
+		b->strings = strings;
+		b->strcap = cap;
+	}
+	memcpy(b->strings + at, s, len);
+	b->strsz += len;
+	return at;
+}
+
+static catalog_entry *_build_entry(struct _builder *b, const char *name)
+{
+	catalog_entry *e;
+
+	if (b->nentries == b->entcap)
+	{
+		uint32_t cap = b->entcap ? b->entcap * 2 : 1024;
+		catalog_entry *entries = realloc(b->entries, cap * sizeof(catalog_entry));
+		if (entries == NULL)
+		{
+			b->err = ENOMEM;
+			return NULL;
+		}
+		b->entries = entries;
+		uint32_t *orders = realloc(b->orders, cap * sizeof(uint32_t));
+		if (orders == NULL)
+		{
+			b->err = ENOMEM;
+			return NULL;
+		}
+		b->orders = orders;
+		b->entcap = cap;
+	}
+	e = &b->entries[b->nentries];
+	memset(e, 0, sizeof(catalog_entry));
+	e->name = _build_string(b, name);
+	if (b->err)
+		return NULL;
+	b->nentries++;
+	return e;
+}
+
+/* qsort() has no way to pass these to the comparison */
+static const char *sort_strings;
+static const catalog_entry *sort_entries;
+
+static int _compare_names(const void *a, const void *b)
+{
+	const catalog_entry *left = a, *right = b;
+	return strcmp(sort_strings + left->name, sort_strings + right->name);
+}
+
+/* Folders first, then case insensitive, as a listing is sorted by default */
+static int _compare_default(const void *a, const void *b)
+{
+	const catalog_entry *left = &sort_entries[*(const uint32_t *)a];
+	const catalog_entry *right = &sort_entries[*(const uint32_t *)b];
+	int r;
+
+	r = (right->flags & FILEINFOFLAG_DIRECTORY) - (left->flags & FILEINFOFLAG_DIRECTORY);
+	if (r == 0)
+		r = strcasecmp(sort_strings + left->name, sort_strings + right->name);
+	if (r == 0)
+		r = strcmp(sort_strings + left->name, sort_strings + right->name);
+	return r;
+}
+
+static int _compare_dirs(const void *a, const void *b)
+{
+	const catalog_dir *left = a, *right = b;
+	return strcmp(sort_strings + left->path, sort_strings + right->path);
+}
+
+/* Reads a directory's entries from disk */
+static void _build_scan(struct _builder *b, const char *path, uint32_t *dirflags)
+{
+	char entpath[MAX_FILEPATH];
+	struct dirent *de;
+	struct stat st;
+	catalog_entry *e;
+	DIR *dp;
+
+	if ((dp = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(dp)) != NULL && b->err == 0)
+	{
+		snprintf(entpath, sizeof(entpath), "%s/%s", path, de->d_name);
+		if (stat(entpath, &st) != 0 || (e = _build_entry(b, de->d_name)) == NULL)
+			continue;
+
+		e->flags = fileinfo_flags(de->d_name, st.st_mode);
+		e->size = st.st_size;
+		e->atime = st.st_atime;
+		e->mtime = st.st_mtime;
+		e->ctime = st.st_ctime;
+		e->mode = st.st_mode;
+		e->uid = st.st_uid;
+		e->gid = st.st_gid;
+
+		if (fileinfo_dirlink(entpath, &st))
+			e->flags |= CATENTRY_SYMLINK;
+		else if (S_ISREG(st.st_mode) && st.st_mtime > b->started - CATALOG_SETTLE)
+			*dirflags |= CATDIR_UNSETTLED;
+	}
+	closedir(dp);
+}
+
+/* Adds the directory at rel and everything below it */
+static void _build_dir(struct _builder *b, const char *rel)
+{
+	char path[MAX_FILEPATH];
+	char child[MAX_FILEPATH];
+	struct stat st;
+	uint32_t d, first, count, flags = 0;
+	int old;
+
+	join_path(catroot, rel, path, sizeof(path));
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return;
+
+	if (b->ndirs == b->dircap)
+	{
+		uint32_t cap = b->dircap ? b->dircap * 2 : 256;
+		catalog_dir *dirs = realloc(b->dirs, cap * sizeof(catalog_dir));
+		if (dirs == NULL)
+		{
+			b->err = ENOMEM;
+			return;
+		}
+		b->dirs = dirs;
+		b->dircap = cap;
+	}
+	d = b->ndirs++;
+	b->dirs[d].path = _build_string(b, rel);
+	first = b->nentries;
+
+	/* unchanged directories are copied from the map, in order already */
+	old = _find_dir(rel);
+	if (old >= 0 && !dstate[old].stale && cdirs[old].mtime == st.st_mtime)
+	{
+		const catalog_dir *od = &cdirs[old];
+		for (uint32_t i = 0; i < od->count && b->err == 0; i++)
+		{
+			catalog_entry *e = _build_entry(b, cstrings + centries[od->first + i].name);
+			if (e == NULL)
+				break;
+			uint32_t name = e->name;
+			*e = centries[od->first + i];
+			e->name = name;
+			b->orders[first + i] = corders[od->first + i];
+		}
+	}
+	else
+	{
+		_build_scan(b, path, &flags);
+		count = b->nentries - first;
+		sort_strings = b->strings;
+		qsort(b->entries + first, count, sizeof(catalog_entry), _compare_names);
+		for (uint32_t i = 0; i < count; i++)
+			b->orders[first + i] = i;
+		sort_entries = b->entries + first;
+		qsort(b->orders + first, count, sizeof(uint32_t), _compare_default);
+	}
+	if (b->err)
+		return;
+
+	count = b->nentries - first;
+	b->dirs[d].first = first;
+	b->dirs[d].count = count;
+	b->dirs[d].flags = flags;
+	b->dirs[d].mtime = st.st_mtime;
+
+	for (uint32_t i = 0; i < count && b->err == 0; i++)
+	{
+		const catalog_entry *e = &b->entries[first + i];
+		const char *name = b->strings + e->name;
+		if (!(e->flags & FILEINFOFLAG_DIRECTORY) || (e->flags & CATENTRY_SYMLINK) ||
+			strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", name) >= MAX_TNFSPATH)
+			continue;
+		_build_dir(b, child);
+	}
+}
+
+static bool _write_all(FILE *f, const void *buf, size_t len, uint64_t *at)
+{
+	static const char zeros[8];
+	size_t pad = (8 - *at % 8) % 8;
+
+	if (pad && fwrite(zeros, 1, pad, f) != pad)
+		return false;
+	*at += pad;
+	if (len && fwrite(buf, 1, len, f) != len)
+		return false;
+	*at += len;
+	return true;
+}
+
+int catalog_build(const char *catpath, const char *rootdir)
+{
+	char realroot[MAX_FILEPATH];
+	char tmppath[MAX_FILEPATH + 8];
+	struct _builder b;
+	catalog_header h;
+	uint64_t at;
+	FILE *f;
+	bool ok;
+
+	if (realpath(rootdir, realroot) == NULL)
+		return -1;
+	if (catpath != catfile)
+		strlcpy(catfile, catpath, sizeof(catfile));
+	if (rootdir != catroot)
+	{
+		strlcpy(catroot, rootdir, sizeof(catroot));
+		for (int len = strlen(catroot); len > 0 && catroot[len - 1] == '/'; len--)
+			catroot[len - 1] = '\0';
+	}
+
+	memset(&b, 0, sizeof(b));
+	last_build = b.started = time(NULL);
+	memset(&h, 0, sizeof(h));
+	h.root = _build_string(&b, realroot);
+	_build_dir(&b, "");
+	if (b.err == 0 && b.ndirs == 0)
+		b.err = ENOENT;
+
+	if (b.err == 0)
+	{
+		sort_strings = b.strings;
+		qsort(b.dirs, b.ndirs, sizeof(catalog_dir), _compare_dirs);
+
+		memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+		h.version = CATALOG_VERSION;
+		h.byteorder = CATALOG_BYTEORDER;
+		h.ndirs = b.ndirs;
+		h.nentries = b.nentries;
+		h.strsz = b.strsz;
+		h.built = b.started;
+		/* each table starts 8 byte aligned */
+		at = (sizeof(h) + 7) & ~7;
+		h.dirs = at;
+		at = (at + b.ndirs * sizeof(catalog_dir) + 7) & ~7;
+		h.entries = at;
+		at = (at + b.nentries * sizeof(catalog_entry) + 7) & ~7;
+		h.orders = at;
+		at = (at + b.nentries * sizeof(uint32_t) + 7) & ~7;
+		h.strings = at;
+
+		/* written beside it and renamed into place, so whatever has it
+		   mapped keeps a complete file */
+		snprintf(tmppath, sizeof(tmppath), "%s.tmp", catpath);
+		if ((f = fopen(tmppath, "wb")) == NULL)
+		{
+			b.err = errno;
+		}
+		else
+		{
+			at = 0;
+			ok = _write_all(f, &h, sizeof(h), &at) &&
+				 _write_all(f, b.dirs, b.ndirs * sizeof(catalog_dir), &at) &&
+				 _write_all(f, b.entries, b.nentries * sizeof(catalog_entry), &at) &&
+				 _write_all(f, b.orders, b.nentries * sizeof(uint32_t), &at) &&
+				 _write_all(f, b.strings, b.strsz, &at);
+			if (fclose(f) != 0 || !ok)
+				b.err = EIO;
+			if (b.err == 0 && rename(tmppath, catpath) != 0)
+				b.err = errno;
+			if (b.err != 0)
+				unlink(tmppath);
+		}
+	}
+
+	free(b.dirs);
+	free(b.entries);
+	free(b.orders);
+	free(b.strings);
+
+	if (b.err != 0)
+	{
+		LOG("Unable to write catalog %s: %s\n", catpath, strerror(b.err));
+		return -1;
+	}
+	if (_map(catpath, realroot) < 0)
+	{
+		LOG("Unable to map catalog %s\n", catpath);
+		_unmap();
+		return -1;
+	}
+	return 0;
+}
+
+int catalog_open(const char *catpath, const char *rootdir)
+{
+	char realroot[MAX_FILEPATH];
+
+	if (realpath(rootdir, realroot) == NULL)
+		return -1;
+	strlcpy(catfile, catpath, sizeof(catfile));
+	strlcpy(catroot, rootdir, sizeof(catroot));
+	for (int len = strlen(catroot); len > 0 && catroot[len - 1] == '/'; len--)
+		catroot[len - 1] = '\0';
+
+	last_build = time(NULL);
+	if (_map(catpath, realroot) == 0)
+	{
+		LOG("Catalog %s mapped: %u directories, %u entries\n", catpath, chdr->ndirs, chdr->nentries);
+		return 0;
+	}
+
+	LOG("Building catalog %s\n", catpath);
+	if (catalog_build(catpath, rootdir) < 0)
+		return -1;
+	LOG("Catalog %s built: %u directories, %u entries\n", catpath, chdr->ndirs, chdr->nentries);
+	return 0;
+}
+
+void catalog_close()
+{
+	_unmap();
+}
+
+#endif
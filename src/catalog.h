@@ -0,0 +1,68 @@
+#ifndef _TNFS_CATALOG_H
+#define _TNFS_CATALOG_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Memory mapped catalog of the served tree
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "fileinfo.h"
+
+/* The order catalog_list() hands entries over in */
+#define CATALOG_ORDER_NAME 0		/* strcmp() order of the names */
+#define CATALOG_ORDER_DEFAULT 1		/* folders first, then case insensitive */
+
+typedef void (*catalog_callback)(const char *name, fileinfo_t *finf, void *ctx);
+
+/* Map the catalog at catpath for the tree at rootdir, building it first
+ * if it's missing or was built for another tree. Returns 0 on success. */
+int catalog_open(const char *catpath, const char *rootdir);
+
+/* Write the catalog at catpath afresh, reusing whatever is mapped for
+ * directories that haven't changed. Returns 0 on success. */
+int catalog_build(const char *catpath, const char *rootdir);
+void catalog_close();
+
+/* List the directory at path in the given order. Returns 0 if it was
+ * listed from the catalog, -1 if the filesystem has to be asked. */
+int catalog_list(const char *path, int order, catalog_callback cb, void *ctx);
+
+/* stat() from the catalog. Returns 0 if answered, -1 if not. */
+int catalog_stat(const char *path, struct stat *st);
+
+/* Listings and stat()s answered from the catalog, and those that weren't */
+void catalog_cache_stats(uint64_t *hits, uint64_t *misses);
+
+/* Note that path was changed, so its directory isn't served from the
+ * catalog until it's refreshed */
+void catalog_invalidate(const char *path);
+
+/* Called from the main loop: rebuilds the catalog now and then if parts
+ * of it went stale */
+void catalog_tick(time_t now);
+
+#endif
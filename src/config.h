@@ -23,6 +23,7 @@
 
 #define TNFSD_PORT	16384	/* UDP port to listen on */
 #define MAXMSGSZ	532	/* maximum size of a TNFS message */
+/* defaults of the limits that can be set with tnfsd -l or -f; see settings.h */
 #define MAX_FD_PER_CONN	16	/* maximum open file descriptors per client */
 #define MAX_DHND_PER_CONN 8	/* max open directories per client */
 #define MAX_SESSIONS        4096   /* maximum number of opened sessions */
@@ -30,6 +31,8 @@
 #define MAX_TCP_CONN        4096   /* maximum number of TCP connections */
 #define SESSION_TIMEOUT 600 /* Sessions are thrown out after no contact for this many seconds. 0 = no timeout */
 #define CONN_TIMEOUT    600 /* TCP connections are thrown out after no contact for this many seconds. 0 = no timeout */
+#define TCP_RXBUFSZ	(MAXMSGSZ * 4)	/* per-connection buffer for requests received over TCP */
+#define MAX_WINDOW	8	/* maximum requests a UDP client may have in flight in windowed mode. A power of two */
 #define TNFS_HEADERSZ	4	/* minimum header size */
 #define TNFS_MAX_PAYLOAD (MAXMSGSZ - TNFS_HEADERSZ - 1) /* Maximum usuable payload in a UDP datagram (-1 for status byte) */
 #define MAX_TNFSPATH	256	/* maximum path length */
@@ -41,7 +44,46 @@
 #define TIMEOUT_MSB	0x03	/* Timeout MSB (1 sec) */
 #define MAX_FILENAME_LEN 256	/* longest filename supported */
 #define MAX_IOSZ	512	/* maximum size of an IO operation */
+#define TCP_MAX_IOSZ	32768	/* maximum size of a READ over TCP when sent with sendfile() */
+#define STREAM_UDP_MAX	65536	/* most bytes a STREAMREAD sends over UDP before the client must ask again */
+#define STREAM_UDP_BURST 8	/* chunks sent per STREAMREAD on each pass over UDP */
+#define STREAM_TCP_BURST 32	/* chunks sent per STREAMREAD on each pass over TCP */
+#define STREAM_INTERVAL	2	/* milliseconds between passes while STREAMREADs are running */
+#define WRITEBEHIND_SIZE (64 * 1024)	/* bytes of sequential WRITEs to a file gathered into one write() */
+#define WRITEBEHIND_MAX	64	/* files that can have WRITEs gathered at once */
+#define WRITEBEHIND_DELAY 200	/* most milliseconds a WRITE is held before being written out */
+#define FILETABLE_MAX	1024	/* files open at once that sessions share descriptors for */
+#define FILETABLE_HANDLES 16384	/* session descriptors of shared files */
+#define OVERLAY_MAX_OPEN 256	/* overlaid files open at once across all sessions */
+#define OVERLAY_BLOCK	512	/* bytes copied into a client's overlay when it first writes to them */
+#define ZIP_MAX_ARCHIVES 16	/* archive directories kept parsed */
+#define ZIP_CACHE_SIZE	(32 * 1024 * 1024)	/* bytes of decompressed archive members kept for reuse */
+#define ZIP_MAX_MEMBER	(16 * 1024 * 1024)	/* largest archive member that can be opened */
+#define CATALOG_RECHECK	5	/* seconds a catalogued directory is trusted before it and its files are stat()ed again */
+#define CATALOG_REFRESH	30	/* least seconds between rebuilds of a catalog that went stale */
+#define CATALOG_SETTLE	10	/* files modified this recently keep their directory out of the catalog until the next rebuild */
+#define SEARCH_BUILD_SLICE 16	/* directories read on each pass of the main loop while the search index is built */
+#define SEARCH_MAX_PENDING 1024	/* changes searched one by one before the search index is rebuilt */
+#define SEARCH_MAX_RESULTS 4096	/* most entries a SEARCH returns */
+#define CASEFOLD_CACHE_DIRS 64	/* directories whose names are kept case folded for case insensitive lookups */
 #define STATS_INTERVAL 60   /* how often the server stats should be logged. 0 to disable stats logging. */
+#define ACCESS_LOG_SAMPLE 1	/* one request in this many gets a record in the access log of tnfsd -a */
+#define ACCESS_LOG_ROTATE 65536	/* kilobytes the access log grows to before it's rotated. 0 = never */
+#define ACCESS_LOG_KEEP 4	/* rotated access logs kept */
+#define ACCESS_LOG_BUFSZ (64 * 1024)	/* bytes of access log records gathered before they're written */
+#define ACCESS_LOG_FLUSH 1	/* most seconds access log records wait to be written */
+#define CAPTURE_LIMIT 1024	/* megabytes of requests tnfsd -w captures before it stops. 0 = no limit */
+#define CAPTURE_BUFSZ (256 * 1024)	/* bytes of captured requests gathered before they're written */
+#define CAPTURE_FLUSH 1	/* most seconds captured requests wait to be written */
+#define MEMFS_LIMIT 1024	/* megabytes the tree served from memory with tnfsd -M may take, files clients write included. 0 = no limit */
+#define SLOW_REQUEST_MS 500	/* requests and main loop passes taking this long are logged. 0 = never */
+#define LOG_LEVEL 1	/* 0 logs only the server's own messages, 1 those about clients too; see log.h */
+#define LOG_LINE_MAX 512	/* longest line logged */
+#define LOG_RING_LINES 1024	/* lines waiting for the log writer thread before more are dropped */
+#define LOG_WRITE_INTERVAL 50	/* milliseconds between passes of the log writer thread */
+#define STATS_LATENCY_BUCKETS 24	/* power of two buckets of request latencies, the last for those over about 4 seconds */
+#define METRICS_MAX_CLIENTS 4	/* scrapes of the metrics page served at once */
+#define METRICS_TIMEOUT 5	/* seconds a metrics client has to send its request */
 #define TCP_KA_IDLE 30 /* the time (in seconds) the connection needs to remain idle before TCP starts sending keepalive probes */
 #define TCP_KA_INTVL 1  /* the time (in seconds) between individual keepalive probes */
 #define TCP_KA_COUNT 60 /* the maximum number of keepalive probes TCP should send before dropping the connection */
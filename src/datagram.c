@@ -27,16 +27,25 @@ TNFS daemon datagram handler
 #include <sys/types.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <inttypes.h>
 
 #ifdef UNIX
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/stat.h>
+#endif
+#ifdef ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #endif
 
 #ifdef WIN32
@@ -54,20 +63,30 @@ TNFS daemon datagram handler
 #include "tnfs_file.h"
 #include "event.h"
 #include "auth.h"
+#include "search.h"
+#include "settings.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "capture.h"
+#include "probes.h"
+#ifdef ENABLE_CATALOG
+#include "catalog.h"
+#endif
 
 int sockfd;         /* UDP global socket file descriptor */
 int tcplistenfd;    /* TCP listening socket file descriptor */
 bool write_support; /* Whether writes should be enabled. */
+static bool slow_logged; /* a slow request was logged this pass of the main loop */
 
 tnfs_cmdfunc dircmd[NUM_DIRCMDS] =
 	{&tnfs_opendir, &tnfs_readdir, &tnfs_closedir,
 	 &tnfs_mkdir, &tnfs_rmdir, &tnfs_telldir, &tnfs_seekdir,
-	 &tnfs_opendirx, &tnfs_readdirx};
+	 &tnfs_opendirx, &tnfs_readdirx, &tnfs_search};
 
 tnfs_cmdfunc filecmd[NUM_FILECMDS] =
 	{&tnfs_open_deprecated, &tnfs_read, &tnfs_write, &tnfs_close,
 	 &tnfs_stat, &tnfs_lseek, &tnfs_unlink, &tnfs_chmod, &tnfs_rename,
-	 &tnfs_open};
+	 &tnfs_open, &tnfs_streamread};
 
 const char *sesscmd_names[NUM_SESSCMDS] =
 	{
@@ -83,7 +102,8 @@ const char *dircmd_names[NUM_DIRCMDS] =
 	 "TNFS_TELLDIR",
 	 "TNFS_SEEKDIR",
 	 "TNFS_OPENDIRX",
-	 "TNFS_READDIRX"};
+	 "TNFS_READDIRX",
+	 "TNFS_SEARCH"};
 
 const char *filecmd_names[NUM_FILECMDS] =
 	{
@@ -96,7 +116,8 @@ const char *filecmd_names[NUM_FILECMDS] =
 		"TNFS_UNLINK",
 		"TNFS_CHMOD",
 		"TNFS_RENAME",
-		"TNFS_OPEN"};
+		"TNFS_OPEN",
+		"TNFS_STREAMREAD"};
 
 const char *get_cmd_name(uint8_t cmd)
 {
@@ -242,14 +263,98 @@ void tnfs_sockclose()
 #endif
 }
 
+/* Milliseconds from an arbitrary point, unaffected by clock changes */
+int64_t tnfs_clock_ms()
+{
+#ifdef WIN32
+	return (int64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Monotonic microseconds, for timing requests */
+int64_t tnfs_clock_us()
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (int64_t)(now.QuadPart / freq.QuadPart * 1000000 +
+					 now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Whether a TCP socket can take another reply without blocking */
+bool tnfs_writable(int fd)
+{
+#ifdef WIN32
+	fd_set wfds;
+	struct timeval tv = {0, 0};
+	FD_ZERO(&wfds);
+	FD_SET(fd, &wfds);
+	return select(fd + 1, NULL, &wfds, NULL, &tv) > 0;
+#else
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
+#endif
+}
+
+/* TCP connections, grown as they're needed up to settings.max_tcp_conn;
+ * slots not in use have a cli_fd of 0 */
+TcpConnection *tcp_conn_list = NULL;
+int tcp_conn_slots = 0;
+int tcp_conn_count = 0;
+
+/* Connections in use, least recently heard from first, so the idle
+ * ones can be found without looking at the rest. They're linked by
+ * index as the table may move when it grows. */
+static int tcp_idle_head = -1;
+static int tcp_idle_tail = -1;
+
+static void _idle_unlink(TcpConnection *tcp_conn)
+{
+	if (tcp_conn->idle_prev >= 0)
+		tcp_conn_list[tcp_conn->idle_prev].idle_next = tcp_conn->idle_next;
+	else
+		tcp_idle_head = tcp_conn->idle_next;
+	if (tcp_conn->idle_next >= 0)
+		tcp_conn_list[tcp_conn->idle_next].idle_prev = tcp_conn->idle_prev;
+	else
+		tcp_idle_tail = tcp_conn->idle_prev;
+}
+
+static void _idle_append(TcpConnection *tcp_conn)
+{
+	int i = tcp_conn - tcp_conn_list;
+
+	tcp_conn->idle_prev = tcp_idle_tail;
+	tcp_conn->idle_next = -1;
+	if (tcp_idle_tail >= 0)
+		tcp_conn_list[tcp_idle_tail].idle_next = i;
+	else
+		tcp_idle_head = i;
+	tcp_idle_tail = i;
+}
+
 void tnfs_mainloop()
 {
 	int i;
-	TcpConnection tcpsocks[MAX_TCP_CONN];
 	time_t last_stats_report = 0;
 	time_t now = 0;
-
-	memset(&tcpsocks, 0, sizeof(tcpsocks));
+	int64_t last_stream_pump = 0;
+	int64_t woke = 0;
 
 	/* add UDP socket and TCP listen socket to event listener */
 	tnfs_event_register(sockfd);
@@ -257,11 +362,51 @@ void tnfs_mainloop()
 
 	while (true)
 	{
-		tnfs_close_stale_connections(tcpsocks);
+		time(&now);
+		tnfs_close_stale_connections(now);
+		metrics_close_stale(now);
+		accesslog_tick(now);
+		capture_tick(now);
+
+		/* keep any STREAMREADs moving at their own pace */
+		if (tnfs_streams_active() && tnfs_clock_ms() - last_stream_pump >= STREAM_INTERVAL)
+		{
+			tnfs_stream_pump();
+			last_stream_pump = tnfs_clock_ms();
+		}
 
-		event_wait_res_t *wait_res = tnfs_event_wait(1);
+		/* index the tree for SEARCH a little at a time */
+		if (search_building())
+			search_build_slice();
+
+		/* and gathered WRITEs out once they've waited long enough */
+		if (tnfs_writebehind_pending())
+			tnfs_writebehind_flush(false);
+
+		int timeout = search_building() ? 0 : tnfs_streams_active() ? STREAM_INTERVAL : 1000;
+		if (tnfs_writebehind_pending() && timeout > WRITEBEHIND_DELAY)
+			timeout = WRITEBEHIND_DELAY;
+		if (woke != 0)
+		{
+			int64_t busy = tnfs_clock_us() - woke;
+			stats_loop(busy);
+			/* unless a request owned up to it already */
+			if (settings.slow_request_ms > 0 && busy >= (int64_t)settings.slow_request_ms * 1000 &&
+				!slow_logged)
+				LOG("Slow pass of the main loop took %" PRId64 "ms\n", busy / 1000);
+		}
+		event_wait_res_t *wait_res = tnfs_event_wait(timeout);
+		woke = tnfs_clock_us();
+		slow_logged = false;
 		if (wait_res->size == SOCKET_ERROR)
 		{
+			/* a signal asking for the stats interrupts the wait
+			 * too, and it isn't a reason to stop */
+			if (errno == EINTR && stats_report_requested())
+			{
+				stats_report();
+				continue;
+			}
 			break;
 		}
 
@@ -280,32 +425,57 @@ void tnfs_mainloop()
 		/* Incoming TCP connection? */
 		if (tnfs_event_is_active(wait_res, tcplistenfd))
 		{
-			tcp_accept(tcpsocks);
+			tcp_accept();
 		}
 
+		/* Scrape of the metrics page? */
+		metrics_handle(wait_res);
+
 		// was the fdset relevant to any of the existing connections?
-		for (i = 0; i < MAX_TCP_CONN; i++)
+		for (i = 0; i < tcp_conn_slots; i++)
 		{
-			if (tcpsocks[i].cli_fd)
+			if (tcp_conn_list[i].cli_fd)
 			{
-				if (tnfs_event_is_active(wait_res, tcpsocks[i].cli_fd))
+				if (tnfs_event_is_active(wait_res, tcp_conn_list[i].cli_fd))
 				{
-					tnfs_handle_tcpmsg(&tcpsocks[i]);
+					tnfs_handle_tcpmsg(&tcp_conn_list[i]);
 				}
 			}
 		}
 
-		time(&now);
-		if (STATS_INTERVAL > 0 && now - last_stats_report > STATS_INTERVAL)
+		if (stats_report_requested() ||
+			(settings.stats_interval > 0 && now - last_stats_report > settings.stats_interval))
 		{
-			stats_report(tcpsocks);
+			stats_report();
 			last_stats_report = now;
 		}
+#ifdef ENABLE_CATALOG
+		catalog_tick(now);
+#endif
 	}
-	tnfs_close_all_connections(tcpsocks);
+	tnfs_writebehind_flush(true);
+	tnfs_close_all_connections();
+}
+
+/* Makes room for more connections, up to settings.max_tcp_conn */
+static void _grow_tcp_conn_list()
+{
+	int size = tcp_conn_slots ? tcp_conn_slots * 2 : 16;
+	TcpConnection *grown;
+
+	if (tcp_conn_slots >= settings.max_tcp_conn)
+		return;
+	if (size > settings.max_tcp_conn)
+		size = settings.max_tcp_conn;
+	if ((grown = realloc(tcp_conn_list, size * sizeof(TcpConnection))) == NULL)
+		return;
+	memset(grown + tcp_conn_slots, 0, (size - tcp_conn_slots) * sizeof(TcpConnection));
+	tcp_conn_list = grown;
+	tcp_conn_slots = size;
 }
 
-void tcp_accept(TcpConnection *tcp_conn_list)
+/* Accepts one connection. Returns false if none could be accepted. */
+static bool _accept_one()
 {
 	int acc_fd, i;
 	struct sockaddr_in cliaddr;
@@ -324,23 +494,32 @@ void tcp_accept(TcpConnection *tcp_conn_list)
 	if (acc_fd < 1)
 	{
 		fprintf(stderr, "WARNING: unable to accept TCP connection: %s\n", strerror(errno));
-		return;
+		return false;
 	}
 
 	bool event_registered = false;
 	if (tnfs_event_register(acc_fd))
 	{
 		event_registered = true;
-		tcp_conn = tcp_conn_list;
-		for (i = 0; i < MAX_TCP_CONN; i++)
+		for (i = 0; i < tcp_conn_slots && tcp_conn_list[i].cli_fd != 0; i++)
+			;
+		if (i == tcp_conn_slots)
+			_grow_tcp_conn_list();
+		tcp_conn = tcp_conn_list + i;
+		for (; i < tcp_conn_slots; i++)
 		{
 			if (tcp_conn->cli_fd == 0)
 			{
+				if ((tcp_conn->rxbuf = malloc(TCP_RXBUFSZ)) == NULL)
+					break;
 				MSGLOG(cliaddr.sin_addr.s_addr, "New TCP connection at index %d.", i);
 				tcp_conn->cli_fd = acc_fd;
 				tcp_conn->cliaddr = cliaddr;
 				tcp_conn->last_contact = time(NULL);
-				return;
+				tcp_conn->rxlen = 0;
+				_idle_append(tcp_conn);
+				tcp_conn_count++;
+				return true;
 			}
 			tcp_conn++;
 		}
@@ -363,7 +542,22 @@ void tcp_accept(TcpConnection *tcp_conn_list)
 
 	send(acc_fd, (const char *)txbuf, sizeof(txbuf), 0);
 	close(acc_fd);
+	return true;
+}
+
+/* The event backends may be edge triggered, so accept every connection
+ * that's waiting; clients connecting at once would otherwise be left in
+ * the backlog until the next one arrives. */
+void tcp_accept()
+{
+#ifdef WIN32
+	_accept_one();
+#else
+	struct pollfd pfd = {tcplistenfd, POLLIN, 0};
 
+	while (_accept_one() && poll(&pfd, 1, 0) > 0)
+		;
+#endif
 }
 
 void tnfs_handle_udpmsg()
@@ -375,56 +569,311 @@ void tnfs_handle_udpmsg()
 #endif
 	int rxbytes;
 	struct sockaddr_in cliaddr;
-	unsigned char rxbuf[MAXMSGSZ];
+	unsigned char rxbuf[MAXMSGSZ + 1];
 
-	len = sizeof(cliaddr);
-	rxbytes = recvfrom(sockfd, (char *)rxbuf, sizeof(rxbuf), 0,
-					   (struct sockaddr *)&cliaddr, &len);
+	/* The event backends may be edge triggered, so read every datagram
+	 * that's waiting; clients in windowed mode send several at once. */
+	while (true)
+	{
+		len = sizeof(cliaddr);
+#ifdef WIN32
+		rxbytes = recvfrom(sockfd, (char *)rxbuf, MAXMSGSZ, 0,
+						   (struct sockaddr *)&cliaddr, &len);
+#else
+		rxbytes = recvfrom(sockfd, (char *)rxbuf, MAXMSGSZ, MSG_DONTWAIT,
+						   (struct sockaddr *)&cliaddr, &len);
+		if (rxbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+#endif
 
-	if (rxbytes >= TNFS_HEADERSZ)
+		if (rxbytes > 0)
+			capture_request(&cliaddr, false, rxbuf, rxbytes);
+		if (rxbytes >= TNFS_HEADERSZ)
+		{
+			*(rxbuf + rxbytes) = 0;
+			/* probably a valid TNFS packet, decode it */
+			tnfs_decode(&cliaddr, 0, rxbytes, rxbuf);
+		}
+		else if (rxbytes >= 0)
+		{
+			MSGLOG(cliaddr.sin_addr.s_addr,
+				   "Invalid datagram received");
+		}
+#ifdef WIN32
+		return;
+#else
+		else
+		{
+			return;
+		}
+#endif
+	}
+}
+
+/* Skips over nstrings NULL terminated strings starting at pos.
+ * Returns the position after the last one, 0 if they haven't all
+ * arrived yet. If the buffered data has been drained from the socket
+ * and ends on a terminator after at least nrequired strings, the
+ * remaining strings are taken to have been left off by the client. */
+static int _frame_strings(unsigned char *buf, int len, int pos,
+	int nstrings, int nrequired, bool drained)
+{
+	unsigned char *end;
+	int i;
+
+	for (i = 0; i < nstrings; i++)
 	{
-		/* probably a valid TNFS packet, decode it */
-		tnfs_decode(&cliaddr, 0, rxbytes, rxbuf);
+		if (pos >= len ||
+			(end = memchr(buf + pos, 0, len - pos)) == NULL)
+		{
+			if (drained && i >= nrequired && pos == len)
+				return len;
+			return 0;
+		}
+		pos = end - buf + 1;
 	}
-	else
+	return pos;
+}
+
+static int _frame_fixed(int len, int framelen)
+{
+	return len >= framelen ? framelen : 0;
+}
+
+/* TNFS requests carry no length over TCP, so the length of the request
+ * at the start of buf is worked out from the layout of its command.
+ * Returns the length of the request, 0 if more bytes are needed, or -1
+ * if the command is unknown and the request can't be framed. */
+int tnfs_tcp_framelen(unsigned char *buf, int len, bool drained)
+{
+	if (len < TNFS_HEADERSZ)
+		return 0;
+
+	switch (*(buf + 3))
+	{
+	case TNFS_UMOUNT:
+	case TNFS_SIZE:
+	case TNFS_FREE:
+		return TNFS_HEADERSZ;
+	case TNFS_MOUNT:
+		/* version, then mount point, user and password. Older
+		 * clients leave off the user and password entirely */
+		return _frame_strings(buf, len, TNFS_HEADERSZ + 2, 3, 1, drained);
+	case TNFS_OPENDIR:
+	case TNFS_MKDIR:
+	case TNFS_RMDIR:
+	case TNFS_STATFILE:
+	case TNFS_UNLINKFILE:
+		return _frame_strings(buf, len, TNFS_HEADERSZ, 1, 1, drained);
+	case TNFS_READDIR:
+	case TNFS_CLOSEDIR:
+	case TNFS_TELLDIR:
+	case TNFS_CLOSEFILE:
+		return _frame_fixed(len, TNFS_HEADERSZ + 1);
+	case TNFS_READDIRX:
+		return _frame_fixed(len, TNFS_HEADERSZ + 2);
+	case TNFS_SEEKDIR:
+		return _frame_fixed(len, TNFS_HEADERSZ + 5);
+	case TNFS_OPENDIRX:
+		/* options, then pattern and path. A lone string is taken
+		 * to be the path by tnfs_opendirx() */
+		return _frame_strings(buf, len, TNFS_HEADERSZ + 4, 2, 1, drained);
+	case TNFS_SEARCH:
+		/* options, then query and path, both required */
+		return _frame_strings(buf, len, TNFS_HEADERSZ + 4, 2, 2, drained);
+	case TNFS_READBLOCK:
+		return _frame_fixed(len, TNFS_HEADERSZ + 3);
+	case TNFS_WRITEBLOCK:
+		if (len < TNFS_HEADERSZ + 3)
+			return 0;
+		return _frame_fixed(len, TNFS_HEADERSZ + 3 + tnfs16uint(buf + TNFS_HEADERSZ + 1));
+	case TNFS_SEEKFILE:
+		return _frame_fixed(len, TNFS_HEADERSZ + 6);
+	case TNFS_OPENFILE_OLD:
+	case TNFS_CHMODFILE:
+		return _frame_strings(buf, len, TNFS_HEADERSZ + 2, 1, 1, drained);
+	case TNFS_OPENFILE:
+		return _frame_strings(buf, len, TNFS_HEADERSZ + 4, 1, 1, drained);
+	case TNFS_RENAMEFILE:
+		return _frame_strings(buf, len, TNFS_HEADERSZ, 2, 2, drained);
+	case TNFS_STREAMREAD:
+		return _frame_fixed(len, TNFS_HEADERSZ + 9);
+	default:
+		return -1;
+	}
+}
+
+/* The nth string in the request data from offset, or NULL */
+static const char *_request_string(unsigned char *databuf, int datasz, int offset, int n)
+{
+	unsigned char *end;
+
+	while (offset < datasz)
 	{
-		MSGLOG(cliaddr.sin_addr.s_addr,
-			   "Invalid datagram received");
+		if ((end = memchr(databuf + offset, 0, datasz - offset)) == NULL)
+			return NULL;
+		if (n-- == 0)
+			return (const char *)databuf + offset;
+		offset = end - databuf + 1;
 	}
+	return NULL;
+}
 
-	*(rxbuf + rxbytes) = 0;
+/* What a request is about: sets *path to the path it names, or NULL,
+ * and returns the file or directory handle it's on, or -1. The layouts
+ * are those of tnfs_tcp_framelen(). */
+int tnfs_request_target(uint8_t cmd, unsigned char *databuf, int datasz, const char **path)
+{
+	*path = NULL;
+	switch (cmd)
+	{
+	case TNFS_MOUNT:
+	case TNFS_OPENFILE_OLD:
+	case TNFS_CHMODFILE:
+		*path = _request_string(databuf, datasz, 2, 0);
+		break;
+	case TNFS_OPENDIR:
+	case TNFS_MKDIR:
+	case TNFS_RMDIR:
+	case TNFS_STATFILE:
+	case TNFS_UNLINKFILE:
+	case TNFS_RENAMEFILE:
+		*path = _request_string(databuf, datasz, 0, 0);
+		break;
+	case TNFS_OPENFILE:
+		*path = _request_string(databuf, datasz, 4, 0);
+		break;
+	case TNFS_OPENDIRX:
+	case TNFS_SEARCH:
+		/* the directory follows the pattern or query */
+		if ((*path = _request_string(databuf, datasz, 4, 1)) == NULL)
+			*path = _request_string(databuf, datasz, 4, 0);
+		break;
+	case TNFS_READDIR:
+	case TNFS_CLOSEDIR:
+	case TNFS_TELLDIR:
+	case TNFS_SEEKDIR:
+	case TNFS_READDIRX:
+	case TNFS_READBLOCK:
+	case TNFS_WRITEBLOCK:
+	case TNFS_CLOSEFILE:
+	case TNFS_SEEKFILE:
+	case TNFS_STREAMREAD:
+		if (datasz > 0)
+			return databuf[0];
+		break;
+	}
+	return -1;
+}
+
+/* Decodes every complete request waiting in the connection's receive
+ * buffer, leaving any partial request at the start of the buffer.
+ * Returns -1 if the connection had to be closed. */
+static int tnfs_tcp_decode_frames(TcpConnection *tcp_conn, bool drained)
+{
+	int pos = 0;
+	int framelen;
+
+	while (pos < tcp_conn->rxlen)
+	{
+		framelen = tnfs_tcp_framelen(tcp_conn->rxbuf + pos, tcp_conn->rxlen - pos, drained);
+		if (framelen < 0)
+		{
+			/* unknown command: there's no telling where it ends,
+			 * so hand over everything that has arrived */
+			if (!drained)
+				break;
+			framelen = tcp_conn->rxlen - pos;
+		}
+		if (framelen == 0)
+			break;
+		if (framelen > MAXMSGSZ)
+		{
+			MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Request too large, closing socket.");
+			tnfs_close_tcp(tcp_conn);
+			return -1;
+		}
+		capture_request(&tcp_conn->cliaddr, true, tcp_conn->rxbuf + pos, framelen);
+		tnfs_decode(&tcp_conn->cliaddr, tcp_conn->cli_fd, framelen, tcp_conn->rxbuf + pos);
+		pos += framelen;
+	}
+
+	if (pos > 0)
+	{
+		tcp_conn->rxlen -= pos;
+		memmove(tcp_conn->rxbuf, tcp_conn->rxbuf + pos, tcp_conn->rxlen);
+	}
+
+	if (tcp_conn->rxlen >= MAXMSGSZ)
+	{
+		MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Unterminated request, closing socket.");
+		tnfs_close_tcp(tcp_conn);
+		return -1;
+	}
+	return 0;
 }
 
 void tnfs_handle_tcpmsg(TcpConnection *tcp_conn)
 {
-	unsigned char buf[MAXMSGSZ];
 	int sz;
 
 	tcp_conn->last_contact = time(NULL);
+	if (tcp_idle_tail != tcp_conn - tcp_conn_list)
+	{
+		_idle_unlink(tcp_conn);
+		_idle_append(tcp_conn);
+	}
 
-	sz = recv(tcp_conn->cli_fd, (char *)buf, sizeof(buf), 0);
-
+	/* The event backends may be edge triggered, so keep reading until
+	 * the socket has nothing more to give. Several pipelined requests
+	 * can arrive in one segment, and a request can be split across
+	 * segments, so decode whatever complete requests have arrived
+	 * after each read. */
+	while (true)
+	{
 #ifdef WIN32
-	if (sz == SOCKET_ERROR) {
-		LOG("WSAGetLastError() = %d\n", WSAGetLastError());
-	}
+		sz = recv(tcp_conn->cli_fd, (char *)tcp_conn->rxbuf + tcp_conn->rxlen,
+				  TCP_RXBUFSZ - tcp_conn->rxlen, 0);
+		if (sz == SOCKET_ERROR) {
+			LOG("WSAGetLastError() = %d\n", WSAGetLastError());
+		}
 #else
-	if (sz == -1) {
-		LOG("Error: %s\n", strerror(errno));
-	}
+		sz = recv(tcp_conn->cli_fd, (char *)tcp_conn->rxbuf + tcp_conn->rxlen,
+				  TCP_RXBUFSZ - tcp_conn->rxlen, MSG_DONTWAIT);
+		if (sz == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			tnfs_tcp_decode_frames(tcp_conn, true);
+			return;
+		}
+		if (sz == -1) {
+			LOG("Error: %s\n", strerror(errno));
+		}
 #endif
 
-	if (sz <= 0) {
-		MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Client disconnected, closing socket.");
-		tnfs_close_tcp(tcp_conn);
+		if (sz <= 0) {
+			MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Client disconnected, closing socket.");
+			tnfs_close_tcp(tcp_conn);
+			return;
+		}
+		tcp_conn->rxlen += sz;
+
+#ifdef WIN32
+		/* select() is level triggered; anything left will be
+		 * picked up on the next pass through the main loop */
+		tnfs_tcp_decode_frames(tcp_conn, true);
 		return;
+#else
+		if (tnfs_tcp_decode_frames(tcp_conn, false) < 0)
+			return;
+#endif
 	}
-	tnfs_decode(&tcp_conn->cliaddr, tcp_conn->cli_fd, sz, buf);
 }
 
 void tnfs_close_tcp(TcpConnection *tcp_conn)
 {
 		tnfs_reset_cli_fd_in_sessions(tcp_conn->cli_fd);
+		_idle_unlink(tcp_conn);
+		tcp_conn_count--;
 
 #ifdef WIN32
 		closesocket(tcp_conn->cli_fd);
@@ -433,6 +882,51 @@ void tnfs_close_tcp(TcpConnection *tcp_conn)
 #endif
 		tnfs_event_unregister(tcp_conn->cli_fd);
 		tcp_conn->cli_fd = 0;
+		free(tcp_conn->rxbuf);
+		tcp_conn->rxbuf = NULL;
+		tcp_conn->rxlen = 0;
+}
+
+/* Log a request that held up the main loop, naming what it was about.
+ * sess is NULL if the request had none or may have freed it. */
+static void _log_slow(Header *hdr, Session *sess, unsigned char *databuf, int datasz,
+	int64_t latency)
+{
+	unsigned char *ip = (unsigned char *)&hdr->ipaddr;
+	const char *path;
+	char target[MAX_FILEPATH + 16] = "";
+	int h = tnfs_request_target(hdr->cmd, databuf, datasz, &path);
+
+	/* names of handles outlive their closing, so CLOSE has one too */
+	if (path != NULL)
+		snprintf(target, sizeof(target), " %s", path);
+	else if (h >= 0 && sess != NULL && (hdr->cmd & 0xF0) == CLASS_DIRECTORY &&
+			 h < settings.max_dhnd_per_conn && sess->dhandles[h].path[0])
+		snprintf(target, sizeof(target), " %s", sess->dhandles[h].path);
+	else if (h >= 0 && sess != NULL && (hdr->cmd & 0xF0) == CLASS_FILE &&
+			 h < settings.max_fd_per_conn && sess->fdpath[h] != NULL)
+		snprintf(target, sizeof(target), " %s", sess->fdpath[h]);
+	else if (h >= 0)
+		snprintf(target, sizeof(target), " handle %d", h);
+
+	LOG("Slow request | %d.%d.%d.%d s=%02x %s%s took %" PRId64 "ms\n",
+		ip[0], ip[1], ip[2], ip[3], hdr->sid, get_cmd_name(hdr->cmd), target,
+		latency / 1000);
+	slow_logged = true;
+}
+
+/* Account for a request that started at start, in usec */
+static void _carried_out(Header *hdr, Session *sess, unsigned char *databuf, int datasz,
+	int64_t start)
+{
+	int64_t latency = tnfs_clock_us() - start;
+
+	TNFS_PROBE6(command__done, hdr->sid, hdr->seqno, hdr->cmd, hdr->status, latency,
+				get_cmd_name(hdr->cmd));
+	stats_command(hdr->cmd, latency);
+	accesslog_end(latency);
+	if (settings.slow_request_ms > 0 && latency >= (int64_t)settings.slow_request_ms * 1000)
+		_log_slow(hdr, sess, databuf, datasz, latency);
 }
 
 void tnfs_decode(struct sockaddr_in *cliaddr, int cli_fd, int rxbytes, unsigned char *rxbuf)
@@ -441,10 +935,10 @@ void tnfs_decode(struct sockaddr_in *cliaddr, int cli_fd, int rxbytes, unsigned
 	Session *sess;
 	int sindex;
 	int datasz = rxbytes - TNFS_HEADERSZ;
-	int cmdclass, cmdidx;
 	unsigned char *databuf = rxbuf + TNFS_HEADERSZ;
 
 	memset(&hdr, 0, sizeof(hdr));
+	stats.bytes_in += rxbytes;
 
 	/* note: don't forget about byte alignment issues on some
 	 * architectures... */
@@ -454,17 +948,12 @@ void tnfs_decode(struct sockaddr_in *cliaddr, int cli_fd, int rxbytes, unsigned
 	hdr.ipaddr = cliaddr->sin_addr.s_addr;
 	hdr.port = ntohs(cliaddr->sin_port);
 	hdr.cli_fd = cli_fd;
+	TNFS_PROBE5(request, hdr.sid, hdr.seqno, hdr.cmd, rxbytes, hdr.ipaddr);
 
 #ifdef DEBUG
 	TNFSMSGLOG(&hdr, "REQUEST cmd=0x%02x %s", hdr.cmd, get_cmd_name(hdr.cmd));
 #endif
 
-	if (!is_cmd_allowed(hdr.cmd))
-	{
-		tnfs_notpermitted(&hdr);
-		return;
-	}
-
 	/* The MOUNT command is the only one that doesn't need an
 	 * established session (since MOUNT is actually what will
 	 * establish the session) */
@@ -492,47 +981,164 @@ void tnfs_decode(struct sockaddr_in *cliaddr, int cli_fd, int rxbytes, unsigned
 	}
 	else
 	{
+		int64_t start = tnfs_clock_us();
+		TNFS_PROBE3(command__start, hdr.sid, hdr.seqno, hdr.cmd);
+		accesslog_begin(&hdr, databuf, datasz);
 		tnfs_mount(&hdr, databuf, datasz);
+		_carried_out(&hdr, NULL, databuf, datasz, start);
+		return;
+	}
+
+	/* windowed sessions keep their own account of what has been
+	 * carried out and what needs retransmitting */
+	if (sess->window != NULL && cli_fd == 0)
+	{
+		tnfs_window_receive(sess, sindex, &hdr, cliaddr, rxbytes, rxbuf);
 		return;
 	}
 
-	/* client is asking for a resend */
-	if (hdr.seqno == sess->lastseqno)
+	/* client is asking for a resend. Only the last chunk of a
+	 * STREAMREAD is kept, so the stream starts again instead. */
+	if (hdr.seqno == sess->lastseqno && hdr.cmd != TNFS_STREAMREAD)
 	{
 		tnfs_resend(sess, cliaddr, cli_fd);
 		return;
 	}
 
+	tnfs_dispatch(&hdr, sess, sindex, databuf, datasz);
+}
+
+/* Carry out a request on an established session */
+void tnfs_dispatch(Header *hdr, Session *sess, int sindex,
+	unsigned char *databuf, int datasz)
+{
+	int cmdclass, cmdidx;
+	int64_t start = tnfs_clock_us();
+
+	TNFS_PROBE3(command__start, hdr->sid, hdr->seqno, hdr->cmd);
+	accesslog_begin(hdr, databuf, datasz);
+	if (!is_cmd_allowed(hdr->cmd))
+	{
+		tnfs_notpermitted(hdr, sess);
+		_carried_out(hdr, sess, databuf, datasz, start);
+		return;
+	}
+
 	/* find the command class and pass it off to the right
 	 * function */
-	cmdclass = hdr.cmd & 0xF0;
-	cmdidx = hdr.cmd & 0x0F;
+	cmdclass = hdr->cmd & 0xF0;
+	cmdidx = hdr->cmd & 0x0F;
 	switch (cmdclass)
 	{
 	case CLASS_SESSION:
 		switch (cmdidx)
 		{
 		case TNFS_UMOUNT:
-			tnfs_umount(&hdr, sess, sindex);
+			tnfs_umount(hdr, sess, sindex);
 			break;
 		default:
-			tnfs_badcommand(&hdr, sess);
+			tnfs_badcommand(hdr, sess);
 		}
 		break;
 	case CLASS_DIRECTORY:
 		if (cmdidx < NUM_DIRCMDS)
-			(*dircmd[cmdidx])(&hdr, sess, databuf, datasz);
+			(*dircmd[cmdidx])(hdr, sess, databuf, datasz);
 		else
-			tnfs_badcommand(&hdr, sess);
+			tnfs_badcommand(hdr, sess);
 		break;
 	case CLASS_FILE:
 		if (cmdidx < NUM_FILECMDS)
-			(*filecmd[cmdidx])(&hdr, sess, databuf, datasz);
+			(*filecmd[cmdidx])(hdr, sess, databuf, datasz);
 		else
-			tnfs_badcommand(&hdr, sess);
+			tnfs_badcommand(hdr, sess);
 		break;
 	default:
-		tnfs_badcommand(&hdr, sess);
+		tnfs_badcommand(hdr, sess);
+	}
+	/* an UMOUNT frees the session */
+	_carried_out(hdr, hdr->cmd == TNFS_UMOUNT ? NULL : sess, databuf, datasz, start);
+}
+
+/* Handle a request on a session in windowed mode. Requests are carried
+ * out strictly in sequence number order so a client can pipeline reads
+ * of the same file; those arriving ahead of a missing one are held until
+ * the gap is filled by the client's retry. */
+void tnfs_window_receive(Session *sess, int sindex, Header *hdr,
+	struct sockaddr_in *cliaddr, int rxbytes, unsigned char *rxbuf)
+{
+	tnfs_window *w = sess->window;
+	uint8_t ahead = hdr->seqno - w->nextseqno;
+	uint8_t behind = w->nextseqno - 1 - hdr->seqno;
+	int slot = hdr->seqno % w->size;
+	Header next;
+
+	if (ahead > 0 && ahead < w->size)
+	{
+		/* early arrival, wait for the ones before it */
+		if (!w->pending[slot].valid)
+		{
+			w->pending[slot].valid = true;
+			w->pending[slot].cliaddr = *cliaddr;
+			w->pending[slot].rxbytes = rxbytes;
+			memcpy(w->pending[slot].rxbuf, rxbuf, rxbytes);
+		}
+		return;
+	}
+
+	if (behind < w->size)
+	{
+		/* already carried out: the client missed the reply, or
+		 * some of the stream of a STREAMREAD, which starts again */
+		if (hdr->cmd == TNFS_STREAMREAD)
+		{
+			tnfs_dispatch(hdr, sess, sindex, rxbuf + TNFS_HEADERSZ, rxbytes - TNFS_HEADERSZ);
+		}
+		else if (w->reply[slot].valid && w->reply[slot].seqno == hdr->seqno)
+		{
+			int txbytes = sendto(sockfd, WIN32_CHAR_P w->reply[slot].msg, w->reply[slot].msgsz, 0,
+				   (struct sockaddr *)cliaddr, sizeof(struct sockaddr_in));
+			TNFS_PROBE3(resend, sess->sid, hdr->seqno, txbytes);
+			stats_resend(txbytes);
+			if (txbytes < w->reply[slot].msgsz)
+			{
+				TNFSMSGLOG(hdr, "Retransmit was truncated");
+			}
+		}
+		return;
+	}
+
+	if (ahead != 0)
+	{
+		/* nowhere near the window; the client has lost track of
+		 * its sequence numbers, so start again from this request */
+		TNFSMSGLOG(hdr, "Sequence number outside window, resynchronizing");
+		memset(w->pending, 0, sizeof(w->pending));
+	}
+
+	w->nextseqno = hdr->seqno + 1;
+	tnfs_dispatch(hdr, sess, sindex, rxbuf + TNFS_HEADERSZ, rxbytes - TNFS_HEADERSZ);
+	if (hdr->cmd == TNFS_UMOUNT)
+		return;
+
+	/* now carry out anything that was waiting on that one */
+	slot = w->nextseqno % w->size;
+	while (w->pending[slot].valid && *(w->pending[slot].rxbuf + 2) == w->nextseqno)
+	{
+		w->pending[slot].valid = false;
+
+		memset(&next, 0, sizeof(next));
+		next.sid = hdr->sid;
+		next.seqno = w->nextseqno;
+		next.cmd = *(w->pending[slot].rxbuf + 3);
+		next.ipaddr = w->pending[slot].cliaddr.sin_addr.s_addr;
+		next.port = ntohs(w->pending[slot].cliaddr.sin_port);
+
+		w->nextseqno++;
+		tnfs_dispatch(&next, sess, sindex, w->pending[slot].rxbuf + TNFS_HEADERSZ,
+					  w->pending[slot].rxbytes - TNFS_HEADERSZ);
+		if (next.cmd == TNFS_UMOUNT)
+			return;
+		slot = w->nextseqno % w->size;
 	}
 }
 
@@ -550,11 +1156,11 @@ void tnfs_badcommand(Header *hdr, Session *sess)
 	tnfs_send(sess, hdr, NULL, 0);
 }
 
-void tnfs_notpermitted(Header *hdr)
+void tnfs_notpermitted(Header *hdr, Session *sess)
 {
 	TNFSMSGLOG(hdr, "Command %s is not permitted", get_cmd_name(hdr->cmd));
 	hdr->status = TNFS_EPERM;
-	tnfs_send(NULL, hdr, NULL, 0);
+	tnfs_send(sess, hdr, NULL, 0);
 }
 
 void tnfs_send(Session *sess, Header *hdr, unsigned char *msg, int msgsz)
@@ -586,6 +1192,16 @@ void tnfs_send(Session *sess, Header *hdr, unsigned char *msg, int msgsz)
 	{
 		sess->lastmsgsz = TNFS_HEADERSZ + 1 + msgsz; /* header + status code + payload */
 		sess->lastseqno = hdr->seqno;
+		sess->lastfile.size = 0;
+
+		if (sess->window != NULL)
+		{
+			int slot = hdr->seqno % sess->window->size;
+			sess->window->reply[slot].valid = true;
+			sess->window->reply[slot].seqno = hdr->seqno;
+			sess->window->reply[slot].msgsz = sess->lastmsgsz;
+			memcpy(sess->window->reply[slot].msg, txbuf, sess->lastmsgsz);
+		}
 	}
 
 	if (hdr->cli_fd == 0)
@@ -595,15 +1211,47 @@ void tnfs_send(Session *sess, Header *hdr, unsigned char *msg, int msgsz)
 	}
 	else
 	{
+#ifdef WIN32
 		txbytes = send(hdr->cli_fd, WIN32_CHAR_P txbuf, msgsz + TNFS_HEADERSZ + 1, 0); 
+#else
+		/* a client that leaves its replies unread mustn't hold up the
+		 * rest; one that doesn't fit closes its connection below */
+		txbytes = send(hdr->cli_fd, txbuf, msgsz + TNFS_HEADERSZ + 1, MSG_DONTWAIT);
+#endif
 	}
+	TNFS_PROBE5(reply, hdr->sid, hdr->seqno, hdr->cmd, hdr->status, txbytes);
+	stats_reply(hdr->cmd, hdr->status, txbytes);
+	accesslog_reply(hdr->status, txbytes);
 
 	if (txbytes < TNFS_HEADERSZ + 1 + msgsz)
 	{
-		TNFSMSGLOG(hdr, "Message was truncated");
+		if (hdr->cli_fd == 0)
+			TNFSMSGLOG(hdr, "Message was truncated");
+		else if (txbytes >= 0 || errno != EPIPE)
+		{
+			/* the client would read what follows out of step; the
+			 * replies still to come once it's shut down are dropped */
+			TNFSMSGLOG(hdr, "Message was truncated, closing connection");
+			shutdown(hdr->cli_fd, SHUT_RDWR);
+		}
 	}
 }
 
+#ifdef ENABLE_SENDFILE
+/* Bytes the send buffer of a TCP socket can take without blocking. The
+ * size the kernel reports is twice that set, half being its overhead. */
+static int _send_room(int fd)
+{
+	int sndbuf, queued;
+	socklen_t len = sizeof(sndbuf);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0 ||
+		ioctl(fd, SIOCOUTQ, &queued) != 0)
+		return 0;
+	return sndbuf / 2 - queued;
+}
+#endif
+
 void tnfs_resend(Session *sess, struct sockaddr_in *cliaddr, int cli_fd)
 {
 	int txbytes;
@@ -612,43 +1260,137 @@ void tnfs_resend(Session *sess, struct sockaddr_in *cliaddr, int cli_fd)
 		txbytes = sendto(sockfd, WIN32_CHAR_P sess->lastmsg, sess->lastmsgsz, 0,
 						(struct sockaddr *)cliaddr, sizeof(struct sockaddr_in));
 	}
+#ifdef ENABLE_SENDFILE
+	else if (sess->lastfile.size > 0)
+	{
+		/* the data of a sendfile() READ wasn't kept, so send it
+		 * from the file again */
+		off_t offset = sess->lastfile.offset;
+		txbytes = 0;
+		if (_send_room(cli_fd) >= sess->lastmsgsz + sess->lastfile.size &&
+			send(cli_fd, sess->lastmsg, sess->lastmsgsz, MSG_MORE | MSG_DONTWAIT) == sess->lastmsgsz &&
+			tnfs_sendfile(cli_fd, file_osfd(sess->lastfile.fd), &offset, sess->lastfile.size) == sess->lastfile.size)
+		{
+			txbytes = sess->lastmsgsz;
+		}
+	}
+#endif
 	else
 	{
+#ifdef WIN32
 		txbytes = send(cli_fd, WIN32_CHAR_P sess->lastmsg, sess->lastmsgsz, 0); 
+#else
+		txbytes = send(cli_fd, sess->lastmsg, sess->lastmsgsz, MSG_DONTWAIT);
+#endif
 	}
+	TNFS_PROBE3(resend, sess->sid, sess->lastseqno, txbytes);
+	stats_resend(txbytes);
 	if (txbytes < sess->lastmsgsz)
 	{
 		MSGLOG(cliaddr->sin_addr.s_addr,
 			   "Retransmit was truncated");
+		if (cli_fd != 0)
+			shutdown(cli_fd, SHUT_RDWR);
 	}
 }
 
-void tnfs_close_stale_connections(TcpConnection *tcp_conn_list)
+#ifdef ENABLE_SENDFILE
+/* Sends size bytes of the file starting at *offset on a TCP socket,
+ * without copying them through userspace. Returns the number sent. */
+int tnfs_sendfile(int cli_fd, int fd, off_t *offset, int size)
 {
-	time_t now = time(NULL);
-	TcpConnection *tcp_conn = tcp_conn_list;
-	for (int i = 0; i < MAX_TCP_CONN; i++)
+	ssize_t sent;
+	int total = 0;
+
+	while (total < size)
 	{
-		if (tcp_conn->cli_fd != 0)
+		sent = sendfile(cli_fd, fd, offset, size - total);
+		if (sent <= 0)
 		{
-			if ((now - tcp_conn->last_contact) > CONN_TIMEOUT)
-			{
-				MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Socket is no longer active; disconnecting.");
-				tnfs_close_tcp(tcp_conn);
-			}
+			if (sent < 0 && errno == EINTR)
+				continue;
+			break;
 		}
-		tcp_conn++;
+		total += sent;
+	}
+	return total;
+}
+
+/* Reply to a READ over TCP with the data at pos in the session's file
+ * sent straight from it. The header goes out first with MSG_MORE so it
+ * shares a segment with the start of the data. Only as much is read as
+ * the socket takes without blocking; a reply that is cut short anyway
+ * shuts the connection down, as the client can't find where the next
+ * one starts. Returns the number of bytes of the file sent, or -1 if it
+ * can't be sent this way, in which case nothing has been sent. */
+int tnfs_send_file(Session *sess, Header *hdr, int fd, off_t pos, int requestsz)
+{
+	struct stat st;
+	off_t offset;
+	int size, room;
+	int osfd = file_osfd(fd);
+	unsigned char *txbuf = sess->lastmsg;
+
+	if (osfd < 0 || fstat(osfd, &st) != 0 || !S_ISREG(st.st_mode) || pos >= st.st_size)
+		return -1;
+	if (!tnfs_writable(hdr->cli_fd) || (room = _send_room(hdr->cli_fd) - (TNFS_HEADERSZ + 3)) <= 0)
+		return -1;
+
+	size = (st.st_size - pos) < requestsz ? (int)(st.st_size - pos) : requestsz;
+	if (size > room)
+		size = room;
+
+	uint16tnfs(txbuf, hdr->sid);
+	*(txbuf + 2) = hdr->seqno;
+	*(txbuf + 3) = hdr->cmd;
+	*(txbuf + 4) = hdr->status = TNFS_SUCCESS;
+	uint16tnfs(txbuf + 5, (uint16_t)size);
+
+	sess->lastmsgsz = TNFS_HEADERSZ + 3;
+	sess->lastseqno = hdr->seqno;
+	sess->lastfile.fd = fd;
+	sess->lastfile.offset = pos;
+	sess->lastfile.size = size;
+
+	/* sendfile() with an offset leaves the file position alone */
+	offset = pos;
+	if (send(hdr->cli_fd, txbuf, sess->lastmsgsz, MSG_MORE | MSG_DONTWAIT) < sess->lastmsgsz ||
+		tnfs_sendfile(hdr->cli_fd, osfd, &offset, size) < size)
+	{
+		TNFSMSGLOG(hdr, "Message was truncated, closing connection");
+		shutdown(hdr->cli_fd, SHUT_RDWR);
+	}
+	TNFS_PROBE5(reply, hdr->sid, hdr->seqno, hdr->cmd, TNFS_SUCCESS, sess->lastmsgsz + (int)(offset - pos));
+	stats_reply(hdr->cmd, TNFS_SUCCESS, sess->lastmsgsz + (int)(offset - pos));
+	accesslog_reply(TNFS_SUCCESS, sess->lastmsgsz + (int)(offset - pos));
+	return (int)(offset - pos);
+}
+#endif
+
+void tnfs_close_stale_connections(time_t now)
+{
+	TcpConnection *tcp_conn;
+
+	/* only the front of the idle list can have timed out */
+	while (settings.conn_timeout > 0 && tcp_idle_head >= 0)
+	{
+		tcp_conn = &tcp_conn_list[tcp_idle_head];
+		if ((now - tcp_conn->last_contact) <= settings.conn_timeout)
+			break;
+		MSGLOG(tcp_conn->cliaddr.sin_addr.s_addr, "Socket is no longer active; disconnecting.");
+		tnfs_close_tcp(tcp_conn);
 	}
 }
 
-void tnfs_close_all_connections(TcpConnection *tcp_conn_list)
+void tnfs_close_all_connections()
 {
 	TcpConnection *tcp_conn = tcp_conn_list;
-	for (int i = 0; i < MAX_TCP_CONN; i++)
+	for (int i = 0; i < tcp_conn_slots; i++)
 	{
 		if (tcp_conn->cli_fd != 0)
 		{
 			tnfs_close_tcp(tcp_conn);
 		}
+		tcp_conn++;
 	}
 }
@@ -26,6 +26,7 @@
  * */
 
 #include <sys/types.h>
+#include <stdbool.h>
 
 #ifdef UNIX
 #include <arpa/inet.h>
@@ -48,17 +49,36 @@
 int tnfs_sockinit(int port);
 void tnfs_sockclose();
 void tnfs_mainloop();
+int64_t tnfs_clock_ms();
+int64_t tnfs_clock_us();
+const char *get_cmd_name(uint8_t cmd);
+bool tnfs_writable(int fd);
 void tnfs_handle_udpmsg();
-void tcp_accept(TcpConnection *tcp_conn_list);
+/* TCP connections; slots not in use have a cli_fd of 0 */
+extern TcpConnection *tcp_conn_list;
+extern int tcp_conn_slots;
+extern int tcp_conn_count;
+
+void tcp_accept();
 void tnfs_handle_tcpmsg(TcpConnection *tcp_conn);
+int tnfs_tcp_framelen(unsigned char *buf, int len, bool drained);
+int tnfs_request_target(uint8_t cmd, unsigned char *databuf, int datasz, const char **path);
 void tnfs_decode(struct sockaddr_in *cliaddr, int cli_fd,
 	int rxbytes, unsigned char *rxbuf);
+void tnfs_dispatch(Header *hdr, Session *sess, int sindex,
+	unsigned char *databuf, int datasz);
+void tnfs_window_receive(Session *sess, int sindex, Header *hdr,
+	struct sockaddr_in *cliaddr, int rxbytes, unsigned char *rxbuf);
 void tnfs_invalidsession(Header *hdr);
 void tnfs_badcommand(Header *hdr, Session *sess);
-void tnfs_notpermitted(Header *hdr);
+void tnfs_notpermitted(Header *hdr, Session *sess);
 void tnfs_send(Session *sess, Header *hdr, unsigned char *msg, int msgsz);
 void tnfs_resend(Session *sess, struct sockaddr_in *cliaddr, int cli_fd);
-void tnfs_close_stale_connections(TcpConnection *tcp_conn_list);
-void tnfs_close_all_connections(TcpConnection *tcp_conn_list);
+#ifdef ENABLE_SENDFILE
+int tnfs_sendfile(int cli_fd, int fd, off_t *offset, int size);
+int tnfs_send_file(Session *sess, Header *hdr, int fd, off_t pos, int requestsz);
+#endif
+void tnfs_close_stale_connections(time_t now);
+void tnfs_close_all_connections();
 void tnfs_close_tcp(TcpConnection *tcp_conn);
 #endif
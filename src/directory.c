@@ -38,6 +38,7 @@
 #include "log.h"
 #include "config.h"
 #include "directory.h"
+#include "settings.h"
 #include "tnfs_file.h"
 #include "datagram.h"
 #include "errortable.h"
@@ -45,46 +46,40 @@
 #include "endian.h"
 #include "log.h"
 #include "fileinfo.h"
+#include "pattern.h"
+#include "search.h"
+#include "probes.h"
+#include "vfs.h"
+#ifdef WITH_ZIP
+#include "zip.h"
+#endif
+#ifdef ENABLE_CATALOG
+#include "catalog.h"
+#endif
 
 #ifdef TNFS_DIR_EXT
-#include <stdint.h>
-#include <string.h>
-struct tnfs_opendir_ext {
-	struct dirent **namelist;
-	int at, start, inc, total, visited;
-	uint64_t seed;
-	int do_reverse_list;        /* ;r reverse list order; default: forward list */
-	int do_shuffle_list;        /* ;s shuffle list order; default: forward list. note: seed at [s+1] */
-	int do_exclude_sysnames;    /* ;x hide system names like .git or .gitignore; default: show system files and dirs */
-	int do_exclude_files;       // ;f hide file names; default: show files
-	int do_exclude_dirs;        // ;d hide dir names; default: show dirs
-	int do_uppercase;           // ;u "UPPER CASE" names; default: as-is
-	int do_lowercase;           // ;l "lower case" names; default: as-is
-	int do_camelcase;           // ;c "Camel Case" names; default: as-is
-	char *wildcard;
-};
-static int alphacase_sort(const struct dirent **a, const struct dirent **b) {
-	return strcasecmp((*a)->d_name, (*b)->d_name);
-}
-static int wildcard( const char *pattern, const char *str ) {
-	if( *pattern=='\0' ) return !*str;
-	if( *pattern=='*' )  return wildcard(pattern+1, str) || (*str && wildcard(pattern, str+1));
-	if( *pattern=='?' )  return *str && (*str != '.') && wildcard(pattern+1, str+1);
-	return ((*str|32) == (*pattern|32)) && wildcard(pattern+1, str+1);
-}
-static double rng(uint64_t *seed) { // returns [0,1)
+/* ;u ;l ;c name casing, applied as names are sent */
+#define DIR_EXT_UPPERCASE 0x01
+#define DIR_EXT_LOWERCASE 0x02
+#define DIR_EXT_CAMELCASE 0x04
+
+static uint64_t splitmix64(uint64_t *seed) {
 	uint64_t z = (*seed += UINT64_C(0x9e3779b97f4a7c15));
 	z = (z ^ (z >> 30)) *  UINT64_C(0xbf58476d1ce4e5b9);
 	z = (z ^ (z >> 27)) *  UINT64_C(0x94d049bb133111eb);
-	z = z ^ (z >> 31);
-	return z / (double)0x100000000ULL;
+	return z ^ (z >> 31);
 }
 static int is_prime(unsigned candidate) {
 	/* GPL: https://github.com/kushaldas/elfutils/blob/master/lib/next_prime.c */
-	/* No even number and none less than 10 will be passed here. */
+	/* Only odd numbers are passed here, from 3 up since the caller adds
+	 * one to a count of at least 2. Those below 9 are prime except 1;
+	 * the loop below would take 3 for a multiple of itself. */
 	unsigned divn = 3;
 	unsigned sq = divn * divn, old_sq;
 
+	if (candidate < 9)
+		return candidate > 1;
+
 	while (sq < candidate && candidate % divn != 0)
 	{
 		old_sq = sq;
@@ -105,7 +100,21 @@ static unsigned next_prime(unsigned seed) {
 }
 #endif
 
-directory_entry_list dirlist_concat(directory_entry_list list1, directory_entry_list list2);
+/* What goes into a directory listing and in what order */
+struct _dirscan
+{
+	uint8_t diropts;		/* TNFS_DIROPT_* */
+	uint8_t sortopts;		/* TNFS_DIRSORT_* */
+	uint16_t maxresults;		/* 0 for no limit */
+	const tnfs_pattern *pattern;	/* NULL to match everything */
+	uint8_t exclude;		/* DIRSCAN_EXCLUDE_* */
+};
+
+#define DIRSCAN_EXCLUDE_DOTNAMES 0x01
+#define DIRSCAN_EXCLUDE_FILES 0x02
+#define DIRSCAN_EXCLUDE_DIRS 0x04
+
+static int _scan_directory(dir_handle *dirh, const struct _dirscan *scan);
 
 char root[MAX_ROOT]; /* root for all operations */
 char realroot[MAX_ROOT]; /* full path of the tnfs root dir */
@@ -116,11 +125,9 @@ int tnfs_setroot(const char *rootdir)
 	if (strlen(rootdir) > MAX_ROOT)
 		return -1;
 
-#ifdef WIN32
-	GetFullPathNameA(rootdir, MAX_ROOT, realroot, NULL);
-#else
-	realpath(rootdir, realroot);
-#endif
+	char resolved[MAX_FILEPATH];
+	if (vfs->realpath(rootdir, resolved) != NULL)
+		strlcpy(realroot, resolved, MAX_ROOT);
 
 	strlcpy(root, rootdir, MAX_ROOT);
 	return 0;
@@ -143,7 +150,7 @@ int validate_dir(Session *s, const char *path)
 #endif
 
 	/* check we have an actual directory */
-	if (stat(fullpath, &dirstat) == 0)
+	if (vfs->stat(fullpath, &dirstat) == 0)
 	{
 		if (S_ISDIR(dirstat.st_mode))
 		{
@@ -178,11 +185,19 @@ int validate_path(Session *s, const char *path)
 {
 	char valpath[MAX_FILEPATH];
 
-#ifdef WIN32
-	GetFullPathNameA(path, MAX_FILEPATH, valpath, NULL);
+	if (vfs->realpath(path, valpath) == NULL)
+	{
+#ifdef WITH_ZIP
+		/* paths inside an archive only exist up to the archive */
+		char archive[MAX_FILEPATH];
+		const char *member;
+		if (!zip_split_path(path, archive, sizeof(archive), &member) ||
+			vfs->realpath(archive, valpath) == NULL)
+			return 0;
 #else
-	realpath(path, valpath);
+		return 0;
 #endif
+	}
 
 #ifdef DEBUG
 	fprintf(stderr, "validate path: %s::%s == ", valpath, realroot);
@@ -280,13 +295,69 @@ void normalize_path(char *newbuf, char *oldbuf, int bufsz)
 #endif
 }
 
+int relative_path(const char *root, const char *path, char *rel, int relsz)
+{
+	int rootlen = strlen(root);
+	int len;
+
+	if (strncmp(path, root, rootlen) != 0 ||
+		(path[rootlen] != '/' && path[rootlen] != '\0'))
+		return -1;
+	path += rootlen;
+	while (*path == '/')
+		path++;
+	if (strlcpy(rel, path, relsz) >= relsz)
+		return -1;
+	for (len = strlen(rel); len > 0 && rel[len - 1] == '/'; len--)
+		rel[len - 1] = '\0';
+	return 0;
+}
+
+void join_path(const char *root, const char *rel, char *buf, int bufsz)
+{
+	snprintf(buf, bufsz, "%s%s%s", root, *rel ? "/" : "", rel);
+}
+
+/* Returns the open directory named by the first byte of the request,
+ * or NULL after replying with EBADF */
+static dir_handle *_validate_dirhandle(Header *hdr, Session *s,
+									   unsigned char *databuf, int datasz, int propersize)
+{
+	if (datasz != propersize ||
+		*databuf >= settings.max_dhnd_per_conn ||
+		!s->dhandles[*databuf].in_use)
+	{
+		hdr->status = TNFS_EBADF;
+		tnfs_send(s, hdr, NULL, 0);
+		return NULL;
+	}
+	return &s->dhandles[*databuf];
+}
+
+/* Copies the name of a listed entry for sending */
+static void _entry_name(dir_handle *dh, dir_listing_entry *entry, char *buf, int bufsz)
+{
+	strlcpy(buf, dh->list.names + entry->name, bufsz);
+#ifdef TNFS_DIR_EXT
+	/* convert to 'l'owercase/'u'ppercase/'c'amelcase here as needed */
+	for (char *p = buf; *p; p++)
+	{
+		if (dh->nameopts & DIR_EXT_LOWERCASE)
+			*p = tolower((unsigned char)*p);
+		else if (dh->nameopts & DIR_EXT_UPPERCASE)
+			*p = toupper((unsigned char)*p);
+		else if (dh->nameopts & DIR_EXT_CAMELCASE)
+			*p = (p == buf || p[-1] <= 32) ? toupper((unsigned char)*p) : tolower((unsigned char)*p);
+	}
+#endif
+}
+
 /* Open a directory */
 void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 {
-	DIR *dptr;
 	char path[MAX_TNFSPATH];
 	unsigned char reply[2];
-	int i;
+	int i, err;
 
 	if (*(databuf + datasz - 1) != 0)
 	{
@@ -304,9 +375,10 @@ void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 #endif
 
 	/* find the first available slot in the session */
-	for (i = 0; i < MAX_DHND_PER_CONN; i++)
+	for (i = 0; i < settings.max_dhnd_per_conn; i++)
 	{
-		if (s->dhandles[i].handle == NULL)
+		dir_handle *dh = &s->dhandles[i];
+		if (!dh->in_use)
 		{
 #ifdef TNFS_DIR_EXT
 			/* extract options from databuf if present at eos; truncates databuf */
@@ -314,59 +386,84 @@ void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 			if(options) *options++ = '\0';
 
 			/* extract wildcard mask from path; extra work needed if /enclosed/ in a path; truncates databuf */
-			char *mask = 0;
+			tnfs_pattern *mask = 0;
 			if(strchr((const char *)databuf,'*') || strchr((const char*)databuf,'?')) {
-				mask = strrchr((const char*)databuf,'/');
-				if(mask) *mask = '\0', mask = strdup(mask+1);
-				else mask = strdup((const char *)databuf), databuf[0] = 0;
+				char *slash = strrchr((const char*)databuf,'/');
+				if(slash) *slash = '\0', mask = pattern_compile(slash+1, PATTERN_QMARK_NOT_DOT);
+				else mask = pattern_compile((const char *)databuf, PATTERN_QMARK_NOT_DOT), databuf[0] = 0;
 			}
-
-			/* build & normalize path */
+#endif
 			snprintf(path, MAX_TNFSPATH, "%s/%s/%s",
 					 root, s->root, databuf);
-			normalize_path(s->dhandles[i].path, path, MAX_TNFSPATH);
+			normalize_path(dh->path, path, MAX_TNFSPATH);
 
 			/* set path to root if requested path is outside tnfs root */
-			if (!validate_path(s, s->dhandles[i].path))
-				strcpy(s->dhandles[i].path, root);
+			if (!validate_path(s, dh->path))
+				strcpy(dh->path, root);
 
-			/* scan directory */
-			struct dirent **namelist;
-			int n = scandir(s->dhandles[i].path, &namelist, NULL, alphacase_sort);
-			if(n>=0)
+#ifdef TNFS_DIR_EXT
+			/* list everything scandir() would, filtered as it's read and
+			   in case insensitive order */
+			struct _dirscan scan = {
+				TNFS_DIROPT_NO_FOLDERSFIRST | TNFS_DIROPT_NO_SKIPHIDDEN |
+				TNFS_DIROPT_NO_SKIPSPECIAL | TNFS_DIROPT_DIR_PATTERN,
+				0, 0, mask, 0 };
+			if (options && strchr(options, 'x')) scan.exclude |= DIRSCAN_EXCLUDE_DOTNAMES;  /* ;x hide system names like .git or .gitignore */
+			if (options && strchr(options, 'f')) scan.exclude |= DIRSCAN_EXCLUDE_FILES;     /* ;f hide file names */
+			if (options && strchr(options, 'd')) scan.exclude |= DIRSCAN_EXCLUDE_DIRS;      /* ;d hide dir names */
+
+			err = _scan_directory(dh, &scan);
+			pattern_free(mask);
+			if (err == 0)
 			{
-				/* allocate iteration structure and options */
-				struct tnfs_opendir_ext *handle = calloc(1, sizeof(struct tnfs_opendir_ext));
-				handle->do_uppercase = options ? !!strchr(options,'u') : 0;
-				handle->do_lowercase = options ? !!strchr(options,'l') : 0;
-				handle->do_camelcase = options ? !!strchr(options,'c') : 0;
-				handle->do_exclude_dirs = options ? !!strchr(options,'d') : 0;
-				handle->do_exclude_files = options ? !!strchr(options,'f') : 0;
-				handle->do_exclude_sysnames = options ? !!strchr(options,'x') : 0;
-				handle->do_reverse_list = options ? !!strchr(options,'r') : 0;
-				handle->do_shuffle_list = options ? !!strchr(options,'s') : 0;
-				handle->seed = handle->do_shuffle_list ? strchr(options,'s')[1] : 123u;
-				handle->at = handle->do_shuffle_list ? ((unsigned)rng(&handle->seed) * 100000) % (n-1) : (handle->do_reverse_list ? n - 1 : 0);
-				handle->inc = handle->do_shuffle_list ? next_prime(n+(handle->seed&0xff)*7) : (handle->do_reverse_list ? -1 : 1);
-				handle->visited = 0;
-				handle->total = n;
-				handle->namelist = namelist;
-				handle->wildcard = mask;
-
-				s->dhandles[i].handle = (void*)handle;
+				dh->nameopts = 0;
+				if (options && strchr(options, 'u')) dh->nameopts |= DIR_EXT_UPPERCASE;
+				if (options && strchr(options, 'l')) dh->nameopts |= DIR_EXT_LOWERCASE;
+				if (options && strchr(options, 'c')) dh->nameopts |= DIR_EXT_CAMELCASE;
+
+				/* ;r reverse and ;s shuffle (seed at [s+1]) visit the same
+				   snapshot in another order */
+				uint32_t n = dh->list.count;
+				if (n > 1 && options && (strchr(options, 'r') || strchr(options, 's')))
+				{
+					dh->list.order = malloc(n * sizeof(uint32_t));
+					if (dh->list.order == NULL)
+						err = ENOMEM;
+				}
+				if (err == 0 && dh->list.order != NULL && strchr(options, 's'))
+				{
+					uint64_t seed = strchr(options, 's')[1];
+					uint32_t at = splitmix64(&seed) % n;
+					/* a prime larger than the count steps through every entry */
+					uint32_t inc = next_prime(n + 1 + (seed & 0xff) * 7);
+					for (uint32_t k = 0; k < n; k++, at = (at + inc) % n)
+						dh->list.order[k] = at;
+				}
+				else if (err == 0 && dh->list.order != NULL)
+				{
+					for (uint32_t k = 0; k < n; k++)
+						dh->list.order[k] = n - 1 - k;
+				}
+				if (err != 0)
+					dirlist_free(&dh->list);
+			}
 #else
-			snprintf(path, MAX_TNFSPATH, "%s/%s/%s",
-					 root, s->root, databuf);
-			normalize_path(s->dhandles[i].path, path, MAX_TNFSPATH);
-
-			/* set path to root if requested path is outside tnfs root */
-			if (!validate_path(s, s->dhandles[i].path))
-				strcpy(s->dhandles[i].path, root);
-
-			if ((dptr = opendir(s->dhandles[i].path)) != NULL)
+			err = 0;
+			if ((dh->handle = vfs->opendir(dh->path)) == NULL)
 			{
-				s->dhandles[i].handle = dptr;
+				err = errno;
+#ifdef WITH_ZIP
+				/* directories inside archives are listed up front */
+				if (_load_directory(dh,
+						TNFS_DIROPT_NO_FOLDERSFIRST | TNFS_DIROPT_NO_SKIPHIDDEN | TNFS_DIROPT_NO_SKIPSPECIAL,
+						0, 0, NULL) == 0)
+					err = 0;
+#endif
+			}
 #endif
+			if (err == 0)
+			{
+				dh->in_use = true;
 				/* send OK response */
 				hdr->status = TNFS_SUCCESS;
 				reply[0] = (unsigned char)i;
@@ -374,7 +471,7 @@ void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 			}
 			else
 			{
-				hdr->status = tnfs_error(errno);
+				hdr->status = tnfs_error(err);
 				tnfs_send(s, hdr, NULL, 0);
 			}
 
@@ -391,84 +488,62 @@ void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 /* Read a directory entry */
 void tnfs_readdir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 {
-	struct dirent *entry;
+	const char *name;
+	dir_listing_entry *lentry;
 	char reply[MAX_FILENAME_LEN];
 
-	if (datasz != 1 ||
-		*databuf > MAX_DHND_PER_CONN ||
-		s->dhandles[*databuf].handle == NULL)
-	{
-		hdr->status = TNFS_EBADF;
-		tnfs_send(s, hdr, NULL, 0);
+	dir_handle *dh = _validate_dirhandle(hdr, s, databuf, datasz, 1);
+	if (dh == NULL)
 		return;
-	}
 
-#ifdef TNFS_DIR_EXT
-	/* visit entry */
-	struct tnfs_opendir_ext *handle = (struct tnfs_opendir_ext*) s->dhandles[*databuf].handle; repeat:;
-	if(handle->visited++ < handle->total)
+	if (dh->handle != NULL)
 	{
-		/* handle forward, reverse and shuffle iterators */
-		entry = handle->namelist[handle->at];
-		handle->at = (handle->at + handle->inc) % handle->total;
-		/* repeat if options and conditions do not match */
-		if(handle->do_exclude_sysnames) if(entry->d_name[0] == '.') goto repeat;
-		if(handle->wildcard) if(!wildcard(handle->wildcard, entry->d_name)) goto repeat;
-		/* stat here for 'd' and 'f' flags. bypass if needed */
-		if( handle->do_exclude_dirs ) if(entry->d_type == DT_DIR) goto repeat;
-		if( handle->do_exclude_files ) if(entry->d_type != DT_DIR) goto repeat;
-		/* convert to 'l'owercase/'u'ppercase/'c'amelcase here as needed */
-                char *p = entry->d_name;
-                /**/ if( handle->do_lowercase ) while(*p) *p++ = tolower(*p); //= *s | 32;
-	        else if( handle->do_uppercase ) while(*p) *p++ = toupper(*p); //= *s & ~32;
-	        else if( handle->do_camelcase ) while(*p) *p++ = (p == entry->d_name || p[-1] <= 32 ? toupper(*p) : tolower(*p));
-#else
-	entry = readdir(s->dhandles[*databuf].handle);
-	if (entry)
-	{
-#endif
-		strlcpy(reply, entry->d_name, MAX_FILENAME_LEN);
-		hdr->status = TNFS_SUCCESS;
-		tnfs_send(s, hdr, (unsigned char *)reply, strlen(reply) + 1);
+		/* streamed straight from the directory */
+		if ((name = vfs->readdir(dh->handle)) == NULL)
+		{
+			hdr->status = TNFS_EOF;
+			tnfs_send(s, hdr, NULL, 0);
+			return;
+		}
+		strlcpy(reply, name, MAX_FILENAME_LEN);
 	}
 	else
 	{
-		hdr->status = TNFS_EOF;
-		tnfs_send(s, hdr, NULL, 0);
+		if ((lentry = dirlist_get(&dh->list, dh->pos)) == NULL)
+		{
+			hdr->status = TNFS_EOF;
+			tnfs_send(s, hdr, NULL, 0);
+			return;
+		}
+		_entry_name(dh, lentry, reply, MAX_FILENAME_LEN);
+		dh->pos++;
 	}
+
+	hdr->status = TNFS_SUCCESS;
+	tnfs_send(s, hdr, (unsigned char *)reply, strlen(reply) + 1);
+}
+
+/* Release everything held by a directory handle */
+void dirhandle_close(dir_handle *dh)
+{
+	if (dh->handle)
+		vfs->closedir(dh->handle);
+	dirlist_free(&dh->list);
+	dh->handle = NULL;
+	dh->in_use = false;
+	dh->path[0] = '\0';
+	dh->pos = 0;
+	dh->nameopts = 0;
 }
 
 /* Close a directory */
 void tnfs_closedir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 {
-	if (datasz != 1 ||
-		*databuf > MAX_DHND_PER_CONN ||
-		s->dhandles[*databuf].handle == NULL)
-	{
-		hdr->status = TNFS_EBADF;
-		tnfs_send(s, hdr, NULL, 0);
+	dir_handle *dh = _validate_dirhandle(hdr, s, databuf, datasz, 1);
+	if (dh == NULL)
 		return;
-	}
-
-#ifdef TNFS_DIR_EXT
-	/* deallocate ext iterator */
-	struct tnfs_opendir_ext *handle = (struct tnfs_opendir_ext*) s->dhandles[*databuf].handle;
-	for(int i = 0; i < handle->total; ++i)
-	{
-		free(handle->namelist[i]);
-	}
-	if(handle->namelist) free(handle->namelist);
-	if(handle->wildcard) free(handle->wildcard);
-	free(handle);
-#else
-	closedir(s->dhandles[*databuf].handle);
-#endif
 
-	s->dhandles[*databuf].handle = NULL;
-	s->dhandles[*databuf].path[0] = '\0';
-	dirlist_free(s->dhandles[*databuf].entry_list);
-	s->dhandles[*databuf].current_entry = s->dhandles[*databuf].entry_list = NULL;
-	s->dhandles[*databuf].entry_count = 0;
+	dirhandle_close(dh);
 
 	hdr->status = TNFS_SUCCESS;
 	tnfs_send(s, hdr, NULL, 0);
@@ -485,12 +560,12 @@ void tnfs_mkdir(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	}
 	else
 	{
-#ifdef WIN32
-		if (mkdir(dirbuf) == 0)
-#else
-		if (mkdir(dirbuf, 0755) == 0)
-#endif
+		if (vfs->mkdir(dirbuf) == 0)
 		{
+#ifdef ENABLE_CATALOG
+			catalog_invalidate(dirbuf);
+#endif
+			search_changed(dirbuf);
 			hdr->status = TNFS_SUCCESS;
 			tnfs_send(s, hdr, NULL, 0);
 		}
@@ -513,8 +588,12 @@ void tnfs_rmdir(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	}
 	else
 	{
-		if (rmdir(dirbuf) == 0)
+		if (vfs->rmdir(dirbuf) == 0)
 		{
+#ifdef ENABLE_CATALOG
+			catalog_invalidate(dirbuf);
+#endif
+			search_changed(dirbuf);
 			hdr->status = TNFS_SUCCESS;
 			tnfs_send(s, hdr, NULL, 0);
 		}
@@ -532,14 +611,9 @@ void tnfs_seekdir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 
 	// databuf holds our directory handle
 	// followed by 4 bytes for the new position
-	if (datasz != 5 ||
-		*databuf > MAX_DHND_PER_CONN ||
-		s->dhandles[*databuf].handle == NULL)
-	{
-		hdr->status = TNFS_EBADF;
-		tnfs_send(s, hdr, NULL, 0);
+	dir_handle *dh = _validate_dirhandle(hdr, s, databuf, datasz, 5);
+	if (dh == NULL)
 		return;
-	}
 
 	pos = tnfs32uint(databuf + 1);
 #ifdef DEBUG
@@ -547,22 +621,14 @@ void tnfs_seekdir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 #endif
 
 	// We handle this differently depending on whether we've pre-loaded the directory or not
-	if (s->dhandles[*databuf].entry_list == NULL)
+	if (dh->handle != NULL)
 	{
-		seekdir(s->dhandles[*databuf].handle, (long)pos);
+		vfs->seekdir(dh->handle, (long)pos);
 	}
 	else
 	{
-		s->dhandles[*databuf].current_entry = dirlist_get_node_at_index(s->dhandles[*databuf].entry_list, pos);
-	}
-#ifdef USAGELOG
-	if (pos == 0) {
-		if (strcmp(s->lastpath, s->dhandles[*databuf].path) != 0) {
-				USGLOG(hdr, "Path changed to: %s", s->dhandles[*databuf].path);
-		};
-		strcpy(s->lastpath, s->dhandles[*databuf].path);
+		dh->pos = pos < dh->list.count ? pos : dh->list.count;
 	}
-#endif
 
 
 	hdr->status = TNFS_SUCCESS;
@@ -574,23 +640,18 @@ void tnfs_telldir(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	int32_t pos;
 
 	// databuf holds our directory handle: check it
-	if (datasz != 1 ||
-		*databuf > MAX_DHND_PER_CONN ||
-		s->dhandles[*databuf].handle == NULL)
-	{
-		hdr->status = TNFS_EBADF;
-		tnfs_send(s, hdr, NULL, 0);
+	dir_handle *dh = _validate_dirhandle(hdr, s, databuf, datasz, 1);
+	if (dh == NULL)
 		return;
-	}
 
 	// We handle this differently depending on whether we've pre-loaded the directory or not
-	if (s->dhandles[*databuf].entry_list == NULL)
+	if (dh->handle != NULL)
 	{
-		pos = telldir(s->dhandles[*databuf].handle);
+		pos = vfs->telldir(dh->handle);
 	}
 	else
 	{
-		pos = dirlist_get_index_for_node(s->dhandles[*databuf].entry_list, s->dhandles[*databuf].current_entry);
+		pos = dh->pos;
 	}
 
 #ifdef DEBUG
@@ -619,21 +680,14 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	ctime - 4 bytes: Creation time in seconds since the epoch, little endian
 	entry - X bytes: Zero-terminated string providing directory entry path
 */
-	uint8_t sid;
 	// databuf holds our directory handle followed by number of entries requested
-	if (datasz != 2 ||
-		(sid = databuf[0]) > MAX_DHND_PER_CONN ||
-		s->dhandles[sid].handle == NULL)
-	{
-		hdr->status = TNFS_EBADF;
-		tnfs_send(s, hdr, NULL, 0);
+	dir_handle *dh = _validate_dirhandle(hdr, s, databuf, datasz, 2);
+	if (dh == NULL)
 		return;
-	}
 	// req_count of '0' means "as many as will fit in the reply"
 	// any other value sets a max number of replies to send
 	uint8_t req_count = databuf[1];
 
-	dir_handle *dh = &s->dhandles[sid];
 #ifdef DEBUG
 /*  // Force a delay to check handling on the client
 	LOG("A LITTLE PAUSE\n");
@@ -645,13 +699,14 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 #endif
 
 	// Return EOF if we're already at the end of the list
-	if (dh->current_entry == NULL)
+	if (dh->pos >= dh->list.count)
 	{
 #ifdef DEBUG
 		TNFSMSGLOG(hdr, "readdirx no more entries - returning EOF");
 #endif
 		hdr->status = TNFS_EOF;
 		tnfs_send(s, hdr, NULL, 0);
+		return;
 	}
 
 #ifdef DEBUG
@@ -676,21 +731,23 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	// set the status to 0
 	reply[1] = 0;
 
-	directory_entry *pThisEntry, *pEntryInReply;
+	dir_listing_entry *pThisEntry;
+	directory_entry *pEntryInReply;
+	char name[MAX_FILENAME_LEN];
 	// Start by pointing to just after the reply 'header' in the buffer
 	pEntryInReply = (directory_entry *)(reply + READDIRX_HEADER_SIZE);
 
 	uint8_t count_sent = 0;
 	int total_size = READDIRX_HEADER_SIZE;
 
-	while (dh->current_entry != NULL)
+	while ((pThisEntry = dirlist_get(&dh->list, dh->pos)) != NULL)
 	{
 		// Quit if we've reached the requested count
 		if (req_count != 0 && count_sent >= req_count)
 			break;
 
-		pThisEntry = &dh->current_entry->entry;
-		int namelen = strlen(pThisEntry->entrypath);
+		_entry_name(dh, pThisEntry, name, sizeof(name));
+		int namelen = strlen(name);
 
 		// Quit if this entry won't fit in what's left of the reply buffer
 		if ((total_size + READDIRX_ENTRY_SIZE + namelen) > sizeof(reply))
@@ -698,10 +755,10 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 
 		// If this is the first entry, copy the directory position into the reply
 		if (count_sent == 0)
-			uint16tnfs(reply + 2, dirlist_get_index_for_node(dh->entry_list, dh->current_entry));
+			uint16tnfs(reply + 2, dh->pos);
 
 		// Copy the entry data into the appropriate spots in the reply buffer
-		strcpy(pEntryInReply->entrypath, pThisEntry->entrypath);
+		strcpy(pEntryInReply->entrypath, name);
 
 		pEntryInReply->flags = pThisEntry->flags;
 		uint32tnfs((unsigned char *)&pEntryInReply->size, pThisEntry->size);
@@ -718,11 +775,11 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 		pEntryInReply = (directory_entry *)(reply + total_size);
 
 		// Point to the next directory entry
-		dh->current_entry = dh->current_entry->next;
+		dh->pos++;
 	}
 
 	// If we've reached the end of the directory, set the TNFS_DIRSTATUS_EOF flag
-	if(dh->current_entry == NULL)
+	if (dh->pos >= dh->list.count)
 		reply[1] |= TNFS_DIRSTATUS_EOF;
 
 	// Respond with whatever we've collected
@@ -733,178 +790,182 @@ void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	tnfs_send(s, hdr, reply, total_size);
 }
 
-// Returns false if pattern doesn't match, otherwise true
-bool _pattern_match(const char *src, const char *pattern)
+/* A listing being taken */
+struct _dirload
 {
-	if (src == NULL || pattern == NULL)
-		return false;
+	const struct _dirscan *scan;
+	dir_listing *list;
+	int err;
+};
 
-	int m = strlen(pattern);
-	int n = strlen(src);
+/* Adds an entry to the listing being taken unless the options filter it out */
+static void _dirload_add(const char *name, fileinfo_t *finf, void *ctx)
+{
+	struct _dirload *dl = ctx;
+	const struct _dirscan *scan = dl->scan;
+	int err;
 
-#ifdef DEBUG
-	fprintf(stderr, "Pattern match: \"%s\", \"%s\" = ", src, pattern);
-#endif
-	// Empty pattern can only match with empty string
-	if (m == 0)
-		return (n == 0);
+	// If we were given a max, ignore anything past it
+	if (dl->err || (scan->maxresults > 0 && dl->list->count >= scan->maxresults))
+		return;
 
-	// Lookup table for storing results of subproblems
-	bool lookup[n + 1][m + 1];
+	/* If it's not a directory and we have a pattern that this doesn't match, skip it
+		Ignore the directory qualification if TNFS_DIROPT_DIR_PATTERN is set */
+	if ((scan->diropts & TNFS_DIROPT_DIR_PATTERN) || !(finf->flags & FILEINFOFLAG_DIRECTORY))
+	{
+		if (scan->pattern != NULL && pattern_match(scan->pattern, name) == false)
+			return;
+	}
 
-	// Initailze lookup table to false
-	memset(lookup, false, sizeof(lookup));
+	// Skip this if it's hidden (assuming TNFS_DIROPT_NO_SKIPHIDDEN isn't set)
+	if (!(scan->diropts & TNFS_DIROPT_NO_SKIPHIDDEN) && (finf->flags & FILEINFOFLAG_HIDDEN))
+		return;
 
-	// Empty pattern can match with empty string
-	lookup[0][0] = true;
+	// Skip this if it's special (assuming TNFS_DIROPT_NO_SKIPSPECIAL isn't set)
+	if (!(scan->diropts & TNFS_DIROPT_NO_SKIPSPECIAL) && (finf->flags & FILEINFOFLAG_SPECIAL))
+		return;
 
-	// Only '*' can match with empty string
-	for (int j = 1; j <= m; j++)
-		if (pattern[j - 1] == '*')
-			lookup[0][j] = lookup[0][j - 1];
+	if ((scan->exclude & DIRSCAN_EXCLUDE_DOTNAMES) && name[0] == '.')
+		return;
+	if ((scan->exclude & DIRSCAN_EXCLUDE_DIRS) && (finf->flags & FILEINFOFLAG_DIRECTORY))
+		return;
+	if ((scan->exclude & DIRSCAN_EXCLUDE_FILES) && !(finf->flags & FILEINFOFLAG_DIRECTORY))
+		return;
 
-	// Fill the table in bottom-up fashion
-	for (int i = 1; i <= n; i++)
-	{
-		for (int j = 1; j <= m; j++)
-		{
-			// Two cases if we see a '*':
-			// a) We ignore '*' character and move to next character in the pattern,
-			//     i.e., '*' indicates an empty sequence.
-			// b) '*' character matches with i-th character in input
-			if (pattern[j - 1] == '*')
-			{
-				lookup[i][j] = lookup[i][j - 1] || lookup[i - 1][j];
-
-			// Current characters are considered matching in two cases:
-			// (a) current character of pattern is '?'
-			// (b) characters actually match (case insensitive)
-			} else if (pattern[j - 1] == '?' ||
-				 (src[i - 1] == pattern[j - 1]) ||
-				 (tolower(src[i - 1]) == tolower(pattern[j - 1])))
-			{
-				lookup[i][j] = lookup[i - 1][j - 1];
-			}
-			// If characters don't match
-			else
-				lookup[i][j] = false;
-		}
-	}
-	bool result = lookup[n][m];
+	if ((err = dirlist_add(dl->list, name, finf)) != 0)
+		dl->err = err;
+}
 
-#ifdef DEBUG
-	fprintf(stderr, "%s\n", result ? "TRUE" : "FALSE");
+#ifdef ENABLE_CATALOG
+/* Adds an entry listed from the catalog, flagged as a scan would */
+static void _dirload_add_catalogued(const char *name, fileinfo_t *finf, void *ctx)
+{
+#ifdef WITH_ZIP
+	if (zip_is_archive_name(name))
+		finf->flags |= FILEINFOFLAG_DIRECTORY;
 #endif
-	return result;
+	_dirload_add(name, finf, ctx);
 }
 
-/* Returns errno on failure, otherwise zero */
-int _load_directory(dir_handle *dirh, uint8_t diropts, uint8_t sortopts, uint16_t maxresults, const char *pattern)
+/* Whether the catalog's default order is already the one asked for */
+static bool _catalog_sorted(const struct _dirscan *scan)
+{
+#ifdef WITH_ZIP
+	/* archives listed as directories break up the folders */
+	return false;
+#else
+	return !(scan->diropts & TNFS_DIROPT_NO_FOLDERSFIRST) && scan->sortopts == 0;
+#endif
+}
+#endif
+
+/* Takes a snapshot of the directory at dirh->path, filtered and sorted
+ * as asked. Returns errno on failure, otherwise zero */
+static int _read_directory(dir_handle *dirh, const struct _dirscan *scan)
 {
-	struct dirent *entry;
+	vfs_dir *dptr;
+	const char *name;
 	char statpath[MAX_TNFSPATH];
 	char temp_statpath[MAX_TNFSPATH*2 + 4];
+	struct _dirload dl = { scan, &dirh->list, 0 };
+	bool sorted = false;
 
 	// Free any existing entries
-	dirlist_free(dirh->entry_list);
-	dirh->entry_count = 0;
-
-	if ((dirh->handle = opendir(dirh->path)) == NULL)
-		return errno;
+	dirlist_free(&dirh->list);
+	dirh->pos = 0;
 
-	// A list to hold all subdirectory names
-	directory_entry_list list_dirs = NULL;
-	// A list to hold all normal file names
-	directory_entry_list list_files = NULL;
-	uint16_t entrycount = 0;
-
-	// Read every entry
-	while ((entry = readdir(dirh->handle)) != NULL)
+#ifdef ENABLE_CATALOG
+	if (catalog_list(dirh->path, _catalog_sorted(scan) ? CATALOG_ORDER_DEFAULT : CATALOG_ORDER_NAME,
+					 _dirload_add_catalogued, &dl) == 0)
+	{
+		sorted = _catalog_sorted(scan);
+	}
+	else
+#endif
+	if ((dptr = vfs->opendir(dirh->path)) == NULL)
+	{
+		int err = errno;
+#ifdef WITH_ZIP
+		/* directories inside archives are listed from the archive */
+		if (zip_readdir(dirh->path, _dirload_add, &dl) == 0)
+			err = 0;
+#endif
+		if (err != 0)
+			return err;
+	}
+	else
 	{
-		// Try to stat the file before we can decide on other things
-		fileinfo_t finf;
-		snprintf(temp_statpath, sizeof(temp_statpath), "%s%c%s", dirh->path, FILEINFO_PATHSEPARATOR, entry->d_name);
-		strncpy(statpath, temp_statpath, sizeof(statpath));
-		if (get_fileinfo(statpath, &finf) == 0)
+		// Read every entry
+		while ((name = vfs->readdir(dptr)) != NULL && dl.err == 0)
 		{
-			/* If it's not a directory and we have a pattern that this doesn't match, skip it
-				Ignore the directory qualification if TNFS_DIROPT_DIR_PATTERN is set */
-			if ((diropts & TNFS_DIROPT_DIR_PATTERN) || !(finf.flags & FILEINFOFLAG_DIRECTORY))
+			// Try to stat the file before we can decide on other things
+			fileinfo_t finf;
+			snprintf(temp_statpath, sizeof(temp_statpath), "%s%c%s", dirh->path, FILEINFO_PATHSEPARATOR, name);
+			strncpy(statpath, temp_statpath, sizeof(statpath));
+			if (get_fileinfo(statpath, &finf) == 0)
 			{
-				if (pattern != NULL && _pattern_match(entry->d_name, pattern) == false)
-					continue;
-			}
-
-			// Skip this if it's hidden (assuming TNFS_DIROPT_NO_SKIPHIDDEN isn't set)
-			if (!(diropts & TNFS_DIROPT_NO_SKIPHIDDEN) && (finf.flags & FILEINFOFLAG_HIDDEN))
-				continue;
-
-			// Skip this if it's special (assuming TNFS_DIROPT_NO_SKIPSPECIAL isn't set)
-			if (!(diropts & TNFS_DIROPT_NO_SKIPSPECIAL) && (finf.flags & FILEINFOFLAG_SPECIAL))
-				continue;
-
-			// Create a new directory_entry_node to add to our list
-			directory_entry_list_node *node = calloc(1, sizeof(directory_entry_list_node));
-
-			// Copy the name into the node
-			strlcpy(node->entry.entrypath, entry->d_name, MAX_FILENAME_LEN);
-
-			directory_entry_list *list_dest_p = &list_files;
+#ifdef WITH_ZIP
+				// Archives are browsed like directories
+				if (zip_is_archive_name(name))
+					finf.flags |= FILEINFOFLAG_DIRECTORY;
+#endif
+				_dirload_add(name, &finf, &dl);
 
-			if (finf.flags & FILEINFOFLAG_DIRECTORY)
-			{
-				node->entry.flags = finf.flags;
-				/* If the TNFS_DIROPT_NO_FOLDERSFIRST 0x01  flag hasn't been set, put this node
-				   in a separate list for directories so they're sorted separately */
-				if (!(diropts & TNFS_DIROPT_NO_FOLDERSFIRST))
-					list_dest_p = &list_dirs;
+				// If we were given a max, break if we've reached it
+				if (scan->maxresults > 0 && dirh->list.count >= scan->maxresults)
+					break;
 			}
-			node->entry.size = finf.size;
-			node->entry.mtime = finf.m_time;
-			node->entry.ctime = finf.c_time;
-
-			dirlist_push(list_dest_p, node);
-			entrycount++;
-
-			// If we were given a max, break if we've reached it
-			if (maxresults > 0 && entrycount >= maxresults)
-				break;
-#ifdef DEBUG
-			//fprintf(stderr, "_load_directory added \"%s\" %u\n", node->entry.entrypath, node->entry.size);
-#endif
 		}
+		/* everything needed is in the snapshot now */
+		vfs->closedir(dptr);
 	}
 
-	// Sort the two lists (assuming TNFS_DIRSORT_NONE isn't set)
-	if (!(sortopts & TNFS_DIRSORT_NONE))
+	if (dl.err)
 	{
-		if (list_dirs != NULL)
-			dirlist_sort(&list_dirs, sortopts);
-		if (list_files != NULL)
-			dirlist_sort(&list_files, sortopts);
+		dirlist_free(&dirh->list);
+		return dl.err;
 	}
 
-	// Combine the two lists into one
-	dirh->entry_list = dirlist_concat(list_dirs, list_files);
-	dirh->entry_count = entrycount;
+	if (!sorted)
+		dirlist_sort(&dirh->list, scan->diropts, scan->sortopts);
 
 #ifdef DEBUG
 /*
 	fprintf(stderr, "RETURNING LIST:\n");
-	directory_entry_list _dl = dirh->entry_list;
-	while (_dl)
-	{
-		fprintf(stderr, "\t%s\n", _dl->entry.entrypath);
-		_dl = _dl->next;
-	}
+	for (uint32_t i = 0; i < dirh->list.count; i++)
+		fprintf(stderr, "\t%s\n", dirh->list.names + dirh->list.entries[i].name);
 */
 #endif
 
-	dirh->current_entry = dirh->entry_list;
-
 	return 0;
 }
 
+/* Returns errno on failure, otherwise zero */
+static int _scan_directory(dir_handle *dirh, const struct _dirscan *scan)
+{
+	int err;
+
+	TNFS_PROBE1(dirload__start, dirh->path);
+	err = _read_directory(dirh, scan);
+	TNFS_PROBE3(dirload__done, dirh->path, dirh->list.count, err);
+	return err;
+}
+
+int _load_directory(dir_handle *dirh, uint8_t diropts, uint8_t sortopts, uint16_t maxresults, const char *pattern)
+{
+	struct _dirscan scan = { diropts, sortopts, maxresults, NULL, 0 };
+	tnfs_pattern *pat = NULL;
+	int err;
+
+	// Compile the pattern once for the whole listing
+	if (pattern != NULL && (scan.pattern = pat = pattern_compile(pattern, 0)) == NULL)
+		return ENOMEM;
+
+	err = _scan_directory(dirh, &scan);
+	pattern_free(pat);
+	return err;
+}
+
 /* Open a directory with additional options */
 void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 {
@@ -914,7 +975,7 @@ void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	uint8_t diropts;
 	uint8_t sortopts;
 	uint16_t maxresults;
-	uint8_t result;
+	int result;
 	char *pPattern;
 	char *pDirpath;
 
@@ -958,9 +1019,9 @@ void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 #endif
 
 	/* find the first available slot in the session */
-	for (i = 0; i < MAX_DHND_PER_CONN; i++)
+	for (i = 0; i < settings.max_dhnd_per_conn; i++)
 	{
-		if (s->dhandles[i].handle == NULL)
+		if (!s->dhandles[i].in_use)
 		{
 			snprintf(path, sizeof(path), "%s/%s/%s",
 					 root, s->root, pDirpath);
@@ -975,13 +1036,14 @@ void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 			result = _load_directory(&(s->dhandles[i]), diropts, sortopts, maxresults, pPattern);
 			if (result == 0)
 			{
+				s->dhandles[i].in_use = true;
 				/* send OK response */
 				hdr->status = TNFS_SUCCESS;
 				#ifdef DEBUG
-				TNFSMSGLOG(hdr, "opendirx response: handle=%hu, count=%hu", i, s->dhandles[i].entry_count);
+				TNFSMSGLOG(hdr, "opendirx response: handle=%hu, count=%u", i, s->dhandles[i].list.count);
 				#endif
 				reply[0] = (unsigned char) i;
-				uint16tnfs(reply + 1, s->dhandles[i].entry_count);
+				uint16tnfs(reply + 1, s->dhandles[i].list.count > 0xFFFF ? 0xFFFF : s->dhandles[i].list.count);
 				tnfs_send(s, hdr, reply, 3);
 			}
 			else
@@ -1000,157 +1062,189 @@ void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 	tnfs_send(s, hdr, NULL, 0);
 }
 
-// Attaches list2 to the end of list1 and returns the head of the result
-// Return will be list2 if list1 is NULL
-directory_entry_list dirlist_concat(directory_entry_list list1, directory_entry_list list2)
+/* Search the tree below a directory for names matching a pattern, or
+ * containing a string, and page through the results with READDIRX */
+void tnfs_search(Header *hdr, Session *s, unsigned char *databuf, int datasz)
 {
-	if (list1 == NULL)
-		return list2;
+	char path[MAX_TNFSPATH];
+	unsigned char reply[3];
+	uint8_t diropts, sortopts;
+	uint16_t maxresults;
+	char *query, *dirpath;
+	int i, result;
 
-	// Get to the end of the first list
-	directory_entry_list_node *pEnd = list1;
-	while (pEnd->next != NULL)
-		pEnd = pEnd->next;
+	/* options, sort, max, query, directory: the same as OPENDIRX */
+	if (datasz < 7 || *(databuf + datasz - 1) != 0)
+	{
+		hdr->status = TNFS_EINVAL;
+		tnfs_send(s, hdr, NULL, 0);
+		return;
+	}
+	diropts = databuf[0];
+	sortopts = databuf[1];
+	maxresults = tnfs16uint(databuf + 2);
+	query = (char *)(databuf + 4);
+	i = strlen(query);
+	if (i == 0 || i + 5 >= datasz)
+	{
+		hdr->status = TNFS_EINVAL;
+		tnfs_send(s, hdr, NULL, 0);
+		return;
+	}
+	dirpath = query + i + 1;
 
-	pEnd->next = list2;
-	return list1;
-}
+#ifdef DEBUG
+	TNFSMSGLOG(hdr, "search: diropt=0x%02x, sortopt=0x%02x, max=0x%04hx, query=\"%s\", path=\"%s\"",
+			diropts, sortopts, maxresults, query, dirpath);
+#endif
 
-void dirlist_push(directory_entry_list *dlist, directory_entry_list_node *node)
-{
-	if (dlist == NULL || node == NULL)
-		return;
+	/* find the first available slot in the session */
+	for (i = 0; i < settings.max_dhnd_per_conn; i++)
+	{
+		dir_handle *dh = &s->dhandles[i];
+		if (!dh->in_use)
+		{
+			snprintf(path, sizeof(path), "%s/%s/%s", root, s->root, dirpath);
+			normalize_path(dh->path, path, MAX_TNFSPATH);
 
-	// This entry becomes the head, any current head becomes the second node
-	node->next = *dlist;
-	*dlist = node;
-}
+			/* set path to root if requested path is outside tnfs root */
+			if (!validate_path(s, dh->path))
+				strcpy(dh->path, root);
 
-/* Returns poitner to node at index given or NULL if no such index */
-directory_entry_list_node *dirlist_get_node_at_index(directory_entry_list dlist, uint32_t index)
-{
-	uint32_t i = 0;
-	while (dlist && i++ < index)
-		dlist = dlist->next;
+			dirlist_free(&dh->list);
+			dh->pos = 0;
+			result = search_find(dh->path, query, diropts, maxresults, &dh->list);
+			if (result == 0)
+			{
+				dirlist_sort(&dh->list, diropts, sortopts);
+				dh->in_use = true;
+				hdr->status = TNFS_SUCCESS;
+				reply[0] = (unsigned char)i;
+				uint16tnfs(reply + 1, dh->list.count > 0xFFFF ? 0xFFFF : dh->list.count);
+				tnfs_send(s, hdr, reply, 3);
+			}
+			else
+			{
+				dirlist_free(&dh->list);
+				hdr->status = tnfs_error(result);
+				tnfs_send(s, hdr, NULL, 0);
+			}
+			return;
+		}
+	}
 
-	return dlist;
+	/* no free handles left */
+	hdr->status = TNFS_EMFILE;
+	tnfs_send(s, hdr, NULL, 0);
 }
 
-/* Returns poitner to node at index given or NULL if no such index */
-uint32_t dirlist_get_index_for_node(directory_entry_list dlist, directory_entry_list_node *node)
+/* Adds an entry to a listing. Returns errno on failure, otherwise zero */
+int dirlist_add(dir_listing *list, const char *name, const fileinfo_t *finf)
 {
-	uint32_t i = 0;
-	while (dlist)
+	uint32_t namelen = strlen(name) + 1;
+	dir_listing_entry *entry;
+
+	if (list->count == list->capacity)
 	{
-		if (dlist == node)
-			break;
-		dlist = dlist->next;
-		i++;
+		uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+		dir_listing_entry *entries = realloc(list->entries, capacity * sizeof(dir_listing_entry));
+		if (entries == NULL)
+			return ENOMEM;
+		list->entries = entries;
+		list->capacity = capacity;
 	}
+	if (list->namesz + namelen > list->namecap)
+	{
+		uint32_t namecap = list->namecap ? list->namecap : 1024;
+		while (list->namesz + namelen > namecap)
+			namecap *= 2;
+		char *names = realloc(list->names, namecap);
+		if (names == NULL)
+			return ENOMEM;
+		list->names = names;
+		list->namecap = namecap;
+	}
+
+	entry = &list->entries[list->count++];
+	memcpy(list->names + list->namesz, name, namelen);
+	entry->name = list->namesz;
+	list->namesz += namelen;
 
-	return i;
+	entry->flags = (finf->flags & FILEINFOFLAG_DIRECTORY) ? finf->flags : 0;
+	entry->size = finf->size;
+	entry->mtime = finf->m_time;
+	entry->ctime = finf->c_time;
+	return 0;
 }
 
-/* Free the linked list of directory entries */
-void dirlist_free(directory_entry_list dlist)
+/* Returns the entry at the given position of the listing's visiting
+ * order, or NULL past the end */
+dir_listing_entry *dirlist_get(dir_listing *list, uint32_t pos)
 {
-	while (dlist)
-	{
-		directory_entry_list_node *next = dlist->next;
-		free(dlist);
-		dlist = next;
-	}
+	if (pos >= list->count)
+		return NULL;
+	return &list->entries[list->order ? list->order[pos] : pos];
 }
 
-directory_entry_list _mergesort_merge(directory_entry_list list_left, directory_entry_list list_right, uint8_t sortopts)
+/* Free a listing's entries */
+void dirlist_free(dir_listing *list)
 {
-	if (list_left == NULL)
-		return list_right;
-	if (list_right == NULL)
-		return list_left;
+	free(list->entries);
+	free(list->names);
+	free(list->order);
+	memset(list, 0, sizeof(dir_listing));
+}
 
-	directory_entry_list result;
+/* qsort() has no way to pass these to the comparison */
+static const char *sort_names;
+static uint8_t sort_diropts;
+static uint8_t sort_sortopts;
 
+static int _dirlist_compare(const void *a, const void *b)
+{
+	const dir_listing_entry *left = a, *right = b;
 	int r;
-	// Sort by size
-	if (sortopts & TNFS_DIRSORT_SIZE)
-	{
-		r = list_left->entry.size - list_right->entry.size;
-	}
-	// Sort by modified timestamp
-	else if (sortopts & TNFS_DIRSORT_MODIFIED)
+
+	// Directories go first unless TNFS_DIROPT_NO_FOLDERSFIRST is set
+	if (!(sort_diropts & TNFS_DIROPT_NO_FOLDERSFIRST))
 	{
-		r = list_left->entry.mtime - list_right->entry.mtime;
+		r = (right->flags & FILEINFOFLAG_DIRECTORY) - (left->flags & FILEINFOFLAG_DIRECTORY);
+		if (r != 0)
+			return r;
 	}
-	// Sort by name
-	else
+
+	if (!(sort_sortopts & TNFS_DIRSORT_NONE))
 	{
+		// Sort by size
+		if (sort_sortopts & TNFS_DIRSORT_SIZE)
+			r = (left->size > right->size) - (left->size < right->size);
+		// Sort by modified timestamp
+		else if (sort_sortopts & TNFS_DIRSORT_MODIFIED)
+			r = (left->mtime > right->mtime) - (left->mtime < right->mtime);
 		// Decide whether to use case-sensitive or insensitive sorting
-		if (sortopts & TNFS_DIRSORT_CASE)
-			r = strcmp(list_left->entry.entrypath, list_right->entry.entrypath);
+		else if (sort_sortopts & TNFS_DIRSORT_CASE)
+			r = strcmp(sort_names + left->name, sort_names + right->name);
 		else
-			r = strcasecmp(list_left->entry.entrypath, list_right->entry.entrypath);
-	}
-
-	// Reverse the result if we're sorting descending
-	if (sortopts & TNFS_DIRSORT_DESCENDING)
-		r *= -1;
+			r = strcasecmp(sort_names + left->name, sort_names + right->name);
 
-	if (r < 0)
-	{
-		result = list_left;
-		result->next = _mergesort_merge(list_left->next, list_right, sortopts);
-	}
-	else
-	{
-		result = list_right;
-		result->next = _mergesort_merge(list_left, list_right->next, sortopts);
+		// Reverse the result if we're sorting descending
+		if (sort_sortopts & TNFS_DIRSORT_DESCENDING)
+			r = -r;
+		if (r != 0)
+			return r;
 	}
 
-	return result;
-}
-
-directory_entry_list _mergesort_get_middle(directory_entry_list head)
-{
-	if (head == NULL)
-		return head;
-
-	directory_entry_list slow, fast;
-	slow = fast = head;
-
-	while (fast->next != NULL && fast->next->next != NULL)
-	{
-		slow = slow->next;
-		fast = fast->next->next;
-	}
-	return slow;
+	// Otherwise keep the order they were read in; names are pooled in that order
+	return (left->name > right->name) - (left->name < right->name);
 }
 
-void _mergesort(directory_entry_list *headP, uint8_t sortopts)
+/* Sort a listing as OPENDIRX asks */
+void dirlist_sort(dir_listing *list, uint8_t diropts, uint8_t sortopts)
 {
-	directory_entry_list head = *headP;
-
-	if (head == NULL || head->next == NULL)
+	if (list->count < 2)
 		return;
-
-	directory_entry_list list_left;
-	directory_entry_list list_right;
-	directory_entry_list list_mid;
-
-	// Split the list into two separate lists
-	list_left = head;
-	list_mid = _mergesort_get_middle(head);
-	list_right = list_mid->next;
-	list_mid->next = NULL;
-
-	// Merge the two lists
-	_mergesort(&list_left, sortopts);
-	_mergesort(&list_right, sortopts);
-	*headP = _mergesort_merge(list_left, list_right, sortopts);
-}
-
-/* Merge sort on a singly-linked list */
-void dirlist_sort(directory_entry_list *dlist, uint8_t sortopts)
-{
-	_mergesort(dlist, sortopts);
+	sort_names = list->names;
+	sort_diropts = diropts;
+	sort_sortopts = sortopts;
+	qsort(list->entries, list->count, sizeof(dir_listing_entry), _dirlist_compare);
 }
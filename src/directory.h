@@ -28,6 +28,7 @@
  * */
 
 #include "tnfs.h"
+#include "fileinfo.h"
 
 #define TNFS_DIROPT_NO_FOLDERSFIRST 0x01 
 #define TNFS_DIROPT_NO_SKIPHIDDEN 0x02
@@ -47,17 +48,32 @@ int tnfs_setroot(const char *rootdir);
 
 /* validates a path points to an actual directory */
 int validate_dir(Session *s, const char *path);
+/* 1 if path resolves to somewhere inside the root, 0 if not */
+int validate_path(Session *s, const char *path);
 void normalize_path(char *dst, char *src, int pathsz);
 
+/* copies the part of path below root into rel, without slashes at
+ * either end. Returns -1 if path isn't in the tree or won't fit */
+int relative_path(const char *root, const char *path, char *rel, int relsz);
+/* builds the path of rel below root, or root itself if rel is empty */
+void join_path(const char *root, const char *rel, char *buf, int bufsz);
+
+/* take a filtered, sorted snapshot of the directory at dirh->path.
+ * Returns errno on failure, otherwise zero */
+int _load_directory(dir_handle *dirh, uint8_t diropts, uint8_t sortopts,
+	uint16_t maxresults, const char *pattern);
+
 /* get the root directory for the given session */
 void get_root(Session *s, char *buf, int bufsz);
 
-/* handle list of directory entries */
-void dirlist_free(directory_entry_list dlist);
-void dirlist_push(directory_entry_list *dlist, directory_entry_list_node *node);
-directory_entry_list_node * dirlist_get_node_at_index(directory_entry_list dlist, uint32_t index);
-uint32_t dirlist_get_index_for_node(directory_entry_list dlist, directory_entry_list_node *node);
-void dirlist_sort(directory_entry_list *dlist, uint8_t sortopts);
+/* handle snapshots of directory entries */
+int dirlist_add(dir_listing *list, const char *name, const fileinfo_t *finf);
+dir_listing_entry *dirlist_get(dir_listing *list, uint32_t pos);
+void dirlist_free(dir_listing *list);
+void dirlist_sort(dir_listing *list, uint8_t diropts, uint8_t sortopts);
+
+/* release everything held by a directory handle */
+void dirhandle_close(dir_handle *dh);
 
 /* open, read, close directories */
 void tnfs_opendir(Header *hdr, Session *s, unsigned char *databuf, int datasz);
@@ -69,6 +85,9 @@ void tnfs_telldir(Header *hdr, Session *s, unsigned char *databuf, int datasz);
 void tnfs_opendirx(Header *hdr, Session *s, unsigned char *databuf, int datasz);
 void tnfs_readdirx(Header *hdr, Session *s, unsigned char *databuf, int datasz);
 
+/* search the tree below a directory for matching names */
+void tnfs_search(Header *hdr, Session *s, unsigned char *databuf, int datasz);
+
 /* create and remove directories */
 void tnfs_mkdir(Header *hdr, Session *s, unsigned char *databuf, int datasz);
 void tnfs_rmdir(Header *hdr, Session *s, unsigned char *databuf, int datasz);
@@ -14,8 +14,8 @@ struct event_wait_res
 };
 typedef struct event_wait_res event_wait_res_t;
 
-// Initializes the event queue.
-void tnfs_event_init();
+// Initializes the event queue for up to max_fds descriptors.
+void tnfs_event_init(int max_fds);
 
 // Registers the file descriptor to watch.
 bool tnfs_event_register(int fd);
@@ -23,9 +23,9 @@ bool tnfs_event_register(int fd);
 // Unregisters the file descriptor.
 void tnfs_event_unregister(int fd);
 
-// Waits for a given amount of time for an event on any registered file descriptor.
+// Waits for a given number of milliseconds for an event on any registered file descriptor.
 // Returns the file descriptor number of 0 if timeout occurs.
-event_wait_res_t* tnfs_event_wait(int timeout_sec);
+event_wait_res_t* tnfs_event_wait(int timeout_ms);
 
 // Returns 
 bool tnfs_event_is_active(event_wait_res_t* res, int fds);
@@ -6,15 +6,16 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
-#define _EVENT_MAX_FDS 4096
-
-struct epoll_event events[_EVENT_MAX_FDS];
+struct epoll_event *events;
+int max_events;
 int epfd;
 event_wait_res_t wait_result;
 
-void tnfs_event_init()
+void tnfs_event_init(int max_fds)
 {
-    wait_result.fds = calloc(_EVENT_MAX_FDS, sizeof(int));
+    max_events = max_fds;
+    events = calloc(max_events, sizeof(struct epoll_event));
+    wait_result.fds = calloc(max_events, sizeof(int));
     epfd = epoll_create(1);
 }
 
@@ -37,12 +38,11 @@ void tnfs_event_unregister(int fd)
     epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
-event_wait_res_t* tnfs_event_wait(int timeout_sec)
+event_wait_res_t* tnfs_event_wait(int timeout_ms)
 {
-    int readyfds = epoll_wait(epfd, events, _EVENT_MAX_FDS, timeout_sec * 1000);
+    int readyfds = epoll_wait(epfd, events, max_events, timeout_ms);
 
     wait_result.size = readyfds;
-    memset(wait_result.fds, 0, _EVENT_MAX_FDS * sizeof(int));
 
     if (readyfds == -1)
     {
@@ -62,5 +62,6 @@ event_wait_res_t* tnfs_event_wait(int timeout_sec)
 void tnfs_event_close()
 {
     close(epfd);
+    free(events);
     free(wait_result.fds);
 }
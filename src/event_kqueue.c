@@ -6,16 +6,17 @@
 #include <sys/event.h>
 #include <unistd.h>
 
-#define _EVENT_MAX_FDS 4096
-
-struct kevent event[_EVENT_MAX_FDS];
+struct kevent *event;
+int max_events;
 struct timespec timeout;
 int kq;
 event_wait_res_t wait_result;
 
-void tnfs_event_init()
+void tnfs_event_init(int max_fds)
 {
-    wait_result.fds = calloc(_EVENT_MAX_FDS, sizeof(int));
+    max_events = max_fds;
+    event = calloc(max_events, sizeof(struct kevent));
+    wait_result.fds = calloc(max_events, sizeof(int));
     kq = kqueue();
 }
 
@@ -38,14 +39,14 @@ void tnfs_event_unregister(int fd)
     kevent(kq, &change_event, 1, NULL, 0, NULL);
 }
 
-event_wait_res_t* tnfs_event_wait(int timeout_sec)
+event_wait_res_t* tnfs_event_wait(int timeout_ms)
 {
-    timeout.tv_sec = timeout_sec;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
 
-    int readyfds = kevent(kq, NULL, 0, event, _EVENT_MAX_FDS, &timeout);
+    int readyfds = kevent(kq, NULL, 0, event, max_events, &timeout);
 
     wait_result.size = readyfds;
-    memset(wait_result.fds, 0, _EVENT_MAX_FDS * sizeof(int));
 
     if (readyfds == -1)
     {
@@ -64,5 +65,6 @@ event_wait_res_t* tnfs_event_wait(int timeout_sec)
 void tnfs_event_close()
 {
     close(kq);
+    free(event);
     free(wait_result.fds);
 }
@@ -14,23 +14,24 @@
 #define FD_COPY(f, t)   memcpy(t, f, sizeof(*(f)))
 #endif
 
-#define _EVENT_MAX_FDS 1024
-
-int event_fd_list[_EVENT_MAX_FDS];
+int *event_fd_list;
+int max_events;
 fd_set fdset;
 fd_set errfdset;
 struct timeval select_timeout;
 event_wait_res_t wait_result;
 
-void tnfs_event_init()
+void tnfs_event_init(int max_fds)
 {
-    memset(event_fd_list, 0, sizeof event_fd_list);
-    wait_result.fds = calloc(_EVENT_MAX_FDS, sizeof(int));
+    /* select() can't watch more than this anyway */
+    max_events = max_fds < FD_SETSIZE ? max_fds : FD_SETSIZE;
+    event_fd_list = calloc(max_events, sizeof(int));
+    wait_result.fds = calloc(max_events, sizeof(int));
 }
 
 bool tnfs_event_register(int fd)
 {
-    for (int i = 0; i < _EVENT_MAX_FDS; i++)
+    for (int i = 0; i < max_events; i++)
     {
         if (event_fd_list[i] == 0)
         {
@@ -44,7 +45,7 @@ bool tnfs_event_register(int fd)
 
 void tnfs_event_unregister(int fd)
 {
-    for (int i = 0; i < _EVENT_MAX_FDS; i++)
+    for (int i = 0; i < max_events; i++)
     {
         if (event_fd_list[i] == fd)
         {
@@ -53,10 +54,10 @@ void tnfs_event_unregister(int fd)
     }
 }
 
-event_wait_res_t* tnfs_event_wait(int timeout_sec)
+event_wait_res_t* tnfs_event_wait(int timeout_ms)
 {
     FD_ZERO(&fdset);
-    for (int i = 0; i < _EVENT_MAX_FDS; i++)
+    for (int i = 0; i < max_events; i++)
     {
         if (event_fd_list[i] != 0)
         {
@@ -65,12 +66,12 @@ event_wait_res_t* tnfs_event_wait(int timeout_sec)
     }
     FD_COPY(&fdset, &errfdset);
 
-    select_timeout.tv_sec = timeout_sec;
+    select_timeout.tv_sec = timeout_ms / 1000;
+    select_timeout.tv_usec = (timeout_ms % 1000) * 1000;
 
     int readyfds = select(FD_SETSIZE, &fdset, NULL, &errfdset, &select_timeout);
 
-    wait_result.size = readyfds;
-    memset(wait_result.fds, 0, _EVENT_MAX_FDS * sizeof(int));
+    wait_result.size = 0;
 
     if (readyfds == SOCKET_ERROR)
     {
@@ -80,14 +81,19 @@ event_wait_res_t* tnfs_event_wait(int timeout_sec)
 
     if (readyfds > 0)
     {
+        /* select() counts a descriptor once for each set it's in, so
+         * count the descriptors themselves; fds holds max_events */
         int j = 0;
-        for (int i = 0; i < _EVENT_MAX_FDS; i++)
+        for (int i = 0; i < max_events; i++)
         {
-            if (event_fd_list[i] != 0 && FD_ISSET(event_fd_list[i], &fdset))
+            if (event_fd_list[i] != 0 &&
+                (FD_ISSET(event_fd_list[i], &fdset) ||
+                 FD_ISSET(event_fd_list[i], &errfdset)))
             {
                 wait_result.fds[j++] = event_fd_list[i];
             }
         }
+        wait_result.size = j;
     }
 
     return &wait_result;
@@ -95,5 +101,6 @@ event_wait_res_t* tnfs_event_wait(int timeout_sec)
 
 void tnfs_event_close()
 {
+    free(event_fd_list);
     free(wait_result.fds);
 }
\ No newline at end of file
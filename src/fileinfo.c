@@ -8,6 +8,7 @@
 #include <errno.h>
 
 #include "fileinfo.h"
+#include "vfs.h"
 
 int get_fileinfo(const char *path, fileinfo_t *fileinf)
 {
@@ -32,7 +33,11 @@ int get_fileinfo(const char *path, fileinfo_t *fileinf)
 
 #ifdef WIN32
     WIN32_FILE_ATTRIBUTE_DATA fdata;    
-    if(true == GetFileAttributesEx(path, GetFileExInfoStandard, &fdata))
+    if(vfs != &vfs_posix)
+    {
+        // Other backends are asked with stat() below
+    }
+    else if(true == GetFileAttributesEx(path, GetFileExInfoStandard, &fdata))
     {
         // NOTE: We're only going to return the 32bits worth of data, which means very large files will have the wrong size reported
         if(fdata.nFileSizeHigh > 0 || fdata.nFileSizeLow > 0xFFFFFFFF)
@@ -68,29 +73,45 @@ int get_fileinfo(const char *path, fileinfo_t *fileinf)
     {
         return GetLastError();
     }
+    if(vfs == &vfs_posix)
+        return 0;
 
-#else
+#endif
     struct stat statinfo;
 
-    if (stat(path, &statinfo) == 0)
+    if (vfs->stat(path, &statinfo) == 0)
     {
-        if (S_ISDIR(statinfo.st_mode))
-        {
-            fileinf->flags |= FILEINFOFLAG_DIRECTORY;
-        }
+        fileinf->flags |= fileinfo_flags(namestart, statinfo.st_mode);
         fileinf->size =  statinfo.st_size;
         fileinf->m_time = statinfo.st_mtime;
         fileinf->c_time = statinfo.st_ctime;
-
-        if(namestart[0] == '.')
-            fileinf->flags |= FILEINFOFLAG_HIDDEN;
     }
     else
     {
         return errno;
     }
 
-#endif
-
     return 0;
 }
+
+uint8_t fileinfo_flags(const char *name, mode_t mode)
+{
+    uint8_t flags = 0;
+
+    if (S_ISDIR(mode))
+        flags |= FILEINFOFLAG_DIRECTORY;
+    if (name[0] == '.')
+        flags |= FILEINFOFLAG_HIDDEN;
+    return flags;
+}
+
+bool fileinfo_dirlink(const char *path, const struct stat *st)
+{
+#ifdef WIN32
+    return false;
+#else
+    struct stat lst;
+
+    return S_ISDIR(st->st_mode) && vfs->lstat(path, &lst) == 0 && S_ISLNK(lst.st_mode);
+#endif
+}
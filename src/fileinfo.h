@@ -2,6 +2,9 @@
 #define _FILEINFO_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #define FILEINFOFLAG_DIRECTORY 0x01
 #define FILEINFOFLAG_HIDDEN 0x02
@@ -25,4 +28,13 @@ typedef struct fileinfo fileinfo_t;
 
 int get_fileinfo(const char *path, fileinfo_t *fi);
 
+// The flags get_fileinfo() gives an entry called name with the mode
+// stat() found for it
+uint8_t fileinfo_flags(const char *name, mode_t mode);
+
+// Whether path, which stat() found to be the directory st, is a symlink.
+// Walks of the whole tree don't follow these, since they can lead back
+// up the tree.
+bool fileinfo_dirlink(const char *path, const struct stat *st);
+
 #endif // _FILEINFO_H
@@ -0,0 +1,308 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Open files shared by sessions.
+ *
+ * Hundreds of clients may have the same disk image open. Rather than an
+ * OS descriptor each, a file is opened once for each way it's opened
+ * (read only, write only, read/write) and shared, keyed by its device
+ * and inode. Sessions get a handle with a position of their own, and
+ * read and write with pread() and pwrite(). Opens that truncate, append
+ * or must create the file aren't shared.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "filetable.h"
+
+typedef struct _sharedfile
+{
+	int refs;			/* handles, 0 if not in use */
+	int osfd;
+	dev_t dev;
+	ino_t ino;
+	int accmode;
+	int next;			/* next in the hash chain or free list, -1 at the end */
+} sharedfile;
+
+typedef struct _sharedhandle
+{
+	int file;			/* index in files, -1 if not in use */
+	off_t pos;
+} sharedhandle;
+
+static sharedfile files[FILETABLE_MAX];
+static int buckets[FILETABLE_MAX];
+static int free_file = -1;
+static sharedhandle handles[FILETABLE_HANDLES];
+static int free_handle = -1;	/* linked through file as -2 - next */
+static bool initialised;
+static int nfiles, nhandles;
+static uint64_t hits, misses;
+
+static void _init()
+{
+	for (int i = 0; i < FILETABLE_MAX; i++)
+	{
+		buckets[i] = -1;
+		files[i].next = i + 1 < FILETABLE_MAX ? i + 1 : -1;
+	}
+	free_file = 0;
+	for (int i = 0; i < FILETABLE_HANDLES; i++)
+		handles[i].file = -2 - (i + 1 < FILETABLE_HANDLES ? i + 1 : -1);
+	free_handle = 0;
+	initialised = true;
+}
+
+static int _bucket(dev_t dev, ino_t ino, int accmode)
+{
+	return (int)(((uint64_t)dev * 31 + (uint64_t)ino * 7 + accmode) % FILETABLE_MAX);
+}
+
+static int _find(dev_t dev, ino_t ino, int accmode)
+{
+	int i;
+
+	for (i = buckets[_bucket(dev, ino, accmode)]; i >= 0; i = files[i].next)
+	{
+		if (files[i].ino == ino && files[i].dev == dev && files[i].accmode == accmode)
+			break;
+	}
+	return i;
+}
+
+static int _handle(int file)
+{
+	int h = free_handle;
+
+	free_handle = -2 - handles[h].file;
+	handles[h].file = file;
+	handles[h].pos = 0;
+	files[file].refs++;
+	nhandles++;
+	return SHAREDFD_BASE + h;
+}
+
+int filetable_open(const char *path, int flags, int mode)
+{
+#ifdef WIN32
+	/* without inode numbers there's nothing to tell files apart by */
+	return 0;
+#else
+	int accmode = flags & O_ACCMODE;
+	struct stat st;
+	int f, osfd;
+
+	if (!initialised)
+		_init();
+	if ((flags & (O_TRUNC | O_APPEND | O_EXCL)) || free_handle < 0 ||
+		stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	if ((f = _find(st.st_dev, st.st_ino, accmode)) >= 0)
+	{
+		hits++;
+		return _handle(f);
+	}
+
+	misses++;
+	if (free_file < 0)
+		return 0;
+	if ((osfd = open(path, flags & ~O_CREAT, mode)) < 0)
+		return -1;
+	/* it may have been replaced since the stat() */
+	if (fstat(osfd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(osfd);
+		return 0;
+	}
+	if ((f = _find(st.st_dev, st.st_ino, accmode)) >= 0)
+	{
+		close(osfd);
+		return _handle(f);
+	}
+
+	f = free_file;
+	free_file = files[f].next;
+	files[f].osfd = osfd;
+	files[f].dev = st.st_dev;
+	files[f].ino = st.st_ino;
+	files[f].accmode = accmode;
+	files[f].refs = 0;
+	files[f].next = buckets[_bucket(st.st_dev, st.st_ino, accmode)];
+	buckets[_bucket(st.st_dev, st.st_ino, accmode)] = f;
+	nfiles++;
+	return _handle(f);
+#endif
+}
+
+static sharedhandle *_get(int fd)
+{
+	if (!IS_SHAREDFD(fd) || handles[fd - SHAREDFD_BASE].file < 0)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &handles[fd - SHAREDFD_BASE];
+}
+
+int filetable_osfd(int fd)
+{
+	sharedhandle *h;
+
+	if (!IS_SHAREDFD(fd))
+		return fd;
+	if ((h = _get(fd)) == NULL)
+		return -1;
+	return files[h->file].osfd;
+}
+
+int filetable_pread(int fd, void *buf, int size, off_t offset)
+{
+	sharedhandle *h = _get(fd);
+
+	if (h == NULL)
+		return -1;
+#ifdef WIN32
+	if (lseek(files[h->file].osfd, offset, SEEK_SET) < 0)
+		return -1;
+	return read(files[h->file].osfd, buf, (size_t)size);
+#else
+	return pread(files[h->file].osfd, buf, (size_t)size, offset);
+#endif
+}
+
+int filetable_read(int fd, void *buf, int size)
+{
+	sharedhandle *h = _get(fd);
+	int result;
+
+	if (h == NULL)
+		return -1;
+	if ((result = filetable_pread(fd, buf, size, h->pos)) > 0)
+		h->pos += result;
+	return result;
+}
+
+int filetable_write(int fd, const void *buf, int size)
+{
+	sharedhandle *h = _get(fd);
+	int result;
+
+	if (h == NULL)
+		return -1;
+#ifdef WIN32
+	if (lseek(files[h->file].osfd, h->pos, SEEK_SET) < 0)
+		return -1;
+	result = write(files[h->file].osfd, buf, (size_t)size);
+#else
+	result = pwrite(files[h->file].osfd, buf, (size_t)size, h->pos);
+#endif
+	if (result > 0)
+		h->pos += result;
+	return result;
+}
+
+off_t filetable_lseek(int fd, off_t offset, int whence)
+{
+	sharedhandle *h = _get(fd);
+	struct stat st;
+	off_t pos;
+
+	if (h == NULL)
+		return -1;
+	switch (whence)
+	{
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = h->pos + offset;
+		break;
+	case SEEK_END:
+		if (fstat(files[h->file].osfd, &st) != 0)
+			return -1;
+		pos = st.st_size + offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return h->pos = pos;
+}
+
+int filetable_close(int fd)
+{
+	sharedhandle *h = _get(fd);
+	sharedfile *f;
+	int *link, result = 0;
+
+	if (h == NULL)
+		return -1;
+	f = &files[h->file];
+	if (--f->refs == 0)
+	{
+		for (link = &buckets[_bucket(f->dev, f->ino, f->accmode)]; *link != h->file;
+			 link = &files[*link].next)
+			;
+		*link = f->next;
+		result = close(f->osfd);
+		f->next = free_file;
+		free_file = h->file;
+		nfiles--;
+	}
+	h->file = -2 - free_handle;
+	free_handle = h - handles;
+	nhandles--;
+	return result;
+}
+
+int filetable_files()
+{
+	return nfiles;
+}
+
+int filetable_handles()
+{
+	return nhandles;
+}
+
+void filetable_cache_stats(uint64_t *h, uint64_t *m)
+{
+	*h = hits;
+	*m = misses;
+}
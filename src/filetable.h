@@ -0,0 +1,61 @@
+#ifndef _TNFS_FILETABLE_H
+#define _TNFS_FILETABLE_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Open files shared by sessions
+ *
+ * */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Descriptors handed out for shared files sit below those of overlays
+ * and above any the OS will hand out */
+#define SHAREDFD_BASE 0x10000000
+#define IS_SHAREDFD(fd) ((fd) >= SHAREDFD_BASE && (fd) < SHAREDFD_BASE + FILETABLE_HANDLES)
+
+/* Open path, sharing the OS descriptor with anyone else who has the
+ * same file open the same way. Returns 0 if it can't be shared and
+ * should be opened as usual, or -1 with errno set on failure. flags and
+ * mode are those of open(). */
+int filetable_open(const char *path, int flags, int mode);
+
+/* The OS descriptor behind fd, which is fd itself if it isn't shared */
+int filetable_osfd(int fd);
+
+/* Each descriptor has its own position */
+int filetable_read(int fd, void *buf, int size);
+int filetable_pread(int fd, void *buf, int size, off_t offset);
+int filetable_write(int fd, const void *buf, int size);
+off_t filetable_lseek(int fd, off_t offset, int whence);
+int filetable_close(int fd);
+
+/* Files open, and the descriptors handed out for them */
+int filetable_files();
+int filetable_handles();
+
+/* Opens that found the file already open, and those that didn't */
+void filetable_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
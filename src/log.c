@@ -22,109 +22,221 @@
  *
  * TNFS daemon logging functions
  *
+ * Lines are formatted on the caller's side, after the check of their
+ * level, with a timestamp string that's only remade once a second. With
+ * ENABLE_ASYNCLOG they then go into a ring of LOG_RING_LINES slots that
+ * a writer thread empties to the output, looking every
+ * LOG_WRITE_INTERVAL milliseconds while it's quiet, so the main loop
+ * never waits on the output. The main loop is the only writer to the
+ * ring and the thread the only reader, so it needs no locks. Lines that
+ * find the ring full are counted and dropped, and the writer says how
+ * many it missed.
+ *
  * */
 
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
+#ifdef ENABLE_ASYNCLOG
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
+#include "config.h"
+#include "bsdcompat.h"
 #include "log.h"
+#include "settings.h"
 #include "tnfs.h"
 
 FILE *output;
 
-void TNFSMSGLOG(Header *hdr, const char *msg, ...)
+static time_t stamp_time = -1;
+static char stamp[sizeof "[2011-10-08T07:07:09Z] "];
+
+#ifdef ENABLE_ASYNCLOG
+static char ring[LOG_RING_LINES][LOG_LINE_MAX];
+static atomic_uint_fast64_t ring_head;		/* next slot the main loop fills */
+static atomic_uint_fast64_t ring_tail;		/* next slot the writer empties */
+static atomic_uint_fast64_t dropped;
+static atomic_bool stopping;
+static pthread_t writer;
+static bool writer_running;
+#endif
+
+static void _format_stamp(char *buf, size_t bufsz, time_t t)
 {
-	log_time();
+	struct tm *gmt = gmtime(&t);
 
-	unsigned char *ip = (unsigned char *)&hdr->ipaddr;
-	char buff[128];
+	// Replace %F and %T with equivalents for broader compatibility (wasn't working in MinGW)
+	if (gmt == NULL || strftime(buf, bufsz, "[%Y-%m-%dT%H:%M:%SZ] ", gmt) == 0)
+		strlcpy(buf, "[??] ", bufsz);
+}
 
-	va_list vargs;
-	va_start(vargs, msg);
+/* "[time] ", remade when the second changes */
+static const char *_stamp()
+{
+	time_t now = time(NULL);
+
+	if (now != stamp_time)
+	{
+		stamp_time = now;
+		_format_stamp(stamp, sizeof(stamp), now);
+	}
+	return stamp;
+}
 
-	vsnprintf(buff, sizeof(buff), msg, vargs);
-	va_end(vargs);
+#ifdef ENABLE_ASYNCLOG
+static void *_writer(void *arg)
+{
+	struct timespec interval = {0, LOG_WRITE_INTERVAL * 1000000L};
+	uint64_t reported = 0;
+	char when[sizeof(stamp)];
+
+	for (;;)
+	{
+		bool last = atomic_load(&stopping);
+		uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+		uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+		uint64_t lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+
+		for (; tail != head; tail++)
+		{
+			fputs(ring[tail % LOG_RING_LINES], output);
+			atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+		}
+		if (lost != reported)
+		{
+			_format_stamp(when, sizeof(when), time(NULL));
+			fprintf(output, "%s%llu log lines were dropped\n", when,
+					(unsigned long long)(lost - reported));
+			reported = lost;
+		}
+		fflush(output);
+		if (last)
+			return NULL;
+		/* go straight round again while lines keep coming */
+		if (atomic_load_explicit(&ring_head, memory_order_acquire) == head)
+			nanosleep(&interval, NULL);
+	}
+}
+#endif
 
-	fprintf(output, "%d.%d.%d.%d s=%02x c=%02x q=%02x | %s\n", ip[0], ip[1], ip[2], ip[3], hdr->sid, hdr->cmd, hdr->seqno, buff);
+/* Hands a formatted line over to be written */
+static void _put(const char *line)
+{
+#ifdef ENABLE_ASYNCLOG
+	if (writer_running)
+	{
+		uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+		if (head - atomic_load_explicit(&ring_tail, memory_order_acquire) >= LOG_RING_LINES)
+		{
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+		strlcpy(ring[head % LOG_RING_LINES], line, LOG_LINE_MAX);
+		atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+		return;
+	}
+#endif
+	fputs(line, output);
 	fflush(output);
 }
 
-void USGLOG(Header *hdr, const char *msg, ...)
+/* Formats a line of prefix, the message and suffix after the timestamp */
+static void _line(const char *prefix, const char *suffix, const char *msg, va_list vargs)
 {
-	log_time();
+	char line[LOG_LINE_MAX];
+	int len;
+
+	len = snprintf(line, sizeof(line), "%s%s", _stamp(), prefix);
+	if (len < (int)sizeof(line))
+	{
+		vsnprintf(line + len, sizeof(line) - len, msg, vargs);
+		strlcat(line, suffix, sizeof(line));
+	}
+	_put(line);
+}
 
-	unsigned char *ip = (unsigned char *)&hdr->ipaddr;
-	char buff[128];
-	char sdate[20];
-	struct tm *sTm;
+static bool _wanted(int level)
+{
+	return output != NULL && level <= settings.log_level;
+}
 
-	time_t now = time (0);
-	sTm = gmtime (&now);
+void TNFSMSGLOG(Header *hdr, const char *msg, ...)
+{
+	unsigned char *ip = (unsigned char *)&hdr->ipaddr;
+	char prefix[64];
 
-	strftime (sdate, sizeof(sdate), "%Y-%m-%d %H:%M:%S", sTm);
+	if (!_wanted(LOGLEVEL_CLIENT))
+		return;
+	snprintf(prefix, sizeof(prefix), "%d.%d.%d.%d s=%02x c=%02x q=%02x | ",
+			 ip[0], ip[1], ip[2], ip[3], hdr->sid, hdr->cmd, hdr->seqno);
 
 	va_list vargs;
 	va_start(vargs, msg);
-
-	vsnprintf(buff, sizeof(buff), msg, vargs);
+	_line(prefix, "\n", msg, vargs);
 	va_end(vargs);
-
-	fprintf(output, "%s|%d.%d.%d.%d|SID=%02x|%s\n", sdate, ip[0], ip[1], ip[2], ip[3], hdr->sid, buff);
-	fflush(output);
 }
 
 void MSGLOG(in_addr_t ipaddr, const char *msg, ...)
 {
-	log_time();
-
 	unsigned char *ip = (unsigned char *)&ipaddr;
-	char buff[128];
+	char prefix[32];
+
+	if (!_wanted(LOGLEVEL_CLIENT))
+		return;
+	snprintf(prefix, sizeof(prefix), "%d.%d.%d.%d | ", ip[0], ip[1], ip[2], ip[3]);
 
 	va_list vargs;
 	va_start(vargs, msg);
-
-	vsnprintf(buff, sizeof(buff), msg, vargs);
+	_line(prefix, "\n", msg, vargs);
 	va_end(vargs);
-
-	fprintf(output, "%d.%d.%d.%d | %s\n", ip[0], ip[1], ip[2], ip[3], buff);
-	fflush(output);
 }
 
 void LOG(const char *msg, ...)
 {
-	log_time();
+	if (!_wanted(LOGLEVEL_SERVER))
+		return;
 
 	va_list vargs;
 	va_start(vargs, msg);
-
-	vfprintf(output, msg, vargs);
+	_line("", "", msg, vargs);
 	va_end(vargs);
-	fflush(output);
 }
 
-void log_time() {
-    time_t now;
-    struct tm *gmt;
-
-    time(&now);
-    gmt = gmtime(&now);
-    if (gmt == NULL) {
-        fprintf(output, "Failed to convert time to GMT.\n");
-        return;
-    }
-
-    char formatted_time[sizeof "2011-10-08T07:07:09Z"];
-    // Replace %F and %T with equivalents for broader compatibility (wasn't working in MinGW)
-    if (strftime(formatted_time, sizeof formatted_time, "%Y-%m-%dT%H:%M:%SZ", gmt) == 0) {
-        fprintf(output, "[??] ");
-        return;
-    }
-
-    fprintf(output, "[%s] ", formatted_time);
+uint64_t log_dropped()
+{
+#ifdef ENABLE_ASYNCLOG
+	return atomic_load(&dropped);
+#else
+	return 0;
+#endif
+}
+
+void log_close()
+{
+#ifdef ENABLE_ASYNCLOG
+	if (writer_running)
+	{
+		atomic_store(&stopping, true);
+		pthread_join(writer, NULL);
+		writer_running = false;
+	}
+#endif
+	if (output != NULL)
+		fflush(output);
 }
 
 void log_init(FILE *log_output)
 {
 	output = log_output;
-}
\ No newline at end of file
+#ifdef ENABLE_ASYNCLOG
+	if (!writer_running && pthread_create(&writer, NULL, _writer, NULL) == 0)
+	{
+		writer_running = true;
+		atexit(log_close);
+	}
+#endif
+}
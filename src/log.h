@@ -27,14 +27,23 @@
  * */
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "tnfs.h"
 
+/* What's logged at each LOG_LEVEL; lines above it aren't even formatted */
+#define LOGLEVEL_SERVER	0	/* LOG(): the server's own messages */
+#define LOGLEVEL_CLIENT	1	/* MSGLOG(), TNFSMSGLOG(): about clients */
+
+/* Start logging to file; log_close() writes out what's still waiting */
 void log_init(FILE *file);
+void log_close();
+
 void TNFSMSGLOG(Header *hdr, const char *msg, ...);
-void USGLOG(Header *hdr, const char *msg, ...);
 void MSGLOG(in_addr_t ipaddr, const char *msg, ...);
 void LOG(const char *msg, ...);
-void log_time();
+
+/* Lines dropped because the writer couldn't keep up */
+uint64_t log_dropped();
 
 #endif
@@ -50,12 +50,22 @@ int main(int argc, char **argv)
 #endif
     bool read_only = false;
     char *pvalue = NULL;
+    char *cvalue = NULL;
+    char *ovalue = NULL;
+    int metrics_port = 0;
+    char *avalue = NULL;
+    char *wvalue = NULL;
+    bool build_catalog = false;
+    bool fold_case = false;
+    bool search = false;
+    bool durable = false;
+    bool in_memory = false;
     char *root_path = NULL;
 
     #ifdef ENABLE_CHROOT
-    while((opt = getopt(argc, argv, "ru:g:p:")) != -1)
+    while((opt = getopt(argc, argv, "ru:g:p:c:bisSMo:l:f:m:a:w:")) != -1)
     #else
-    while((opt = getopt(argc, argv, "rp:")) != -1)
+    while((opt = getopt(argc, argv, "rp:c:bisSMo:l:f:m:a:w:")) != -1)
     #endif
     {
         switch(opt)
@@ -66,6 +76,49 @@ int main(int argc, char **argv)
             case 'r':
                 read_only = true;
                 break;
+            case 'c':
+                cvalue = optarg;
+                break;
+            case 'b':
+                build_catalog = true;
+                break;
+            case 'i':
+                fold_case = true;
+                break;
+            case 's':
+                search = true;
+                break;
+            case 'o':
+                ovalue = optarg;
+                break;
+            case 'f':
+                if (tnfsd_load_limits(optarg) < 0)
+                    exit(-1);
+                break;
+            case 'l':
+                if (tnfsd_set_limit(optarg) < 0)
+                    exit(-1);
+                break;
+            case 'S':
+                durable = true;
+                break;
+            case 'M':
+                in_memory = true;
+                break;
+            case 'a':
+                avalue = optarg;
+                break;
+            case 'w':
+                wvalue = optarg;
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                if (metrics_port < 1 || metrics_port > 65535)
+                {
+                    fprintf(stderr, "Invalid metrics port\n");
+                    exit(-1);
+                }
+                break;
             #ifdef ENABLE_CHROOT
             case 'u':
                 uvalue = optarg;
@@ -105,6 +158,18 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
+    if (build_catalog)
+    {
+        /* the offline tool: write the catalog and leave */
+        if (cvalue == NULL)
+        {
+            fprintf(stderr, "-b needs a catalog file given with -c\n");
+            exit(-1);
+        }
+        tnfsd_init_logs(STDERR_FILENO);
+        return tnfsd_build_catalog(root_path, cvalue) == 0 ? 0 : 1;
+    }
+
     #ifdef ENABLE_CHROOT
     if (uvalue || gvalue)
     {
@@ -140,6 +205,23 @@ int main(int argc, char **argv)
     tnfsd_init();
     tnfsd_init_logs(STDERR_FILENO);
     signal(SIGINT, tnfsd_stop);
+#ifdef SIGUSR1
+    signal(SIGUSR1, tnfsd_report_stats);
+#endif
+    if (cvalue)
+        tnfsd_use_catalog(cvalue);
+    tnfsd_fold_case(fold_case);
+    tnfsd_index_search(search);
+    tnfsd_durable_writes(durable);
+    tnfsd_serve_from_memory(in_memory);
+    if (ovalue != NULL)
+        tnfsd_use_overlays(ovalue);
+    if (metrics_port)
+        tnfsd_serve_metrics(metrics_port);
+    if (avalue != NULL)
+        tnfsd_access_log(avalue);
+    if (wvalue != NULL)
+        tnfsd_capture(wvalue);
     tnfsd_start(root_path, port, read_only);
 
     return 0;
@@ -148,8 +230,8 @@ int main(int argc, char **argv)
 void print_usage()
 {
     #ifdef ENABLE_CHROOT
-    fprintf(stderr, "Usage: tnfsd [-u <username> -g <group> -p <port> -r] <root dir>\n");
+    fprintf(stderr, "Usage: tnfsd [-u <username> -g <group> -p <port> -r -i -s -S -M -o <overlay dir> -m <metrics port> -a <access log> -w <capture file> -c <catalog> -b -f <limits file> -l NAME=value] <root dir>\n");
     #else
-    fprintf(stderr, "Usage: tnfsd [-p <port> -r] <root dir>\n");
+    fprintf(stderr, "Usage: tnfsd [-p <port> -r -i -s -S -M -o <overlay dir> -m <metrics port> -a <access log> -w <capture file> -c <catalog> -b -f <limits file> -l NAME=value] <root dir>\n");
     #endif
 }
\ No newline at end of file
@@ -0,0 +1,433 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Server metrics in the Prometheus text format over HTTP.
+ *
+ * The listening socket and its clients are watched by the main loop's
+ * event queue like the TNFS sockets. A client gets the page once it has
+ * sent the head of a GET request, and is then disconnected; the page is
+ * built from the counters in stats.h and the caches' own counts at that
+ * moment. Only the loopback interface is listened on.
+ *
+ * */
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#ifdef UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#endif
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#include "config.h"
+#include "metrics.h"
+#include "stats.h"
+#include "settings.h"
+#include "filetable.h"
+#include "casefold.h"
+#ifdef ENABLE_CATALOG
+#include "catalog.h"
+#endif
+#ifdef WITH_ZIP
+#include "zip.h"
+#endif
+
+#define METRICS_REQSZ 1024
+
+typedef struct _metrics_client
+{
+	int fd;				/* 0 if the slot is free */
+	time_t since;			/* when it connected */
+	int len;
+	char req[METRICS_REQSZ];
+} metrics_client;
+
+/* The page as it's built */
+typedef struct _metrics_page
+{
+	char *buf;
+	size_t len, cap;
+	bool failed;
+} metrics_page;
+
+static int listenfd = -1;
+static metrics_client clients[METRICS_MAX_CLIENTS];
+
+static void _close_socket(int fd)
+{
+#ifdef WIN32
+	closesocket(fd);
+#else
+	close(fd);
+#endif
+}
+
+int metrics_init(int port)
+{
+	struct sockaddr_in addr;
+	int reuseaddr = 1;
+
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuseaddr, sizeof(reuseaddr));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listenfd, METRICS_MAX_CLIENTS) < 0 ||
+		!tnfs_event_register(listenfd))
+	{
+		_close_socket(listenfd);
+		listenfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void _drop(metrics_client *c)
+{
+	tnfs_event_unregister(c->fd);
+	_close_socket(c->fd);
+	c->fd = 0;
+}
+
+void metrics_close()
+{
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd != 0)
+			_drop(&clients[i]);
+	}
+	if (listenfd >= 0)
+	{
+		tnfs_event_unregister(listenfd);
+		_close_socket(listenfd);
+		listenfd = -1;
+	}
+}
+
+static void _printf(metrics_page *p, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (p->failed)
+		return;
+	for (;;)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(p->buf + p->len, p->cap - p->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+		{
+			p->failed = true;
+			return;
+		}
+		if ((size_t)n < p->cap - p->len)
+		{
+			p->len += n;
+			return;
+		}
+		char *grown = realloc(p->buf, p->cap * 2 + n);
+		if (grown == NULL)
+		{
+			p->failed = true;
+			return;
+		}
+		p->buf = grown;
+		p->cap = p->cap * 2 + n;
+	}
+}
+
+static void _family(metrics_page *p, const char *name, const char *type, const char *help)
+{
+	_printf(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* The label value of a command: its name, or its number if unknown */
+static const char *_command(int cmd, char *buf, int bufsz)
+{
+	const char *name = get_cmd_name(cmd);
+
+	if (strcmp(name, "UNKNOWN_CMD") != 0)
+		return name;
+	snprintf(buf, bufsz, "0x%02x", cmd);
+	return buf;
+}
+
+/* Samples of a histogram of microsecond buckets from stats.h, in seconds */
+static void _histogram(metrics_page *p, const char *name, const char *labels,
+					   const uint64_t *buckets, uint64_t count, uint64_t sum_us)
+{
+	uint64_t seen = 0;
+	const char *sep = labels[0] ? "," : "";
+	const char *lbrace = labels[0] ? "{" : "";
+	const char *rbrace = labels[0] ? "}" : "";
+
+	for (int b = 0; b < STATS_LATENCY_BUCKETS - 1; b++)
+	{
+		seen += buckets[b];
+		_printf(p, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n",
+				name, labels, sep, (double)((int64_t)1 << b) / 1e6, seen);
+	}
+	_printf(p, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, count);
+	_printf(p, "%s_sum%s%s%s %.6f\n", name, lbrace, labels, rbrace, sum_us / 1e6);
+	_printf(p, "%s_count%s%s%s %" PRIu64 "\n", name, lbrace, labels, rbrace, count);
+}
+
+static void _cache(metrics_page *p, const char *cache,
+				   void (*counts)(uint64_t *hits, uint64_t *misses), bool hits)
+{
+	uint64_t h, m;
+
+	counts(&h, &m);
+	_printf(p, "tnfsd_cache_%s_total{cache=\"%s\"} %" PRIu64 "\n",
+			hits ? "hits" : "misses", cache, hits ? h : m);
+}
+
+static void _caches(metrics_page *p, bool hits)
+{
+	_cache(p, "filetable", filetable_cache_stats, hits);
+	_cache(p, "casefold", casefold_cache_stats, hits);
+#ifdef ENABLE_CATALOG
+	_cache(p, "catalog", catalog_cache_stats, hits);
+#endif
+#ifdef WITH_ZIP
+	_cache(p, "zip", zip_cache_stats, hits);
+#endif
+}
+
+static void _build(metrics_page *p)
+{
+	char labels[64], cmdbuf[8];
+	int cmd, status;
+
+	_family(p, "tnfsd_sessions", "gauge", "Sessions mounted.");
+	_printf(p, "tnfsd_sessions %d\n", tnfs_session_count());
+	_family(p, "tnfsd_sessions_max", "gauge", "Most sessions that can be mounted.");
+	_printf(p, "tnfsd_sessions_max %d\n", settings.max_sessions);
+	_family(p, "tnfsd_tcp_connections", "gauge", "TCP connections open.");
+	_printf(p, "tnfsd_tcp_connections %d\n", tcp_connections_count());
+	_family(p, "tnfsd_tcp_connections_max", "gauge", "Most TCP connections that can be open.");
+	_printf(p, "tnfsd_tcp_connections_max %d\n", settings.max_tcp_conn);
+	_family(p, "tnfsd_shared_files", "gauge", "Files open in the shared file table.");
+	_printf(p, "tnfsd_shared_files %d\n", filetable_files());
+	_family(p, "tnfsd_shared_file_descriptors", "gauge", "Descriptors handed out for shared files.");
+	_printf(p, "tnfsd_shared_file_descriptors %d\n", filetable_handles());
+
+	_family(p, "tnfsd_requests_total", "counter", "Requests carried out, by command.");
+	for (cmd = 0; cmd < 256; cmd++)
+	{
+		if (stats.cmds[cmd].requests > 0)
+			_printf(p, "tnfsd_requests_total{command=\"%s\"} %" PRIu64 "\n",
+					_command(cmd, cmdbuf, sizeof(cmdbuf)), stats.cmds[cmd].requests);
+	}
+	_family(p, "tnfsd_request_errors_total", "counter", "Replies with an error status, by command.");
+	for (cmd = 0; cmd < 256; cmd++)
+	{
+		if (stats.cmds[cmd].requests > 0)
+			_printf(p, "tnfsd_request_errors_total{command=\"%s\"} %" PRIu64 "\n",
+					_command(cmd, cmdbuf, sizeof(cmdbuf)), stats.cmds[cmd].errors);
+	}
+	_family(p, "tnfsd_request_duration_seconds", "histogram", "Time taken to carry out requests, by command.");
+	for (cmd = 0; cmd < 256; cmd++)
+	{
+		cmd_stats *cs = &stats.cmds[cmd];
+		if (cs->requests == 0)
+			continue;
+		snprintf(labels, sizeof(labels), "command=\"%s\"", _command(cmd, cmdbuf, sizeof(cmdbuf)));
+		_histogram(p, "tnfsd_request_duration_seconds", labels, cs->latency, cs->requests, cs->latency_us);
+	}
+	_family(p, "tnfsd_replies_total", "counter", "Replies sent, by TNFS status.");
+	for (status = 0; status < 256; status++)
+	{
+		if (stats.statuses[status] > 0)
+			_printf(p, "tnfsd_replies_total{status=\"0x%02x\"} %" PRIu64 "\n", status, stats.statuses[status]);
+	}
+
+	_family(p, "tnfsd_received_bytes_total", "counter", "Bytes of requests received.");
+	_printf(p, "tnfsd_received_bytes_total %" PRIu64 "\n", stats.bytes_in);
+	_family(p, "tnfsd_sent_bytes_total", "counter", "Bytes of replies sent, retransmits included.");
+	_printf(p, "tnfsd_sent_bytes_total %" PRIu64 "\n", stats.bytes_out);
+	_family(p, "tnfsd_retransmits_total", "counter", "Replies sent again for clients that missed them.");
+	_printf(p, "tnfsd_retransmits_total %" PRIu64 "\n", stats.resends);
+
+	_family(p, "tnfsd_log_dropped_total", "counter", "Log lines dropped because the log writer fell behind.");
+	_printf(p, "tnfsd_log_dropped_total %" PRIu64 "\n", log_dropped());
+
+	_family(p, "tnfsd_cache_hits_total", "counter", "Lookups answered from a cache.");
+	_caches(p, true);
+	_family(p, "tnfsd_cache_misses_total", "counter", "Lookups a cache couldn't answer.");
+	_caches(p, false);
+
+	_family(p, "tnfsd_loop_busy_seconds", "histogram",
+			"Time each pass of the main loop took before waiting for events again.");
+	_histogram(p, "tnfsd_loop_busy_seconds", "", stats.loop_busy, stats.loop_passes, stats.loop_busy_us);
+	_family(p, "tnfsd_loop_busy_max_seconds", "gauge", "Longest pass of the main loop.");
+	_printf(p, "tnfsd_loop_busy_max_seconds %.6f\n", stats.loop_busy_max / 1e6);
+	_family(p, "tnfsd_loop_lag_seconds", "gauge",
+			"Time under which a fraction of the passes of the main loop kept it from waiting, by quantile.");
+	for (int q = 0; stats.loop_passes > 0 && q < 3; q++)
+	{
+		static const double quantiles[] = {0.5, 0.9, 0.99};
+		int64_t us = stats_percentile(stats.loop_busy, stats.loop_passes, quantiles[q]);
+		if (us < 0)
+			us = (int64_t)1 << (STATS_LATENCY_BUCKETS - 1);
+		_printf(p, "tnfsd_loop_lag_seconds{quantile=\"%g\"} %.6f\n", quantiles[q], us / 1e6);
+	}
+}
+
+static void _send_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		int sent = send(fd, buf, len, 0);
+		if (sent <= 0)
+			return;
+		buf += sent;
+		len -= sent;
+	}
+}
+
+static void _respond(metrics_client *c)
+{
+	metrics_page page = {NULL, 0, 0, false};
+	char head[160];
+	const char *status = "200 OK";
+
+	if (strncmp(c->req, "GET ", 4) != 0)
+		status = "405 Method Not Allowed";
+	else if (strncmp(c->req + 4, "/ ", 2) != 0 && strncmp(c->req + 4, "/metrics ", 9) != 0)
+		status = "404 Not Found";
+
+	if (strcmp(status, "200 OK") == 0 && (page.buf = malloc(page.cap = 16384)) != NULL)
+		_build(&page);
+	if (page.buf == NULL || page.failed)
+	{
+		if (strcmp(status, "200 OK") == 0)
+			status = "500 Internal Server Error";
+		page.len = 0;
+	}
+
+	snprintf(head, sizeof(head),
+			 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+			 status, (unsigned long)page.len);
+	_send_all(c->fd, head, strlen(head));
+	_send_all(c->fd, page.buf, page.len);
+	free(page.buf);
+	_drop(c);
+}
+
+/* Accepts one connection. Returns false if none could be accepted. */
+static bool _accept_one()
+{
+	struct sockaddr_in addr;
+#ifdef WIN32
+	int len = sizeof(addr);
+#else
+	socklen_t len = sizeof(addr);
+#endif
+	int fd = accept(listenfd, (struct sockaddr *)&addr, &len);
+
+	if (fd < 1)
+		return false;
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd == 0)
+		{
+			if (!tnfs_event_register(fd))
+				break;
+			clients[i].fd = fd;
+			clients[i].since = time(NULL);
+			clients[i].len = 0;
+			return true;
+		}
+	}
+	_close_socket(fd);
+	return true;
+}
+
+/* The event backends may be edge triggered, so take every connection
+ * that's waiting */
+static void _accept()
+{
+#ifdef WIN32
+	_accept_one();
+#else
+	struct pollfd pfd = {listenfd, POLLIN, 0};
+
+	while (_accept_one() && poll(&pfd, 1, 0) > 0)
+		;
+#endif
+}
+
+static void _receive(metrics_client *c)
+{
+	int n = recv(c->fd, c->req + c->len, METRICS_REQSZ - 1 - c->len, 0);
+
+	if (n <= 0)
+	{
+		_drop(c);
+		return;
+	}
+	c->len += n;
+	c->req[c->len] = '\0';
+	/* the head of the request is all there is to read */
+	if (strstr(c->req, "\r\n\r\n") != NULL || strstr(c->req, "\n\n") != NULL ||
+		c->len == METRICS_REQSZ - 1)
+		_respond(c);
+}
+
+void metrics_handle(event_wait_res_t *res)
+{
+	if (listenfd < 0)
+		return;
+	if (tnfs_event_is_active(res, listenfd))
+		_accept();
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd != 0 && tnfs_event_is_active(res, clients[i].fd))
+			_receive(&clients[i]);
+	}
+}
+
+void metrics_close_stale(time_t now)
+{
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd != 0 && now - clients[i].since > METRICS_TIMEOUT)
+			_drop(&clients[i]);
+	}
+}
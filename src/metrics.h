@@ -0,0 +1,43 @@
+#ifndef _TNFS_METRICS_H
+#define _TNFS_METRICS_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Server metrics in the Prometheus text format over HTTP
+ *
+ * */
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "event.h"
+
+/* Serve the metrics page on port of the loopback interface, through the
+ * main loop's event queue. Returns 0 on success. */
+int metrics_init(int port);
+void metrics_close();
+
+/* Called from the main loop: answers scrapes whose descriptors are
+ * ready, and drops clients that never sent a request */
+void metrics_handle(event_wait_res_t *res);
+void metrics_close_stale(time_t now);
+
+#endif
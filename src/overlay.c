@@ -0,0 +1,573 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Per-client copy-on-write overlays of shared files.
+ *
+ * Many clients mount the same disk image, and some write to it. With an
+ * overlay directory, a client's writes to a file that already exists go
+ * to a delta file of its own, <dir>/<client address>/<path>, and reads
+ * merge that with the file, which is only ever opened read only. Clients
+ * that haven't written to a file read it directly.
+ *
+ * A delta file is native endian: a header with the size of the file as
+ * the client sees it, then each block written as its number and data, in
+ * the order they were first written. The map of blocks to records is
+ * rebuilt when the delta is opened.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "overlay.h"
+#include "bsdcompat.h"
+#include "log.h"
+
+#define OVERLAY_MAGIC "TNFSCOW"
+
+typedef struct _ovlheader
+{
+	char magic[8];
+	uint32_t blocksize;
+	uint32_t reserved;
+	uint64_t size;			/* of the file as the client sees it */
+	uint64_t visible;		/* bytes of the shared file that still show through */
+} ovlheader;
+
+typedef struct _ovlrecord
+{
+	uint32_t block;
+	uint32_t reserved;
+} ovlrecord;
+
+/* A client's delta of a file, shared by its open handles */
+typedef struct _ovldelta
+{
+	int refs;			/* open handles, 0 if not in use */
+	char path[MAX_FILEPATH];	/* of the delta file */
+	int base;			/* the shared file */
+	int fd;				/* the delta file, -1 until it's first written */
+	ovlheader hdr;
+	uint32_t *map;			/* record + 1 of each block, 0 if it's the shared file's */
+	uint32_t nmap;
+	uint32_t nrecords;
+} ovldelta;
+
+typedef struct _ovlfile
+{
+	ovldelta *delta;		/* NULL if not in use */
+	off_t pos;
+	int flags;
+} ovlfile;
+
+static bool enabled;
+static char ovldir[MAX_FILEPATH];
+static char ovlroot[MAX_FILEPATH];
+static ovldelta deltas[OVERLAY_MAX_OPEN];
+static ovlfile files[OVERLAY_MAX_OPEN];
+
+static int _pread(int fd, void *buf, int size, off_t offset)
+{
+#ifdef WIN32
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return read(fd, buf, (size_t)size);
+#else
+	return pread(fd, buf, (size_t)size, offset);
+#endif
+}
+
+static int _pwrite(int fd, const void *buf, int size, off_t offset)
+{
+#ifdef WIN32
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return write(fd, buf, (size_t)size);
+#else
+	return pwrite(fd, buf, (size_t)size, offset);
+#endif
+}
+
+static int _mkdir(const char *path)
+{
+#ifdef WIN32
+	if (mkdir(path) == 0 || errno == EEXIST)
+#else
+	if (mkdir(path, 0755) == 0 || errno == EEXIST)
+#endif
+		return 0;
+	return -1;
+}
+
+void overlay_init(const char *dir, const char *rootdir)
+{
+	int len;
+
+	strlcpy(ovldir, dir, sizeof(ovldir));
+	strlcpy(ovlroot, rootdir, sizeof(ovlroot));
+	for (len = strlen(ovlroot); len > 1 && ovlroot[len - 1] == '/'; len--)
+		ovlroot[len - 1] = '\0';
+	if (_mkdir(ovldir) < 0)
+	{
+		LOG("Unable to use overlay directory %s: %s\n", ovldir, strerror(errno));
+		return;
+	}
+	enabled = true;
+}
+
+bool overlay_enabled()
+{
+	return enabled;
+}
+
+/* Where the client's delta of the file at path goes */
+static int _deltapath(const char *path, in_addr_t ipaddr, char *out, int outsz)
+{
+	const unsigned char *ip = (const unsigned char *)&ipaddr;
+	int rootlen = strlen(ovlroot);
+
+	if (strncmp(path, ovlroot, rootlen) != 0 ||
+		(path[rootlen] != '/' && path[rootlen] != '\0'))
+		return -1;
+	for (path += rootlen; *path == '/'; path++)
+		;
+	if (snprintf(out, outsz, "%s/%u.%u.%u.%u/%s", ovldir,
+				 ip[0], ip[1], ip[2], ip[3], path) >= outsz)
+		return -1;
+	return 0;
+}
+
+static off_t _recoff(uint32_t record)
+{
+	return sizeof(ovlheader) + (off_t)record * (sizeof(ovlrecord) + OVERLAY_BLOCK);
+}
+
+static int _map_set(ovldelta *d, uint32_t block, uint32_t record)
+{
+	if (block >= d->nmap)
+	{
+		uint32_t nmap = d->nmap ? d->nmap : 64;
+		uint32_t *map;
+		while (nmap <= block)
+			nmap *= 2;
+		if ((map = realloc(d->map, nmap * sizeof(uint32_t))) == NULL)
+			return -1;
+		memset(map + d->nmap, 0, (nmap - d->nmap) * sizeof(uint32_t));
+		d->map = map;
+		d->nmap = nmap;
+	}
+	d->map[block] = record + 1;
+	return 0;
+}
+
+static int _read_header(int fd, ovlheader *hdr)
+{
+	if (_pread(fd, hdr, sizeof(ovlheader), 0) != sizeof(ovlheader) ||
+		memcmp(hdr->magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC)) != 0 ||
+		hdr->blocksize != OVERLAY_BLOCK)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static int _save_header(ovldelta *d)
+{
+	return _pwrite(d->fd, &d->hdr, sizeof(ovlheader), 0) == sizeof(ovlheader) ? 0 : -1;
+}
+
+/* Read the delta, if the client has one, and map its blocks */
+static int _load(ovldelta *d, off_t basesize)
+{
+	struct stat st;
+	ovlrecord rec;
+
+	memset(&d->hdr, 0, sizeof(ovlheader));
+	memcpy(d->hdr.magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC));
+	d->hdr.blocksize = OVERLAY_BLOCK;
+	d->hdr.size = d->hdr.visible = basesize;
+
+	if ((d->fd = open(d->path, O_RDWR)) < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (_read_header(d->fd, &d->hdr) < 0 || fstat(d->fd, &st) < 0)
+	{
+		LOG("Unable to use overlay %s\n", d->path);
+		return -1;
+	}
+	for (; _recoff(d->nrecords + 1) <= st.st_size; d->nrecords++)
+	{
+		if (_pread(d->fd, &rec, sizeof(rec), _recoff(d->nrecords)) != sizeof(rec) ||
+			_map_set(d, rec.block, d->nrecords) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Start the delta afresh, with nothing of the shared file showing
+ * through past size */
+static int _create(ovldelta *d, uint64_t size)
+{
+	char *p;
+
+	for (p = d->path + strlen(ovldir) + 1; (p = strchr(p, '/')) != NULL; p++)
+	{
+		*p = '\0';
+		int result = _mkdir(d->path);
+		*p = '/';
+		if (result < 0)
+			return -1;
+	}
+	if (d->fd >= 0)
+		close(d->fd);
+	if ((d->fd = open(d->path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	free(d->map);
+	d->map = NULL;
+	d->nmap = d->nrecords = 0;
+	d->hdr.size = size;
+	if (d->hdr.visible > size)
+		d->hdr.visible = size;
+	return _save_header(d);
+}
+
+static void _release(ovldelta *d)
+{
+	if (--d->refs > 0)
+		return;
+	if (d->fd >= 0)
+		close(d->fd);
+	close(d->base);
+	free(d->map);
+	memset(d, 0, sizeof(ovldelta));
+}
+
+int overlay_open(const char *path, in_addr_t ipaddr, int flags)
+{
+	char dpath[MAX_FILEPATH];
+	bool writable = (flags & O_ACCMODE) != O_RDONLY;
+	ovldelta *d = NULL, *free_delta = NULL;
+	ovlfile *f = NULL;
+	struct stat st;
+	int i;
+
+	if (!enabled || ((flags & O_CREAT) && (flags & O_EXCL)) ||
+		stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+		_deltapath(path, ipaddr, dpath, sizeof(dpath)) < 0)
+		return 0;
+
+	for (i = 0; i < OVERLAY_MAX_OPEN; i++)
+	{
+		if (deltas[i].refs > 0 && strcmp(deltas[i].path, dpath) == 0)
+			d = &deltas[i];
+		else if (deltas[i].refs == 0 && free_delta == NULL)
+			free_delta = &deltas[i];
+		if (files[i].delta == NULL && f == NULL)
+			f = &files[i];
+	}
+	if (d == NULL)
+	{
+		/* a client that never wrote to the file just reads it */
+		if (!writable && stat(dpath, &st) != 0)
+			return 0;
+		if (free_delta == NULL || f == NULL)
+		{
+			errno = EMFILE;
+			return -1;
+		}
+		d = free_delta;
+		strlcpy(d->path, dpath, sizeof(d->path));
+		d->fd = -1;
+		d->refs = 1;
+		if ((d->base = open(path, O_RDONLY)) < 0)
+		{
+			memset(d, 0, sizeof(ovldelta));
+			return -1;
+		}
+		if (_load(d, st.st_size) < 0)
+		{
+			int err = errno;
+			_release(d);
+			errno = err;
+			return -1;
+		}
+	}
+	else if (f == NULL)
+	{
+		errno = EMFILE;
+		return -1;
+	}
+	else
+	{
+		d->refs++;
+	}
+
+	if (writable && (flags & O_TRUNC) && _create(d, 0) < 0)
+	{
+		int err = errno;
+		_release(d);
+		errno = err;
+		return -1;
+	}
+	f->delta = d;
+	f->pos = 0;
+	f->flags = flags;
+	return OVLFD_BASE + (f - files);
+}
+
+void overlay_stat(const char *path, in_addr_t ipaddr, struct stat *st)
+{
+	char dpath[MAX_FILEPATH];
+	ovlheader hdr;
+	int fd;
+
+	if (!enabled || !S_ISREG(st->st_mode) ||
+		_deltapath(path, ipaddr, dpath, sizeof(dpath)) < 0)
+		return;
+	for (int i = 0; i < OVERLAY_MAX_OPEN; i++)
+	{
+		if (deltas[i].refs > 0 && strcmp(deltas[i].path, dpath) == 0)
+		{
+			st->st_size = deltas[i].hdr.size;
+			return;
+		}
+	}
+	if ((fd = open(dpath, O_RDONLY)) < 0)
+		return;
+	if (_read_header(fd, &hdr) == 0)
+		st->st_size = hdr.size;
+	close(fd);
+}
+
+static ovlfile *_file(int fd)
+{
+	if (!IS_OVLFD(fd) || files[fd - OVLFD_BASE].delta == NULL)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &files[fd - OVLFD_BASE];
+}
+
+/* Read from the shared file, which ends where it stops showing through */
+static int _base_read(ovldelta *d, unsigned char *buf, int size, uint64_t offset)
+{
+	int n = 0;
+
+	if (offset < d->hdr.visible)
+	{
+		n = size;
+		if (offset + n > d->hdr.visible)
+			n = d->hdr.visible - offset;
+		if ((n = _pread(d->base, buf, n, (off_t)offset)) < 0)
+			return -1;
+	}
+	memset(buf + n, 0, size - n);
+	return size;
+}
+
+static int _read_at(ovldelta *d, unsigned char *buf, int size, uint64_t offset)
+{
+	int done = 0;
+
+	if (offset >= d->hdr.size)
+		return 0;
+	if (offset + size > d->hdr.size)
+		size = d->hdr.size - offset;
+	while (done < size)
+	{
+		uint64_t pos = offset + done;
+		uint32_t block = pos / OVERLAY_BLOCK;
+		int inblock = pos % OVERLAY_BLOCK;
+		int n = OVERLAY_BLOCK - inblock;
+		int result;
+
+		if (n > size - done)
+			n = size - done;
+		if (block < d->nmap && d->map[block] != 0)
+		{
+			off_t at = _recoff(d->map[block] - 1) + sizeof(ovlrecord) + inblock;
+			if ((result = _pread(d->fd, buf + done, n, at)) >= 0 && result < n)
+				memset(buf + done + result, 0, n - result);
+		}
+		else
+		{
+			result = _base_read(d, buf + done, n, pos);
+		}
+		if (result < 0)
+			return done > 0 ? done : -1;
+		done += n;
+	}
+	return done;
+}
+
+static int _write_at(ovldelta *d, const unsigned char *buf, int size, uint64_t offset)
+{
+	unsigned char record[sizeof(ovlrecord) + OVERLAY_BLOCK];
+	int done = 0;
+
+	if (d->fd < 0 && _create(d, d->hdr.size) < 0)
+		return -1;
+	while (done < size)
+	{
+		uint64_t pos = offset + done;
+		uint32_t block = pos / OVERLAY_BLOCK;
+		int inblock = pos % OVERLAY_BLOCK;
+		int n = OVERLAY_BLOCK - inblock;
+
+		if (n > size - done)
+			n = size - done;
+		if (block < d->nmap && d->map[block] != 0)
+		{
+			off_t at = _recoff(d->map[block] - 1) + sizeof(ovlrecord) + inblock;
+			if (_pwrite(d->fd, buf + done, n, at) != n)
+				return -1;
+		}
+		else
+		{
+			/* copy the block over before changing it */
+			ovlrecord *rec = (ovlrecord *)record;
+			memset(record, 0, sizeof(record));
+			rec->block = block;
+			if (n < OVERLAY_BLOCK &&
+				_read_at(d, record + sizeof(ovlrecord), OVERLAY_BLOCK,
+						 (uint64_t)block * OVERLAY_BLOCK) < 0)
+				return -1;
+			memcpy(record + sizeof(ovlrecord) + inblock, buf + done, n);
+			if (_pwrite(d->fd, record, sizeof(record), _recoff(d->nrecords)) != sizeof(record) ||
+				_map_set(d, block, d->nrecords) < 0)
+				return -1;
+			d->nrecords++;
+		}
+		done += n;
+	}
+	if (offset + size > d->hdr.size)
+	{
+		d->hdr.size = offset + size;
+		if (_save_header(d) < 0)
+			return -1;
+	}
+	return size;
+}
+
+int overlay_pread(int fd, void *buf, int size, off_t offset)
+{
+	ovlfile *f = _file(fd);
+
+	if (f == NULL)
+		return -1;
+	return _read_at(f->delta, buf, size, (uint64_t)offset);
+}
+
+int overlay_read(int fd, void *buf, int size)
+{
+	ovlfile *f = _file(fd);
+	int result;
+
+	if (f == NULL)
+		return -1;
+	if ((result = _read_at(f->delta, buf, size, (uint64_t)f->pos)) > 0)
+		f->pos += result;
+	return result;
+}
+
+int overlay_write(int fd, const void *buf, int size)
+{
+	ovlfile *f = _file(fd);
+	int result;
+
+	if (f == NULL)
+		return -1;
+	if ((f->flags & O_ACCMODE) == O_RDONLY)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (f->flags & O_APPEND)
+		f->pos = f->delta->hdr.size;
+	if ((result = _write_at(f->delta, buf, size, (uint64_t)f->pos)) > 0)
+		f->pos += result;
+	return result;
+}
+
+off_t overlay_lseek(int fd, off_t offset, int whence)
+{
+	ovlfile *f = _file(fd);
+	off_t pos;
+
+	if (f == NULL)
+		return -1;
+	switch (whence)
+	{
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = f->pos + offset;
+		break;
+	case SEEK_END:
+		pos = f->delta->hdr.size + offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return f->pos = pos;
+}
+
+int overlay_sync(int fd)
+{
+	ovlfile *f = _file(fd);
+
+	if (f == NULL)
+		return -1;
+	if (f->delta->fd < 0)
+		return 0;
+#ifdef WIN32
+	return _commit(f->delta->fd);
+#else
+	return fsync(f->delta->fd);
+#endif
+}
+
+int overlay_close(int fd)
+{
+	ovlfile *f = _file(fd);
+
+	if (f == NULL)
+		return -1;
+	_release(f->delta);
+	f->delta = NULL;
+	return 0;
+}
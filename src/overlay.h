@@ -0,0 +1,60 @@
+#ifndef _TNFS_OVERLAY_H
+#define _TNFS_OVERLAY_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Per-client copy-on-write overlays of shared files
+ *
+ * */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "tnfs.h"
+
+/* Descriptors handed out for overlaid files sit below those of archive
+ * members and above any the OS will hand out */
+#define OVLFD_BASE 0x20000000
+#define IS_OVLFD(fd) ((fd) >= OVLFD_BASE && (fd) < OVLFD_BASE + OVERLAY_MAX_OPEN)
+
+/* Keep each client's changes to the files under rootdir in dir */
+void overlay_init(const char *dir, const char *rootdir);
+bool overlay_enabled();
+
+/* Open path for the client at ipaddr through its overlay. Returns 0 if
+ * the file isn't one to overlay and should be opened as usual, or -1
+ * with errno set on failure. flags are the OS open() flags. */
+int overlay_open(const char *path, in_addr_t ipaddr, int flags);
+
+/* Replace the size in st of the file at path with the one the client
+ * at ipaddr sees */
+void overlay_stat(const char *path, in_addr_t ipaddr, struct stat *st);
+
+int overlay_read(int fd, void *buf, int size);
+int overlay_pread(int fd, void *buf, int size, off_t offset);
+int overlay_write(int fd, const void *buf, int size);
+off_t overlay_lseek(int fd, off_t offset, int whence);
+int overlay_sync(int fd);
+int overlay_close(int fd);
+
+#endif
@@ -0,0 +1,199 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Case insensitive wildcard matching of directory entry names.
+ *
+ * A pattern is compiled once per listing into the literal segments
+ * between its stars, already case folded. With only '*' and '?' to deal
+ * with, taking the leftmost place each segment fits is always safe, so
+ * matching never backtracks: the first segment is tried at the start of
+ * the name, the last at its end, and each one in between is found with
+ * memchr() on its first literal character, which the C library does a
+ * word or vector at a time.
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "pattern.h"
+
+typedef struct _segment
+{
+	const char *text;		/* folded; '?' matches any character */
+	int len;
+	int first;			/* offset of the first literal, -1 if none */
+} segment;
+
+struct _tnfs_pattern
+{
+	int flags;
+	bool anchored_start;		/* the pattern doesn't start with '*' */
+	bool anchored_end;		/* the pattern doesn't end with '*' */
+	int nsegs;
+	segment segs[];
+};
+
+tnfs_pattern *pattern_compile(const char *pattern, int flags)
+{
+	tnfs_pattern *pat;
+	size_t len = strlen(pattern);
+	int maxsegs = len / 2 + 1;
+	char *text, *p;
+	int i;
+
+	/* the segments' text lives after the table, in the same block */
+	pat = malloc(sizeof(tnfs_pattern) + maxsegs * sizeof(segment) + len + 1);
+	if (pat == NULL)
+		return NULL;
+	text = (char *)&pat->segs[maxsegs];
+	for (i = 0; i <= len; i++)
+		text[i] = PATTERN_FOLD(pattern[i]);
+
+	pat->flags = flags;
+	pat->anchored_start = len == 0 || text[0] != '*';
+	pat->anchored_end = len == 0 || text[len - 1] != '*';
+	pat->nsegs = 0;
+
+	for (p = text; *p != '\0';)
+	{
+		if (*p == '*')
+		{
+			*p++ = '\0';
+			continue;
+		}
+		segment *seg = &pat->segs[pat->nsegs++];
+		seg->text = p;
+		seg->len = strcspn(p, "*");
+		seg->first = strspn(p, "?");
+		if (seg->first >= seg->len)
+			seg->first = -1;
+		p += seg->len;
+	}
+	return pat;
+}
+
+void pattern_free(tnfs_pattern *pat)
+{
+	free(pat);
+}
+
+/* Whether the segment matches name at its start; the caller makes
+ * sure there are enough characters */
+static bool _segment_at(const tnfs_pattern *pat, const segment *seg, const char *name)
+{
+	int i;
+
+	for (i = 0; i < seg->len; i++)
+	{
+		if (seg->text[i] == '?')
+		{
+			if ((pat->flags & PATTERN_QMARK_NOT_DOT) && name[i] == '.')
+				return false;
+		}
+		else if (seg->text[i] != name[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Returns the offset of the segment's leftmost match in name[pos..end),
+ * or -1 if it isn't there */
+static int _segment_find(const tnfs_pattern *pat, const segment *seg,
+						 const char *name, int pos, int end)
+{
+	const char *p, *last;
+
+	if (end - pos < seg->len)
+		return -1;
+	last = name + end - seg->len;
+
+	if (seg->first < 0)
+	{
+		for (p = name + pos; p <= last; p++)
+		{
+			if (_segment_at(pat, seg, p))
+				return p - name;
+		}
+		return -1;
+	}
+
+	for (p = name + pos; p <= last; p++)
+	{
+		p = memchr(p + seg->first, seg->text[seg->first], last - p + 1);
+		if (p == NULL)
+			return -1;
+		p -= seg->first;
+		if (_segment_at(pat, seg, p))
+			return p - name;
+	}
+	return -1;
+}
+
+bool pattern_match(const tnfs_pattern *pat, const char *name)
+{
+	char folded[MAX_FILENAME_LEN];
+	const segment *seg = pat->segs;
+	const segment *endseg = pat->segs + pat->nsegs;
+	int n, pos = 0, end, at;
+
+	for (n = 0; name[n] != '\0'; n++)
+	{
+		/* longer than any name that can be listed */
+		if (n == sizeof(folded) - 1)
+			return false;
+		folded[n] = PATTERN_FOLD(name[n]);
+	}
+	folded[n] = '\0';
+	end = n;
+
+	if (pat->nsegs == 0)
+		return !pat->anchored_start || n == 0;
+
+	if (pat->anchored_start)
+	{
+		if (seg->len > n || !_segment_at(pat, seg, folded))
+			return false;
+		pos = seg->len;
+		seg++;
+		/* no stars at all: it has to be the whole name */
+		if (pat->nsegs == 1 && pat->anchored_end)
+			return pos == n;
+	}
+
+	if (pat->anchored_end && seg < endseg)
+	{
+		endseg--;
+		end = n - endseg->len;
+		if (end < pos || !_segment_at(pat, endseg, folded + end))
+			return false;
+	}
+
+	for (; seg < endseg; seg++)
+	{
+		if ((at = _segment_find(pat, seg, folded, pos, end)) < 0)
+			return false;
+		pos = at + seg->len;
+	}
+	return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _TNFS_PATTERN_H
+#define _TNFS_PATTERN_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Case insensitive wildcard matching of directory entry names
+ *
+ * */
+
+#include <stdbool.h>
+
+/* Case folding as matching does it. ASCII only, as tolower() is in the
+ * C locale the server runs in, which also keeps names the same length. */
+#define PATTERN_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+/* '?' doesn't match a '.' (the TNFS_DIR_EXT wildcard rules) */
+#define PATTERN_QMARK_NOT_DOT 0x01
+
+typedef struct _tnfs_pattern tnfs_pattern;
+
+/* Compile a pattern of literals, '*' and '?' for matching any number of
+ * names. Returns NULL if out of memory. */
+tnfs_pattern *pattern_compile(const char *pattern, int flags);
+void pattern_free(tnfs_pattern *pat);
+
+/* Whether name matches the compiled pattern */
+bool pattern_match(const tnfs_pattern *pat, const char *name);
+
+#endif
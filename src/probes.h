@@ -0,0 +1,56 @@
+#ifndef _TNFS_PROBES_H
+#define _TNFS_PROBES_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Static tracepoints of the tnfsd provider, built in with make USDT=yes
+ * (ENABLE_USDT), for bpftrace, perf or SystemTap. Without it they're
+ * nothing at all, and their arguments aren't evaluated.
+ *
+ *   request(sid, seqno, cmd, bytes, ipaddr)	a request has been received
+ *   command__start(sid, seqno, cmd)		it's about to be carried out
+ *   command__done(sid, seqno, cmd, status, usec, name)
+ *   reply(sid, seqno, cmd, status, bytes)	a reply has been sent
+ *   resend(sid, seqno, bytes)			the last one was sent again
+ *   session__alloc(sid, index)
+ *   session__free(sid, index)
+ *   dirload__start(path)			a directory is being listed
+ *   dirload__done(path, entries, errno)
+ *
+ * */
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TNFS_PROBE1(name, a) DTRACE_PROBE1(tnfsd, name, a)
+#define TNFS_PROBE2(name, a, b) DTRACE_PROBE2(tnfsd, name, a, b)
+#define TNFS_PROBE3(name, a, b, c) DTRACE_PROBE3(tnfsd, name, a, b, c)
+#define TNFS_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(tnfsd, name, a, b, c, d, e)
+#define TNFS_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(tnfsd, name, a, b, c, d, e, f)
+#else
+#define TNFS_PROBE1(name, a) do { } while (0)
+#define TNFS_PROBE2(name, a, b) do { } while (0)
+#define TNFS_PROBE3(name, a, b, c) do { } while (0)
+#define TNFS_PROBE5(name, a, b, c, d, e) do { } while (0)
+#define TNFS_PROBE6(name, a, b, c, d, e, f) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,582 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Filename index of the served tree for SEARCH.
+ *
+ * Every entry under the root is kept in memory with its path, and each
+ * case folded three character run of its name points back at it, in a
+ * table sorted by trigram. A query's literal part is looked up by its
+ * rarest trigram and only those entries are matched in full.
+ *
+ * The tree is read breadth first from the main loop, SEARCH_BUILD_SLICE
+ * directories at a time, into a second index that replaces the one
+ * being searched when it's complete. Changes made through the server
+ * are applied straight away: entries that went are marked removed and
+ * new ones are appended past the trigram table, where they're matched
+ * one by one until the next rebuild takes them in.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "search.h"
+#include "directory.h"
+#include "fileinfo.h"
+#include "pattern.h"
+#include "vfs.h"
+#include "bsdcompat.h"
+#include "log.h"
+
+#define TRIGRAM(p) ((uint32_t)(uint8_t)PATTERN_FOLD((p)[0]) << 16 | \
+					(uint32_t)(uint8_t)PATTERN_FOLD((p)[1]) << 8 | (uint8_t)PATTERN_FOLD((p)[2]))
+
+/* entry flags beyond the FILEINFOFLAG_* ones */
+#define SEARCH_NODESCEND 0x40		/* a symlink to a directory */
+#define SEARCH_REMOVED 0x80
+
+typedef struct _search_entry
+{
+	uint32_t path;			/* relative to the root, in the pool */
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint16_t name;			/* offset of the last component of the path */
+	uint8_t flags;
+} search_entry;
+
+typedef struct _search_posting
+{
+	uint32_t gram;
+	uint32_t id;
+} search_posting;
+
+typedef struct _search_index
+{
+	search_entry *entries;
+	uint32_t count, cap;
+	char *pool;
+	uint32_t poolsz, poolcap;
+	search_posting *postings;	/* by trigram, then entry */
+	uint32_t npostings;
+	uint32_t indexed;		/* entries past this aren't in the postings */
+	uint32_t *slots;		/* entry + 1 by hash of its path, 0 if free */
+	uint32_t nslots;
+} search_index;
+
+static char sroot[MAX_FILEPATH];	/* root as paths are built, no trailing slash */
+static search_index live;		/* what's searched */
+static search_index building;		/* being read from the tree */
+static bool enabled;			/* search_init() was called */
+static bool ready;			/* live has been built */
+static bool build_active;
+static bool build_again;		/* things changed behind the build */
+static uint32_t build_cursor;		/* next entry of building to read, if a directory */
+
+static void _index_free(search_index *ix)
+{
+	free(ix->entries);
+	free(ix->pool);
+	free(ix->postings);
+	free(ix->slots);
+	memset(ix, 0, sizeof(search_index));
+}
+
+static uint32_t _hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	while (*s)
+		h = (h ^ (uint8_t)*s++) * 16777619u;
+	return h;
+}
+
+static void _slot_insert(search_index *ix, uint32_t id)
+{
+	uint32_t mask = ix->nslots - 1;
+	uint32_t i = _hash(ix->pool + ix->entries[id].path) & mask;
+	while (ix->slots[i] != 0)
+		i = (i + 1) & mask;
+	ix->slots[i] = id + 1;
+}
+
+/* Keeps the path table under half full. Returns errno on failure. */
+static int _slots_grow(search_index *ix)
+{
+	uint32_t nslots = ix->nslots ? ix->nslots * 2 : 1024;
+	uint32_t *slots;
+
+	if ((slots = calloc(nslots, sizeof(uint32_t))) == NULL)
+		return ENOMEM;
+	free(ix->slots);
+	ix->slots = slots;
+	ix->nslots = nslots;
+	for (uint32_t id = 0; id < ix->count; id++)
+		_slot_insert(ix, id);
+	return 0;
+}
+
+/* Index of the entry at the relative path that hasn't been removed, or -1 */
+static int64_t _lookup(const search_index *ix, const char *rel)
+{
+	uint32_t mask = ix->nslots - 1;
+	uint32_t i;
+
+	if (ix->nslots == 0)
+		return -1;
+	for (i = _hash(rel) & mask; ix->slots[i] != 0; i = (i + 1) & mask)
+	{
+		const search_entry *e = &ix->entries[ix->slots[i] - 1];
+		if (!(e->flags & SEARCH_REMOVED) && strcmp(ix->pool + e->path, rel) == 0)
+			return ix->slots[i] - 1;
+	}
+	return -1;
+}
+
+/* Adds the entry at the relative path. Returns errno on failure. */
+static int _add_entry(search_index *ix, const char *rel, const struct stat *st, bool symlink)
+{
+	uint32_t len = strlen(rel) + 1;
+	const char *name;
+	search_entry *e;
+
+	if (ix->count == ix->cap)
+	{
+		uint32_t cap = ix->cap ? ix->cap * 2 : 1024;
+		search_entry *entries = realloc(ix->entries, cap * sizeof(search_entry));
+		if (entries == NULL)
+			return ENOMEM;
+		ix->entries = entries;
+		ix->cap = cap;
+	}
+	if (ix->poolsz + len > ix->poolcap)
+	{
+		uint32_t cap = ix->poolcap ? ix->poolcap : 65536;
+		while (ix->poolsz + len > cap)
+			cap *= 2;
+		char *pool = realloc(ix->pool, cap);
+		if (pool == NULL)
+			return ENOMEM;
+		ix->pool = pool;
+		ix->poolcap = cap;
+	}
+	if ((ix->count + 1) * 2 > ix->nslots && _slots_grow(ix) != 0)
+		return ENOMEM;
+
+	e = &ix->entries[ix->count];
+	memcpy(ix->pool + ix->poolsz, rel, len);
+	e->path = ix->poolsz;
+	ix->poolsz += len;
+	name = strrchr(rel, '/');
+	e->name = name ? name + 1 - rel : 0;
+
+	e->flags = fileinfo_flags(rel + e->name, st->st_mode) | (symlink ? SEARCH_NODESCEND : 0);
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->ctime = st->st_ctime;
+
+	_slot_insert(ix, ix->count++);
+	return 0;
+}
+
+/* Adds the entries of the directory at rel. Returns errno on failure. */
+static int _read_dir(search_index *ix, const char *rel)
+{
+	char path[MAX_FILEPATH];
+	char child[MAX_FILEPATH];
+	const char *name;
+	struct stat st;
+	vfs_dir *dp;
+	int err = 0;
+
+	join_path(sroot, rel, path, sizeof(path));
+	if ((dp = vfs->opendir(path)) == NULL)
+		return 0;
+	while (err == 0 && (name = vfs->readdir(dp)) != NULL)
+	{
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", name) >= MAX_TNFSPATH)
+			continue;
+		join_path(sroot, child, path, sizeof(path));
+		if (vfs->stat(path, &st) != 0)
+			continue;
+		err = _add_entry(ix, child, &st, fileinfo_dirlink(path, &st));
+	}
+	vfs->closedir(dp);
+	return err;
+}
+
+static void _radix_pass(const search_posting *src, search_posting *dst, uint32_t n, int shift)
+{
+	uint32_t counts[4097];
+
+	memset(counts, 0, sizeof(counts));
+	for (uint32_t i = 0; i < n; i++)
+		counts[((src[i].gram >> shift) & 0xfff) + 1]++;
+	for (int b = 1; b <= 4096; b++)
+		counts[b] += counts[b - 1];
+	for (uint32_t i = 0; i < n; i++)
+		dst[counts[(src[i].gram >> shift) & 0xfff]++] = src[i];
+}
+
+/* Builds the trigram table over every entry. Returns errno on failure. */
+static int _index_postings(search_index *ix)
+{
+	search_posting *postings, *sorted;
+	uint32_t grams[MAX_FILENAME_LEN];
+	uint32_t n = 0, cap = ix->count * 8 + 64;
+
+	if ((postings = malloc(cap * sizeof(search_posting))) == NULL)
+		return ENOMEM;
+	for (uint32_t id = 0; id < ix->count; id++)
+	{
+		const char *name = ix->pool + ix->entries[id].path + ix->entries[id].name;
+		int len = strlen(name), k = 0;
+
+		/* each trigram once per name */
+		for (int i = 0; i + 3 <= len && k < MAX_FILENAME_LEN; i++)
+		{
+			uint32_t g = TRIGRAM(name + i);
+			int j;
+			for (j = 0; j < k && grams[j] != g; j++)
+				;
+			if (j == k)
+				grams[k++] = g;
+		}
+		if (n + k > cap)
+		{
+			while (n + k > cap)
+				cap *= 2;
+			search_posting *grown = realloc(postings, cap * sizeof(search_posting));
+			if (grown == NULL)
+			{
+				free(postings);
+				return ENOMEM;
+			}
+			postings = grown;
+		}
+		for (int j = 0; j < k; j++)
+		{
+			postings[n].gram = grams[j];
+			postings[n++].id = id;
+		}
+	}
+
+	/* two stable passes of 12 bits keep each trigram's entries in order */
+	if ((sorted = malloc((n ? n : 1) * sizeof(search_posting))) == NULL)
+	{
+		free(postings);
+		return ENOMEM;
+	}
+	_radix_pass(postings, sorted, n, 0);
+	_radix_pass(sorted, postings, n, 12);
+	free(sorted);
+
+	free(ix->postings);
+	ix->postings = postings;
+	ix->npostings = n;
+	ix->indexed = ix->count;
+	return 0;
+}
+
+/* The first posting for the trigram, and how many there are */
+static uint32_t _postings_for(const search_index *ix, uint32_t gram, uint32_t *count)
+{
+	uint32_t lo = 0, hi = ix->npostings, first;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (ix->postings[mid].gram < gram)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	hi = ix->npostings;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (ix->postings[mid].gram <= gram)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*count = lo - first;
+	return first;
+}
+
+static void _start_build()
+{
+	int err;
+
+	_index_free(&building);
+	build_active = true;
+	build_again = false;
+	build_cursor = 0;
+	if ((err = _read_dir(&building, "")) != 0)
+	{
+		LOG("Unable to index %s for searching: %s\n", sroot, strerror(err));
+		_index_free(&building);
+		build_active = false;
+	}
+}
+
+void search_init(const char *rootdir)
+{
+	enabled = true;
+	strlcpy(sroot, rootdir, sizeof(sroot));
+	for (int len = strlen(sroot); len > 0 && sroot[len - 1] == '/'; len--)
+		sroot[len - 1] = '\0';
+	_start_build();
+}
+
+bool search_building()
+{
+	return build_active;
+}
+
+void search_build_slice()
+{
+	int dirs = 0, err = 0;
+
+	while (build_active && build_cursor < building.count && dirs < SEARCH_BUILD_SLICE && err == 0)
+	{
+		const search_entry *e = &building.entries[build_cursor++];
+		if ((e->flags & FILEINFOFLAG_DIRECTORY) && !(e->flags & SEARCH_NODESCEND))
+		{
+			char rel[MAX_FILEPATH];
+			/* the pool can move as the directory is read */
+			strlcpy(rel, building.pool + e->path, sizeof(rel));
+			err = _read_dir(&building, rel);
+			dirs++;
+		}
+	}
+	if (!build_active || (err == 0 && build_cursor < building.count))
+		return;
+
+	if (err == 0)
+		err = _index_postings(&building);
+	if (err != 0)
+	{
+		LOG("Unable to index %s for searching: %s\n", sroot, strerror(err));
+		_index_free(&building);
+		build_active = false;
+		return;
+	}
+
+	_index_free(&live);
+	live = building;
+	memset(&building, 0, sizeof(search_index));
+	ready = true;
+	build_active = false;
+	LOG("Search index built: %u entries\n", live.count);
+
+	if (build_again)
+		_start_build();
+}
+
+void search_changed(const char *path)
+{
+	char rel[MAX_FILEPATH];
+	char full[MAX_FILEPATH];
+	struct stat st;
+	bool rebuild = false;
+	int64_t id;
+
+	if (relative_path(sroot, path, rel, sizeof(rel)) < 0 || rel[0] == '\0')
+		return;
+	if (build_active)
+		build_again = true;
+	if (!ready)
+		return;
+
+	if ((id = _lookup(&live, rel)) >= 0)
+	{
+		search_entry *e = &live.entries[id];
+		e->flags |= SEARCH_REMOVED;
+		/* a directory takes everything below it along */
+		if (e->flags & FILEINFOFLAG_DIRECTORY)
+		{
+			size_t len = strlen(rel);
+			for (uint32_t i = 0; i < live.count; i++)
+			{
+				const char *p = live.pool + live.entries[i].path;
+				if (strncmp(p, rel, len) == 0 && p[len] == '/')
+					live.entries[i].flags |= SEARCH_REMOVED;
+			}
+		}
+	}
+
+	join_path(sroot, rel, full, sizeof(full));
+	if (vfs->stat(full, &st) == 0)
+	{
+		if (_add_entry(&live, rel, &st, false) != 0)
+			rebuild = true;
+		/* a directory moved here brings its contents, which only a
+		   rebuild can find */
+		if (S_ISDIR(st.st_mode))
+		{
+			vfs_dir *dp = vfs->opendir(full);
+			const char *name;
+			while (dp != NULL && (name = vfs->readdir(dp)) != NULL)
+			{
+				if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+				{
+					rebuild = true;
+					break;
+				}
+			}
+			if (dp != NULL)
+				vfs->closedir(dp);
+		}
+	}
+	if (live.count - live.indexed > SEARCH_MAX_PENDING)
+		rebuild = true;
+
+	if (rebuild && !build_active)
+		_start_build();
+}
+
+/* A search being carried out */
+struct _searchrun
+{
+	const char *scope;		/* relative path of the directory searched */
+	size_t scopelen;
+	const tnfs_pattern *pattern;
+	uint8_t diropts;
+	uint16_t maxresults;
+	dir_listing *list;
+	int err;
+};
+
+/* Adds the entry to the results if it matches. Returns false once
+ * there's no room for more. */
+static bool _consider(struct _searchrun *run, uint32_t id)
+{
+	const search_entry *e = &live.entries[id];
+	const char *path = live.pool + e->path;
+	fileinfo_t finf;
+
+	if (e->flags & SEARCH_REMOVED)
+		return true;
+	if (run->scopelen > 0 &&
+		(strncmp(path, run->scope, run->scopelen) != 0 || path[run->scopelen] != '/'))
+		return true;
+	if (!(run->diropts & TNFS_DIROPT_NO_SKIPHIDDEN) && (e->flags & FILEINFOFLAG_HIDDEN))
+		return true;
+	if (!pattern_match(run->pattern, path + e->name))
+		return true;
+
+	finf.flags = e->flags & (FILEINFOFLAG_DIRECTORY | FILEINFOFLAG_HIDDEN | FILEINFOFLAG_SPECIAL);
+	finf.size = e->size;
+	finf.m_time = e->mtime;
+	finf.c_time = e->ctime;
+	if ((run->err = dirlist_add(run->list, path + (run->scopelen ? run->scopelen + 1 : 0), &finf)) != 0)
+		return false;
+	return run->list->count < run->maxresults;
+}
+
+int search_find(const char *path, const char *query, uint8_t diropts,
+				uint16_t maxresults, dir_listing *list)
+{
+	char scope[MAX_FILEPATH];
+	char wildcard[MAX_FILENAME_LEN + 3];
+	tnfs_pattern *pat;
+	struct _searchrun run;
+	const char *literal = NULL;
+	int literallen = 0;
+
+	if (!enabled)
+		return ENOSYS;
+	if (!ready)
+		return EAGAIN;
+	if (relative_path(sroot, path, scope, sizeof(scope)) < 0)
+		return ENOENT;
+
+	/* a plain query is looked for anywhere in the name */
+	if (strpbrk(query, "*?") == NULL)
+	{
+		snprintf(wildcard, sizeof(wildcard), "*%s*", query);
+		pat = pattern_compile(wildcard, 0);
+	}
+	else
+	{
+		pat = pattern_compile(query, 0);
+	}
+	if (pat == NULL)
+		return ENOMEM;
+
+	/* the longest run of literals narrows down the entries to match */
+	for (const char *p = query; *p;)
+	{
+		int len = strcspn(p, "*?");
+		if (len > literallen)
+		{
+			literal = p;
+			literallen = len;
+		}
+		p += len;
+		if (*p)
+			p++;
+	}
+
+	run.scope = scope;
+	run.scopelen = strlen(scope);
+	run.pattern = pat;
+	run.diropts = diropts;
+	run.maxresults = (maxresults == 0 || maxresults > SEARCH_MAX_RESULTS) ? SEARCH_MAX_RESULTS : maxresults;
+	run.list = list;
+	run.err = 0;
+
+	bool more = true;
+	if (literallen >= 3)
+	{
+		/* the rarest trigram of the literal */
+		uint32_t first = 0, count = UINT32_MAX;
+		for (int i = 0; i + 3 <= literallen; i++)
+		{
+			uint32_t c, f = _postings_for(&live, TRIGRAM(literal + i), &c);
+			if (c < count)
+			{
+				first = f;
+				count = c;
+			}
+		}
+		for (uint32_t i = 0; i < count && more; i++)
+			more = _consider(&run, live.postings[first + i].id);
+	}
+	else
+	{
+		for (uint32_t id = 0; id < live.indexed && more; id++)
+			more = _consider(&run, id);
+	}
+	/* and whatever changed since the index was built */
+	for (uint32_t id = live.indexed; id < live.count && more; id++)
+		more = _consider(&run, id);
+
+	pattern_free(pat);
+	return run.err;
+}
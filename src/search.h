@@ -0,0 +1,52 @@
+#ifndef _TNFS_SEARCH_H
+#define _TNFS_SEARCH_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Filename index of the served tree for SEARCH
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tnfs.h"
+
+/* Start indexing the tree at rootdir. Until it's called, SEARCH isn't
+ * served. */
+void search_init(const char *rootdir);
+
+/* Whether the index is being built; search_build_slice() reads a few
+ * more directories of it */
+bool search_building();
+void search_build_slice();
+
+/* Note that path was created, removed or changed */
+void search_changed(const char *path);
+
+/* Adds the entries below the directory at path whose names match query
+ * to list, named relative to path. A query without wildcards matches any
+ * name containing it. Returns errno on failure, otherwise zero; EAGAIN
+ * until the index has been built, and ENOSYS if the tree isn't indexed. */
+int search_find(const char *path, const char *query, uint8_t diropts,
+				uint16_t maxresults, dir_listing *list);
+
+#endif
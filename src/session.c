@@ -38,17 +38,21 @@
 #include "directory.h"
 #include "datagram.h"
 #include "errortable.h"
+#include "tnfs_file.h"
 #include "bsdcompat.h"
+#include "settings.h"
+#include "probes.h"
 
-/* List of sessions */
-Session *slist[MAX_SESSIONS];
+/* List of sessions, grown as they're needed */
+Session **slist = NULL;
+int slist_size = 0;
 char *DEFAULT_ROOT = "/";
 
 void tnfs_init()
 {
-	int i;
-	for (i = 0; i < MAX_SESSIONS; i++)
-		slist[i] = NULL;
+	free(slist);
+	slist = NULL;
+	slist_size = 0;
 
 #ifdef BSD
 	/* initialize prng */
@@ -56,6 +60,25 @@ void tnfs_init()
 #endif
 }
 
+/* Clients that want more than one request in flight over UDP append
+ * the window size they'd like after the password. Returns 0 if the
+ * client didn't ask for one. */
+static uint8_t _requested_window(unsigned char *buf, int bufsz)
+{
+	unsigned char *p = buf + 2;
+	unsigned char *end = buf + bufsz;
+	unsigned char *nul;
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (p >= end || (nul = memchr(p, 0, end - p)) == NULL)
+			return 0;
+		p = nul + 1;
+	}
+	return (end - p == 1) ? *p : 0;
+}
+
 /* TODO: This is the "simple" TNFS server that won't do authentication.
  * So it ignores the user/pass fields of the tnfs_mount request. It is
  * intended at some stage that there is a server that can use the underlying
@@ -68,18 +91,20 @@ int tnfs_mount(Header *hdr, unsigned char *buf, int bufsz)
 	int mplen;
 	int sindex;
 	Session *s;
-	unsigned char repbuf[4];
+	unsigned char repbuf[5];
+	int repsz = 4;
 	char *cliroot;
 	uint16_t recycledSid = 0;
+	uint8_t window;
 
 #ifdef DEBUG
 	TNFSMSGLOG(hdr, "TNFS_MOUNT");
 #endif
 	/* Mount packet looks like:
-	 * Header + mountpoint + user + pass.
-	 * Check that there is at least one null terminator so we
+	 * Header + version + mountpoint + user + pass (+ window).
+	 * Check that the mount point has a null terminator so we
 	 * won't create an invalid string ever*/
-	if (*(buf + bufsz - 1) != 0)
+	if (bufsz < 3 || memchr(buf + 2, 0, bufsz - 2) == NULL)
 	{
 		TNFSMSGLOG(hdr, "Unterminated MOUNT operation");
 		return -1;
@@ -130,19 +155,43 @@ int tnfs_mount(Header *hdr, unsigned char *buf, int bufsz)
 	repbuf[2] = TIMEOUT_LSB;
 	repbuf[3] = TIMEOUT_MSB;
 
+	/* windowed mode only makes sense over UDP; TCP connections
+	 * already carry out pipelined requests in order, and a MOUNT is
+	 * framed there without the window byte, so it never gets here */
+	if ((window = _requested_window(buf, bufsz)) > 0)
+	{
+		if (window > MAX_WINDOW)
+			window = MAX_WINDOW;
+		/* the reply slots are picked by seqno % size, so the size
+		 * has to divide 256 for them to line up at the wrap */
+		while (window & (window - 1))
+			window &= window - 1;
+		if (window > 1)
+		{
+			if ((s->window = calloc(1, sizeof(tnfs_window))) != NULL)
+			{
+				s->window->size = window;
+				s->window->nextseqno = hdr->seqno + 1;
+			}
+			else
+			{
+				window = 1;
+			}
+		}
+		repbuf[4] = window;
+		repsz = 5;
+	}
+
 	/* verify that the root path is valid */
 	if (validate_dir(s, "") == 0)
 	{
 		/* all OK - send a response */
 		hdr->status = 0;
 		hdr->sid = s->sid;
-		tnfs_send(s, hdr, repbuf, 4);
+		tnfs_send(s, hdr, repbuf, repsz);
 #ifdef DEBUG
-		TNFSMSGLOG(hdr, "Mounted %s OK, SID=%x", s->root, s->sid);
-#endif
-#ifdef USAGELOG
-		USGLOG(hdr, "Session started at: %s", s->root);
-		s->lastpath[0] = 0;
+		TNFSMSGLOG(hdr, "Mounted %s OK, SID=%x, window=%d", s->root, s->sid,
+			s->window ? s->window->size : 1);
 #endif
 	}
 	else
@@ -168,9 +217,6 @@ void tnfs_umount(Header *hdr, Session *s, int sindex)
 {
 #ifdef DEBUG
 	TNFSMSGLOG(hdr, "Unmounting");
-#endif
-#ifdef USAGELOG
-	USGLOG(hdr, "Unmounting session");
 #endif
 	/* the response must be sent before we deallocate the
 	 * session */
@@ -180,43 +226,86 @@ void tnfs_umount(Header *hdr, Session *s, int sindex)
 	tnfs_freesession(s, sindex);
 }
 
+/* Makes room for more sessions, up to settings.max_sessions */
+static int _grow_slist()
+{
+	int size = slist_size ? slist_size * 2 : 16;
+	Session **grown;
+
+	if (slist_size >= settings.max_sessions)
+		return -1;
+	if (size > settings.max_sessions)
+		size = settings.max_sessions;
+	if ((grown = realloc(slist, size * sizeof(Session *))) == NULL)
+		return -1;
+	memset(grown + slist_size, 0, (size - slist_size) * sizeof(Session *));
+	slist = grown;
+	slist_size = size;
+	return 0;
+}
+
+static Session *_newsession()
+{
+	Session *s = calloc(1, sizeof(Session));
+
+	if (s == NULL)
+		return NULL;
+	s->fd = calloc(settings.max_fd_per_conn, sizeof(int));
+	s->fdpath = calloc(settings.max_fd_per_conn, sizeof(char *));
+	s->dhandles = calloc(settings.max_dhnd_per_conn, sizeof(dir_handle));
+	if (s->fd == NULL || s->fdpath == NULL || s->dhandles == NULL)
+	{
+		free(s->fd);
+		free(s->fdpath);
+		free(s->dhandles);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
 /* Create a new session */
 Session *tnfs_allocsession(int *sindex, uint16_t withSid)
 {
 	Session *s;
 
 	LOG("Allocating new session for 0x%02x\n", withSid);
-	for (*sindex = 0; (*sindex) < MAX_SESSIONS; (*sindex)++)
+	for (*sindex = 0; (*sindex) < slist_size; (*sindex)++)
 	{
 		if (slist[*sindex] == NULL)
+			break;
+	}
+
+	/* reached settings.max_sessions */
+	if (*sindex == slist_size && _grow_slist() < 0)
+		return NULL;
+
+	/* free session entry has been found */
+	s = _newsession();
+	if (s)
+	{
+		if (withSid > 0)
+		{
+			s->sid = withSid;
+		}
+		else
 		{
-			/* free session entry has been found */
-			s = (Session *)malloc(sizeof(Session));
-			if (s)
+			s->sid = tnfs_newsid();
+			if (s->sid == 0)
 			{
-				memset(s, 0, sizeof(Session));
-				if (withSid > 0)
-				{
-					s->sid = withSid;
-				}
-				else
-				{
-					s->sid = tnfs_newsid();
-					if (s->sid == 0)
-					{
-						LOG("Can't allocate session");
-						return NULL;
-					}
-				}
-				LOG("Allocated new session for 0x%02x\n", s->sid);
-				slist[*sindex] = s;
+				LOG("Can't allocate session");
+				free(s->fd);
+				free(s->fdpath);
+				free(s->dhandles);
+				free(s);
+				return NULL;
 			}
-			return s;
 		}
+		LOG("Allocated new session for 0x%02x\n", s->sid);
+		TNFS_PROBE2(session__alloc, s->sid, *sindex);
+		slist[*sindex] = s;
 	}
-
-	/* reached MAX_CLIENTS */
-	return NULL;
+	return s;
 }
 
 /* Free a session */
@@ -224,22 +313,25 @@ void tnfs_freesession(Session *s, int sindex)
 {
 	LOG("Freeing session ID index %d\n", sindex);	
 	int i;
+	TNFS_PROBE2(session__free, s->sid, sindex);
 	if (s->root)
 		free(s->root);
+	if (s->window)
+		free(s->window);
+	tnfs_stream_stop(s);
 
 	/* close open fds, directories etc. */
-	for (i = 0; i < MAX_FD_PER_CONN; i++)
+	for (i = 0; i < settings.max_fd_per_conn; i++)
 	{
 		if (s->fd[i])
-			close(s->fd[i]);
-	}
-	for (i = 0; i < MAX_DHND_PER_CONN; i++)
-	{
-		if (s->dhandles[i].handle)
-			closedir(s->dhandles[i].handle);
-		dirlist_free(s->dhandles[i].entry_list);
-		s->dhandles[i].entry_count = 0;
+			file_close(s->fd[i]);
+		free(s->fdpath[i]);
 	}
+	for (i = 0; i < settings.max_dhnd_per_conn; i++)
+		dirhandle_close(&s->dhandles[i]);
+	free(s->fd);
+	free(s->fdpath);
+	free(s->dhandles);
 	free(s);
 	slist[sindex] = NULL;
 }
@@ -249,7 +341,7 @@ Session *tnfs_findsession_sid(uint16_t sid, int *sindex)
 {
 	int i;
 	Session *s;
-	for (i = 0; i < MAX_SESSIONS; i++)
+	for (i = 0; i < slist_size; i++)
 	{
 		if (slist[i])
 		{
@@ -289,15 +381,15 @@ Session *tnfs_findsession_ipaddr(in_addr_t ipaddr, int *sindex)
 
 	currenttime = time(NULL);
 
-	for (i = 0; i < MAX_SESSIONS; i++)
+	for (i = 0; i < slist_size; i++)
 	{
 		if (slist[i])
 		{
 			s = slist[i];
 
 			/* Remove expired sessions while we're looking at them all */
-			if(SESSION_TIMEOUT > 0 &&
-				(currenttime - s->last_contact >= SESSION_TIMEOUT) &&
+			if(settings.session_timeout > 0 &&
+				(currenttime - s->last_contact >= settings.session_timeout) &&
 				s->cli_fd == 0)
 			{
 				LOG("Deleting expired session 0x%02x\n", s->sid);
@@ -308,9 +400,9 @@ Session *tnfs_findsession_ipaddr(in_addr_t ipaddr, int *sindex)
 			if (s->ipaddr == ipaddr)
 			{
 				// If we've reached the max for this IP, return the first match
-				if ((count + 1) >= MAX_SESSIONS_PER_IP)
+				if ((count + 1) >= settings.max_sessions_per_ip)
 				{
-					LOG("Found we already %d sessions for this IP - returning oldest entry\n", MAX_SESSIONS_PER_IP);
+					LOG("Found we already %d sessions for this IP - returning oldest entry\n", settings.max_sessions_per_ip);
 					*sindex = first_match_idx;
 					return first_match_sess;
 				}
@@ -331,7 +423,7 @@ void tnfs_reset_cli_fd_in_sessions(int cli_fd)
 	int i;
 	Session *s;
 
-	for (i = 0; i < MAX_SESSIONS; i++)
+	for (i = 0; i < slist_size; i++)
 	{
 		if (slist[i])
 		{
@@ -340,6 +432,7 @@ void tnfs_reset_cli_fd_in_sessions(int cli_fd)
 			{
 				LOG("Removing TCP connection handle from session 0x%02x\n", s->sid);
 				s->cli_fd = 0;
+				tnfs_stream_stop(s);
 			}
 		}
 	}
@@ -359,7 +452,8 @@ uint16_t tnfs_newsid()
 #else
 		newsid = rand() & 0xFFFF;
 #endif
-		if (!tnfs_findsession_sid(newsid, &sindex))
+		/* 0 is no session at all */
+		if (newsid != 0 && !tnfs_findsession_sid(newsid, &sindex))
 			return newsid;
 	}
 	LOG("Tried to find a new SID 256 times. (Broken PRNG)");
@@ -369,7 +463,7 @@ uint16_t tnfs_newsid()
 uint16_t tnfs_session_count()
 {
 	uint16_t count = 0;
-	for (uint16_t i = 0; i < MAX_SESSIONS; i++)
+	for (int i = 0; i < slist_size; i++)
 	{
 		if (slist[i])
 		{
@@ -30,6 +30,11 @@
 
 #include "tnfs.h"
 
+/* List of sessions, grown up to settings.max_sessions; slots not in
+ * use are NULL */
+extern Session **slist;
+extern int slist_size;
+
 /* Initialize TNFS */
 void tnfs_init();
 
@@ -0,0 +1,140 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Limits that can be set when the server starts, from the command line
+ * or a file, instead of being compiled in.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "settings.h"
+#include "log.h"
+
+tnfs_settings settings = {
+	MAX_SESSIONS,
+	MAX_SESSIONS_PER_IP,
+	MAX_TCP_CONN,
+	MAX_FD_PER_CONN,
+	MAX_DHND_PER_CONN,
+	SESSION_TIMEOUT,
+	CONN_TIMEOUT,
+	STATS_INTERVAL,
+	LOG_LEVEL,
+	ACCESS_LOG_SAMPLE,
+	ACCESS_LOG_ROTATE,
+	SLOW_REQUEST_MS,
+	CAPTURE_LIMIT,
+	MEMFS_LIMIT
+};
+
+static const struct
+{
+	const char *name;
+	int *value;
+	int min, max;
+} known[] = {
+	/* SIDs and the handles in requests limit these */
+	{"MAX_SESSIONS", &settings.max_sessions, 1, 65535},
+	{"MAX_SESSIONS_PER_IP", &settings.max_sessions_per_ip, 1, 65535},
+	{"MAX_TCP_CONN", &settings.max_tcp_conn, 1, 1000000},
+	{"MAX_FD_PER_CONN", &settings.max_fd_per_conn, 1, 255},
+	{"MAX_DHND_PER_CONN", &settings.max_dhnd_per_conn, 1, 255},
+	{"SESSION_TIMEOUT", &settings.session_timeout, 0, 1000000000},
+	{"CONN_TIMEOUT", &settings.conn_timeout, 0, 1000000000},
+	{"STATS_INTERVAL", &settings.stats_interval, 0, 1000000000},
+	{"LOG_LEVEL", &settings.log_level, LOGLEVEL_SERVER, LOGLEVEL_CLIENT},
+	{"ACCESS_LOG_SAMPLE", &settings.access_log_sample, 1, 1000000000},
+	{"ACCESS_LOG_ROTATE", &settings.access_log_rotate, 0, 1000000000},
+	{"SLOW_REQUEST_MS", &settings.slow_request_ms, 0, 1000000000},
+	{"CAPTURE_LIMIT", &settings.capture_limit, 0, 1000000},
+	{"MEMFS_LIMIT", &settings.memfs_limit, 0, 1000000},
+};
+
+int settings_set(const char *assignment)
+{
+	const char *eq = strchr(assignment, '=');
+	const char *name = assignment;
+	int namelen;
+	char *end;
+	long value;
+
+	if (eq == NULL)
+	{
+		fprintf(stderr, "Expected NAME=value: %s\n", assignment);
+		return -1;
+	}
+	while (isspace((unsigned char)*name))
+		name++;
+	for (namelen = eq - name; namelen > 0 && isspace((unsigned char)name[namelen - 1]); namelen--)
+		;
+	for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+	{
+		if (strlen(known[i].name) != (size_t)namelen || strncmp(known[i].name, name, namelen) != 0)
+			continue;
+		value = strtol(eq + 1, &end, 10);
+		while (isspace((unsigned char)*end))
+			end++;
+		if (end == eq + 1 || *end != '\0' || value < known[i].min || value > known[i].max)
+		{
+			fprintf(stderr, "%s must be a number from %d to %d\n", known[i].name, known[i].min, known[i].max);
+			return -1;
+		}
+		*known[i].value = (int)value;
+		return 0;
+	}
+	fprintf(stderr, "Unknown setting %.*s\n", namelen, name);
+	return -1;
+}
+
+int settings_load(const char *path)
+{
+	char line[256];
+	int lineno = 0, result = 0;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "Unable to read settings from %s\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char *p = line;
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (settings_set(p) < 0)
+		{
+			fprintf(stderr, "at line %d of %s\n", lineno, path);
+			result = -1;
+		}
+	}
+	fclose(f);
+	return result;
+}
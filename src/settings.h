@@ -0,0 +1,58 @@
+#ifndef _TNFS_SETTINGS_H
+#define _TNFS_SETTINGS_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Limits that can be set when the server starts
+ *
+ * */
+
+/* The defaults are the values in config.h */
+typedef struct _tnfs_settings
+{
+	int max_sessions;		/* MAX_SESSIONS */
+	int max_sessions_per_ip;	/* MAX_SESSIONS_PER_IP */
+	int max_tcp_conn;		/* MAX_TCP_CONN */
+	int max_fd_per_conn;		/* MAX_FD_PER_CONN */
+	int max_dhnd_per_conn;		/* MAX_DHND_PER_CONN */
+	int session_timeout;		/* SESSION_TIMEOUT */
+	int conn_timeout;		/* CONN_TIMEOUT */
+	int stats_interval;		/* STATS_INTERVAL */
+	int log_level;			/* LOG_LEVEL */
+	int access_log_sample;		/* ACCESS_LOG_SAMPLE */
+	int access_log_rotate;		/* ACCESS_LOG_ROTATE */
+	int slow_request_ms;		/* SLOW_REQUEST_MS */
+	int capture_limit;		/* CAPTURE_LIMIT */
+	int memfs_limit;		/* MEMFS_LIMIT */
+} tnfs_settings;
+
+extern tnfs_settings settings;
+
+/* Set one limit from NAME=value, named as in config.h. Returns -1 and
+ * says why on stderr if it can't be set. */
+int settings_set(const char *assignment);
+
+/* Set the limits given in a file of NAME=value lines. Blank lines and
+ * those starting with # are skipped. Returns -1 if the file can't be
+ * read or has a line that can't be set. */
+int settings_load(const char *path);
+
+#endif
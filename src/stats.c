@@ -1,23 +1,136 @@
 #include <time.h>
+#include <signal.h>
+#include <inttypes.h>
 
 #include "stats.h"
+#include "errortable.h"
+#include "filetable.h"
 
-void stats_report(TcpConnection *tcp_conn_list)
+server_stats stats;
+static volatile sig_atomic_t report_requested;
+
+static int _bucket(int64_t us)
 {
-    LOG("Stats | Sessions: %d. TCP connections: %d.\n",
-        tnfs_session_count(),
-        tcp_connections_count(tcp_conn_list));
+	int b = 0;
+
+	while (b < STATS_LATENCY_BUCKETS - 1 && ((int64_t)1 << b) <= us)
+		b++;
+	return b;
+}
+
+void stats_command(uint8_t cmd, int64_t latency_us)
+{
+	cmd_stats *cs = &stats.cmds[cmd];
+
+	if (latency_us < 0)
+		latency_us = 0;
+	cs->requests++;
+	cs->latency_us += latency_us;
+	cs->latency[_bucket(latency_us)]++;
+}
+
+void stats_reply(uint8_t cmd, uint8_t status, int bytes)
+{
+	stats.statuses[status]++;
+	if (status != TNFS_SUCCESS)
+		stats.cmds[cmd].errors++;
+	if (bytes > 0)
+		stats.bytes_out += bytes;
+}
+
+void stats_resend(int bytes)
+{
+	stats.resends++;
+	if (bytes > 0)
+		stats.bytes_out += bytes;
+}
+
+void stats_loop(int64_t busy_us)
+{
+	if (busy_us < 0)
+		busy_us = 0;
+	stats.loop_passes++;
+	stats.loop_busy_us += busy_us;
+	stats.loop_busy[_bucket(busy_us)]++;
+	if ((uint64_t)busy_us > stats.loop_busy_max)
+		stats.loop_busy_max = busy_us;
 }
 
-uint8_t tcp_connections_count(TcpConnection *tcp_conn_list)
+int64_t stats_percentile(const uint64_t *buckets, uint64_t count, double fraction)
 {
-	uint16_t count = 0;
-	for (uint16_t i = 0; i < MAX_TCP_CONN; i++)
+	uint64_t seen = 0;
+
+	for (int b = 0; b < STATS_LATENCY_BUCKETS - 1; b++)
 	{
-		if (tcp_conn_list[i].cli_fd)
-		{
-			count++;
-		}
+		seen += buckets[b];
+		if (seen > 0 && seen >= fraction * count)
+			return (int64_t)1 << b;
 	}
-	return count;
-}
\ No newline at end of file
+	return -1;
+}
+
+void stats_request_report()
+{
+	report_requested = 1;
+}
+
+bool stats_report_requested()
+{
+	return report_requested != 0;
+}
+
+/* A percentile for the report, beyond the last bucket taken as its edge */
+static int64_t _under(int64_t percentile)
+{
+	return percentile < 0 ? ((int64_t)1 << (STATS_LATENCY_BUCKETS - 1)) : percentile;
+}
+
+void stats_report()
+{
+	uint64_t requests = 0;
+
+	report_requested = 0;
+    LOG("Stats | Sessions: %d. TCP connections: %d. Shared files: %d open by %d descriptors.\n",
+        tnfs_session_count(),
+        tcp_connections_count(),
+        filetable_files(), filetable_handles());
+
+	for (int cmd = 0; cmd < 256; cmd++)
+		requests += stats.cmds[cmd].requests;
+	LOG("Stats | Requests: %" PRIu64 ". Bytes in: %" PRIu64 ", out: %" PRIu64 ". Retransmits: %" PRIu64 ".\n",
+		requests, stats.bytes_in, stats.bytes_out, stats.resends);
+	if (stats.loop_passes > 0)
+		LOG("Stats | Main loop: %" PRIu64 " passes, mean %" PRIu64 "us, p50 under %" PRId64
+			"us, p90 under %" PRId64 "us, p99 under %" PRId64 "us, longest %" PRIu64 "us.\n",
+			stats.loop_passes, stats.loop_busy_us / stats.loop_passes,
+			_under(stats_percentile(stats.loop_busy, stats.loop_passes, 0.5)),
+			_under(stats_percentile(stats.loop_busy, stats.loop_passes, 0.9)),
+			_under(stats_percentile(stats.loop_busy, stats.loop_passes, 0.99)),
+			stats.loop_busy_max);
+
+	for (int cmd = 0; cmd < 256; cmd++)
+	{
+		cmd_stats *cs = &stats.cmds[cmd];
+
+		if (cs->requests == 0)
+			continue;
+		LOG("Stats | %s: %" PRIu64 " requests (%" PRIu64 " since the last report), %" PRIu64
+			" errors, mean %" PRIu64 "us, p50 under %" PRId64 "us, p99 under %" PRId64 "us\n",
+			get_cmd_name(cmd), cs->requests, cs->requests - cs->reported, cs->errors,
+			cs->latency_us / cs->requests,
+			_under(stats_percentile(cs->latency, cs->requests, 0.5)),
+			_under(stats_percentile(cs->latency, cs->requests, 0.99)));
+		cs->reported = cs->requests;
+	}
+
+	for (int status = 1; status < 256; status++)
+	{
+		if (stats.statuses[status] > 0)
+			LOG("Stats | Replies with status 0x%02x: %" PRIu64 "\n", status, stats.statuses[status]);
+	}
+}
+
+int tcp_connections_count()
+{
+	return tcp_conn_count;
+}
@@ -1,13 +1,62 @@
 #ifndef _STATS_H
 #define _STATS_H
 
+#include <stdint.h>
+
 #include "config.h"
 #include "datagram.h"
 #include "log.h"
 #include "session.h"
 #include "tnfs.h"
 
-void stats_report(TcpConnection *tcp_conn_list);
-uint8_t tcp_connections_count(TcpConnection *tcp_conn_list);
+/* Requests for one command. Latencies are counted in buckets by the
+ * power of two of microseconds they fell under: bucket i holds those
+ * under 2^i us, and the last the rest. */
+typedef struct _cmd_stats
+{
+	uint64_t requests;
+	uint64_t errors;		/* replies with a status other than success */
+	uint64_t latency_us;		/* total */
+	uint64_t latency[STATS_LATENCY_BUCKETS];
+	uint64_t reported;		/* requests at the last report */
+} cmd_stats;
+
+typedef struct _server_stats
+{
+	cmd_stats cmds[256];		/* by command byte */
+	uint64_t statuses[256];		/* replies by TNFS status */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t resends;
+	uint64_t loop_passes;		/* of the main loop */
+	uint64_t loop_busy_us;		/* total time between waits for events */
+	uint64_t loop_busy[STATS_LATENCY_BUCKETS];
+	uint64_t loop_busy_max;
+} server_stats;
+
+extern server_stats stats;
+
+/* Account for a request carried out in latency_us microseconds */
+void stats_command(uint8_t cmd, int64_t latency_us);
+
+/* Account for a reply, or its retransmission, as it's sent */
+void stats_reply(uint8_t cmd, uint8_t status, int bytes);
+void stats_resend(int bytes);
+
+/* Account for a pass of the main loop that kept it from waiting for
+ * busy_us microseconds, which is as long as new requests may wait */
+void stats_loop(int64_t busy_us);
+
+/* The estimated time under which fraction of the count samples in
+ * buckets fell, in microseconds; -1 if beyond the last bucket */
+int64_t stats_percentile(const uint64_t *buckets, uint64_t count, double fraction);
+
+/* Ask for a report at the next pass of the main loop; safe to call
+ * from a signal handler */
+void stats_request_report();
+bool stats_report_requested();
+
+void stats_report();
+int tcp_connections_count();
 
 #endif
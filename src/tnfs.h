@@ -28,8 +28,10 @@
  * */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/types.h>
 
 #ifdef UNIX
 #include <arpa/inet.h>
@@ -38,6 +40,7 @@
 #ifdef WIN32
 #include <windows.h>
 #define WIN32_CHAR_P (char *)
+#define SHUT_RDWR SD_BOTH
 #else
 #define WIN32_CHAR_P
 #endif
@@ -65,6 +68,7 @@
 #define TNFS_SEEKDIR    0x16
 #define TNFS_OPENDIRX   0x17
 #define TNFS_READDIRX   0x18
+#define TNFS_SEARCH     0x19
 
 #define TNFS_OPENFILE_OLD 0x20
 #define	TNFS_READBLOCK	0x21
@@ -76,6 +80,10 @@
 #define TNFS_CHMODFILE	0x27
 #define TNFS_RENAMEFILE	0x28
 #define TNFS_OPENFILE	0x29
+#define TNFS_STREAMREAD	0x2A
+
+#define TNFS_SIZE	0x30
+#define TNFS_FREE	0x31
 
 /* command classes etc. */
 #define CLASS_SESSION	0x00
@@ -83,8 +91,8 @@
 #define CLASS_FILE	0x20
 
 #define NUM_SESSCMDS 2
-#define NUM_DIRCMDS	9
-#define NUM_FILECMDS 10
+#define NUM_DIRCMDS	10
+#define NUM_FILECMDS 11
 
 #define TNFS_DIRENTRY_DIR 0x01
 #define TNFS_DIRENTRY_HIDDEN 0x02
@@ -102,55 +110,109 @@ struct _dir_entry
 
 typedef struct _dir_entry directory_entry;
 
-struct _dir_entry_list_node
+/* A snapshot of a directory taken when it's opened, which READDIR and
+ * READDIRX both page through. Names are kept back to back in a pool
+ * rather than in fixed size buffers. */
+typedef struct _dir_listing_entry
 {
-	directory_entry entry;
-	struct _dir_entry_list_node *next;
-} __attribute__((packed));
-
-typedef struct _dir_entry_list_node directory_entry_list_node;
-typedef directory_entry_list_node * directory_entry_list;
+	uint8_t flags;
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint32_t name;			/* offset of the name in the pool */
+} dir_listing_entry;
+
+typedef struct _dir_listing
+{
+	dir_listing_entry *entries;
+	uint32_t count;
+	uint32_t capacity;
+	char *names;
+	uint32_t namesz;
+	uint32_t namecap;
+	uint32_t *order;		/* visiting order, NULL for the order of entries */
+} dir_listing;
 
 typedef struct _dir_handle
 {
-	DIR *handle;
+	bool in_use;
+	struct _vfs_dir *handle;	/* streamed by plain READDIR; NULL if listed */
 	char path[MAX_TNFSPATH];
-	uint16_t entry_count;
-	directory_entry_list entry_list;
-	directory_entry_list_node * current_entry;
+	dir_listing list;
+	uint32_t pos;			/* next entry of the listing to send */
+	uint8_t nameopts;		/* how names are cased when sent (TNFS_DIR_EXT) */
 } dir_handle;
 
+typedef struct _header
+{
+	uint16_t sid;			/* session id */
+	uint8_t seqno;			/* sequence number */
+	uint8_t cmd;			/* command */
+	uint8_t status;			/* command's status */
+	in_addr_t ipaddr;		/* client address */
+	uint16_t port;			/* client port address */
+	int cli_fd;				/* FD for the TCP connection */
+} Header;
+
+/* A STREAMREAD in progress. Chunks are sent from the main loop a burst
+ * at a time so that one large read doesn't hold up other clients. */
+typedef struct _stream
+{
+	Header hdr;			/* request the chunks are replies to */
+	uint8_t fdslot;			/* session's file descriptor being read */
+	uint32_t offset;		/* file offset of the next chunk */
+	uint32_t remaining;		/* bytes still to send */
+	bool active;
+} tnfs_stream;
+
+/* State for sessions that negotiated more than one request in flight
+ * over UDP. Requests are carried out in sequence number order; those
+ * arriving early wait in pending, and recent replies are kept so any
+ * of them can be retransmitted. Slots are indexed by seqno % size. */
+typedef struct _window
+{
+	uint8_t size;			/* number of requests allowed in flight */
+	uint8_t nextseqno;		/* sequence number to be carried out next */
+	struct
+	{
+		bool valid;
+		uint8_t seqno;
+		int msgsz;
+		unsigned char msg[MAXMSGSZ];
+	} reply[MAX_WINDOW];
+	struct
+	{
+		bool valid;
+		struct sockaddr_in cliaddr;
+		int rxbytes;
+		unsigned char rxbuf[MAXMSGSZ];
+	} pending[MAX_WINDOW];
+} tnfs_window;
+
 typedef struct _session
 {
 	time_t last_contact; /* timestamp of last received request */
 	uint16_t sid;			/* session ID */
 	in_addr_t ipaddr;		/* client addr */
 	uint8_t seqno;			/* last sequence number */
-	int fd[MAX_FD_PER_CONN];	/* file descriptors */
-	//DIR *dhnd[MAX_DHND_PER_CONN];	/* directory handles */
-	//char dpaths[MAX_DHND_PER_CONN][MAX_TNFSPATH]; /* directory path for each handle */
-	dir_handle dhandles[MAX_DHND_PER_CONN];
+	int *fd;			/* file descriptors, settings.max_fd_per_conn of them */
+	char **fdpath;			/* path last opened in each fd slot, for the log */
+	dir_handle *dhandles;		/* settings.max_dhnd_per_conn directory handles */
 	char *root;			/* requested root dir */
 	unsigned char lastmsg[MAXMSGSZ];/* last message sent */
-#ifdef USAGELOG
-	char lastpath[MAX_TNFSPATH];    /* last path visited */
-#endif
 	int lastmsgsz;			/* last message's size inc. hdr */
 	uint8_t lastseqno;		/* last sequence number */
+	struct
+	{
+		int fd;
+		off_t offset;
+		int size;		/* 0 unless the last message was a sendfile() READ */
+	} lastfile;			/* file data following lastmsg */
 	int cli_fd;				/* FD for the TCP connection */
+	tnfs_window *window;	/* NULL unless windowed mode was negotiated */
+	tnfs_stream stream;		/* STREAMREAD in progress */
 } Session;
 
-typedef struct _header
-{
-	uint16_t sid;			/* session id */
-	uint8_t seqno;			/* sequence number */
-	uint8_t cmd;			/* command */
-	uint8_t status;			/* command's status */
-	in_addr_t ipaddr;		/* client address */
-	uint16_t port;			/* client port address */
-	int cli_fd;				/* FD for the TCP connection */
-} Header;
-
 typedef	void(*tnfs_cmdfunc)(Header *hdr, Session *sess,
 				unsigned char *buf, int bufsz);
 
@@ -159,6 +221,9 @@ typedef struct _tcp_conn
 	struct sockaddr_in cliaddr;  /* client address */
 	int cli_fd;					 /* FD for the TCP connection */
 	time_t last_contact;         /* timestamp of last received request */
+	unsigned char *rxbuf;        /* requests received but not yet decoded */
+	int rxlen;                   /* number of bytes waiting in rxbuf */
+	int idle_prev, idle_next;    /* neighbours in the idle list by index, -1 at the ends */
 } TcpConnection;
 
 #endif
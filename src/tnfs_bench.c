@@ -0,0 +1,751 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Load generator for tnfsd. Runs a number of clients, each a thread with
+ * a session of its own over UDP or TCP, carrying out a weighted mix of
+ * operations for a while and reporting the throughput and the p50, p99
+ * and p999 latencies of each command:
+ *
+ *   mount   UMOUNT, then MOUNT and OPEN again
+ *   dir     OPENDIRX, READDIRX until the end of the directory, CLOSEDIR
+ *   stat    STAT of the file
+ *   read    sequential READs of the file, seeking back at its end
+ *   rread   LSEEK to a random block of the file and READ it
+ *   write   sequential WRITEs to a scratch file of each client's own
+ *
+ * Over UDP, datagrams can be dropped either way to see how clients
+ * retransmitting affect the server. tnfsd tells clients apart by address,
+ * so against a loopback server each client sends from an address of its
+ * own, 127.0.0.2 and on.
+ *
+ * Build with make OS=... tnfs_bench, run ../bin/tnfs_bench -f <file>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tnfs.h"
+#include "directory.h"
+#include "tnfs_file.h"
+#include "errortable.h"
+
+#define MAX_RETRIES 8		/* UDP retransmits before a request is given up */
+#define WRITE_WRAP (1024 * 1024)	/* scratch files are rewritten from the start past this */
+
+enum op { OP_MOUNT, OP_DIR, OP_STAT, OP_READ, OP_RREAD, OP_WRITE, NUM_OPS };
+static const char *op_names[NUM_OPS] = {"mount", "dir", "stat", "read", "rread", "write"};
+
+/* Latencies of one command, in microseconds */
+struct series
+{
+	uint32_t *us;
+	size_t n, cap;
+	uint64_t errors;
+};
+
+struct client
+{
+	int id;
+	pthread_t thread;
+	int sock;
+	bool tcp;
+	unsigned int seed;
+	uint16_t sid;
+	uint8_t seqno;
+	int fd, wfd;			/* handles of the file read and the scratch file */
+	uint32_t filesize;
+	uint32_t wpos;
+	unsigned char rxbuf[MAXMSGSZ * 2];
+	int rxlen;				/* bytes buffered from a TCP connection */
+	struct series cmds[256];
+	uint64_t ops, bytes_read, bytes_written, retransmits, timeouts;
+};
+
+/* What the clients are told to do */
+static struct
+{
+	struct sockaddr_in server;
+	bool spread;			/* send from an address per client */
+	int clients;
+	int seconds;
+	int proto;				/* 0 UDP, 1 TCP, 2 half and half */
+	int weights[NUM_OPS];
+	int total_weight;
+	const char *dir;
+	const char *file;
+	int blocksize;
+	int entries;			/* asked for per READDIRX, 0 for as many as fit */
+	double rate;			/* operations per second per client, 0 = flat out */
+	double loss;			/* fraction of datagrams dropped each way */
+	int timeout_ms;
+} cfg;
+
+static volatile bool stopping;
+
+static int64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void record(struct client *c, uint8_t cmd, int64_t us)
+{
+	struct series *s = &c->cmds[cmd];
+
+	if (s->n == s->cap)
+	{
+		size_t cap = s->cap ? s->cap * 2 : 1024;
+		uint32_t *grown = realloc(s->us, cap * sizeof(uint32_t));
+		if (grown == NULL)
+			return;
+		s->us = grown;
+		s->cap = cap;
+	}
+	s->us[s->n++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/* The length of the reply to cmd at the start of buf, or 0 if more of
+ * it is needed. Replies carry no length over TCP, as requests don't. */
+static int reply_len(uint8_t cmd, const unsigned char *buf, int len)
+{
+	int need, pos;
+
+	if (len < TNFS_HEADERSZ + 1)
+		return 0;
+	if (buf[4] != TNFS_SUCCESS)
+		return cmd == TNFS_MOUNT ? TNFS_HEADERSZ + 3 : TNFS_HEADERSZ + 1;
+
+	switch (cmd)
+	{
+	case TNFS_MOUNT:
+		need = TNFS_HEADERSZ + 5;
+		break;
+	case TNFS_OPENDIRX:
+		need = TNFS_HEADERSZ + 4;
+		break;
+	case TNFS_OPENFILE:
+		need = TNFS_HEADERSZ + 2;
+		break;
+	case TNFS_STATFILE:
+		need = TNFS_HEADERSZ + 1 + TNFS_STAT_SIZE;
+		break;
+	case TNFS_WRITEBLOCK:
+		need = TNFS_HEADERSZ + 3;
+		break;
+	case TNFS_SEEKFILE:
+		need = TNFS_HEADERSZ + 5;
+		break;
+	case TNFS_READBLOCK:
+		if (len < TNFS_HEADERSZ + 3)
+			return 0;
+		need = TNFS_HEADERSZ + 3 + (buf[5] | buf[6] << 8);
+		break;
+	case TNFS_READDIRX:
+		/* count, status and position, then each entry's flags,
+		 * size, times and name */
+		if (len < TNFS_HEADERSZ + 5)
+			return 0;
+		pos = TNFS_HEADERSZ + 5;
+		for (int i = 0; i < buf[5]; i++)
+		{
+			unsigned char *end;
+			pos += 13;
+			if (pos >= len || (end = memchr(buf + pos, 0, len - pos)) == NULL)
+				return 0;
+			pos = end - buf + 1;
+		}
+		need = pos;
+		break;
+	default:
+		need = TNFS_HEADERSZ + 1;
+	}
+	return len >= need ? need : 0;
+}
+
+static bool dropped(struct client *c)
+{
+	return cfg.loss > 0 && rand_r(&c->seed) < cfg.loss * ((double)RAND_MAX + 1);
+}
+
+static int send_all(int sock, const unsigned char *buf, int len)
+{
+	while (len > 0)
+	{
+		int n = send(sock, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Carries out one request, putting the reply in reply. Returns the
+ * length of the reply, or -1 if none came. */
+static int request(struct client *c, uint8_t cmd, const unsigned char *data, int datasz,
+				   unsigned char *reply)
+{
+	unsigned char pkt[MAXMSGSZ];
+	struct pollfd pfd = {c->sock, POLLIN, 0};
+	int64_t start = now_us();
+	int len, tries;
+
+	put16(pkt, c->sid);
+	pkt[2] = ++c->seqno;
+	pkt[3] = cmd;
+	memcpy(pkt + TNFS_HEADERSZ, data, datasz);
+
+	if (c->tcp)
+	{
+		if (send_all(c->sock, pkt, TNFS_HEADERSZ + datasz) < 0)
+			goto failed;
+		while ((len = reply_len(cmd, c->rxbuf, c->rxlen)) == 0)
+		{
+			/* tnfsd sends nothing back for some failures */
+			if (poll(&pfd, 1, cfg.timeout_ms * (MAX_RETRIES + 1)) <= 0)
+			{
+				c->timeouts++;
+				goto failed;
+			}
+			int n = recv(c->sock, c->rxbuf + c->rxlen, sizeof(c->rxbuf) - c->rxlen, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				goto failed;
+			c->rxlen += n;
+		}
+		memcpy(reply, c->rxbuf, len);
+		memmove(c->rxbuf, c->rxbuf + len, c->rxlen - len);
+		c->rxlen -= len;
+	}
+	else
+	{
+		for (tries = 0;; tries++)
+		{
+			if (tries > MAX_RETRIES)
+			{
+				c->timeouts++;
+				goto failed;
+			}
+			if (tries > 0)
+				c->retransmits++;
+			if (!dropped(c))
+				send(c->sock, pkt, TNFS_HEADERSZ + datasz, 0);
+
+			/* wait out the timeout for the reply to this request,
+			 * passing over late replies to earlier ones */
+			int64_t deadline = now_us() + cfg.timeout_ms * 1000;
+			len = -1;
+			while (len < 0)
+			{
+				int wait = (deadline - now_us() + 999) / 1000;
+				if (wait <= 0 || poll(&pfd, 1, wait) <= 0)
+					break;
+				len = recv(c->sock, reply, MAXMSGSZ, 0);
+				if (len < TNFS_HEADERSZ + 1 || reply[2] != pkt[2] || reply[3] != cmd || dropped(c))
+					len = -1;
+			}
+			if (len >= 0)
+				break;
+		}
+	}
+
+	record(c, cmd, now_us() - start);
+	if (reply[4] != TNFS_SUCCESS && reply[4] != TNFS_EOF)
+		c->cmds[cmd].errors++;
+	return len;
+
+failed:
+	c->cmds[cmd].errors++;
+	return -1;
+}
+
+/* Returns the handle opened, or -1 */
+static int open_file(struct client *c, const char *path, uint16_t flags)
+{
+	unsigned char data[MAXMSGSZ], reply[MAXMSGSZ];
+	int len = strlen(path) + 1;
+
+	put16(data, flags);
+	put16(data + 2, 0644);
+	memcpy(data + 4, path, len);
+	if (request(c, TNFS_OPENFILE, data, 4 + len, reply) < 0 || reply[4] != TNFS_SUCCESS)
+		return -1;
+	return reply[5];
+}
+
+static void scratch_name(struct client *c, char *buf, int bufsz)
+{
+	snprintf(buf, bufsz, "%s/tnfs_bench.%d", cfg.dir, c->id);
+}
+
+/* Mounts the root and opens the files the mix needs */
+static int mount_session(struct client *c)
+{
+	static const unsigned char data[] = {PROTOVERSION_LSB, PROTOVERSION_MSB, '/', 0, 0, 0};
+	unsigned char reply[MAXMSGSZ];
+	char path[MAX_TNFSPATH];
+
+	c->sid = 0;
+	if (request(c, TNFS_MOUNT, data, sizeof(data), reply) < 0 || reply[4] != TNFS_SUCCESS)
+		return -1;
+	c->sid = reply[0] | reply[1] << 8;
+
+	if (cfg.weights[OP_READ] || cfg.weights[OP_RREAD] || cfg.weights[OP_MOUNT])
+	{
+		if ((c->fd = open_file(c, cfg.file, TNFS_O_RDONLY)) < 0)
+			return -1;
+	}
+	if (cfg.weights[OP_WRITE])
+	{
+		scratch_name(c, path, sizeof(path));
+		if ((c->wfd = open_file(c, path, TNFS_O_WRONLY | TNFS_O_CREAT | TNFS_O_TRUNC)) < 0)
+			return -1;
+		c->wpos = 0;
+	}
+	return 0;
+}
+
+static void op_dir(struct client *c)
+{
+	unsigned char data[MAXMSGSZ], reply[MAXMSGSZ];
+	int len = strlen(cfg.dir) + 1;
+	uint8_t handle;
+
+	/* default options and sorting, no limit or pattern */
+	memset(data, 0, 5);
+	memcpy(data + 5, cfg.dir, len);
+	if (request(c, TNFS_OPENDIRX, data, 5 + len, reply) < 0 || reply[4] != TNFS_SUCCESS)
+		return;
+	handle = reply[5];
+
+	data[0] = handle;
+	data[1] = cfg.entries;
+	while (!stopping)
+	{
+		if (request(c, TNFS_READDIRX, data, 2, reply) < 0 || reply[4] != TNFS_SUCCESS ||
+			(reply[6] & TNFS_DIRSTATUS_EOF))
+			break;
+	}
+	request(c, TNFS_CLOSEDIR, &handle, 1, reply);
+}
+
+static void op_stat(struct client *c)
+{
+	unsigned char reply[MAXMSGSZ];
+	request(c, TNFS_STATFILE, (const unsigned char *)cfg.file, strlen(cfg.file) + 1, reply);
+}
+
+static void seek(struct client *c, int fd, uint32_t pos)
+{
+	unsigned char data[6], reply[MAXMSGSZ];
+
+	data[0] = fd;
+	data[1] = SEEK_SET;
+	put32(data + 2, pos);
+	request(c, TNFS_SEEKFILE, data, sizeof(data), reply);
+}
+
+static void op_read(struct client *c)
+{
+	unsigned char data[3], reply[MAXMSGSZ];
+	int len;
+
+	data[0] = c->fd;
+	put16(data + 1, cfg.blocksize);
+	len = request(c, TNFS_READBLOCK, data, sizeof(data), reply);
+	if (len > 0 && reply[4] == TNFS_SUCCESS)
+		c->bytes_read += len - (TNFS_HEADERSZ + 3);
+	else if (len > 0 && reply[4] == TNFS_EOF)
+		seek(c, c->fd, 0);
+}
+
+static void op_rread(struct client *c)
+{
+	uint32_t blocks = c->filesize / cfg.blocksize;
+
+	seek(c, c->fd, blocks ? (rand_r(&c->seed) % blocks) * (uint32_t)cfg.blocksize : 0);
+	op_read(c);
+}
+
+static void op_write(struct client *c)
+{
+	unsigned char data[3 + MAXMSGSZ], reply[MAXMSGSZ];
+
+	if (c->wpos >= WRITE_WRAP)
+	{
+		seek(c, c->wfd, 0);
+		c->wpos = 0;
+	}
+	data[0] = c->wfd;
+	put16(data + 1, cfg.blocksize);
+	for (int i = 0; i < cfg.blocksize; i++)
+		data[3 + i] = rand_r(&c->seed);
+	if (request(c, TNFS_WRITEBLOCK, data, 3 + cfg.blocksize, reply) > 0 && reply[4] == TNFS_SUCCESS)
+	{
+		c->bytes_written += cfg.blocksize;
+		c->wpos += cfg.blocksize;
+	}
+}
+
+static void op_mount(struct client *c)
+{
+	unsigned char reply[MAXMSGSZ];
+
+	request(c, TNFS_UMOUNT, NULL, 0, reply);
+	mount_session(c);
+}
+
+static enum op pick(struct client *c)
+{
+	int r = rand_r(&c->seed) % cfg.total_weight;
+	enum op op;
+
+	for (op = 0; op < NUM_OPS - 1; op++)
+	{
+		if (r < cfg.weights[op])
+			break;
+		r -= cfg.weights[op];
+	}
+	return op;
+}
+
+static int connect_client(struct client *c)
+{
+	struct sockaddr_in local;
+	int one = 1;
+
+	c->sock = socket(AF_INET, c->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (c->sock < 0)
+		return -1;
+	if (cfg.spread)
+	{
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(0x7f000002 + c->id);
+		if (bind(c->sock, (struct sockaddr *)&local, sizeof(local)) < 0)
+			return -1;
+	}
+	if (connect(c->sock, (struct sockaddr *)&cfg.server, sizeof(cfg.server)) < 0)
+		return -1;
+	if (c->tcp)
+		setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+static void *run_client(void *arg)
+{
+	struct client *c = arg;
+	unsigned char reply[MAXMSGSZ];
+	char path[MAX_TNFSPATH];
+	uint8_t wfd;
+	int64_t start;
+
+	if (connect_client(c) < 0)
+	{
+		fprintf(stderr, "client %d: unable to connect: %s\n", c->id, strerror(errno));
+		return NULL;
+	}
+	if (mount_session(c) < 0)
+	{
+		fprintf(stderr, "client %d: unable to mount and open the files\n", c->id);
+		return NULL;
+	}
+	if (cfg.weights[OP_RREAD] &&
+		request(c, TNFS_STATFILE, (const unsigned char *)cfg.file, strlen(cfg.file) + 1, reply) > 0 &&
+		reply[4] == TNFS_SUCCESS)
+		c->filesize = get32(reply + TNFS_HEADERSZ + 1 + ST_SIZE_OFFSET);
+
+	start = now_us();
+	while (!stopping)
+	{
+		switch (pick(c))
+		{
+		case OP_MOUNT: op_mount(c); break;
+		case OP_DIR: op_dir(c); break;
+		case OP_STAT: op_stat(c); break;
+		case OP_READ: op_read(c); break;
+		case OP_RREAD: op_rread(c); break;
+		case OP_WRITE: op_write(c); break;
+		default: break;
+		}
+		c->ops++;
+
+		/* paced clients keep to their schedule rather than their
+		 * latency, as real ones would */
+		if (cfg.rate > 0)
+		{
+			int64_t wait = start + (int64_t)(c->ops * 1e6 / cfg.rate) - now_us();
+			if (wait > 0)
+				usleep(wait);
+		}
+	}
+
+	if (cfg.weights[OP_WRITE])
+	{
+		scratch_name(c, path, sizeof(path));
+		wfd = c->wfd;
+		request(c, TNFS_CLOSEFILE, &wfd, 1, reply);
+		request(c, TNFS_UNLINKFILE, (const unsigned char *)path, strlen(path) + 1, reply);
+	}
+	request(c, TNFS_UMOUNT, NULL, 0, reply);
+	close(c->sock);
+	return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct series *s, double fraction)
+{
+	size_t i = (size_t)(fraction * s->n);
+	return s->us[i < s->n ? i : s->n - 1];
+}
+
+static const char *cmd_name(int cmd)
+{
+	switch (cmd)
+	{
+	case TNFS_MOUNT: return "MOUNT";
+	case TNFS_UMOUNT: return "UMOUNT";
+	case TNFS_OPENDIRX: return "OPENDIRX";
+	case TNFS_READDIRX: return "READDIRX";
+	case TNFS_CLOSEDIR: return "CLOSEDIR";
+	case TNFS_OPENFILE: return "OPEN";
+	case TNFS_READBLOCK: return "READ";
+	case TNFS_WRITEBLOCK: return "WRITE";
+	case TNFS_CLOSEFILE: return "CLOSE";
+	case TNFS_STATFILE: return "STAT";
+	case TNFS_SEEKFILE: return "LSEEK";
+	case TNFS_UNLINKFILE: return "UNLINK";
+	default: return "?";
+	}
+}
+
+static void report(struct client *clients, double elapsed)
+{
+	uint64_t ops = 0, rd = 0, wr = 0, retransmits = 0, timeouts = 0;
+
+	printf("%-10s %10s %8s %10s %10s %10s %10s\n",
+		   "command", "requests", "errors", "req/s", "p50 us", "p99 us", "p999 us");
+	for (int cmd = 0; cmd < 256; cmd++)
+	{
+		struct series all = {NULL, 0, 0, 0};
+		size_t filled = 0;
+
+		for (int i = 0; i < cfg.clients; i++)
+		{
+			all.n += clients[i].cmds[cmd].n;
+			all.errors += clients[i].cmds[cmd].errors;
+		}
+		if (all.n == 0 && all.errors == 0)
+			continue;
+		if (all.n > 0 && (all.us = malloc(all.n * sizeof(uint32_t))) == NULL)
+			continue;
+		for (int i = 0; i < cfg.clients; i++)
+		{
+			struct series *s = &clients[i].cmds[cmd];
+			memcpy(all.us + filled, s->us, s->n * sizeof(uint32_t));
+			filled += s->n;
+		}
+		qsort(all.us, all.n, sizeof(uint32_t), compare_u32);
+		printf("%-10s %10zu %8" PRIu64 " %10.0f %10" PRIu32 " %10" PRIu32 " %10" PRIu32 "\n",
+			   cmd_name(cmd), all.n, all.errors, all.n / elapsed,
+			   all.n ? percentile(&all, 0.5) : 0, all.n ? percentile(&all, 0.99) : 0,
+			   all.n ? percentile(&all, 0.999) : 0);
+		free(all.us);
+	}
+
+	for (int i = 0; i < cfg.clients; i++)
+	{
+		ops += clients[i].ops;
+		rd += clients[i].bytes_read;
+		wr += clients[i].bytes_written;
+		retransmits += clients[i].retransmits;
+		timeouts += clients[i].timeouts;
+	}
+	printf("%" PRIu64 " operations in %.1fs, %.0f/s. Read %.2f MB/s, wrote %.2f MB/s. "
+		   "Retransmits: %" PRIu64 ", gave up: %" PRIu64 ".\n",
+		   ops, elapsed, ops / elapsed, rd / elapsed / 1e6, wr / elapsed / 1e6,
+		   retransmits, timeouts);
+}
+
+/* Sets the weights from a list like read=8,stat=1 */
+static int parse_mix(char *mix)
+{
+	memset(cfg.weights, 0, sizeof(cfg.weights));
+	for (char *item = strtok(mix, ","); item != NULL; item = strtok(NULL, ","))
+	{
+		char *eq = strchr(item, '=');
+		int op;
+
+		if (eq != NULL)
+			*eq = '\0';
+		for (op = 0; op < NUM_OPS && strcmp(item, op_names[op]) != 0; op++)
+			;
+		if (op == NUM_OPS)
+		{
+			fprintf(stderr, "Unknown operation '%s'\n", item);
+			return -1;
+		}
+		cfg.weights[op] = eq != NULL ? atoi(eq + 1) : 1;
+	}
+	cfg.total_weight = 0;
+	for (int op = 0; op < NUM_OPS; op++)
+		cfg.total_weight += cfg.weights[op];
+	return cfg.total_weight > 0 ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			" -s addr     server address (127.0.0.1)\n"
+			" -p port     server port (%d)\n"
+			" -c n        clients (8)\n"
+			" -t seconds  how long to run (10)\n"
+			" -P proto    udp, tcp or mixed (udp)\n"
+			" -m mix      weights of mount, dir, stat, read, rread and write\n"
+			"             (read=8,rread=4,stat=2,dir=1)\n"
+			" -d dir      directory to list, and to write scratch files in (/)\n"
+			" -f file     file to stat and read\n"
+			" -b bytes    READ and WRITE size (512)\n"
+			" -n entries  entries asked for per READDIRX, 0 for as many as fit (0)\n"
+			" -r rate     operations per second per client, 0 for flat out (0)\n"
+			" -l percent  datagrams dropped each way over UDP (0)\n"
+			" -o ms       UDP retransmit timeout (200)\n",
+			name, TNFSD_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	char defmix[] = "read=8,rread=4,stat=2,dir=1";
+	char *mix = defmix;
+	const char *addr = "127.0.0.1";
+	int port = TNFSD_PORT;
+	struct client *clients;
+	int64_t start;
+	int opt;
+
+	cfg.clients = 8;
+	cfg.seconds = 10;
+	cfg.dir = "/";
+	cfg.blocksize = 512;
+	cfg.timeout_ms = 200;
+	while ((opt = getopt(argc, argv, "s:p:c:t:P:m:d:f:b:n:r:l:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's': addr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'c': cfg.clients = atoi(optarg); break;
+		case 't': cfg.seconds = atoi(optarg); break;
+		case 'P':
+			cfg.proto = strcmp(optarg, "tcp") == 0 ? 1 : strcmp(optarg, "mixed") == 0 ? 2 : 0;
+			break;
+		case 'm': mix = optarg; break;
+		case 'd': cfg.dir = optarg; break;
+		case 'f': cfg.file = optarg; break;
+		case 'b': cfg.blocksize = atoi(optarg); break;
+		case 'n': cfg.entries = atoi(optarg); break;
+		case 'r': cfg.rate = atof(optarg); break;
+		case 'l': cfg.loss = atof(optarg) / 100; break;
+		case 'o': cfg.timeout_ms = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (parse_mix(mix) < 0 || cfg.clients < 1 || cfg.seconds < 1 || cfg.timeout_ms < 1 ||
+		cfg.blocksize < 1 || cfg.blocksize > MAXMSGSZ - TNFS_HEADERSZ - 3 ||
+		cfg.entries < 0 || cfg.entries > 255)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (cfg.file == NULL && (cfg.weights[OP_STAT] || cfg.weights[OP_READ] ||
+							 cfg.weights[OP_RREAD] || cfg.weights[OP_MOUNT]))
+	{
+		fprintf(stderr, "The mix needs a file to read, given with -f\n");
+		return 1;
+	}
+	cfg.server.sin_family = AF_INET;
+	cfg.server.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &cfg.server.sin_addr) != 1)
+	{
+		fprintf(stderr, "Bad server address %s\n", addr);
+		return 1;
+	}
+	cfg.spread = (ntohl(cfg.server.sin_addr.s_addr) >> 24) == 127;
+
+	if ((clients = calloc(cfg.clients, sizeof(struct client))) == NULL)
+		return 1;
+	start = now_us();
+	for (int i = 0; i < cfg.clients; i++)
+	{
+		clients[i].id = i;
+		clients[i].seed = i + 1;
+		clients[i].tcp = cfg.proto == 1 || (cfg.proto == 2 && i % 2);
+		pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+	}
+	sleep(cfg.seconds);
+	stopping = true;
+	for (int i = 0; i < cfg.clients; i++)
+		pthread_join(clients[i].thread, NULL);
+
+	report(clients, (now_us() - start) / 1e6);
+	return 0;
+}
@@ -51,9 +51,259 @@
 #include "bsdcompat.h"
 #include "log.h"
 #include "auth.h"
+#include "session.h"
+#include "settings.h"
+#include "search.h"
+#include "casefold.h"
+#include "overlay.h"
+#include "vfs.h"
+#ifdef WITH_ZIP
+#include "zip.h"
+#endif
+#ifdef ENABLE_CATALOG
+#include "catalog.h"
+#endif
 
 char fnbuf[MAX_FILEPATH];
 unsigned char iobuf[MAX_IOSZ + 2]; /* 2 bytes added for the size param */
+int active_streams;                /* sessions with a STREAMREAD running */
+
+/* Sequential WRITEs to a file gathered up to be made in one write().
+ * The data goes out when the buffer fills, after WRITEBEHIND_DELAY, or
+ * before anything else is done with the descriptor. */
+typedef struct _writebehind
+{
+	int fd;				/* 0 if not in use */
+	int len;			/* bytes waiting */
+	int err;			/* errno of a write made after the WRITE was acknowledged */
+	int64_t since;			/* when the oldest of them arrived */
+	unsigned char *buf;
+} writebehind;
+
+static writebehind wbufs[WRITEBEHIND_MAX];
+static int wb_pending;             /* buffers holding data */
+static bool durable_writes;        /* acknowledge WRITEs once they're on disk instead */
+
+/* A session's descriptors may belong to the backend, to a client's
+ * overlay of a file or, when built with ZIP support, to a member of an
+ * archive */
+static int file_read(int fd, void *buf, int size)
+{
+	if (IS_OVLFD(fd))
+		return overlay_read(fd, buf, size);
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return zipread(fd, buf, size);
+#endif
+	return vfs->read(fd, buf, size);
+}
+
+static off_t file_lseek(int fd, off_t offset, int whence)
+{
+	if (IS_OVLFD(fd))
+		return overlay_lseek(fd, offset, whence);
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return ziplseek(fd, offset, whence);
+#endif
+	return vfs->lseek(fd, offset, whence);
+}
+
+static int file_os_write(int fd, const void *buf, int size)
+{
+	return vfs->write(fd, buf, size);
+}
+
+int file_osfd(int fd)
+{
+	if (IS_OVLFD(fd))
+		return -1;
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return -1;
+#endif
+	return vfs->osfd(fd);
+}
+
+void tnfs_file_durable(bool durable)
+{
+	durable_writes = durable;
+}
+
+static writebehind *_wb_find(int fd)
+{
+	for (int i = 0; i < WRITEBEHIND_MAX; i++)
+	{
+		if (wbufs[i].fd == fd)
+			return &wbufs[i];
+	}
+	return NULL;
+}
+
+/* Write out what's buffered. A failure is kept to report to the next
+ * WRITE or CLOSE of the descriptor, as the data was acknowledged. */
+static void _wb_flush(writebehind *wb)
+{
+	int done = 0, n;
+
+	if (wb->len == 0)
+		return;
+	while (done < wb->len)
+	{
+		if ((n = file_os_write(wb->fd, wb->buf + done, wb->len - done)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			wb->err = errno;
+			break;
+		}
+		done += n;
+	}
+	wb->len = 0;
+	wb_pending--;
+}
+
+/* Called before the descriptor is read from, moved or stat()ed.
+ * Sessions that opened a file the same way share its OS descriptor
+ * through the filetable, so what the others wrote to it goes out too.
+ * Files held by the memory backend have no OS descriptor to tell them
+ * apart by, and everything waiting is written. */
+static void _wb_flush_fd(int fd)
+{
+	int osfd;
+
+	/* overlays and archive members aren't written behind */
+	if (wb_pending == 0 || IS_OVLFD(fd))
+		return;
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return;
+#endif
+	osfd = vfs->osfd(fd);
+	for (int i = 0; i < WRITEBEHIND_MAX && wb_pending > 0; i++)
+	{
+		if (wbufs[i].len > 0 && (osfd < 0 || vfs->osfd(wbufs[i].fd) == osfd))
+			_wb_flush(&wbufs[i]);
+	}
+}
+
+void tnfs_writebehind_flush(bool all)
+{
+	int64_t now = tnfs_clock_ms();
+
+	for (int i = 0; i < WRITEBEHIND_MAX && wb_pending > 0; i++)
+	{
+		if (wbufs[i].len > 0 && (all || now - wbufs[i].since >= WRITEBEHIND_DELAY))
+			_wb_flush(&wbufs[i]);
+	}
+}
+
+bool tnfs_writebehind_pending()
+{
+	return wb_pending > 0;
+}
+
+/* Takes the error of a write made behind the client's back, if any */
+static int _wb_error(int fd)
+{
+	writebehind *wb = _wb_find(fd);
+	int err = 0;
+
+	if (wb != NULL)
+	{
+		err = wb->err;
+		wb->err = 0;
+	}
+	return err;
+}
+
+static int file_write(int fd, const unsigned char *data, int size)
+{
+	writebehind *wb;
+	int err, n;
+
+	if (IS_OVLFD(fd))
+	{
+		if ((n = overlay_write(fd, data, size)) > 0 && durable_writes && overlay_sync(fd) < 0)
+			return -1;
+		return n;
+	}
+	if ((err = _wb_error(fd)) != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	if (durable_writes)
+	{
+		if ((n = file_os_write(fd, data, size)) > 0 && vfs->sync(fd) < 0)
+			return -1;
+		return n;
+	}
+
+	/* the descriptor's buffer, or a free one */
+	if ((wb = _wb_find(fd)) == NULL)
+	{
+		for (int i = 0; i < WRITEBEHIND_MAX && wb == NULL; i++)
+		{
+			if (wbufs[i].len == 0 && wbufs[i].err == 0)
+				wb = &wbufs[i];
+		}
+		if (wb == NULL)
+			return file_os_write(fd, data, size);
+		if (wb->buf == NULL && (wb->buf = malloc(WRITEBEHIND_SIZE)) == NULL)
+			return file_os_write(fd, data, size);
+		wb->fd = fd;
+	}
+
+	if (wb->len + size > WRITEBEHIND_SIZE)
+	{
+		_wb_flush(wb);
+		if ((err = _wb_error(fd)) != 0)
+		{
+			errno = err;
+			return -1;
+		}
+	}
+	if (wb->len == 0)
+	{
+		wb->since = tnfs_clock_ms();
+		wb_pending++;
+	}
+	memcpy(wb->buf + wb->len, data, size);
+	wb->len += size;
+	if (wb->len == WRITEBEHIND_SIZE)
+		_wb_flush(wb);
+	return size;
+}
+
+int file_close(int fd)
+{
+	writebehind *wb = _wb_find(fd);
+	int err = 0;
+
+	/* the last of the data, and any trouble writing it, go first */
+	if (wb != NULL)
+	{
+		_wb_flush(wb);
+		err = wb->err;
+		wb->err = 0;
+		wb->fd = 0;
+	}
+	if (IS_OVLFD(fd))
+		return overlay_close(fd);
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return zipclose(fd);
+#endif
+	if (vfs->close(fd) < 0)
+		return -1;
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
 
 void tnfs_open_deprecated(Header *hdr, Session *s, unsigned char *buf,
 						  int bufsz)
@@ -101,18 +351,20 @@ void tnfs_open(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 
 	if (!is_open_allowed(fnbuf, flags))
 	{
-		tnfs_notpermitted(hdr);
+		tnfs_notpermitted(hdr, s);
 		return;
 	}
 
-	for (i = 0; i < MAX_FD_PER_CONN; i++)
+	for (i = 0; i < settings.max_fd_per_conn; i++)
 	{
 		if (s->fd[i] == 0)
 		{
+			/* a file the client changes may be its own copy */
+			if ((fd = overlay_open(fnbuf, s->ipaddr, tnfs_make_mode(flags))) == 0)
 #ifdef WITH_ZIP
-			fd = zipopen(fnbuf, tnfs_make_mode(flags), mode);
+				fd = zipopen(fnbuf, tnfs_make_mode(flags), mode);
 #else
-			fd = open(fnbuf, tnfs_make_mode(flags), mode);
+				fd = vfs->open(fnbuf, tnfs_make_mode(flags), mode);
 #endif
 #ifdef DEBUG
 			fprintf(stderr, "filename: %s\n", (char *)buf + 4);
@@ -120,9 +372,6 @@ void tnfs_open(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 			fprintf(stderr, "mode: %o\n", mode);
 			fprintf(stderr, "open: fd=%d\n", fd);
 #endif
-#ifdef USAGELOG
-	                USGLOG(hdr, "File mounted: %s", (char *)buf + 4);
-#endif
 
 			if (fd <= 0)
 			{
@@ -131,7 +380,18 @@ void tnfs_open(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 				return;
 			}
 
+			/* its size and times are about to change, unless it's overlaid */
+			if (!IS_OVLFD(fd) &&
+				((flags & TNFS_O_ACCMODE) != TNFS_O_RDONLY || (flags & (TNFS_O_CREAT | TNFS_O_TRUNC))))
+			{
+#ifdef ENABLE_CATALOG
+				catalog_invalidate(fnbuf);
+#endif
+				search_changed(fnbuf);
+			}
 			s->fd[i] = fd;
+			free(s->fdpath[i]);
+			s->fdpath[i] = strdup(fnbuf);
 			hdr->status = TNFS_SUCCESS;
 			reply[0] = (unsigned char)i;
 			tnfs_send(s, hdr, reply, 1);
@@ -153,9 +413,27 @@ void tnfs_read(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 		return;
 
 	requestsz = tnfs16uint(buf + 1);
+	_wb_flush_fd(fd);
+#ifdef ENABLE_SENDFILE
+	/* over TCP the data can go straight from the file to the socket,
+	 * which also lifts the limit of what fits in a datagram. Archive
+	 * members and overlaid files have no OS descriptor and take the
+	 * copy path. */
+	if (hdr->cli_fd != 0 && file_osfd(fd) >= 0)
+	{
+		off_t pos = file_lseek(fd, 0, SEEK_CUR);
+		int sent = pos < 0 ? -1 :
+			tnfs_send_file(s, hdr, fd, pos, requestsz > TCP_MAX_IOSZ ? TCP_MAX_IOSZ : requestsz);
+		if (sent >= 0)
+		{
+			file_lseek(fd, pos + sent, SEEK_SET);
+			return;
+		}
+	}
+#endif
 	if (requestsz > MAX_IOSZ)
 		requestsz = MAX_IOSZ;
-	readsz = read(fd, iobuf + 2, (size_t)requestsz);
+	readsz = file_read(fd, iobuf + 2, requestsz);
 	if (readsz > 0)
 	{
 		hdr->status = TNFS_SUCCESS;
@@ -183,6 +461,131 @@ void tnfs_read(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	}
 }
 
+/* Reads from the given offset without moving the file position */
+static int _read_at(int fd, uint32_t offset, unsigned char *buf, int size)
+{
+	_wb_flush_fd(fd);
+	if (IS_OVLFD(fd))
+		return overlay_pread(fd, buf, size, (off_t)offset);
+#ifdef WITH_ZIP
+	if (IS_ZIPFD(fd))
+		return zippread(fd, buf, size, (off_t)offset);
+#endif
+	return vfs->pread(fd, buf, size, (off_t)offset);
+}
+
+/* Sends up to burst chunks of the session's STREAMREAD. Each chunk is
+ * a reply to the original request carrying its own offset, so the
+ * client can spot and ask again for any that went missing. */
+static void _stream_send(Session *s, int burst)
+{
+	tnfs_stream *st = &s->stream;
+	unsigned char chunk[TNFS_STREAM_HDRSZ + MAX_IOSZ];
+	int readsz;
+	uint32_t offset;
+
+	while (burst-- > 0 && st->remaining > 0)
+	{
+		if (st->hdr.cli_fd != 0 && !tnfs_writable(st->hdr.cli_fd))
+			return;
+
+		offset = st->offset;
+		readsz = _read_at(s->fd[st->fdslot], offset, chunk + TNFS_STREAM_HDRSZ,
+						  st->remaining < MAX_IOSZ ? st->remaining : MAX_IOSZ);
+		if (readsz < 0)
+		{
+			st->hdr.status = tnfs_error(errno);
+			tnfs_send(s, &st->hdr, NULL, 0);
+			tnfs_stream_stop(s);
+			return;
+		}
+
+		if (readsz == 0)
+		{
+			st->hdr.status = TNFS_EOF;
+			chunk[0] = TNFS_STREAM_LAST | TNFS_STREAM_EOF;
+			st->remaining = 0;
+		}
+		else
+		{
+			st->hdr.status = TNFS_SUCCESS;
+			st->offset += readsz;
+			st->remaining -= readsz;
+			chunk[0] = st->remaining == 0 ? TNFS_STREAM_LAST : 0;
+		}
+		uint32tnfs(chunk + 1, offset);
+		uint16tnfs(chunk + 5, (uint16_t)readsz);
+		tnfs_send(s, &st->hdr, chunk, TNFS_STREAM_HDRSZ + readsz);
+	}
+
+	if (st->remaining == 0)
+		tnfs_stream_stop(s);
+}
+
+/* Read a range of a file as a stream of chunks. The request is the fd,
+ * a 32 bit offset and a 32 bit length. Over UDP the server may stop
+ * short of the length; the client asks again for whatever is left. */
+void tnfs_streamread(Header *hdr, Session *s, unsigned char *buf, int bufsz)
+{
+	unsigned char reply[TNFS_STREAM_HDRSZ];
+	uint32_t length;
+
+	int fd = validate_fd(hdr, s, buf, bufsz, 9);
+	if (!fd)
+		return;
+
+	/* a new request replaces any stream that's still running */
+	tnfs_stream_stop(s);
+
+	length = tnfs32uint(buf + 5);
+	if (hdr->cli_fd == 0 && length > STREAM_UDP_MAX)
+		length = STREAM_UDP_MAX;
+
+	if (length == 0)
+	{
+		/* nothing to send; this is how a client cancels a stream */
+		reply[0] = TNFS_STREAM_LAST;
+		memcpy(reply + 1, buf + 1, 4);
+		uint16tnfs(reply + 5, 0);
+		hdr->status = TNFS_SUCCESS;
+		tnfs_send(s, hdr, reply, sizeof(reply));
+		return;
+	}
+
+	s->stream.hdr = *hdr;
+	s->stream.fdslot = *buf;
+	s->stream.offset = tnfs32uint(buf + 1);
+	s->stream.remaining = length;
+	s->stream.active = true;
+	active_streams++;
+
+	_stream_send(s, hdr->cli_fd == 0 ? STREAM_UDP_BURST : STREAM_TCP_BURST);
+}
+
+void tnfs_stream_stop(Session *s)
+{
+	if (s->stream.active)
+		active_streams--;
+	memset(&s->stream, 0, sizeof(s->stream));
+}
+
+bool tnfs_streams_active()
+{
+	return active_streams > 0;
+}
+
+void tnfs_stream_pump()
+{
+	int i;
+
+	for (i = 0; i < slist_size && active_streams > 0; i++)
+	{
+		if (slist[i] && slist[i]->stream.active)
+			_stream_send(slist[i], slist[i]->stream.hdr.cli_fd == 0 ?
+						 STREAM_UDP_BURST : STREAM_TCP_BURST);
+	}
+}
+
 void tnfs_write(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 {
 	int writesz;
@@ -195,7 +598,13 @@ void tnfs_write(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 		return;
 
 	writesz = tnfs16uint(buf + 1);
-	writesz = write(fd, buf + 3, (size_t)writesz);
+	if (writesz > bufsz - 3)
+	{
+		hdr->status = TNFS_EINVAL;
+		tnfs_send(s, hdr, NULL, 0);
+		return;
+	}
+	writesz = file_write(fd, buf + 3, writesz);
 	if (writesz > 0)
 	{
 		hdr->status = 0;
@@ -229,7 +638,8 @@ void tnfs_lseek(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	fprintf(stderr, "lseek: offset=%d (%x) whence=%d tnfs_whence=%d\n",
 			offset, offset, whence, *(buf + 1));
 #endif
-	if ((result = lseek(fd, (off_t)offset, whence)) < 0)
+	_wb_flush_fd(fd);
+	if ((result = file_lseek(fd, (off_t)offset, whence)) < 0)
 	{
 		hdr->status = tnfs_error(errno);
 #ifdef DEBUG
@@ -255,9 +665,17 @@ void tnfs_close(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	if (!fd)
 		return;
 
-	if (close(fd) == 0)
+	if (s->stream.active && s->stream.fdslot == *buf)
+		tnfs_stream_stop(s);
+	if (s->lastfile.size > 0 && s->lastfile.fd == fd)
+		s->lastfile.size = 0;
+
+	/* the descriptor is gone either way, but a failure to write out
+	 * data held back is still reported */
+	int result = file_close(fd);
+	s->fd[*buf] = 0; /* clear the session's descriptor */
+	if (result == 0)
 	{
-		s->fd[*buf] = 0; /* clear the session's descriptor */
 		hdr->status = TNFS_SUCCESS;
 		tnfs_send(s, hdr, NULL, 0);
 	}
@@ -272,6 +690,7 @@ void tnfs_stat(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 {
 	struct stat statinfo;
 	unsigned char msgbuf[TNFS_STAT_SIZE];
+	int result;
 #ifdef DEBUG
 	fprintf(stderr, "stat: bufsz=%d buf=%s\n", bufsz, buf);
 #endif
@@ -287,12 +706,30 @@ void tnfs_stat(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 #ifdef DEBUG
 	fprintf(stderr, "stat: path=%s\n", fnbuf);
 #endif
+	/* the size has to include WRITEs still held back */
+	if (wb_pending > 0)
+		tnfs_writebehind_flush(true);
 
-	if (stat(fnbuf, &statinfo) == 0)
+#ifdef ENABLE_CATALOG
+	result = -1;
+#ifdef WITH_ZIP
+	/* archives are stat()ed as the directories they're listed as */
+	if (!zip_is_archive_name(fnbuf))
+#endif
+		result = catalog_stat(fnbuf, &statinfo);
+	if (result != 0)
+#endif
+#ifdef WITH_ZIP
+		result = zipstat(fnbuf, &statinfo);
+#else
+		result = vfs->stat(fnbuf, &statinfo);
+#endif
+	if (result == 0)
 	{
 #ifdef DEBUG
 		fprintf(stderr, "stat: OK\n");
 #endif
+		overlay_stat(fnbuf, s->ipaddr, &statinfo);
 		uint16tnfs(msgbuf + ST_MODE_OFFSET, (uint16_t)statinfo.st_mode);
 		uint16tnfs(msgbuf + ST_UID_OFFSET, (uint16_t)statinfo.st_uid);
 		uint16tnfs(msgbuf + ST_GID_OFFSET, (uint16_t)statinfo.st_gid);
@@ -324,8 +761,12 @@ void tnfs_unlink(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	}
 	else
 	{
-		if (unlink(fnbuf) == 0)
+		if (vfs->unlink(fnbuf) == 0)
 		{
+#ifdef ENABLE_CATALOG
+			catalog_invalidate(fnbuf);
+#endif
+			search_changed(fnbuf);
 			hdr->status = TNFS_SUCCESS;
 			tnfs_send(s, hdr, NULL, 0);
 		}
@@ -363,7 +804,7 @@ void tnfs_rename(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 		return;
 	}
 
-	if (rename((char *)fnbuf, tobuf) < 0)
+	if (vfs->rename((char *)fnbuf, tobuf) < 0)
 	{
 		hdr->status = tnfs_error(errno);
 		tnfs_send(s, hdr, NULL, 0);
@@ -375,6 +816,12 @@ void tnfs_rename(Header *hdr, Session *s, unsigned char *buf, int bufsz)
 	}
 	else
 	{
+#ifdef ENABLE_CATALOG
+		catalog_invalidate(fnbuf);
+		catalog_invalidate(tobuf);
+#endif
+		search_changed(fnbuf);
+		search_changed(tobuf);
 		hdr->status = TNFS_SUCCESS;
 		tnfs_send(s, hdr, NULL, 0);
 	}
@@ -396,6 +843,15 @@ int tnfs_valid_filename(Session *s,
 	get_root(s, fullpath, MAX_FILEPATH);
 	strlcat(fullpath, filename, MAX_FILEPATH);
 	normalize_path(fullpath, fullpath, MAX_FILEPATH);
+
+	if (casefold_enabled())
+	{
+		/* match the client's name against what's there, below the root */
+		char rootpath[MAX_FILEPATH];
+		get_root(s, rootpath, MAX_FILEPATH);
+		normalize_path(rootpath, rootpath, MAX_FILEPATH);
+		casefold_resolve(fullpath, strlen(rootpath));
+	}
 	return 0;
 }
 
@@ -431,12 +887,12 @@ int validate_fd(Header *hdr, Session *s, unsigned char *buf, int bufsz,
 				int propersize)
 {
 	if (bufsz < propersize ||
-		*buf > MAX_FD_PER_CONN ||
+		*buf >= settings.max_fd_per_conn ||
 		s->fd[*buf] == 0)
 	{
 #ifdef DEBUG
 		fprintf(stderr, "BAD FD: bufsz=%d propersize=%d fd=%d max=%d",
-				bufsz, propersize, *buf, MAX_FD_PER_CONN);
+				bufsz, propersize, *buf, settings.max_fd_per_conn);
 #endif
 		hdr->status = TNFS_EBADFD;
 		tnfs_send(s, hdr, NULL, 0);
@@ -26,6 +26,8 @@
  *
  * */
 
+#include <stdbool.h>
+
 #include "tnfs.h"
 
 #define TNFS_O_RDONLY	0x0001
@@ -47,6 +49,10 @@
 #define ST_CTIME_OFFSET	0x12
 #define TNFS_STAT_SIZE	0x16
 
+#define TNFS_STREAM_LAST	0x01	/* final chunk of this STREAMREAD */
+#define TNFS_STREAM_EOF		0x02	/* end of file was reached */
+#define TNFS_STREAM_HDRSZ	7	/* flags + offset + size before each chunk */
+
 #define TNFS_SEEK_SET	0x00
 #define TNFS_SEEK_CUR	0x01
 #define TNFS_SEEK_END	0x02
@@ -61,6 +67,12 @@ void tnfs_stat(Header *hdr, Session *s, unsigned char *buf, int bufsz);
 void tnfs_unlink(Header *hdr, Session *s, unsigned char *buf, int bufsz);
 void tnfs_chmod(Header *hdr, Session *s, unsigned char *buf, int bufsz);
 void tnfs_rename(Header *hdr, Session *s, unsigned char *buf, int bufsz);
+void tnfs_streamread(Header *hdr, Session *s, unsigned char *buf, int bufsz);
+
+/* send the next burst of every running STREAMREAD */
+void tnfs_stream_pump();
+void tnfs_stream_stop(Session *s);
+bool tnfs_streams_active();
 
 int tnfs_valid_filename(Session *s,
                         char *fullpath,
@@ -70,4 +82,18 @@ int validate_fd(Header *hdr, Session *s, unsigned char *buf, int bufsz,
 		int correctsize);
 int getwhence(unsigned char tnfs_whence);
 
+/* close a descriptor from a session's fd table */
+int file_close(int fd);
+
+/* the OS descriptor behind one from a session's fd table, or -1 if
+ * there isn't one */
+int file_osfd(int fd);
+
+/* acknowledge WRITEs only once they've reached the disk */
+void tnfs_file_durable(bool durable);
+
+/* write out gathered WRITEs that have waited long enough, or all of them */
+void tnfs_writebehind_flush(bool all);
+bool tnfs_writebehind_pending();
+
 #endif
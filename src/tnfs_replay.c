@@ -0,0 +1,935 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Replays requests captured with tnfsd -w against a test server, to
+ * reproduce what real clients did to a server or to compare two builds
+ * on the same traffic.
+ *
+ * Each client connection of the capture, a client address and port over
+ * UDP or a TCP connection, gets a socket of its own and sends its
+ * requests in order, waiting for the reply to each before sending the
+ * next, no sooner than they were sent originally scaled by -x. tnfsd
+ * tells clients apart by address, so each captured address is replayed
+ * from one of its own: 127.0.0.2 and on against a loopback server, from
+ * -b on, or as mapped with -m. The SIDs of the capture are rewritten to
+ * those the test server gives out when the clients MOUNT.
+ *
+ * Replies are checked to be for the request sent, and their latencies
+ * reported by command, along with how far behind the capture's timing
+ * the requests were sent. -w writes the status, length and a hash of
+ * each reply to a file, and -c compares them with such a file from an
+ * earlier run. Times in STAT and READDIRX replies are left out of the
+ * hashes, as replaying writes changes them.
+ *
+ * Build with make OS=... tnfs_replay, run ../bin/tnfs_replay <capture>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tnfs.h"
+#include "capture.h"
+#include "directory.h"
+#include "tnfs_file.h"
+#include "errortable.h"
+
+#define MAX_MAPPINGS 64
+#define MAX_DIFFS_SHOWN 10
+#define NO_REPLY -1
+/* the largest reply: a READ over TCP, with its status and size */
+#define MAX_REPLYSZ (TNFS_HEADERSZ + 3 + TCP_MAX_IOSZ)
+
+/* A captured request */
+struct request
+{
+	int64_t at;				/* microseconds after the first request */
+	int flow;
+	int len;
+	const unsigned char *data;
+};
+
+/* What came back for a request */
+struct outcome
+{
+	int status;				/* NO_REPLY if nothing did */
+	uint32_t len;			/* bytes after the headers of its replies */
+	uint32_t hash;
+	uint32_t us;
+};
+
+/* A captured client address, and what it's replayed as */
+struct client
+{
+	in_addr_t orig;
+	struct in_addr addr;
+	bool bind;
+	uint16_t from_sid;		/* the session of the capture... */
+	uint16_t to_sid;		/* ...and the test server's */
+	bool mounted;			/* to_sid is new, for the next request to take up */
+};
+
+/* Requests from one client port over UDP, or one TCP connection */
+struct flow
+{
+	in_addr_t ip;
+	uint16_t port;
+	bool tcp;
+	int client;
+	int sock;				/* -1 until the first request */
+	int *reqs;
+	size_t nreqs, next, cap;
+	int pending;			/* request waiting for its reply, or -1 */
+	uint8_t seqno, cmd;
+	int64_t sent, deadline;
+	struct outcome got;
+	unsigned char *rxbuf;	/* replies buffered from a TCP connection */
+	int rxlen;
+};
+
+/* Latencies of one command, in microseconds */
+struct series
+{
+	uint32_t *us;
+	size_t n, cap;
+	uint64_t unanswered;
+};
+
+static struct
+{
+	struct sockaddr_in server;
+	double speed;			/* 0 = as fast as the replies come */
+	int timeout_ms;
+	struct in_addr base;	/* first address to replay clients from */
+	bool bind;
+	struct { in_addr_t from; struct in_addr to; } map[MAX_MAPPINGS];
+	int nmap;
+} cfg;
+
+static struct request *requests;
+static size_t nrequests;
+static struct outcome *outcomes;
+static struct client *clients;
+static int nclients;
+static struct flow *flows;
+static int nflows;
+static struct series cmds[256], lag;
+static uint64_t stale, unmapped;
+
+static int64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void record(struct series *s, int64_t us)
+{
+	if (s->n == s->cap)
+	{
+		size_t cap = s->cap ? s->cap * 2 : 1024;
+		uint32_t *grown = realloc(s->us, cap * sizeof(uint32_t));
+		if (grown == NULL)
+			return;
+		s->us = grown;
+		s->cap = cap;
+	}
+	s->us[s->n++] = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static const char *cmd_name(int cmd)
+{
+	switch (cmd)
+	{
+	case TNFS_MOUNT: return "MOUNT";
+	case TNFS_UMOUNT: return "UMOUNT";
+	case TNFS_OPENDIR: return "OPENDIR";
+	case TNFS_READDIR: return "READDIR";
+	case TNFS_CLOSEDIR: return "CLOSEDIR";
+	case TNFS_MKDIR: return "MKDIR";
+	case TNFS_RMDIR: return "RMDIR";
+	case TNFS_TELLDIR: return "TELLDIR";
+	case TNFS_SEEKDIR: return "SEEKDIR";
+	case TNFS_OPENDIRX: return "OPENDIRX";
+	case TNFS_READDIRX: return "READDIRX";
+	case TNFS_SEARCH: return "SEARCH";
+	case TNFS_OPENFILE_OLD: return "OPEN_OLD";
+	case TNFS_READBLOCK: return "READ";
+	case TNFS_WRITEBLOCK: return "WRITE";
+	case TNFS_CLOSEFILE: return "CLOSE";
+	case TNFS_STATFILE: return "STAT";
+	case TNFS_SEEKFILE: return "LSEEK";
+	case TNFS_UNLINKFILE: return "UNLINK";
+	case TNFS_CHMODFILE: return "CHMOD";
+	case TNFS_RENAMEFILE: return "RENAME";
+	case TNFS_OPENFILE: return "OPEN";
+	case TNFS_STREAMREAD: return "STREAMREAD";
+	default: return "?";
+	}
+}
+
+/* Reading the capture */
+
+static int find_client(in_addr_t ip)
+{
+	int i;
+
+	for (i = 0; i < nclients && clients[i].orig != ip; i++)
+		;
+	if (i < nclients)
+		return i;
+
+	struct client *grown = realloc(clients, (nclients + 1) * sizeof(struct client));
+	if (grown == NULL)
+		return -1;
+	clients = grown;
+	memset(&clients[i], 0, sizeof(struct client));
+	clients[i].orig = ip;
+	clients[i].bind = cfg.bind;
+	clients[i].addr.s_addr = htonl(ntohl(cfg.base.s_addr) + i);
+	for (int m = 0; m < cfg.nmap; m++)
+	{
+		if (cfg.map[m].from == ip)
+		{
+			clients[i].addr = cfg.map[m].to;
+			clients[i].bind = true;
+		}
+	}
+	nclients++;
+	return i;
+}
+
+static int find_flow(in_addr_t ip, uint16_t port, bool tcp)
+{
+	int i;
+
+	for (i = nflows - 1; i >= 0; i--)
+	{
+		if (flows[i].ip == ip && flows[i].port == port && flows[i].tcp == tcp)
+			return i;
+	}
+
+	struct flow *grown = realloc(flows, (nflows + 1) * sizeof(struct flow));
+	if (grown == NULL)
+		return -1;
+	flows = grown;
+	i = nflows;
+	memset(&flows[i], 0, sizeof(struct flow));
+	flows[i].ip = ip;
+	flows[i].port = port;
+	flows[i].tcp = tcp;
+	flows[i].sock = -1;
+	flows[i].pending = -1;
+	if ((flows[i].client = find_client(ip)) < 0)
+		return -1;
+	if (tcp && (flows[i].rxbuf = malloc(MAX_REPLYSZ)) == NULL)
+		return -1;
+	nflows++;
+	return i;
+}
+
+static int add_to_flow(struct flow *f, int r)
+{
+	if (f->nreqs == f->cap)
+	{
+		size_t cap = f->cap ? f->cap * 2 : 64;
+		int *grown = realloc(f->reqs, cap * sizeof(int));
+		if (grown == NULL)
+			return -1;
+		f->reqs = grown;
+		f->cap = cap;
+	}
+	f->reqs[f->nreqs++] = r;
+	return 0;
+}
+
+/* Reads the capture at path into memory and sorts its requests into
+ * flows. Returns -1 if it can't be read. */
+static int load_capture(const char *path)
+{
+	unsigned char *buf;
+	size_t size, cap = 0, pos = 8;
+	int64_t first = 0;
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 8)
+	{
+		fprintf(stderr, "Unable to read the capture %s\n", path);
+		return -1;
+	}
+	size = len;
+	rewind(f);
+	if ((buf = malloc(size)) == NULL || fread(buf, 1, size, f) != size ||
+		memcmp(buf, CAPTURE_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s isn't a capture of tnfsd -w\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	while (pos + CAPTURE_RECORD_HDRSZ <= size)
+	{
+		const unsigned char *rec = buf + pos;
+		int64_t at = get32(rec) | (int64_t)get32(rec + 4) << 32;
+		in_addr_t ip;
+		int reqlen = get16(rec + 15), fl;
+
+		if (pos + CAPTURE_RECORD_HDRSZ + reqlen > size)
+			break;
+		pos += CAPTURE_RECORD_HDRSZ + reqlen;
+		if (reqlen < TNFS_HEADERSZ)
+			continue;
+
+		if (nrequests == cap)
+		{
+			cap = cap ? cap * 2 : 4096;
+			struct request *grown = realloc(requests, cap * sizeof(struct request));
+			if (grown == NULL)
+				return -1;
+			requests = grown;
+		}
+		memcpy(&ip, rec + 8, 4);
+		if ((fl = find_flow(ip, get16(rec + 12), rec[14] & CAPTURE_TCP)) < 0)
+			return -1;
+		if (nrequests == 0)
+			first = at;
+		requests[nrequests].at = at - first;
+		requests[nrequests].flow = fl;
+		requests[nrequests].len = reqlen;
+		requests[nrequests].data = rec + CAPTURE_RECORD_HDRSZ;
+		if (add_to_flow(&flows[fl], nrequests) < 0)
+			return -1;
+		nrequests++;
+	}
+	if (pos != size)
+		fprintf(stderr, "Ignoring a partial record at the end of %s\n", path);
+	if ((outcomes = calloc(nrequests ? nrequests : 1, sizeof(struct outcome))) == NULL)
+		return -1;
+	return 0;
+}
+
+/* Replaying */
+
+/* The length of the reply to cmd at the start of buf, or 0 if more of
+ * it is needed. Replies carry no length over TCP, as requests don't. */
+static int reply_len(uint8_t cmd, const unsigned char *buf, int len)
+{
+	int need, pos;
+
+	if (len < TNFS_HEADERSZ + 1)
+		return 0;
+	if (cmd == TNFS_STREAMREAD && (buf[4] == TNFS_SUCCESS || buf[4] == TNFS_EOF))
+	{
+		/* each chunk has its flags, offset and size */
+		if (len < TNFS_HEADERSZ + 1 + TNFS_STREAM_HDRSZ)
+			return 0;
+		need = TNFS_HEADERSZ + 1 + TNFS_STREAM_HDRSZ + get16(buf + TNFS_HEADERSZ + 6);
+		return len >= need ? need : 0;
+	}
+	if (buf[4] != TNFS_SUCCESS)
+		return cmd == TNFS_MOUNT ? TNFS_HEADERSZ + 3 : TNFS_HEADERSZ + 1;
+
+	switch (cmd)
+	{
+	case TNFS_MOUNT:
+		/* windows aren't given over TCP */
+		need = TNFS_HEADERSZ + 5;
+		break;
+	case TNFS_OPENDIR:
+	case TNFS_OPENFILE_OLD:
+	case TNFS_OPENFILE:
+		need = TNFS_HEADERSZ + 2;
+		break;
+	case TNFS_READDIR:
+	{
+		const unsigned char *end = memchr(buf + TNFS_HEADERSZ + 1, 0, len - TNFS_HEADERSZ - 1);
+		if (end == NULL)
+			return 0;
+		return end - buf + 1;
+	}
+	case TNFS_OPENDIRX:
+	case TNFS_SEARCH:
+	case TNFS_WRITEBLOCK:
+		need = TNFS_HEADERSZ + 1 + (cmd == TNFS_WRITEBLOCK ? 2 : 3);
+		break;
+	case TNFS_TELLDIR:
+	case TNFS_SEEKFILE:
+		need = TNFS_HEADERSZ + 5;
+		break;
+	case TNFS_STATFILE:
+		need = TNFS_HEADERSZ + 1 + TNFS_STAT_SIZE;
+		break;
+	case TNFS_READBLOCK:
+		if (len < TNFS_HEADERSZ + 3)
+			return 0;
+		need = TNFS_HEADERSZ + 3 + get16(buf + TNFS_HEADERSZ + 1);
+		break;
+	case TNFS_READDIRX:
+		/* count, status and position, then each entry's flags,
+		 * size, times and name */
+		if (len < TNFS_HEADERSZ + 5)
+			return 0;
+		pos = TNFS_HEADERSZ + 5;
+		for (int i = 0; i < buf[5]; i++)
+		{
+			const unsigned char *end;
+			pos += 13;
+			if (pos >= len || (end = memchr(buf + pos, 0, len - pos)) == NULL)
+				return 0;
+			pos = end - buf + 1;
+		}
+		need = pos;
+		break;
+	default:
+		need = TNFS_HEADERSZ + 1;
+	}
+	return len >= need ? need : 0;
+}
+
+/* Adds the data of a reply to the hash, leaving out the times */
+static uint32_t hash_reply(uint32_t h, uint8_t cmd, const unsigned char *buf, int len)
+{
+	unsigned char data[MAX_REPLYSZ];
+	int n = len - (TNFS_HEADERSZ + 1);
+
+	if (n <= 0 || n > (int)sizeof(data))
+		return h;
+	memcpy(data, buf + TNFS_HEADERSZ + 1, n);
+	if (buf[4] == TNFS_SUCCESS && cmd == TNFS_STATFILE && n >= TNFS_STAT_SIZE)
+	{
+		memset(data + ST_ATIME_OFFSET, 0, 12);
+	}
+	else if (buf[4] == TNFS_SUCCESS && cmd == TNFS_READDIRX && n >= 4)
+	{
+		int pos = 4;
+		for (int i = 0; i < data[0] && pos + 13 < n; i++)
+		{
+			memset(data + pos + 5, 0, 8);
+			pos += 13;
+			while (pos < n && data[pos])
+				pos++;
+			pos++;
+		}
+	}
+
+	/* FNV-1a */
+	for (int i = 0; i < n; i++)
+		h = (h ^ data[i]) * 16777619;
+	return h;
+}
+
+static int send_all(int sock, const unsigned char *buf, int len)
+{
+	while (len > 0)
+	{
+		int n = send(sock, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int connect_flow(struct flow *f)
+{
+	struct client *c = &clients[f->client];
+	struct sockaddr_in local;
+	int one = 1;
+
+	f->sock = socket(AF_INET, f->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (f->sock < 0)
+		return -1;
+	if (c->bind)
+	{
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr = c->addr;
+		if (bind(f->sock, (struct sockaddr *)&local, sizeof(local)) < 0)
+			goto failed;
+	}
+	if (connect(f->sock, (struct sockaddr *)&cfg.server, sizeof(cfg.server)) < 0)
+		goto failed;
+	if (f->tcp)
+		setsockopt(f->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	f->rxlen = 0;
+	return 0;
+
+failed:
+	close(f->sock);
+	f->sock = -1;
+	return -1;
+}
+
+static void close_flow(struct flow *f)
+{
+	if (f->sock >= 0)
+		close(f->sock);
+	f->sock = -1;
+	f->rxlen = 0;
+}
+
+/* Ends the flow's wait for a reply to its request */
+static void finish(struct flow *f, int status)
+{
+	int r = f->pending;
+	uint8_t cmd = requests[r].data[3];
+
+	f->got.status = status;
+	outcomes[r] = f->got;
+	if (status == NO_REPLY)
+		cmds[cmd].unanswered++;
+	else
+		record(&cmds[cmd], outcomes[r].us);
+	f->pending = -1;
+	f->next++;
+}
+
+static void send_request(struct flow *f, int r, int64_t now)
+{
+	struct client *c = &clients[f->client];
+	unsigned char pkt[MAXMSGSZ * 2];
+	int len = requests[r].len;
+	uint16_t sid;
+
+	f->pending = r;
+	f->got.status = NO_REPLY;
+	f->got.len = 0;
+	f->got.hash = 2166136261u;
+	f->got.us = 0;
+	if (len > (int)sizeof(pkt) || (f->sock < 0 && connect_flow(f) < 0))
+	{
+		fprintf(stderr, "Unable to replay request %d: %s\n", r, strerror(errno));
+		finish(f, NO_REPLY);
+		return;
+	}
+
+	/* carry on the capture's sessions with those the server gives */
+	memcpy(pkt, requests[r].data, len);
+	sid = get16(pkt);
+	if (pkt[3] != TNFS_MOUNT && c->mounted)
+	{
+		c->from_sid = sid;
+		c->mounted = false;
+	}
+	if (c->to_sid != 0 && sid == c->from_sid)
+		put16(pkt, c->to_sid);
+	else if (pkt[3] != TNFS_MOUNT)
+		unmapped++;
+
+	f->seqno = pkt[2];
+	f->cmd = pkt[3];
+	f->sent = now;
+	f->deadline = now + cfg.timeout_ms * 1000;
+	if (f->tcp ? send_all(f->sock, pkt, len) < 0 : send(f->sock, pkt, len, 0) < 0)
+	{
+		close_flow(f);
+		finish(f, NO_REPLY);
+	}
+}
+
+/* Takes in a reply to the flow's request */
+static void take_reply(struct flow *f, const unsigned char *buf, int len, int64_t now)
+{
+	struct client *c = &clients[f->client];
+
+	f->got.len += len - TNFS_HEADERSZ;
+	f->got.hash = hash_reply(f->got.hash, f->cmd, buf, len);
+	f->got.us = now - f->sent;
+
+	if (f->cmd == TNFS_MOUNT && buf[4] == TNFS_SUCCESS)
+	{
+		c->to_sid = get16(buf);
+		c->mounted = true;
+	}
+
+	/* a STREAMREAD is answered by chunks up to the last */
+	if (f->cmd == TNFS_STREAMREAD && (buf[4] == TNFS_SUCCESS || buf[4] == TNFS_EOF) &&
+		len >= TNFS_HEADERSZ + 1 + TNFS_STREAM_HDRSZ && !(buf[TNFS_HEADERSZ + 1] & TNFS_STREAM_LAST))
+	{
+		f->deadline = now + cfg.timeout_ms * 1000;
+		return;
+	}
+	finish(f, buf[4]);
+}
+
+static void receive(struct flow *f, int64_t now)
+{
+	unsigned char buf[MAXMSGSZ * 2];
+	int len;
+
+	if (!f->tcp)
+	{
+		while ((len = recv(f->sock, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+		{
+			/* replies to requests given up on, or sent again */
+			if (f->pending < 0 || len < TNFS_HEADERSZ + 1 || buf[2] != f->seqno || buf[3] != f->cmd)
+				stale++;
+			else
+				take_reply(f, buf, len, now);
+		}
+		return;
+	}
+
+	if (f->rxlen == MAX_REPLYSZ)
+	{
+		/* no reply is this long: out of step with the server */
+		stale++;
+		close_flow(f);
+		if (f->pending >= 0)
+			finish(f, NO_REPLY);
+		return;
+	}
+	len = recv(f->sock, f->rxbuf + f->rxlen, MAX_REPLYSZ - f->rxlen, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (len <= 0)
+	{
+		/* the server closed it; the next request connects again */
+		close_flow(f);
+		if (f->pending >= 0)
+			finish(f, NO_REPLY);
+		return;
+	}
+	f->rxlen += len;
+	while (f->pending >= 0 && (len = reply_len(f->cmd, f->rxbuf, f->rxlen)) > 0)
+	{
+		if (f->rxbuf[2] != f->seqno || f->rxbuf[3] != f->cmd)
+		{
+			/* out of step with the server: start afresh */
+			stale++;
+			close_flow(f);
+			finish(f, NO_REPLY);
+			return;
+		}
+		take_reply(f, f->rxbuf, len, now);
+		f->rxlen -= len;
+		memmove(f->rxbuf, f->rxbuf + len, f->rxlen);
+	}
+	if (f->pending < 0 && f->rxlen > 0)
+	{
+		stale++;
+		f->rxlen = 0;
+	}
+}
+
+/* Sends each request when it's due and its flow has had the reply to
+ * the one before. Returns the seconds it took. */
+static double replay()
+{
+	struct pollfd *pfds = calloc(nflows ? nflows : 1, sizeof(struct pollfd));
+	int *polled = calloc(nflows ? nflows : 1, sizeof(int));
+	int64_t start = now_us(), now;
+	size_t done = 0;
+
+	if (pfds == NULL || polled == NULL)
+		return 0;
+	while (true)
+	{
+		int64_t wake;
+		int npfds = 0;
+
+		now = now_us();
+		wake = now + 1000000;
+		done = 0;
+		for (int i = 0; i < nflows; i++)
+		{
+			struct flow *f = &flows[i];
+
+			if (f->pending >= 0 && now >= f->deadline)
+				finish(f, NO_REPLY);
+			while (f->pending < 0 && f->next < f->nreqs)
+			{
+				int r = f->reqs[f->next];
+				int64_t due = cfg.speed > 0 ? start + (int64_t)(requests[r].at / cfg.speed) : now;
+
+				if (due > now)
+				{
+					if (due < wake)
+						wake = due;
+					break;
+				}
+				record(&lag, now - due);
+				send_request(f, r, now);
+			}
+			if (f->pending >= 0)
+			{
+				if (f->deadline < wake)
+					wake = f->deadline;
+				pfds[npfds].fd = f->sock;
+				pfds[npfds].events = POLLIN;
+				polled[npfds++] = i;
+			}
+			done += f->next;
+		}
+		if (done == nrequests)
+			break;
+
+		if (poll(pfds, npfds, wake > now ? (wake - now + 999) / 1000 : 0) < 0 && errno != EINTR)
+			break;
+		now = now_us();
+		for (int p = 0; p < npfds; p++)
+		{
+			if (pfds[p].revents)
+				receive(&flows[polled[p]], now);
+		}
+	}
+	free(pfds);
+	free(polled);
+	return (now_us() - start) / 1e6;
+}
+
+/* Reporting */
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct series *s, double fraction)
+{
+	size_t i = (size_t)(fraction * s->n);
+	if (s->n == 0)
+		return 0;
+	return s->us[i < s->n ? i : s->n - 1];
+}
+
+static void report(double elapsed)
+{
+	uint64_t answered = 0, unanswered = 0;
+
+	printf("%-10s %10s %9s %10s %10s %10s %10s\n",
+		   "command", "requests", "no reply", "p50 us", "p99 us", "p999 us", "max us");
+	for (int cmd = 0; cmd < 256; cmd++)
+	{
+		struct series *s = &cmds[cmd];
+
+		if (s->n == 0 && s->unanswered == 0)
+			continue;
+		qsort(s->us, s->n, sizeof(uint32_t), compare_u32);
+		printf("%-10s %10zu %9" PRIu64 " %10" PRIu32 " %10" PRIu32 " %10" PRIu32 " %10" PRIu32 "\n",
+			   cmd_name(cmd), s->n + s->unanswered, s->unanswered, percentile(s, 0.5),
+			   percentile(s, 0.99), percentile(s, 0.999), s->n ? s->us[s->n - 1] : 0);
+		answered += s->n;
+		unanswered += s->unanswered;
+	}
+
+	qsort(lag.us, lag.n, sizeof(uint32_t), compare_u32);
+	printf("%zu requests from %d clients over %d connections in %.1fs, captured over %.1fs. "
+		   "No reply: %" PRIu64 ", stray replies: %" PRIu64 ", SIDs not mapped: %" PRIu64 ".\n",
+		   nrequests, nclients, nflows, elapsed,
+		   nrequests ? requests[nrequests - 1].at / 1e6 : 0.0, unanswered, stale, unmapped);
+	if (cfg.speed > 0)
+		printf("Sent behind the capture's timing: p50 %" PRIu32 "us, p99 %" PRIu32 "us, max %" PRIu32 "us.\n",
+			   percentile(&lag, 0.5), percentile(&lag, 0.99), lag.n ? lag.us[lag.n - 1] : 0);
+}
+
+static int write_outcomes(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL)
+		return -1;
+	for (size_t r = 0; r < nrequests; r++)
+	{
+		fprintf(f, "%zu %s %d %" PRIu32 " %08" PRIx32 "\n", r, cmd_name(requests[r].data[3]),
+				outcomes[r].status, outcomes[r].len, outcomes[r].hash);
+	}
+	return fclose(f);
+}
+
+/* Returns how many replies differ from those in the file at path, or
+ * -1 if it can't be read */
+static long compare_outcomes(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128], name[32];
+	long diffs = 0;
+	size_t r, seen = 0;
+	int status;
+	uint32_t len, hash;
+
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (sscanf(line, "%zu %31s %d %" SCNu32 " %" SCNx32, &r, name, &status, &len, &hash) != 5 ||
+			r >= nrequests)
+			continue;
+		seen++;
+		if (outcomes[r].status != status || outcomes[r].len != len || outcomes[r].hash != hash)
+		{
+			if (diffs++ < MAX_DIFFS_SHOWN)
+				printf("Request %zu, %s: status %d, %" PRIu32 " bytes, hash %08" PRIx32
+					   " where it was %d, %" PRIu32 " bytes, hash %08" PRIx32 "\n",
+					   r, name, outcomes[r].status, outcomes[r].len, outcomes[r].hash,
+					   status, len, hash);
+		}
+	}
+	fclose(f);
+	return diffs + (long)(nrequests - seen);
+}
+
+static int parse_mapping(char *arg)
+{
+	char *eq = strchr(arg, '=');
+
+	if (eq == NULL || cfg.nmap == MAX_MAPPINGS)
+		return -1;
+	*eq = '\0';
+	if (inet_pton(AF_INET, arg, &cfg.map[cfg.nmap].from) != 1 ||
+		inet_pton(AF_INET, eq + 1, &cfg.map[cfg.nmap].to) != 1)
+		return -1;
+	cfg.nmap++;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [options] <capture>\n"
+			" -s addr       server address (127.0.0.1)\n"
+			" -p port       server port (%d)\n"
+			" -x speed      times the capture's speed, 0 for as fast as replies come (1)\n"
+			" -b addr       replay clients from this address and on\n"
+			"               (127.0.0.2 for a loopback server)\n"
+			" -m from=to    replay the client at address from from address to\n"
+			" -o ms         time to wait for a reply (1000)\n"
+			" -w file       write the outcome of each request to file\n"
+			" -c file       compare the outcomes with those written to file before\n",
+			name, TNFSD_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	const char *addr = "127.0.0.1", *baseaddr = NULL, *outpath = NULL, *comparepath = NULL;
+	int port = TNFSD_PORT, opt;
+	double elapsed;
+	long diffs = 0;
+
+	cfg.speed = 1;
+	cfg.timeout_ms = 1000;
+	while ((opt = getopt(argc, argv, "s:p:x:b:m:o:w:c:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's': addr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'x': cfg.speed = atof(optarg); break;
+		case 'b': baseaddr = optarg; break;
+		case 'm':
+			if (parse_mapping(optarg) < 0)
+			{
+				fprintf(stderr, "Bad mapping %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o': cfg.timeout_ms = atoi(optarg); break;
+		case 'w': outpath = optarg; break;
+		case 'c': comparepath = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || cfg.speed < 0 || cfg.timeout_ms < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	cfg.server.sin_family = AF_INET;
+	cfg.server.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &cfg.server.sin_addr) != 1)
+	{
+		fprintf(stderr, "Bad server address %s\n", addr);
+		return 1;
+	}
+	if (baseaddr != NULL)
+	{
+		if (inet_pton(AF_INET, baseaddr, &cfg.base) != 1)
+		{
+			fprintf(stderr, "Bad address %s\n", baseaddr);
+			return 1;
+		}
+		cfg.bind = true;
+	}
+	else if ((ntohl(cfg.server.sin_addr.s_addr) >> 24) == 127)
+	{
+		cfg.base.s_addr = htonl(0x7f000002);
+		cfg.bind = true;
+	}
+
+	if (load_capture(argv[optind]) < 0)
+		return 1;
+	if (!cfg.bind && nclients - cfg.nmap > 1)
+		fprintf(stderr, "The %d clients of the capture will share an address, and so sessions; "
+				"give them addresses of their own with -b or -m\n", nclients);
+
+	elapsed = replay();
+	report(elapsed);
+
+	if (outpath != NULL && write_outcomes(outpath) != 0)
+	{
+		fprintf(stderr, "Unable to write %s: %s\n", outpath, strerror(errno));
+		return 1;
+	}
+	if (comparepath != NULL)
+	{
+		if ((diffs = compare_outcomes(comparepath)) < 0)
+		{
+			fprintf(stderr, "Unable to read %s: %s\n", comparepath, strerror(errno));
+			return 1;
+		}
+		printf("%ld of %zu replies differ from %s.\n", diffs, nrequests, comparepath);
+	}
+	return diffs > 0 ? 2 : 0;
+}
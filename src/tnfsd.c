@@ -1,14 +1,36 @@
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
 
 #include "auth.h"
+#include "catalog.h"
+#include "search.h"
+#include "settings.h"
+#include "casefold.h"
 #include "datagram.h"
 #include "directory.h"
 #include "errortable.h"
 #include "event.h"
 #include "log.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "capture.h"
+#include "overlay.h"
+#include "tnfs_file.h"
+#include "vfs.h"
 #include "version.h"
 #include "tnfsd.h"
 
+static const char *catalog = NULL;
+static const char *overlays = NULL;
+static bool durable = false;
+static int metrics_port = 0;
+static const char *access_log = NULL;
+static const char *capture = NULL;
+static bool in_memory = false;
+static bool search = false;
+
 void tnfsd_init()
 {
 	tnfs_init();              /* initialize structures etc. */
@@ -21,6 +43,75 @@ void tnfsd_init_logs(int log_output_fd)
 	log_init(log_output);
 }
 
+void tnfsd_use_catalog(const char* catalog_path)
+{
+	catalog = catalog_path;
+}
+
+void tnfsd_fold_case(bool enable)
+{
+	casefold_init(enable);
+}
+
+void tnfsd_index_search(bool enable)
+{
+	search = enable;
+}
+
+int tnfsd_set_limit(const char* assignment)
+{
+	return settings_set(assignment);
+}
+
+int tnfsd_load_limits(const char* path)
+{
+	return settings_load(path);
+}
+
+void tnfsd_use_overlays(const char* overlay_dir)
+{
+	overlays = overlay_dir;
+}
+
+void tnfsd_durable_writes(bool enable)
+{
+	durable = enable;
+	tnfs_file_durable(enable);
+}
+
+void tnfsd_serve_metrics(int port)
+{
+	metrics_port = port;
+}
+
+void tnfsd_access_log(const char* path)
+{
+	access_log = path;
+}
+
+void tnfsd_capture(const char* path)
+{
+	capture = path;
+}
+
+void tnfsd_serve_from_memory(bool enable)
+{
+	in_memory = enable;
+}
+
+int tnfsd_build_catalog(const char* path, const char* catalog_path)
+{
+#ifdef ENABLE_CATALOG
+	if (catalog_open(catalog_path, path) < 0 || catalog_build(catalog_path, path) < 0)
+		return -1;
+	catalog_close();
+	return 0;
+#else
+	LOG("Catalogs aren't supported on this platform\n");
+	return -1;
+#endif
+}
+
 int tnfsd_start(const char* path, int port, bool read_only)
 {
 	LOG("Starting tnfsd version %s on port %d using root directory \"%s\"\n", version, port, path);
@@ -32,26 +123,103 @@ int tnfsd_start(const char* path, int port, bool read_only)
 	{
 		LOG("The server runs in read-write mode. TNFS clients can upload and modify files. Use -r to enable read-only mode.\n");
 	}
+	if (casefold_enabled())
+	{
+		LOG("File names are matched case insensitively.\n");
+	}
+	if (durable)
+	{
+		LOG("WRITEs are acknowledged once they've reached the disk.\n");
+	}
+
+	if (in_memory)
+	{
+		uint32_t files, dirs;
+		uint64_t bytes;
 
+		if (vfs_memory_load(path) < 0)
+		{
+			LOG("Unable to load %s into memory: %s\n", path, strerror(errno));
+			return TNFSD_ERR_INVALID_DIR;
+		}
+		vfs = &vfs_memory;
+		vfs_memory_stats(&files, &dirs, &bytes);
+		LOG("Serving %u files in %u directories from memory, %" PRIu64 " kilobytes. Changes made by clients are lost when the server stops.\n",
+			files, dirs, bytes / 1024);
+	}
 	if (tnfs_setroot(path) < 0)
 	{
 		LOG("Invalid root directory: %s\n", path);
 		return TNFSD_ERR_INVALID_DIR;
 	}
-	tnfs_event_init();        /* initialize event system */
+	/* overlays and catalogs are files beside the tree on disk */
+	if (in_memory && (overlays != NULL || catalog != NULL))
+	{
+		LOG("Overlays and catalogs aren't used for a tree served from memory\n");
+	}
+	else if (overlays != NULL)
+	{
+		overlay_init(overlays, path);
+		if (overlay_enabled())
+			LOG("Clients' writes to existing files go to their overlays in %s\n", overlays);
+	}
+#ifdef ENABLE_CATALOG
+	if (catalog != NULL && !in_memory && catalog_open(catalog, path) < 0)
+	{
+		LOG("Unable to use catalog %s, listing from the filesystem\n", catalog);
+	}
+#endif
+	if (search)
+		search_init(path);    /* start indexing the tree for SEARCH */
+	tnfs_event_init(settings.max_tcp_conn + 2 +  /* initialize event system, with room for the UDP and listening sockets */
+		(metrics_port ? METRICS_MAX_CLIENTS + 1 : 0));
 	if (tnfs_sockinit(port) < 0)  /* initialize communications */
 	{
 		LOG("Can't bind port %d\n", port);
 		return TNFSD_ERR_SOCKET_ERROR;
 	}      
+	if (metrics_port)
+	{
+		if (metrics_init(metrics_port) < 0)
+			LOG("Can't serve metrics on port %d\n", metrics_port);
+		else
+			LOG("Serving metrics at http://127.0.0.1:%d/metrics\n", metrics_port);
+	}
 	auth_init(read_only);     /* initialize authentication */
+	if (access_log != NULL)
+	{
+		if (accesslog_open(access_log) < 0)
+			LOG("Unable to open the access log %s: %s\n", access_log, strerror(errno));
+		else
+			LOG("Logging requests to %s\n", access_log);
+	}
+	if (capture != NULL)
+	{
+		if (capture_open(capture) < 0)
+			LOG("Unable to open the capture %s: %s\n", capture, strerror(errno));
+		else
+			LOG("Capturing requests to %s\n", capture);
+	}
 	tnfs_mainloop();          /* run */
+	LOG("Stopping tnfsd server.\n");
+	metrics_close();
+	accesslog_close();
+	capture_close();
 	tnfs_event_close();
+#ifdef ENABLE_CATALOG
+	catalog_close();
+#endif
 	return 0;
 }
 
 void tnfsd_stop()
 {
-	LOG("Stopping tnfsd server.\n");
+	/* this is a signal handler, which mustn't log; tnfsd_start() says
+	   the server is stopping once the main loop has ended */
 	tnfs_sockclose();
 }
+
+void tnfsd_report_stats()
+{
+	stats_request_report();
+}
@@ -15,6 +15,60 @@ void tnfsd_init();
 // file descriptor. It'll use stderr by default.
 void tnfsd_init_logs(int log_output_fd);
 
+// Serve listings and stats from the catalog file at catalog_path,
+// mapped when the server starts and built first if it's missing.
+// Call before tnfsd_start().
+void tnfsd_use_catalog(const char* catalog_path);
+
+// Resolve file names given by clients case insensitively when they
+// don't exist as given. Call before tnfsd_start().
+void tnfsd_fold_case(bool enable);
+
+// Index the names in the tree when the server starts so clients can
+// SEARCH it. Without it SEARCH is answered with ENOSYS. Call before
+// tnfsd_start().
+void tnfsd_index_search(bool enable);
+
+// Set a limit from NAME=value, named as in config.h: MAX_SESSIONS,
+// MAX_SESSIONS_PER_IP, MAX_TCP_CONN, MAX_FD_PER_CONN, MAX_DHND_PER_CONN,
+// SESSION_TIMEOUT, CONN_TIMEOUT, STATS_INTERVAL, LOG_LEVEL,
+// ACCESS_LOG_SAMPLE, ACCESS_LOG_ROTATE, SLOW_REQUEST_MS, CAPTURE_LIMIT or
+// MEMFS_LIMIT.
+// Call before tnfsd_start(). Returns 0 on success.
+int tnfsd_set_limit(const char* assignment);
+
+// Set the limits in a file of NAME=value lines. Returns 0 on success.
+int tnfsd_load_limits(const char* path);
+
+// Send each client's writes to files that already exist to its own
+// copy-on-write overlay in overlay_dir. Call before tnfsd_start().
+void tnfsd_use_overlays(const char* overlay_dir);
+
+// Acknowledge WRITEs only once the data has reached the disk, rather
+// than gathering them up to write later. Call before tnfsd_start().
+void tnfsd_durable_writes(bool enable);
+
+// Serve the server's metrics in the Prometheus text format over HTTP on
+// port of the loopback interface. Call before tnfsd_start().
+void tnfsd_serve_metrics(int port);
+
+// Log the requests clients make, or a sample of them, to the file or
+// named pipe at path. Call before tnfsd_start().
+void tnfsd_access_log(const char* path);
+
+// Capture the requests clients send, as they arrived, to the file at
+// path for tnfs_replay. Call before tnfsd_start().
+void tnfsd_capture(const char* path);
+
+// Load the tree, a directory or a tar image, into memory at startup
+// and serve it from there rather than the disk. Call before
+// tnfsd_start().
+void tnfsd_serve_from_memory(bool enable);
+
+// Build or refresh the catalog file at catalog_path for the tree
+// at path without starting the server. Returns 0 on success.
+int tnfsd_build_catalog(const char* path, const char* catalog_path);
+
 // Start the TNFS server. The function will block until
 // the server is stopped with tnfsd_stop().
 //
@@ -25,4 +79,8 @@ int tnfsd_start(const char* path, int port, bool read_only);
 // Stop the TNFS server and deallocate memory.
 void tnfsd_stop();
 
+// Log the server stats, with the counts and latencies of each command,
+// on the next pass of the main loop. Can be used as a signal handler.
+void tnfsd_report_stats();
+
 #endif
\ No newline at end of file
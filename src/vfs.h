@@ -0,0 +1,90 @@
+#ifndef _TNFS_VFS_H
+#define _TNFS_VFS_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * The filesystem the tree is served from.
+ *
+ * The command handlers, and the archive, search and case folding code
+ * below them, reach files and directories through vfs rather than the
+ * OS. vfs_posix, the default, is the OS's own filesystem with open
+ * files shared through the filetable. vfs_memory serves a tree held in
+ * RAM, loaded at startup from a directory or a tar image.
+ *
+ * The operations behave like the POSIX calls they're named after,
+ * returning -1 (NULL for realpath, opendir and readdir) with errno set
+ * on failure. Descriptors are positive. Overlays and archive members
+ * sit above the backend with descriptors of their own.
+ *
+ * */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+typedef struct _vfs_dir vfs_dir;
+
+typedef struct _tnfs_vfs
+{
+	const char *name;
+
+	int (*open)(const char *path, int flags, int mode);
+	int (*read)(int fd, void *buf, int size);
+	int (*pread)(int fd, void *buf, int size, off_t offset);
+	int (*write)(int fd, const void *buf, int size);
+	off_t (*lseek)(int fd, off_t offset, int whence);
+	int (*sync)(int fd);
+	int (*close)(int fd);
+	/* the OS descriptor behind fd, for sendfile(), or -1 if none */
+	int (*osfd)(int fd);
+
+	int (*stat)(const char *path, struct stat *st);
+	int (*lstat)(const char *path, struct stat *st);
+	int (*unlink)(const char *path);
+	int (*rename)(const char *from, const char *to);
+	int (*mkdir)(const char *path);
+	int (*rmdir)(const char *path);
+	/* resolved must hold MAX_FILEPATH bytes */
+	char *(*realpath)(const char *path, char *resolved);
+
+	vfs_dir *(*opendir)(const char *path);
+	/* the name of the next entry, "." and ".." included */
+	const char *(*readdir)(vfs_dir *dir);
+	long (*telldir)(vfs_dir *dir);
+	void (*seekdir)(vfs_dir *dir, long pos);
+	int (*closedir)(vfs_dir *dir);
+} tnfs_vfs;
+
+/* The backend in use */
+extern const tnfs_vfs *vfs;
+
+extern const tnfs_vfs vfs_posix;
+extern const tnfs_vfs vfs_memory;
+
+/* Load the directory tree or tar image at source into vfs_memory, which
+ * then serves it at the path source. Returns -1 with errno set if it
+ * can't be read or won't fit in MEMFS_LIMIT. */
+int vfs_memory_load(const char *source);
+
+/* Files and directories held in memory, and the bytes they take */
+void vfs_memory_stats(uint32_t *files, uint32_t *dirs, uint64_t *bytes);
+
+#endif
@@ -0,0 +1,1277 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * A tree served from memory.
+ *
+ * The tree is read at startup from a directory, or from a tar image
+ * (ustar, with GNU and pax long names), and answers for the path it was
+ * loaded from. Nothing is written back: files clients create or change
+ * live until the server stops. A directory's entries are kept sorted by
+ * name, and listings are taken as a snapshot when the directory is
+ * opened. Everything held, written files included, is kept under
+ * MEMFS_LIMIT megabytes.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "vfs.h"
+#include "settings.h"
+#include "bsdcompat.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef O_ACCMODE
+#define O_ACCMODE (O_RDONLY | O_WRONLY | O_RDWR)
+#endif
+
+#define TAR_BLOCK 512
+#define DIR_SIZE 4096		/* the size directories report, as they do on most disks */
+
+typedef struct _memnode
+{
+	char *name;
+	struct _memnode *parent;	/* NULL for the root */
+	mode_t mode;			/* S_IFDIR or S_IFREG and the permissions */
+	ino_t ino;
+	time_t atime, mtime, ctime;
+	/* a file's data */
+	unsigned char *data;
+	size_t size, cap;
+	/* a directory's entries, sorted by name */
+	struct _memnode **children;
+	uint32_t nchildren, maxchildren;
+	int opens;			/* descriptors open on it */
+	bool unlinked;			/* freed once the last is closed */
+} memnode;
+
+typedef struct _memfile
+{
+	memnode *node;			/* NULL if not in use */
+	off_t pos;
+	int flags;
+} memfile;
+
+/* The names of a directory when it was opened */
+struct _vfs_dir
+{
+	uint32_t count, pos;
+	uint32_t *offsets;
+	char *names;
+};
+
+static char mount[MAX_FILEPATH];	/* the path the tree is served at */
+static size_t mountlen;
+static memnode *mroot;
+static memfile *mfiles;			/* descriptor n is mfiles[n - 1] */
+static int nmfiles;
+static uint64_t used;
+static uint32_t nfiles, ndirs;
+static ino_t next_ino = 1;
+
+/* Takes bytes more of the MEMFS_LIMIT, or fails with ENOSPC */
+static int _charge(size_t bytes)
+{
+	if (settings.memfs_limit > 0 &&
+		used + bytes > (uint64_t)settings.memfs_limit * 1024 * 1024)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+	used += bytes;
+	return 0;
+}
+
+static memnode *_node_new(const char *name, mode_t mode)
+{
+	size_t len = strlen(name) + 1;
+	memnode *n;
+
+	if (_charge(sizeof(memnode) + len) < 0)
+		return NULL;
+	if ((n = calloc(1, sizeof(memnode))) == NULL || (n->name = malloc(len)) == NULL)
+	{
+		free(n);
+		used -= sizeof(memnode) + len;
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(n->name, name, len);
+	n->mode = mode;
+	n->ino = next_ino++;
+	n->atime = n->mtime = n->ctime = time(NULL);
+	if (S_ISDIR(mode))
+		ndirs++;
+	else
+		nfiles++;
+	return n;
+}
+
+static void _node_free(memnode *n)
+{
+	for (uint32_t i = 0; i < n->nchildren; i++)
+		_node_free(n->children[i]);
+	used -= sizeof(memnode) + strlen(n->name) + 1 + n->cap;
+	if (S_ISDIR(n->mode))
+		ndirs--;
+	else
+		nfiles--;
+	free(n->children);
+	free(n->data);
+	free(n->name);
+	free(n);
+}
+
+/* Index of name among dir's entries, or where it would go */
+static uint32_t _child_pos(memnode *dir, const char *name, bool *found)
+{
+	uint32_t lo = 0, hi = dir->nchildren;
+
+	*found = false;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(dir->children[mid]->name, name);
+		if (c == 0)
+		{
+			*found = true;
+			return mid;
+		}
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static memnode *_child(memnode *dir, const char *name)
+{
+	bool found;
+	uint32_t i = _child_pos(dir, name, &found);
+
+	return found ? dir->children[i] : NULL;
+}
+
+/* Makes sure another entry fits in dir */
+static int _make_room(memnode *dir)
+{
+	if (dir->nchildren == dir->maxchildren)
+	{
+		uint32_t max = dir->maxchildren ? dir->maxchildren * 2 : 8;
+		memnode **children = realloc(dir->children, max * sizeof(memnode *));
+		if (children == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		dir->children = children;
+		dir->maxchildren = max;
+	}
+	return 0;
+}
+
+static int _attach(memnode *dir, memnode *n)
+{
+	bool found;
+	uint32_t i;
+
+	if (_make_room(dir) < 0)
+		return -1;
+	i = _child_pos(dir, n->name, &found);
+	memmove(dir->children + i + 1, dir->children + i,
+			(dir->nchildren - i) * sizeof(memnode *));
+	dir->children[i] = n;
+	dir->nchildren++;
+	n->parent = dir;
+	dir->mtime = dir->ctime = time(NULL);
+	return 0;
+}
+
+static void _detach(memnode *n)
+{
+	memnode *dir = n->parent;
+	bool found;
+	uint32_t i = _child_pos(dir, n->name, &found);
+
+	memmove(dir->children + i, dir->children + i + 1,
+			(dir->nchildren - i - 1) * sizeof(memnode *));
+	dir->nchildren--;
+	n->parent = NULL;
+	dir->mtime = dir->ctime = time(NULL);
+}
+
+/* Takes n out of the tree, freeing it unless it's still open */
+static void _remove(memnode *n)
+{
+	_detach(n);
+	if (n->opens > 0)
+		n->unlinked = true;
+	else
+		_node_free(n);
+}
+
+/* Collapses runs of slashes and drops a trailing one */
+static void _collapse(char *s)
+{
+	char *out = s;
+
+	for (char *in = s; *in; in++)
+	{
+		if (*in == '/' && out > s && out[-1] == '/')
+			continue;
+		*out++ = *in;
+	}
+	if (out > s + 1 && out[-1] == '/')
+		out--;
+	*out = '\0';
+}
+
+/* Puts the path below the mount point, with . and .. resolved, in rel:
+ * "" for the root, otherwise names separated by single slashes */
+static int _relative(const char *path, char *rel)
+{
+	char buf[MAX_FILEPATH];
+	const char *p;
+	size_t len = 0;
+
+	if (strlcpy(buf, path, sizeof(buf)) >= sizeof(buf))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	_collapse(buf);
+	if (mroot == NULL || strncmp(buf, mount, mountlen) != 0 ||
+		(buf[mountlen] != '\0' && buf[mountlen] != '/'))
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	for (p = buf + mountlen; *p; )
+	{
+		const char *end;
+		size_t n;
+
+		while (*p == '/')
+			p++;
+		if ((end = strchr(p, '/')) == NULL)
+			end = p + strlen(p);
+		n = end - p;
+		if (n == 0 || (n == 1 && p[0] == '.'))
+		{
+			/* nothing to add */
+		}
+		else if (n == 2 && p[0] == '.' && p[1] == '.')
+		{
+			/* nothing above the mount point is served */
+			if (len == 0)
+			{
+				errno = ENOENT;
+				return -1;
+			}
+			while (len > 0 && rel[len - 1] != '/')
+				len--;
+			if (len > 0)
+				len--;
+		}
+		else
+		{
+			if (len > 0)
+				rel[len++] = '/';
+			memcpy(rel + len, p, n);
+			len += n;
+		}
+		p = end;
+	}
+	rel[len] = '\0';
+	return 0;
+}
+
+static memnode *_walk(const char *rel)
+{
+	char name[MAX_FILEPATH];
+	memnode *n = mroot;
+
+	while (*rel)
+	{
+		const char *end = strchr(rel, '/');
+		size_t len = end ? (size_t)(end - rel) : strlen(rel);
+
+		if (!S_ISDIR(n->mode))
+		{
+			errno = ENOTDIR;
+			return NULL;
+		}
+		memcpy(name, rel, len);
+		name[len] = '\0';
+		if ((n = _child(n, name)) == NULL)
+		{
+			errno = ENOENT;
+			return NULL;
+		}
+		rel += len;
+		if (*rel == '/')
+			rel++;
+	}
+	return n;
+}
+
+static memnode *_lookup(const char *path)
+{
+	char rel[MAX_FILEPATH];
+
+	if (_relative(path, rel) < 0)
+		return NULL;
+	return _walk(rel);
+}
+
+/* The directory path would be made in, with leaf set to its name. rel
+ * is scratch space of MAX_FILEPATH bytes. */
+static memnode *_lookup_parent(const char *path, char *rel, const char **leaf)
+{
+	char *slash;
+	memnode *dir;
+
+	if (_relative(path, rel) < 0)
+		return NULL;
+	if (*rel == '\0')
+	{
+		/* the root is always there */
+		errno = EEXIST;
+		return NULL;
+	}
+	if ((slash = strrchr(rel, '/')) == NULL)
+	{
+		*leaf = rel;
+		dir = mroot;
+	}
+	else
+	{
+		*slash = '\0';
+		*leaf = slash + 1;
+		dir = _walk(rel);
+	}
+	if (dir != NULL && !S_ISDIR(dir->mode))
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+	return dir;
+}
+
+/* Gives a file room for exactly cap bytes of data */
+static int _resize(memnode *n, size_t cap)
+{
+	unsigned char *data;
+
+	if (_charge(cap - n->cap) < 0)
+		return -1;
+	if ((data = realloc(n->data, cap)) == NULL)
+	{
+		used -= cap - n->cap;
+		errno = ENOMEM;
+		return -1;
+	}
+	n->data = data;
+	n->cap = cap;
+	return 0;
+}
+
+/* Makes room for size bytes of a file's data, with more to come */
+static int _reserve(memnode *n, size_t size)
+{
+	size_t cap;
+
+	if (size <= n->cap)
+		return 0;
+	for (cap = n->cap ? n->cap : 4096; cap < size; cap *= 2)
+		;
+	return _resize(n, cap);
+}
+
+static memfile *_file(int fd)
+{
+	if (fd < 1 || fd > nmfiles || mfiles[fd - 1].node == NULL)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &mfiles[fd - 1];
+}
+
+static int _open(const char *path, int flags, int mode)
+{
+	char rel[MAX_FILEPATH];
+	const char *leaf;
+	memnode *n, *dir;
+	int accmode = flags & O_ACCMODE;
+	int fd;
+
+	if ((n = _lookup(path)) != NULL)
+	{
+		if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL))
+		{
+			errno = EEXIST;
+			return -1;
+		}
+		if (S_ISDIR(n->mode) && accmode != O_RDONLY)
+		{
+			errno = EISDIR;
+			return -1;
+		}
+		if ((flags & O_TRUNC) && accmode != O_RDONLY && S_ISREG(n->mode))
+		{
+			n->size = 0;
+			n->mtime = n->ctime = time(NULL);
+		}
+	}
+	else
+	{
+		if (errno != ENOENT || !(flags & O_CREAT))
+			return -1;
+		if ((dir = _lookup_parent(path, rel, &leaf)) == NULL)
+			return -1;
+		if ((n = _node_new(leaf, S_IFREG | (mode & 07777))) == NULL)
+			return -1;
+		if (_attach(dir, n) < 0)
+		{
+			_node_free(n);
+			return -1;
+		}
+	}
+
+	for (fd = 0; fd < nmfiles && mfiles[fd].node != NULL; fd++)
+		;
+	if (fd == nmfiles)
+	{
+		int max = nmfiles ? nmfiles * 2 : 64;
+		memfile *grown = realloc(mfiles, max * sizeof(memfile));
+		if (grown == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(grown + nmfiles, 0, (max - nmfiles) * sizeof(memfile));
+		mfiles = grown;
+		nmfiles = max;
+	}
+	mfiles[fd].node = n;
+	mfiles[fd].pos = 0;
+	mfiles[fd].flags = flags;
+	n->opens++;
+	return fd + 1;
+}
+
+static int _pread(int fd, void *buf, int size, off_t offset)
+{
+	memfile *f = _file(fd);
+
+	if (f == NULL)
+		return -1;
+	if ((f->flags & O_ACCMODE) == O_WRONLY)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (S_ISDIR(f->node->mode))
+	{
+		errno = EISDIR;
+		return -1;
+	}
+	if (offset < 0 || size < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if ((size_t)offset >= f->node->size)
+		return 0;
+	if ((size_t)size > f->node->size - offset)
+		size = f->node->size - offset;
+	memcpy(buf, f->node->data + offset, size);
+	return size;
+}
+
+static int _read(int fd, void *buf, int size)
+{
+	int n = _pread(fd, buf, size, _file(fd) ? mfiles[fd - 1].pos : 0);
+
+	if (n > 0)
+		mfiles[fd - 1].pos += n;
+	return n;
+}
+
+static int _write(int fd, const void *buf, int size)
+{
+	memfile *f = _file(fd);
+	memnode *n;
+	size_t end;
+
+	if (f == NULL)
+		return -1;
+	if ((f->flags & O_ACCMODE) == O_RDONLY)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	n = f->node;
+	if (f->flags & O_APPEND)
+		f->pos = n->size;
+	end = f->pos + size;
+	if (_reserve(n, end) < 0)
+		return -1;
+	/* a write past the end leaves a hole of zeroes */
+	if ((size_t)f->pos > n->size)
+		memset(n->data + n->size, 0, f->pos - n->size);
+	memcpy(n->data + f->pos, buf, size);
+	if (end > n->size)
+		n->size = end;
+	f->pos = end;
+	n->mtime = n->ctime = time(NULL);
+	return size;
+}
+
+static off_t _lseek(int fd, off_t offset, int whence)
+{
+	memfile *f = _file(fd);
+	off_t pos;
+
+	if (f == NULL)
+		return -1;
+	switch (whence)
+	{
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = f->pos + offset;
+		break;
+	case SEEK_END:
+		pos = f->node->size + offset;
+		break;
+	default:
+		pos = -1;
+		break;
+	}
+	if (pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	f->pos = pos;
+	return pos;
+}
+
+static int _sync(int fd)
+{
+	return _file(fd) == NULL ? -1 : 0;
+}
+
+static int _close(int fd)
+{
+	memfile *f = _file(fd);
+	memnode *n;
+
+	if (f == NULL)
+		return -1;
+	n = f->node;
+	f->node = NULL;
+	if (--n->opens == 0 && n->unlinked)
+		_node_free(n);
+	return 0;
+}
+
+/* There's no OS descriptor to send from */
+static int _osfd(int fd)
+{
+	return -1;
+}
+
+static void _fill_stat(memnode *n, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = n->mode;
+	st->st_ino = n->ino;
+	st->st_nlink = S_ISDIR(n->mode) ? 2 : 1;
+	st->st_size = S_ISDIR(n->mode) ? DIR_SIZE : n->size;
+	st->st_atime = n->atime;
+	st->st_mtime = n->mtime;
+	st->st_ctime = n->ctime;
+}
+
+static int _stat(const char *path, struct stat *st)
+{
+	memnode *n = _lookup(path);
+
+	if (n == NULL)
+		return -1;
+	_fill_stat(n, st);
+	return 0;
+}
+
+static int _unlink(const char *path)
+{
+	memnode *n = _lookup(path);
+
+	if (n == NULL)
+		return -1;
+	if (S_ISDIR(n->mode))
+	{
+		errno = EISDIR;
+		return -1;
+	}
+	_remove(n);
+	return 0;
+}
+
+static int _rename(const char *from, const char *to)
+{
+	char rel[MAX_FILEPATH], fromrel[MAX_FILEPATH];
+	const char *leaf;
+	memnode *n, *dir, *old;
+	char *name;
+	size_t len;
+
+	if (_relative(from, fromrel) < 0 || (n = _walk(fromrel)) == NULL)
+		return -1;
+	if (n == mroot)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+	if ((dir = _lookup_parent(to, rel, &leaf)) == NULL)
+		return -1;
+	/* a directory can't go inside itself */
+	for (memnode *d = dir; d != NULL; d = d->parent)
+	{
+		if (d == n)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if ((old = _child(dir, leaf)) != NULL)
+	{
+		if (old == n)
+			return 0;
+		if (S_ISDIR(old->mode) && !S_ISDIR(n->mode))
+		{
+			errno = EISDIR;
+			return -1;
+		}
+		if (!S_ISDIR(old->mode) && S_ISDIR(n->mode))
+		{
+			errno = ENOTDIR;
+			return -1;
+		}
+		if (old->nchildren > 0)
+		{
+			errno = ENOTEMPTY;
+			return -1;
+		}
+	}
+
+	len = strlen(leaf) + 1;
+	if (_make_room(dir) < 0)
+		return -1;
+	if ((name = malloc(len)) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(name, leaf, len);
+	if (old != NULL)
+		_remove(old);
+	_detach(n);
+	used += len;
+	used -= strlen(n->name) + 1;
+	free(n->name);
+	n->name = name;
+	n->ctime = time(NULL);
+	/* room was made for it above, so this can't fail */
+	_attach(dir, n);
+	return 0;
+}
+
+static int _mkdir(const char *path)
+{
+	char rel[MAX_FILEPATH];
+	const char *leaf;
+	memnode *dir, *n;
+
+	if ((dir = _lookup_parent(path, rel, &leaf)) == NULL)
+		return -1;
+	if (_child(dir, leaf) != NULL)
+	{
+		errno = EEXIST;
+		return -1;
+	}
+	if ((n = _node_new(leaf, S_IFDIR | 0755)) == NULL)
+		return -1;
+	if (_attach(dir, n) < 0)
+	{
+		_node_free(n);
+		return -1;
+	}
+	return 0;
+}
+
+static int _rmdir(const char *path)
+{
+	memnode *n = _lookup(path);
+
+	if (n == NULL)
+		return -1;
+	if (!S_ISDIR(n->mode))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (n == mroot)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+	if (n->nchildren > 0)
+	{
+		errno = ENOTEMPTY;
+		return -1;
+	}
+	_remove(n);
+	return 0;
+}
+
+static char *_realpath(const char *path, char *resolved)
+{
+	char rel[MAX_FILEPATH];
+
+	if (_relative(path, rel) < 0 || _walk(rel) == NULL)
+		return NULL;
+	if (snprintf(resolved, MAX_FILEPATH, "%s%s%s", mount,
+				 *rel || mountlen == 0 ? "/" : "", rel) >= MAX_FILEPATH)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return resolved;
+}
+
+static vfs_dir *_opendir(const char *path)
+{
+	memnode *n = _lookup(path);
+	size_t namesz = sizeof(".") + sizeof("..");
+	uint32_t count, off;
+	vfs_dir *d;
+
+	if (n == NULL)
+		return NULL;
+	if (!S_ISDIR(n->mode))
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+	count = n->nchildren + 2;
+	for (uint32_t i = 0; i < n->nchildren; i++)
+		namesz += strlen(n->children[i]->name) + 1;
+	if ((d = malloc(sizeof(vfs_dir) + count * sizeof(uint32_t) + namesz)) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	d->count = count;
+	d->pos = 0;
+	d->offsets = (uint32_t *)(d + 1);
+	d->names = (char *)(d->offsets + count);
+
+	memcpy(d->names, ".\0..", sizeof(".") + sizeof(".."));
+	d->offsets[0] = 0;
+	d->offsets[1] = sizeof(".");
+	off = sizeof(".") + sizeof("..");
+	for (uint32_t i = 0; i < n->nchildren; i++)
+	{
+		size_t len = strlen(n->children[i]->name) + 1;
+		memcpy(d->names + off, n->children[i]->name, len);
+		d->offsets[i + 2] = off;
+		off += len;
+	}
+	return d;
+}
+
+static const char *_readdir(vfs_dir *d)
+{
+	if (d->pos >= d->count)
+		return NULL;
+	return d->names + d->offsets[d->pos++];
+}
+
+static long _telldir(vfs_dir *d)
+{
+	return d->pos;
+}
+
+static void _seekdir(vfs_dir *d, long pos)
+{
+	d->pos = pos < 0 ? 0 : pos > (long)d->count ? d->count : (uint32_t)pos;
+}
+
+static int _closedir(vfs_dir *d)
+{
+	free(d);
+	return 0;
+}
+
+const tnfs_vfs vfs_memory = {
+	"memory",
+	_open,
+	_read,
+	_pread,
+	_write,
+	_lseek,
+	_sync,
+	_close,
+	_osfd,
+	_stat,
+	_stat,
+	_unlink,
+	_rename,
+	_mkdir,
+	_rmdir,
+	_realpath,
+	_opendir,
+	_readdir,
+	_telldir,
+	_seekdir,
+	_closedir
+};
+
+/* Finds or makes the entry at rel, making the directories on the way.
+ * An existing file is emptied to be loaded again. */
+static memnode *_preload_node(const char *rel, mode_t mode, time_t mtime)
+{
+	char name[MAX_FILEPATH];
+	memnode *dir = mroot, *n = mroot;
+
+	while (*rel)
+	{
+		const char *end = strchr(rel, '/');
+		size_t len = end ? (size_t)(end - rel) : strlen(rel);
+		bool last = end == NULL || end[1] == '\0';
+
+		memcpy(name, rel, len);
+		name[len] = '\0';
+		rel += len;
+		if (*rel == '/')
+			rel++;
+		if (len == 0 || strcmp(name, ".") == 0)
+			continue;
+		if (strcmp(name, "..") == 0)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if ((n = _child(dir, name)) == NULL)
+		{
+			if ((n = _node_new(name, last ? mode : S_IFDIR | 0755)) == NULL)
+				return NULL;
+			if (_attach(dir, n) < 0)
+			{
+				_node_free(n);
+				return NULL;
+			}
+		}
+		if (!S_ISDIR(n->mode))
+		{
+			if (!last)
+			{
+				errno = ENOTDIR;
+				return NULL;
+			}
+			n->size = 0;
+		}
+		dir = n;
+	}
+	if (S_ISDIR(n->mode) != S_ISDIR(mode))
+	{
+		errno = EEXIST;
+		return NULL;
+	}
+	n->mode = mode;
+	n->mtime = n->ctime = mtime;
+	return n;
+}
+
+/* Reads size bytes from fd into a file's data */
+static int _preload_data(memnode *n, int fd, size_t size)
+{
+	size_t got = 0;
+	ssize_t r;
+
+	if (size > n->cap && _resize(n, size) < 0)
+		return -1;
+	while (got < size)
+	{
+		if ((r = read(fd, n->data + got, size - got)) <= 0)
+		{
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+		got += r;
+	}
+	n->size = size;
+	return 0;
+}
+
+/* Loads the directory at path into rel, which has room for
+ * MAX_FILEPATH bytes and is put back as it was */
+static int _preload_dir(const char *path, char *rel)
+{
+	char full[MAX_FILEPATH];
+	size_t rellen = strlen(rel);
+	struct dirent *de;
+	struct stat st;
+	memnode *n;
+	DIR *dp;
+	int fd, err = 0;
+
+	if ((dp = opendir(path)) == NULL)
+		return -1;
+	while (err == 0 && (de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(full, sizeof(full), "%s/%s", path, de->d_name) >= (int)sizeof(full) ||
+			snprintf(rel + rellen, MAX_FILEPATH - rellen, "%s%s",
+					 rellen ? "/" : "", de->d_name) >= (int)(MAX_FILEPATH - rellen))
+		{
+			err = ENAMETOOLONG;
+			break;
+		}
+		if (stat(full, &st) != 0)
+			continue;
+#ifndef WIN32
+		/* a linked directory would be loaded again under the link's
+		 * name, without end if it leads back up */
+		struct stat lst;
+		if (S_ISDIR(st.st_mode) && lstat(full, &lst) == 0 && S_ISLNK(lst.st_mode))
+			continue;
+#endif
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+			continue;
+
+		if ((n = _preload_node(rel, st.st_mode & (S_IFMT | 07777), st.st_mtime)) == NULL)
+		{
+			err = errno;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			if (_preload_dir(full, rel) < 0)
+				err = errno;
+		}
+		else if ((fd = open(full, O_RDONLY | O_BINARY)) < 0)
+		{
+			err = errno;
+		}
+		else
+		{
+			if (_preload_data(n, fd, st.st_size) < 0)
+				err = errno;
+			close(fd);
+		}
+		rel[rellen] = '\0';
+	}
+	closedir(dp);
+	rel[rellen] = '\0';
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Parses a tar numeric field: octal, or base-256 with the top bit set */
+static uint64_t _tar_number(const unsigned char *p, int len)
+{
+	uint64_t v = 0;
+
+	if (p[0] & 0x80)
+	{
+		v = p[0] & 0x7f;
+		for (int i = 1; i < len; i++)
+			v = (v << 8) | p[i];
+		return v;
+	}
+	int i = 0;
+	while (i < len && p[i] == ' ')
+		i++;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		v = (v << 3) | (p[i] - '0');
+	return v;
+}
+
+static bool _tar_checksum_ok(const unsigned char *h)
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : h[i];
+	return sum == _tar_number(h + 148, 8);
+}
+
+static int _read_block(int fd, unsigned char *block)
+{
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < TAR_BLOCK)
+	{
+		if ((r = read(fd, block + got, TAR_BLOCK - got)) <= 0)
+		{
+			if (r == 0 && got == 0)
+				return 0;
+			/* a block cut short isn't a tar image */
+			if (r == 0)
+				errno = EINVAL;
+			return -1;
+		}
+		got += r;
+	}
+	return 1;
+}
+
+/* Reads an entry's data of size bytes into a buffer of its own, which
+ * the caller frees */
+static char *_tar_string(int fd, uint64_t size)
+{
+	unsigned char block[TAR_BLOCK];
+	char *s;
+
+	if (size >= MAX_FILEPATH * 64 || (s = malloc(size + 1)) == NULL)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	for (uint64_t got = 0; got < size; got += TAR_BLOCK)
+	{
+		if (_read_block(fd, block) <= 0)
+		{
+			free(s);
+			errno = EINVAL;
+			return NULL;
+		}
+		memcpy(s + got, block, size - got < TAR_BLOCK ? size - got : TAR_BLOCK);
+	}
+	s[size] = '\0';
+	return s;
+}
+
+/* Finds the path of a pax extended header's "len path=value\n" records */
+static bool _pax_path(char *records, uint64_t size, char *path)
+{
+	char *p = records, *end = records + size;
+
+	while (p < end)
+	{
+		char *rec = p, *kv;
+		long len = strtol(p, &kv, 10);
+		if (len <= 0 || rec + len > end || *kv != ' ')
+			break;
+		kv++;
+		if (strncmp(kv, "path=", 5) == 0 && rec[len - 1] == '\n')
+		{
+			size_t n = rec + len - 1 - (kv + 5);
+			if (n < MAX_FILEPATH)
+			{
+				memcpy(path, kv + 5, n);
+				path[n] = '\0';
+				return true;
+			}
+		}
+		p = rec + len;
+	}
+	return false;
+}
+
+static int _preload_tar(const char *path)
+{
+	unsigned char h[TAR_BLOCK];
+	char name[MAX_FILEPATH], longname[MAX_FILEPATH];
+	bool have_longname = false;
+	memnode *n;
+	int fd, r, err = 0;
+
+	if ((fd = open(path, O_RDONLY | O_BINARY)) < 0)
+		return -1;
+	while (err == 0 && (r = _read_block(fd, h)) > 0)
+	{
+		uint64_t size = _tar_number(h + 124, 12);
+		mode_t mode = _tar_number(h + 100, 8) & 07777;
+		time_t mtime = (time_t)_tar_number(h + 136, 12);
+		char type = h[156];
+		char *s;
+
+		/* the archive ends with blocks of zeroes */
+		if (h[0] == '\0')
+			break;
+		if (!_tar_checksum_ok(h))
+		{
+			err = EINVAL;
+			break;
+		}
+
+		if (type == 'L' || type == 'x')
+		{
+			/* the long name of the entry that follows */
+			if ((s = _tar_string(fd, size)) == NULL)
+			{
+				err = errno;
+				break;
+			}
+			if (type == 'L')
+			{
+				have_longname = strlcpy(longname, s, sizeof(longname)) < sizeof(longname);
+			}
+			else if (_pax_path(s, size, longname))
+			{
+				have_longname = true;
+			}
+			free(s);
+			continue;
+		}
+
+		if (have_longname)
+		{
+			strlcpy(name, longname, sizeof(name));
+		}
+		else if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0')
+		{
+			snprintf(name, sizeof(name), "%.155s/%.100s", (char *)h + 345, (char *)h);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "%.100s", (char *)h);
+		}
+		have_longname = false;
+
+		if (type == '5' || type == '0' || type == '\0' || type == '7')
+		{
+			bool isdir = type == '5';
+			if ((n = _preload_node(name, (isdir ? S_IFDIR : S_IFREG) | mode, mtime)) == NULL)
+			{
+				err = errno;
+				break;
+			}
+			if (!isdir)
+			{
+				if (_preload_data(n, fd, size) < 0)
+				{
+					err = errno;
+					break;
+				}
+				/* the data is padded out to a whole block */
+				size = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+			}
+			else
+			{
+				size = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+			}
+		}
+		else
+		{
+			/* links, devices and the like aren't served */
+			size = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+		}
+		if (size > 0 && lseek(fd, (off_t)size, SEEK_CUR) < 0)
+			err = errno;
+	}
+	if (err == 0 && r < 0)
+		err = errno;
+	close(fd);
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int vfs_memory_load(const char *source)
+{
+	char rel[MAX_FILEPATH] = "";
+	struct stat st;
+	int result;
+
+	if (stat(source, &st) != 0)
+		return -1;
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (strlcpy(mount, source, sizeof(mount)) >= sizeof(mount))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	_collapse(mount);
+	/* served at / after a chroot */
+	if (strcmp(mount, "/") == 0)
+		mount[0] = '\0';
+	mountlen = strlen(mount);
+
+	if (mroot != NULL)
+		_node_free(mroot);
+	if ((mroot = _node_new("", S_IFDIR | 0755)) == NULL)
+		return -1;
+	mroot->mtime = mroot->ctime = st.st_mtime;
+
+	result = S_ISDIR(st.st_mode) ? _preload_dir(source, rel) : _preload_tar(source);
+	if (result < 0)
+	{
+		int err = errno;
+		_node_free(mroot);
+		mroot = NULL;
+		errno = err;
+	}
+	return result;
+}
+
+void vfs_memory_stats(uint32_t *files, uint32_t *dirs, uint64_t *bytes)
+{
+	*files = nfiles;
+	*dirs = ndirs;
+	*bytes = used;
+}
@@ -0,0 +1,210 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * The OS's own filesystem, the default backend. Files opened the same
+ * way by several sessions share one OS descriptor through the
+ * filetable.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#endif
+
+#include "config.h"
+#include "vfs.h"
+#include "filetable.h"
+#include "bsdcompat.h"
+
+const tnfs_vfs *vfs = &vfs_posix;
+
+static int _open(const char *path, int flags, int mode)
+{
+	int fd;
+
+	if ((fd = filetable_open(path, flags, mode)) != 0)
+		return fd;
+	return open(path, flags, mode);
+}
+
+static int _read(int fd, void *buf, int size)
+{
+	if (IS_SHAREDFD(fd))
+		return filetable_read(fd, buf, size);
+	return read(fd, buf, (size_t)size);
+}
+
+static int _pread(int fd, void *buf, int size, off_t offset)
+{
+	if (IS_SHAREDFD(fd))
+		return filetable_pread(fd, buf, size, offset);
+#ifdef WIN32
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	int readsz = -1;
+	if (lseek(fd, offset, SEEK_SET) >= 0)
+		readsz = read(fd, buf, (size_t)size);
+	lseek(fd, pos, SEEK_SET);
+	return readsz;
+#else
+	return pread(fd, buf, (size_t)size, offset);
+#endif
+}
+
+static int _write(int fd, const void *buf, int size)
+{
+	if (IS_SHAREDFD(fd))
+		return filetable_write(fd, buf, size);
+	return write(fd, buf, (size_t)size);
+}
+
+static off_t _lseek(int fd, off_t offset, int whence)
+{
+	if (IS_SHAREDFD(fd))
+		return filetable_lseek(fd, offset, whence);
+	return lseek(fd, offset, whence);
+}
+
+static int _sync(int fd)
+{
+#ifdef WIN32
+	return _commit(filetable_osfd(fd));
+#else
+	return fsync(filetable_osfd(fd));
+#endif
+}
+
+static int _close(int fd)
+{
+	if (IS_SHAREDFD(fd))
+		return filetable_close(fd);
+	return close(fd);
+}
+
+static int _stat(const char *path, struct stat *st)
+{
+	return stat(path, st);
+}
+
+static int _lstat(const char *path, struct stat *st)
+{
+#ifdef WIN32
+	return stat(path, st);
+#else
+	return lstat(path, st);
+#endif
+}
+
+static int _mkdir(const char *path)
+{
+#ifdef WIN32
+	return mkdir(path);
+#else
+	return mkdir(path, 0755);
+#endif
+}
+
+static char *_realpath(const char *path, char *resolved)
+{
+#ifdef WIN32
+	if (GetFullPathNameA(path, MAX_FILEPATH, resolved, NULL) == 0)
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+	return resolved;
+#else
+	/* the OS may want PATH_MAX bytes */
+	char *full = realpath(path, NULL);
+	size_t len;
+
+	if (full == NULL)
+		return NULL;
+	len = strlcpy(resolved, full, MAX_FILEPATH);
+	free(full);
+	if (len >= MAX_FILEPATH)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return resolved;
+#endif
+}
+
+/* A vfs_dir is the OS's own DIR */
+static vfs_dir *_opendir(const char *path)
+{
+	return (vfs_dir *)opendir(path);
+}
+
+static const char *_readdir(vfs_dir *dir)
+{
+	struct dirent *de = readdir((DIR *)dir);
+
+	return de != NULL ? de->d_name : NULL;
+}
+
+static long _telldir(vfs_dir *dir)
+{
+	return telldir((DIR *)dir);
+}
+
+static void _seekdir(vfs_dir *dir, long pos)
+{
+	seekdir((DIR *)dir, pos);
+}
+
+static int _closedir(vfs_dir *dir)
+{
+	return closedir((DIR *)dir);
+}
+
+const tnfs_vfs vfs_posix = {
+	"posix",
+	_open,
+	_read,
+	_pread,
+	_write,
+	_lseek,
+	_sync,
+	_close,
+	filetable_osfd,
+	_stat,
+	_lstat,
+	unlink,
+	rename,
+	_mkdir,
+	rmdir,
+	_realpath,
+	_opendir,
+	_readdir,
+	_telldir,
+	_seekdir,
+	_closedir
+};
@@ -0,0 +1,855 @@
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Serving the contents of ZIP archives as if they were directories.
+ *
+ * A path such as games/collection.zip/Adventure/Zork.atr is split at the
+ * archive; the rest is looked up in the archive's central directory,
+ * which is parsed once and kept while the archive is unchanged.
+ * Members are inflated whole when opened and kept in an LRU cache
+ * shared by all sessions, so clients reading a disk image a sector at
+ * a time (or several clients reading the same one) only pay for the
+ * decompression once.
+ *
+ * */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "endian.h"
+#include "bsdcompat.h"
+#include "zip.h"
+#include "vfs.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define ZIP_EOCD_SIG	0x06054b50	/* end of central directory record */
+#define ZIP_CDIR_SIG	0x02014b50	/* central directory file header */
+#define ZIP_LOCAL_SIG	0x04034b50	/* local file header */
+#define ZIP_EOCD_SIZE	22
+#define ZIP_CDIR_SIZE	46
+#define ZIP_LOCAL_SIZE	30
+#define ZIP_FILES_GROW	16	/* open member slots added at a time */
+#define ZIP_MAX_COMMENT	65535
+
+#define ZIP_METHOD_STORED	0
+#define ZIP_METHOD_DEFLATED	8
+#define ZIP_FLAG_ENCRYPTED	0x0001
+
+typedef struct _zip_member
+{
+	char *name;			/* path in the archive; directories end in '/' */
+	uint16_t method;
+	uint16_t flags;
+	uint32_t crc;
+	uint32_t csize;			/* compressed size */
+	uint32_t usize;			/* uncompressed size */
+	uint32_t offset;		/* offset of the local header */
+	time_t mtime;
+} zip_member;
+
+/* An archive's central directory, members sorted by name */
+typedef struct _zip_archive
+{
+	char path[MAX_FILEPATH];
+	time_t mtime;
+	off_t size;
+	int nmembers;
+	zip_member *members;
+	char *names;
+	struct _zip_archive *next;
+} zip_archive;
+
+/* A decompressed member. Entries still open somewhere are never
+ * evicted; the rest are dropped least recently used first once the
+ * cache holds more than ZIP_CACHE_SIZE bytes. */
+typedef struct _zip_data
+{
+	char *archive;
+	char *member;
+	time_t mtime;
+	off_t archsize;
+	unsigned char *data;
+	uint32_t size;
+	int refs;
+	struct _zip_data *prev, *next;
+} zip_data;
+
+typedef struct _zip_file
+{
+	zip_data *zd;			/* NULL if the slot is free */
+	off_t pos;
+} zip_file;
+
+static zip_archive *archives;		/* most recently used first */
+static int narchives;
+
+static zip_data *cache_head, *cache_tail;	/* most recently used at the head */
+static size_t cache_bytes;
+static uint64_t cache_hits, cache_misses;
+
+static zip_file *zfiles;
+static int nzfiles;
+
+bool zip_is_archive_name(const char *name)
+{
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".zip") == 0;
+}
+
+bool zip_split_path(const char *path, char *archive, int archivesz, const char **member)
+{
+	const char *p = path;
+	struct stat st;
+	size_t len;
+
+	while ((p = strchr(p, '.')) != NULL)
+	{
+		p++;
+		if (strncasecmp(p, "zip", 3) != 0 || (p[3] != '/' && p[3] != '\0'))
+			continue;
+
+		len = p + 3 - path;
+		if (len >= (size_t)archivesz)
+			return false;
+		memcpy(archive, path, len);
+		archive[len] = '\0';
+
+		if (vfs->stat(archive, &st) == 0 && S_ISREG(st.st_mode))
+		{
+			p += 3;
+			while (*p == '/')
+				p++;
+			*member = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Reads exactly size bytes from the given offset */
+static int _read_fully(int fd, off_t offset, void *buf, size_t size)
+{
+	int n;
+	size_t got = 0;
+
+	while (got < size)
+	{
+		n = vfs->pread(fd, (char *)buf + got, size - got, offset + got);
+		if (n <= 0)
+		{
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+/* DOS dates and times are local time with two second resolution */
+static time_t _dos_time(uint16_t date, uint16_t time)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = ((date >> 9) & 0x7f) + 80;
+	tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+	tm.tm_mday = date & 0x1f;
+	tm.tm_hour = (time >> 11) & 0x1f;
+	tm.tm_min = (time >> 5) & 0x3f;
+	tm.tm_sec = (time & 0x1f) * 2;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static int _member_cmp(const void *a, const void *b)
+{
+	return strcmp(((const zip_member *)a)->name, ((const zip_member *)b)->name);
+}
+
+static void _archive_free(zip_archive *za)
+{
+	free(za->members);
+	free(za->names);
+	free(za);
+}
+
+/* Reads the central directory. Returns errno on failure, otherwise zero */
+static int _archive_load(zip_archive *za, int fd)
+{
+	unsigned char *tail, *cdir, *p, *end;
+	off_t tailsz, cdoff;
+	uint32_t cdsize;
+	uint16_t count, namelen;
+	char *name;
+	size_t namesz = 0;
+	int i, err;
+
+	tailsz = za->size < ZIP_EOCD_SIZE + ZIP_MAX_COMMENT ?
+			 za->size : ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;
+	if (tailsz < ZIP_EOCD_SIZE)
+		return EINVAL;
+	if ((tail = malloc(tailsz)) == NULL)
+		return ENOMEM;
+	if (_read_fully(fd, za->size - tailsz, tail, tailsz) < 0)
+	{
+		err = errno;
+		free(tail);
+		return err;
+	}
+
+	/* the end record is followed by a comment of up to 64K, so search
+	 * backwards for its signature */
+	for (p = tail + tailsz - ZIP_EOCD_SIZE; p >= tail; p--)
+	{
+		if (tnfs32uint(p) == ZIP_EOCD_SIG)
+			break;
+	}
+	if (p < tail)
+	{
+		free(tail);
+		return EINVAL;
+	}
+	count = tnfs16uint(p + 10);
+	cdsize = tnfs32uint(p + 12);
+	cdoff = tnfs32uint(p + 16);
+	free(tail);
+
+	/* ZIP64 archives keep the real values elsewhere */
+	if (count == 0xffff || cdoff == 0xffffffff || cdoff + cdsize > za->size)
+		return EFBIG;
+
+	if ((cdir = malloc(cdsize + 1)) == NULL)
+		return ENOMEM;
+	if (_read_fully(fd, cdoff, cdir, cdsize) < 0)
+	{
+		err = errno;
+		free(cdir);
+		return err;
+	}
+
+	za->members = calloc(count ? count : 1, sizeof(zip_member));
+	/* names are stored NUL terminated, which never needs more space
+	 * than the fixed part of the headers they came out of */
+	za->names = malloc(cdsize + 1);
+	if (za->members == NULL || za->names == NULL)
+	{
+		free(cdir);
+		return ENOMEM;
+	}
+
+	end = cdir + cdsize;
+	p = cdir;
+	for (i = 0; i < count; i++)
+	{
+		if (p + ZIP_CDIR_SIZE > end || tnfs32uint(p) != ZIP_CDIR_SIG)
+			break;
+		namelen = tnfs16uint(p + 28);
+		if (p + ZIP_CDIR_SIZE + namelen > end)
+			break;
+
+		name = za->names + namesz;
+		memcpy(name, p + ZIP_CDIR_SIZE, namelen);
+		name[namelen] = '\0';
+
+		/* skip anything that could be used to climb out of the archive
+		 * or that can't be named by a TNFS path */
+		if (namelen > 0 && name[0] != '/' && strstr(name, "..") == NULL &&
+			strlen(name) == namelen && namelen < MAX_TNFSPATH)
+		{
+			zip_member *zm = &za->members[za->nmembers++];
+			zm->name = name;
+			zm->flags = tnfs16uint(p + 8);
+			zm->method = tnfs16uint(p + 10);
+			zm->mtime = _dos_time(tnfs16uint(p + 14), tnfs16uint(p + 12));
+			zm->crc = tnfs32uint(p + 16);
+			zm->csize = tnfs32uint(p + 20);
+			zm->usize = tnfs32uint(p + 24);
+			zm->offset = tnfs32uint(p + 42);
+			namesz += namelen + 1;
+		}
+		p += ZIP_CDIR_SIZE + namelen + tnfs16uint(p + 30) + tnfs16uint(p + 32);
+	}
+	free(cdir);
+
+	qsort(za->members, za->nmembers, sizeof(zip_member), _member_cmp);
+	return 0;
+}
+
+/* Finds the parsed archive, loading it if it's new or has changed.
+ * Returns NULL with errno set on failure. */
+static zip_archive *_archive_get(const char *path)
+{
+	zip_archive *za, **pp;
+	struct stat st;
+	int fd, err;
+
+	if (vfs->stat(path, &st) < 0)
+		return NULL;
+
+	for (pp = &archives; (za = *pp) != NULL; pp = &za->next)
+	{
+		if (strcmp(za->path, path) != 0)
+			continue;
+
+		*pp = za->next;
+		if (za->mtime == st.st_mtime && za->size == st.st_size)
+		{
+			za->next = archives;
+			archives = za;
+			return za;
+		}
+		_archive_free(za);
+		narchives--;
+		break;
+	}
+
+	if ((za = calloc(1, sizeof(zip_archive))) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	strlcpy(za->path, path, sizeof(za->path));
+	za->mtime = st.st_mtime;
+	za->size = st.st_size;
+
+	if ((fd = vfs->open(path, O_RDONLY | O_BINARY, 0)) < 0)
+	{
+		err = errno;
+		_archive_free(za);
+		errno = err;
+		return NULL;
+	}
+	err = _archive_load(za, fd);
+	vfs->close(fd);
+	if (err)
+	{
+		_archive_free(za);
+		errno = err;
+		return NULL;
+	}
+
+	/* drop the least recently used archive if there are too many */
+	if (++narchives > ZIP_MAX_ARCHIVES)
+	{
+		for (pp = &archives; (*pp)->next != NULL; pp = &(*pp)->next)
+			;
+		_archive_free(*pp);
+		*pp = NULL;
+		narchives--;
+	}
+	za->next = archives;
+	archives = za;
+	return za;
+}
+
+/* Index of the first member whose name is not less than name */
+static int _lower_bound(zip_archive *za, const char *name)
+{
+	int lo = 0, hi = za->nmembers, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (strcmp(za->members[mid].name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static zip_member *_member_find(zip_archive *za, const char *name)
+{
+	int i = _lower_bound(za, name);
+	if (i < za->nmembers && strcmp(za->members[i].name, name) == 0)
+		return &za->members[i];
+	return NULL;
+}
+
+/* Whether name is a directory in the archive, either because it has an
+ * entry of its own or because members are stored under it. Sets *mtime
+ * to the directory's time, or the archive's if it has no entry. */
+static bool _is_dir(zip_archive *za, const char *name, time_t *mtime)
+{
+	char prefix[MAX_TNFSPATH + 1];
+	size_t len;
+	int i;
+
+	*mtime = za->mtime;
+	if (*name == '\0')
+		return true;
+
+	len = snprintf(prefix, sizeof(prefix), "%s", name);
+	while (len > 0 && prefix[len - 1] == '/')
+		prefix[--len] = '\0';
+	if (len + 1 >= sizeof(prefix))
+		return false;
+	prefix[len++] = '/';
+	prefix[len] = '\0';
+
+	i = _lower_bound(za, prefix);
+	if (i >= za->nmembers || strncmp(za->members[i].name, prefix, len) != 0)
+		return false;
+	if (za->members[i].name[len] == '\0')
+		*mtime = za->members[i].mtime;
+	return true;
+}
+
+int zip_readdir(const char *path, zip_dir_callback callback, void *ctx)
+{
+	char archive[MAX_FILEPATH];
+	char prefix[MAX_TNFSPATH + 1];
+	char child[MAX_FILENAME_LEN];
+	char lastdir[MAX_FILENAME_LEN] = "";
+	const char *member, *rest, *slash;
+	zip_archive *za;
+	fileinfo_t finf;
+	size_t len;
+	int i;
+	time_t mtime;
+
+	if (!zip_split_path(path, archive, sizeof(archive), &member))
+		return ENOENT;
+	if ((za = _archive_get(archive)) == NULL)
+		return errno;
+	if (!_is_dir(za, member, &mtime))
+		return _member_find(za, member) ? ENOTDIR : ENOENT;
+
+	len = snprintf(prefix, sizeof(prefix), "%s", member);
+	while (len > 0 && prefix[len - 1] == '/')
+		prefix[--len] = '\0';
+	if (len > 0)
+	{
+		prefix[len++] = '/';
+		prefix[len] = '\0';
+	}
+
+	/* everything under the directory sorts together, with whatever is
+	 * in each subdirectory grouped right after it */
+	for (i = _lower_bound(za, prefix); i < za->nmembers; i++)
+	{
+		zip_member *zm = &za->members[i];
+		if (strncmp(zm->name, prefix, len) != 0)
+			break;
+		rest = zm->name + len;
+		if (*rest == '\0')
+			continue;
+
+		memset(&finf, 0, sizeof(finf));
+		if ((slash = strchr(rest, '/')) != NULL)
+		{
+			if ((size_t)(slash - rest) >= sizeof(child))
+				continue;
+			memcpy(child, rest, slash - rest);
+			child[slash - rest] = '\0';
+			if (strcmp(child, lastdir) == 0)
+				continue;
+			strcpy(lastdir, child);
+
+			finf.flags = FILEINFOFLAG_DIRECTORY;
+			/* an entry for the directory itself sorts first */
+			finf.m_time = finf.c_time = slash[1] == '\0' ? zm->mtime : za->mtime;
+		}
+		else
+		{
+			strlcpy(child, rest, sizeof(child));
+			finf.size = zm->usize;
+			finf.m_time = finf.c_time = zm->mtime;
+		}
+		if (child[0] == '.')
+			finf.flags |= FILEINFOFLAG_HIDDEN;
+
+		callback(child, &finf, ctx);
+	}
+	return 0;
+}
+
+int zipstat(const char *path, struct stat *st)
+{
+	char archive[MAX_FILEPATH];
+	const char *member;
+	zip_archive *za;
+	zip_member *zm;
+	time_t mtime;
+
+	if (!zip_split_path(path, archive, sizeof(archive), &member))
+		return vfs->stat(path, st);
+	if (vfs->stat(archive, st) < 0 || (za = _archive_get(archive)) == NULL)
+		return -1;
+
+	/* members are read only, whatever the archive's own permissions */
+	st->st_mode &= ~(S_IFMT | S_IWUSR | S_IWGRP | S_IWOTH);
+	if ((zm = _member_find(za, member)) != NULL && zm->name[strlen(zm->name) - 1] != '/')
+	{
+		st->st_mode |= S_IFREG;
+		st->st_size = zm->usize;
+		st->st_mtime = st->st_ctime = zm->mtime;
+	}
+	else if (_is_dir(za, member, &mtime))
+	{
+		/* the archive itself is presented as a directory */
+		st->st_mode |= S_IFDIR | ((st->st_mode & 0444) >> 2);
+		st->st_size = 0;
+		st->st_mtime = st->st_ctime = mtime;
+	}
+	else
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+static void _cache_unlink(zip_data *zd)
+{
+	if (zd->prev)
+		zd->prev->next = zd->next;
+	else
+		cache_head = zd->next;
+	if (zd->next)
+		zd->next->prev = zd->prev;
+	else
+		cache_tail = zd->prev;
+	zd->prev = zd->next = NULL;
+}
+
+static void _cache_push(zip_data *zd)
+{
+	zd->next = cache_head;
+	if (cache_head)
+		cache_head->prev = zd;
+	else
+		cache_tail = zd;
+	cache_head = zd;
+}
+
+static void _cache_free(zip_data *zd)
+{
+	cache_bytes -= zd->size;
+	free(zd->archive);
+	free(zd->member);
+	free(zd->data);
+	free(zd);
+}
+
+/* Drops unused members from the cold end until it's back under budget */
+static void _cache_trim()
+{
+	zip_data *zd, *prev;
+
+	for (zd = cache_tail; zd != NULL && cache_bytes > ZIP_CACHE_SIZE; zd = prev)
+	{
+		prev = zd->prev;
+		if (zd->refs == 0)
+		{
+			_cache_unlink(zd);
+			_cache_free(zd);
+		}
+	}
+}
+
+/* Inflates a member into buf. Returns errno on failure, otherwise zero */
+static int _member_extract(zip_archive *za, zip_member *zm, unsigned char *buf)
+{
+	unsigned char local[ZIP_LOCAL_SIZE];
+	unsigned char *cbuf = NULL;
+	z_stream zs;
+	off_t dataoff;
+	int fd, err = 0;
+
+	if ((fd = vfs->open(za->path, O_RDONLY | O_BINARY, 0)) < 0)
+		return errno;
+
+	/* the local header's name and extra field can differ in length
+	 * from the central directory's */
+	if (_read_fully(fd, zm->offset, local, ZIP_LOCAL_SIZE) < 0)
+	{
+		err = errno;
+		goto out;
+	}
+	if (tnfs32uint(local) != ZIP_LOCAL_SIG)
+	{
+		err = EIO;
+		goto out;
+	}
+	dataoff = (off_t)zm->offset + ZIP_LOCAL_SIZE +
+			  tnfs16uint(local + 26) + tnfs16uint(local + 28);
+
+	if (zm->method == ZIP_METHOD_STORED)
+	{
+		if (zm->csize != zm->usize || _read_fully(fd, dataoff, buf, zm->usize) < 0)
+			err = zm->csize != zm->usize ? EIO : errno;
+		goto out;
+	}
+
+	if ((cbuf = malloc(zm->csize ? zm->csize : 1)) == NULL)
+	{
+		err = ENOMEM;
+		goto out;
+	}
+	if (_read_fully(fd, dataoff, cbuf, zm->csize) < 0)
+	{
+		err = errno;
+		goto out;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+	{
+		err = ENOMEM;
+		goto out;
+	}
+	zs.next_in = cbuf;
+	zs.avail_in = zm->csize;
+	zs.next_out = buf;
+	zs.avail_out = zm->usize;
+	if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != zm->usize)
+		err = EIO;
+	inflateEnd(&zs);
+
+out:
+	if (err == 0 && crc32(crc32(0L, Z_NULL, 0), buf, zm->usize) != zm->crc)
+		err = EIO;
+	free(cbuf);
+	vfs->close(fd);
+	return err;
+}
+
+/* Finds a member in the cache, inflating it if it isn't there. The
+ * returned entry holds a reference. Returns NULL with errno set. */
+static zip_data *_cache_get(zip_archive *za, zip_member *zm)
+{
+	zip_data *zd;
+	int err;
+
+	for (zd = cache_head; zd != NULL; zd = zd->next)
+	{
+		if (zd->mtime == za->mtime && zd->archsize == za->size &&
+			strcmp(zd->member, zm->name) == 0 && strcmp(zd->archive, za->path) == 0)
+		{
+			_cache_unlink(zd);
+			_cache_push(zd);
+			zd->refs++;
+			cache_hits++;
+			return zd;
+		}
+	}
+	cache_misses++;
+
+	if (zm->flags & ZIP_FLAG_ENCRYPTED)
+	{
+		errno = EACCES;
+		return NULL;
+	}
+	if (zm->method != ZIP_METHOD_STORED && zm->method != ZIP_METHOD_DEFLATED)
+	{
+		errno = ENOSYS;
+		return NULL;
+	}
+	if (zm->usize > ZIP_MAX_MEMBER)
+	{
+		errno = EFBIG;
+		return NULL;
+	}
+
+	if ((zd = calloc(1, sizeof(zip_data))) == NULL ||
+		(zd->data = malloc(zm->usize ? zm->usize : 1)) == NULL ||
+		(zd->archive = strdup(za->path)) == NULL ||
+		(zd->member = strdup(zm->name)) == NULL)
+	{
+		err = ENOMEM;
+		goto fail;
+	}
+	if ((err = _member_extract(za, zm, zd->data)) != 0)
+		goto fail;
+
+	zd->mtime = za->mtime;
+	zd->archsize = za->size;
+	zd->size = zm->usize;
+	zd->refs = 1;
+	cache_bytes += zd->size;
+	_cache_push(zd);
+	_cache_trim();
+	return zd;
+
+fail:
+	if (zd)
+	{
+		free(zd->archive);
+		free(zd->member);
+		free(zd->data);
+		free(zd);
+	}
+	errno = err;
+	return NULL;
+}
+
+static zip_file *_zfile(int fd)
+{
+	int i = fd - ZIPFD_BASE;
+	if (i < 0 || i >= nzfiles || zfiles[i].zd == NULL)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &zfiles[i];
+}
+
+int zipopen(const char *path, int flags, int mode)
+{
+	char archive[MAX_FILEPATH];
+	const char *member;
+	zip_archive *za;
+	zip_member *zm;
+	zip_data *zd;
+	zip_file *grown;
+	time_t mtime;
+	int i;
+
+	/* the archive itself can still be opened, so clients that fetch
+	 * whole archives keep working */
+	if (!zip_split_path(path, archive, sizeof(archive), &member) || *member == '\0')
+		return vfs->open(path, flags, mode);
+
+	if ((flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) != 0)
+	{
+		errno = EROFS;
+		return -1;
+	}
+	if ((za = _archive_get(archive)) == NULL)
+		return -1;
+	if ((zm = _member_find(za, member)) == NULL || zm->name[strlen(zm->name) - 1] == '/')
+	{
+		errno = _is_dir(za, member, &mtime) ? EISDIR : ENOENT;
+		return -1;
+	}
+
+	for (i = 0; i < nzfiles && zfiles[i].zd != NULL; i++)
+		;
+	if (i == nzfiles)
+	{
+		grown = realloc(zfiles, (nzfiles + ZIP_FILES_GROW) * sizeof(zip_file));
+		if (grown == NULL)
+		{
+			errno = ENFILE;
+			return -1;
+		}
+		memset(grown + nzfiles, 0, ZIP_FILES_GROW * sizeof(zip_file));
+		zfiles = grown;
+		nzfiles += ZIP_FILES_GROW;
+	}
+
+	if ((zd = _cache_get(za, zm)) == NULL)
+		return -1;
+	zfiles[i].zd = zd;
+	zfiles[i].pos = 0;
+	return ZIPFD_BASE + i;
+}
+
+int zippread(int fd, void *buf, int size, off_t offset)
+{
+	zip_file *zf = _zfile(fd);
+
+	if (zf == NULL)
+		return -1;
+	if (offset < 0 || size < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset >= zf->zd->size)
+		return 0;
+	if (size > zf->zd->size - offset)
+		size = zf->zd->size - offset;
+	memcpy(buf, zf->zd->data + offset, size);
+	return size;
+}
+
+int zipread(int fd, void *buf, int size)
+{
+	zip_file *zf = _zfile(fd);
+	int readsz;
+
+	if (zf == NULL)
+		return -1;
+	if ((readsz = zippread(fd, buf, size, zf->pos)) > 0)
+		zf->pos += readsz;
+	return readsz;
+}
+
+off_t ziplseek(int fd, off_t offset, int whence)
+{
+	zip_file *zf = _zfile(fd);
+	off_t pos;
+
+	if (zf == NULL)
+		return -1;
+	switch (whence)
+	{
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = zf->pos + offset;
+		break;
+	case SEEK_END:
+		pos = zf->zd->size + offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return zf->pos = pos;
+}
+
+int zipclose(int fd)
+{
+	zip_file *zf = _zfile(fd);
+
+	if (zf == NULL)
+		return -1;
+	zf->zd->refs--;
+	zf->zd = NULL;
+	_cache_trim();
+	return 0;
+}
+
+void zip_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	*hits = cache_hits;
+	*misses = cache_misses;
+}
@@ -0,0 +1,68 @@
+#ifndef _TNFS_ZIP_H
+#define _TNFS_ZIP_H
+
+/* The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Serving the contents of ZIP archives as if they were directories
+ *
+ * */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fileinfo.h"
+
+/* Descriptors handed out for archive members sit well above any the
+ * OS will hand out, so they can share the session's fd slots */
+#define ZIPFD_BASE 0x40000000
+#define IS_ZIPFD(fd) ((fd) >= ZIPFD_BASE)
+
+typedef void (*zip_dir_callback)(const char *name, fileinfo_t *finf, void *ctx);
+
+/* Splits a path that goes through a ZIP archive into the path of the
+ * archive and the path of the member inside it ("" for the archive
+ * itself). Returns false if the path doesn't go through an archive. */
+bool zip_split_path(const char *path, char *archive, int archivesz, const char **member);
+
+/* Whether a directory entry name looks like a ZIP archive */
+bool zip_is_archive_name(const char *name);
+
+/* Calls back for each entry of the directory at path inside an
+ * archive. Returns 0, or an errno value on failure. */
+int zip_readdir(const char *path, zip_dir_callback callback, void *ctx);
+
+/* open() and stat() that also work on paths inside archives. Members
+ * can only be opened for reading. */
+int zipopen(const char *path, int flags, int mode);
+int zipstat(const char *path, struct stat *st);
+
+/* I/O on descriptors returned by zipopen() for archive members */
+int zipread(int fd, void *buf, int size);
+int zippread(int fd, void *buf, int size, off_t offset);
+off_t ziplseek(int fd, off_t offset, int whence);
+int zipclose(int fd);
+
+/* Members opened from the cache, and those that were inflated */
+void zip_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif